@@ -0,0 +1,211 @@
+// Runs the Dragon workloads (the .dgn scripts directly inside the given directories, or the given scripts) several times
+// each in a fresh VM, and writes their wall times, instructions dispatched, garbage collections and peak heap size as JSON.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/vm.h"
+#include "../src/file.h"
+#include "../src/profiler.h"
+#include "../src/thread.h"
+
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+#define DEFAULT_RUNS 5
+
+typedef struct {
+	char** paths;
+	size_t count;
+	size_t capacity;
+	size_t directoryLength;
+} Workloads;
+
+typedef struct {
+	InterpreterResult result;
+	double seconds;
+	size_t instructions;
+	size_t minorCollections;
+	size_t majorCollections;
+	size_t peakBytes;
+} Run;
+
+static void addWorkload(Workloads* workloads, const char* path) {
+	if (workloads->count + 1 > workloads->capacity) {
+		workloads->capacity = workloads->capacity < 16 ? 16 : workloads->capacity * 2;
+		workloads->paths = realloc(workloads->paths, sizeof(char*) * workloads->capacity);
+		if (workloads->paths == NULL) exit(1);
+	}
+
+	size_t length = strlen(path);
+	char* copy = malloc(length + 1);
+	if (copy == NULL) exit(1);
+	memcpy(copy, path, length + 1);
+	workloads->paths[workloads->count++] = copy;
+}
+
+// Scripts in subdirectories are modules imported by the workloads, not workloads themselves.
+static void workloadVisitor(const char* path, void* context) {
+	Workloads* workloads = context;
+	const char* name = path + workloads->directoryLength + 1;
+	if (strchr(name, '/') != NULL || strchr(name, '\\') != NULL) return;
+	addWorkload(workloads, path);
+}
+
+static int comparePaths(const void* a, const void* b) {
+	return strcmp(*(const char**)a, *(const char**)b);
+}
+
+static int compareSeconds(const void* a, const void* b) {
+	double left = *(const double*)a;
+	double right = *(const double*)b;
+	return left < right ? -1 : left > right;
+}
+
+// Counting instructions needs the profiler's dispatch hook, which would skew the timing, so it gets a run of its own.
+static Run runWorkload(const char* directory, const char* source, bool count) {
+	Run run = { 0 };
+	VM vm;
+	initVM(&vm);
+	if (count && !startProfiler(&vm, PROFILE_INSTRUMENT, 0)) {
+		fprintf(stderr, "Could not start the profiler.\n");
+		exit(1);
+	}
+
+	double start = monotonicSeconds();
+	run.result = interpret(&vm, directory, source);
+	run.seconds = monotonicSeconds() - start;
+
+	if (count) {
+		for (size_t i = 0; i < UINT8_COUNT; i++) run.instructions += vm.profiler->opcodeCounts[i];
+		stopProfiler(&vm, NULL);
+	}
+	run.minorCollections = vm.gcStats.minorCount;
+	run.majorCollections = vm.gcStats.majorCount;
+	run.peakBytes = vm.gcStats.peakBytes;
+	freeVM(&vm);
+	return run;
+}
+
+static const char* resultName(InterpreterResult result) {
+	switch (result) {
+		case INTERPRETER_OK: return "ok";
+		case INTERPRETER_COMPILER_ERR: return "compile error";
+		case INTERPRETER_RUNTIME_ERR: return "runtime error";
+		default: return "unknown";
+	}
+}
+
+// Returns whether every run of the workload succeeded.
+static bool benchmark(FILE* output, const char* path, size_t runs, bool first) {
+	char* source = readFile(path);
+	char* directory = getDirectory(path);
+
+	Run counted = runWorkload(directory, source, true);
+	bool ok = counted.result == INTERPRETER_OK;
+
+	double* seconds = malloc(sizeof(double) * runs);
+	if (seconds == NULL) exit(1);
+	Run last = counted;
+	for (size_t i = 0; i < runs && ok; i++) {
+		last = runWorkload(directory, source, false);
+		seconds[i] = last.seconds;
+		ok = last.result == INTERPRETER_OK;
+	}
+
+	fprintf(output, "%s\n\t\t{\n\t\t\t\"path\": \"", first ? "" : ",");
+	for (const char* c = path; *c != '\0'; c++) {
+		if (*c == '"' || *c == '\\') fputc('\\', output);
+		fputc(*c, output);
+	}
+	fprintf(output, "\",\n\t\t\t\"status\": \"%s\"", resultName(ok ? INTERPRETER_OK : last.result));
+
+	if (ok) {
+		double total = 0;
+		fprintf(output, ",\n\t\t\t\"wallSeconds\": [");
+		for (size_t i = 0; i < runs; i++) {
+			fprintf(output, "%s%.6f", i == 0 ? "" : ", ", seconds[i]);
+			total += seconds[i];
+		}
+		qsort(seconds, runs, sizeof(double), compareSeconds);
+		double median = runs % 2 == 1 ? seconds[runs / 2] : (seconds[runs / 2 - 1] + seconds[runs / 2]) / 2;
+
+		fprintf(output, "],\n\t\t\t\"minSeconds\": %.6f,\n\t\t\t\"medianSeconds\": %.6f,\n\t\t\t\"meanSeconds\": %.6f", seconds[0], median, total / (double)runs);
+		fprintf(output, ",\n\t\t\t\"instructions\": %zu", counted.instructions);
+		fprintf(output, ",\n\t\t\t\"minorCollections\": %zu,\n\t\t\t\"majorCollections\": %zu", last.minorCollections, last.majorCollections);
+		fprintf(output, ",\n\t\t\t\"peakBytes\": %zu", last.peakBytes);
+		fprintf(stderr, "%-32s %10.3f ms median %14zu instructions %6zu collections %12zu peak bytes\n", path, median * 1000,
+			counted.instructions, last.minorCollections + last.majorCollections, last.peakBytes);
+	}
+	else {
+		fprintf(stderr, "%-32s %s\n", path, resultName(last.result));
+	}
+	fprintf(output, "\n\t\t}");
+
+	free(seconds);
+	free(directory);
+	free(source);
+	return ok;
+}
+
+int main(int argc, const char* argv[]) {
+	size_t runs = DEFAULT_RUNS;
+	const char* outputPath = "bench.json";
+	Workloads workloads = { NULL, 0, 0, 0 };
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+			runs = (size_t)atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			outputPath = argv[++i];
+		}
+		else if (argv[i][0] != '-' && hasExtension(argv[i], ".dgn")) {
+			addWorkload(&workloads, argv[i]);
+		}
+		else if (argv[i][0] != '-') {
+			size_t first = workloads.count;
+			workloads.directoryLength = strlen(argv[i]);
+			if (!forEachFile(argv[i], ".dgn", workloadVisitor, &workloads)) {
+				fprintf(stderr, "Could not open directory \"%s\".\n", argv[i]);
+				return 120;
+			}
+			qsort(&workloads.paths[first], workloads.count - first, sizeof(char*), comparePaths);
+		}
+		else {
+			fprintf(stderr, "Usage: %s [--runs count] [--output path] [directory or script...]\n", argv[0]);
+			return 120;
+		}
+	}
+
+	if (workloads.count == 0) {
+		fprintf(stderr, "No workloads given.\n");
+		return 120;
+	}
+
+	FILE* output = fopen(outputPath, "w");
+	if (output == NULL) {
+		fprintf(stderr, "Could not open \"%s\".\n", outputPath);
+		return 120;
+	}
+	// The workloads' own output isn't needed.
+	fflush(stdout);
+	if (freopen(NULL_DEVICE, "w", stdout) == NULL) {
+		fprintf(stderr, "Could not discard the workloads' output.\n");
+	}
+
+	bool ok = true;
+	fprintf(output, "{\n\t\"runs\": %zu,\n\t\"workloads\": [", runs);
+	for (size_t i = 0; i < workloads.count; i++) {
+		if (!benchmark(output, workloads.paths[i], runs, i == 0)) ok = false;
+		free(workloads.paths[i]);
+	}
+	fprintf(output, "\n\t]\n}\n");
+	fclose(output);
+	free(workloads.paths);
+
+	fprintf(stderr, "Results written to \"%s\".\n", outputPath);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,154 @@
+// Micro-benchmarks for Table (src/table.c): get (with interned and transient keys), set, delete and findString at a
+// range of load factors, and hashString over a range of string lengths.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/vm.h"
+#include "../src/memory.h"
+#include "../src/object.h"
+#include "../src/table.h"
+
+#define CAPACITY_LIMIT 16384
+#define OPERATIONS 4000000
+
+static double seconds(void) {
+	return (double)clock() / CLOCKS_PER_SEC;
+}
+
+// Interned strings "<prefix><i>", or transient copies of the first count of original, kept alive by a list on the VM's
+// stack.
+static ObjList* makeKeys(VM* vm, const char* prefix, ObjList* original, size_t count) {
+	ValueArray array;
+	initValueArray(&array);
+	ObjList* keys = newList(vm, array);
+	push(vm, OBJ_VAL(keys));
+
+	for (size_t i = 0; i < count; i++) {
+		Value key;
+		if (original != NULL) {
+			ObjString* string = AS_STRING(original->items.values[i]);
+			key = OBJ_VAL(copyTransientString(vm, string->chars, string->length));
+		}
+		else {
+			key = OBJ_VAL(makeStringf(vm, "%s%zu", prefix, i));
+			push(vm, key);
+			key = OBJ_VAL(internString(vm, AS_STRING(key)));
+			pop(vm);
+		}
+		push(vm, key);
+		writeValueArray(vm, &keys->items, key);
+		WRITE_BARRIER(vm, keys, key);
+		pop(vm);
+	}
+	return keys;
+}
+
+static ObjString* keyAt(ObjList* keys, size_t i) {
+	return AS_STRING(keys->items.values[i % keys->items.count]);
+}
+
+static void report(const char* operation, size_t count, Table* table, double elapsed, size_t operations) {
+	printf("%-10s entries %6zu  load %.2f  %7.2f ns/op\n", operation, count, (double)count / (double)table->capacity,
+		elapsed * 1e9 / (double)operations);
+}
+
+static void benchmark(VM* vm, size_t count, ObjList* hits, ObjList* misses) {
+	Table table;
+	initTable(&table);
+
+	// Fills the table from empty a number of times, so growing it is included.
+	size_t rounds = OPERATIONS / 4 / count;
+	double start = seconds();
+	for (size_t round = 0; round < rounds; round++) {
+		freeTable(vm, &table);
+		for (size_t i = 0; i < count; i++) tableSet(vm, &table, keyAt(hits, i), NUMBER_VAL((double)i));
+	}
+	report("set", count, &table, seconds() - start, rounds * count);
+
+	Value value;
+	double sum = 0;
+	start = seconds();
+	for (size_t i = 0; i < OPERATIONS; i++) {
+		if (tableGet(&table, keyAt(hits, i % count), &value)) sum += AS_NUMBER(value);
+	}
+	report("get hit", count, &table, seconds() - start, OPERATIONS);
+
+	// Keys made at run time, which are compared by their chars.
+	ObjList* copies = makeKeys(vm, NULL, hits, count);
+	start = seconds();
+	for (size_t i = 0; i < OPERATIONS; i++) {
+		if (tableGet(&table, keyAt(copies, i), &value)) sum += AS_NUMBER(value);
+	}
+	report("get copy", count, &table, seconds() - start, OPERATIONS);
+	pop(vm);
+
+	start = seconds();
+	for (size_t i = 0; i < OPERATIONS; i++) {
+		if (tableGet(&table, keyAt(misses, i), &value)) sum += AS_NUMBER(value);
+	}
+	report("get miss", count, &table, seconds() - start, OPERATIONS);
+
+	start = seconds();
+	for (size_t i = 0; i < OPERATIONS; i++) {
+		ObjString* key = keyAt(hits, i % count);
+		if (tableFindString(&table, key->chars, key->length, key->hash) != NULL) sum += 1;
+	}
+	report("findString", count, &table, seconds() - start, OPERATIONS);
+
+	// Deletes and puts back each key in turn, leaving deleted slots behind.
+	start = seconds();
+	for (size_t i = 0; i < OPERATIONS; i++) {
+		ObjString* key = keyAt(hits, i % count);
+		tableDelete(&table, key);
+		tableSet(vm, &table, key, NUMBER_VAL(1));
+	}
+	report("delete+set", count, &table, seconds() - start, OPERATIONS);
+
+	if (sum < 0) printf("%g\n", sum);
+	freeTable(vm, &table);
+}
+
+static void benchmarkHash(size_t length) {
+	char* chars = malloc(length);
+	if (chars == NULL) exit(1);
+	for (size_t i = 0; i < length; i++) chars[i] = (char)('a' + i % 26);
+
+	// Roughly the same number of bytes hashed at every length.
+	size_t operations = OPERATIONS * 16 / (length < 16 ? 16 : length) + 1;
+	uint32_t sum = 0;
+	double start = seconds();
+	for (size_t i = 0; i < operations; i++) {
+		chars[i % length] ^= 1;
+		sum += hashString(chars, length);
+	}
+	double elapsed = seconds() - start;
+	printf("%-10s length %6zu  %7.2f ns/op  %6.2f GB/s\n", "hashString", length, elapsed * 1e9 / (double)operations,
+		(double)(operations * length) / elapsed / 1e9);
+
+	if (sum == 1) printf("%u\n", sum);
+	free(chars);
+}
+
+int main(void) {
+	VM vm;
+	initVM(&vm);
+
+	ObjList* hits = makeKeys(&vm, "key", NULL, CAPACITY_LIMIT);
+	ObjList* misses = makeKeys(&vm, "miss", NULL, CAPACITY_LIMIT);
+
+	// Sizes at both ends of the load factors the table grows between.
+	static const size_t counts[] = { 8, 14, 100, 220, 1000, 1790, 8000, 14300 };
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		benchmark(&vm, counts[i], hits, misses);
+		printf("\n");
+	}
+
+	static const size_t lengths[] = { 4, 8, 16, 32, 64, 256, 1024, 65536 };
+	for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) benchmarkHash(lengths[i]);
+
+	pop(&vm);
+	pop(&vm);
+	freeVM(&vm);
+	return 0;
+}
@@ -4,10 +4,95 @@
 #include "vm.h"
 #include "common.h"
 #include "file.h"
+#include "debug.h"
+#include "bytecode.h"
+#include "profiler.h"
+#include "io.h"
+#include "jit.h"
 
-static void repl() {
+typedef struct {
+	int optimizationLevel;
+	bool cacheStats;
+	bool gcStats;
+	bool opcodeStats;
+	bool bytecodeCache;
+	bool importPrescan;
+	size_t frameMax;
+	bool gcIncremental;
+	size_t gcSliceBudget;
+	double gcMaxPause;
+	double gcGrowthFactor;
+	size_t gcMinHeap;
+	size_t gcSoftLimit;
+	size_t gcHardLimit;
+	bool profile;
+	ProfileMode profileMode;
+	uint32_t profileInterval;
+	const char* profileOutput;
+	bool jit;
+} Options;
+
+static void applyOptions(VM* vm, Options* options) {
+	vm->optimizationLevel = options->optimizationLevel;
+	vm->bytecodeCache = options->bytecodeCache;
+	vm->importPrescan = options->importPrescan;
+	// The profiler has to see every instruction run, so the JIT is left off with it.
+	vm->jit = options->jit && !options->profile;
+	vm->gcIncremental = options->gcIncremental;
+	vm->gcSliceBudget = options->gcSliceBudget;
+	vm->gcMaxPause = options->gcMaxPause;
+	vm->gcGrowthFactor = options->gcGrowthFactor;
+	vm->gcMinHeap = options->gcMinHeap;
+	vm->gcSoftLimit = options->gcSoftLimit;
+	vm->gcHardLimit = options->gcHardLimit;
+	updateHeapTarget(vm);
+	if (options->frameMax != vm->frameMax && !setFrameMax(vm, options->frameMax)) {
+		fprintf(stderr, "Could not reserve a stack for %zu frames.\n", options->frameMax);
+		exit(120);
+	}
+}
+
+// Parses a positive number, returning false if text isn't one.
+static bool parsePositive(const char* text, double* number) {
+	char* end;
+	*number = strtod(text, &end);
+	return end != text && *end == '\0' && *number > 0;
+}
+
+// Parses a number of bytes, optionally suffixed with K, M or G (powers of 1024), returning false if text isn't one.
+static bool parseSize(const char* text, size_t* size) {
+	char* end;
+	double number = strtod(text, &end);
+	if (end == text || number < 0) return false;
+
+	double scale = 1;
+	if (*end == 'K' || *end == 'k') scale = 1024.0;
+	else if (*end == 'M' || *end == 'm') scale = 1024.0 * 1024;
+	else if (*end == 'G' || *end == 'g') scale = 1024.0 * 1024 * 1024;
+	if (scale != 1) end++;
+	if (*end != '\0') return false;
+
+	*size = (size_t)(number * scale);
+	return true;
+}
+
+// The GC tunables may also be set by environment variables (DRAGON_GC_GROWTH etc.), overridden by the options.
+static void readEnvironment(Options* options) {
+	double number;
+	const char* value = getenv("DRAGON_GC_GROWTH");
+	if (value != NULL && parsePositive(value, &number) && number >= 1) options->gcGrowthFactor = number;
+	value = getenv("DRAGON_GC_MIN_HEAP");
+	if (value != NULL) parseSize(value, &options->gcMinHeap);
+	value = getenv("DRAGON_GC_SOFT_LIMIT");
+	if (value != NULL) parseSize(value, &options->gcSoftLimit);
+	value = getenv("DRAGON_GC_HARD_LIMIT");
+	if (value != NULL) parseSize(value, &options->gcHardLimit);
+}
+
+static void repl(Options* options) {
 	VM vm;
 	initVM(&vm);
+	applyOptions(&vm, options);
 
 	char line[1024];
 
@@ -19,18 +104,31 @@ static void repl() {
 			break;
 		}
 		interpret(&vm, ".", line);
+		flushStandardOutput(&vm);
 	}
 
 	freeVM(&vm);
 }
 
-static void runFile(const char* path) {
-	char* source = readFile(path);
+static void runFile(const char* path, Options* options) {
+	// Precompiled scripts ('--precompile') are run without their source.
+	bool isBytecode = hasExtension(path, BYTECODE_EXTENSION);
+	char* source = isBytecode ? NULL : readFile(path);
 	char* directory = getDirectory(path);
 	VM vm;
 	initVM(&vm);
-	InterpreterResult result = interpret(&vm, directory, source);
+	applyOptions(&vm, options);
+	if (options->profile && !startProfiler(&vm, options->profileMode, options->profileInterval)) {
+		fprintf(stderr, "Could not start the profiler.\n");
+	}
+	InterpreterResult result = isBytecode ? interpretBytecode(&vm, directory, path) : interpret(&vm, directory, source);
+	if (vm.profiler != NULL) stopProfiler(&vm, options->profileOutput);
+	if (options->cacheStats) printCacheStats(&vm);
+	if (options->gcStats) printGCStats(&vm);
 	freeVM(&vm);
+#ifdef DRAGON_OPCODE_STATS
+	if (options->opcodeStats) printOpcodeStats(40);
+#endif
 	free(source);
 	free(directory);
 
@@ -38,17 +136,143 @@ static void runFile(const char* path) {
 	if (result == INTERPRETER_RUNTIME_ERR) exit(122);
 }
 
+typedef struct {
+	VM* vm;
+	size_t compiled;
+	size_t failed;
+} PrecompileState;
+
+static void precompileVisitor(const char* path, void* context) {
+	PrecompileState* state = context;
+	if (precompileFile(state->vm, path)) {
+		state->compiled++;
+	}
+	else {
+		fprintf(stderr, "Could not precompile \"%s\".\n", path);
+		state->failed++;
+	}
+}
+
+// Writes a bytecode file next to every script below directory.
+static void precompileDirectory(const char* directory, Options* options) {
+	VM vm;
+	initVM(&vm);
+	applyOptions(&vm, options);
+
+	PrecompileState state = { &vm, 0, 0 };
+	bool found = forEachFile(directory, ".dgn", precompileVisitor, &state);
+	freeVM(&vm);
+
+	if (!found) {
+		fprintf(stderr, "Could not open directory \"%s\".\n", directory);
+		exit(120);
+	}
+	printf("Precompiled %zu file(s).\n", state.compiled);
+	if (state.failed > 0) exit(121);
+}
+
 int main(int argc, const char* argv[]) {
-	if (argc == 1) {
-		repl();
+	Options options = { 1, false, false, false, true, true, DEFAULT_FRAME_MAX, false, 4000, 0.001, GC_HEAP_GROW_FACTOR, GC_MIN_HEAP, 0, 0, false, PROFILE_SAMPLE, 1000, "profile.folded", false };
+	readEnvironment(&options);
+	double number;
+	const char* path = NULL;
+	const char* precompile = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--cache-stats") == 0) {
+			options.cacheStats = true;
+		}
+		else if (strcmp(argv[i], "--gc-stats") == 0) {
+			options.gcStats = true;
+		}
+		else if (strcmp(argv[i], "--opcode-stats") == 0) {
+#ifdef DRAGON_OPCODE_STATS
+			options.opcodeStats = true;
+#else
+			fprintf(stderr, "'--opcode-stats' requires a build with DRAGON_OPCODE_STATS enabled.\n");
+			return 120;
+#endif
+		}
+		else if (strcmp(argv[i], "--jit") == 0) {
+#ifdef JIT_SUPPORTED
+			options.jit = true;
+#else
+			fprintf(stderr, "'--jit' requires a build with DRAGON_JIT enabled, on x86-64.\n");
+			return 120;
+#endif
+		}
+		else if (strcmp(argv[i], "--gc-incremental") == 0) {
+			options.gcIncremental = true;
+		}
+		else if (strcmp(argv[i], "--gc-slice") == 0 && i + 1 < argc && parsePositive(argv[i + 1], &number)) {
+			options.gcSliceBudget = (size_t)number;
+			i++;
+		}
+		else if (strcmp(argv[i], "--gc-max-pause") == 0 && i + 1 < argc && parsePositive(argv[i + 1], &number)) {
+			options.gcMaxPause = number / 1000;
+			i++;
+		}
+		else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc &&
+			(strcmp(argv[i + 1], "sample") == 0 || strcmp(argv[i + 1], "instrument") == 0)) {
+			options.profile = true;
+			options.profileMode = strcmp(argv[++i], "sample") == 0 ? PROFILE_SAMPLE : PROFILE_INSTRUMENT;
+		}
+		else if (strcmp(argv[i], "--profile-interval") == 0 && i + 1 < argc && parsePositive(argv[i + 1], &number)) {
+			options.profileInterval = (uint32_t)number;
+			i++;
+		}
+		else if (strcmp(argv[i], "--profile-output") == 0 && i + 1 < argc) {
+			options.profileOutput = argv[++i];
+		}
+		else if (strcmp(argv[i], "--gc-growth") == 0 && i + 1 < argc && parsePositive(argv[i + 1], &number) && number >= 1) {
+			options.gcGrowthFactor = number;
+			i++;
+		}
+		else if (strcmp(argv[i], "--gc-min-heap") == 0 && i + 1 < argc && parseSize(argv[i + 1], &options.gcMinHeap)) {
+			i++;
+		}
+		else if (strcmp(argv[i], "--gc-soft-limit") == 0 && i + 1 < argc && parseSize(argv[i + 1], &options.gcSoftLimit)) {
+			i++;
+		}
+		else if (strcmp(argv[i], "--gc-hard-limit") == 0 && i + 1 < argc && parseSize(argv[i + 1], &options.gcHardLimit)) {
+			i++;
+		}
+		else if (strcmp(argv[i], "--no-bytecode-cache") == 0) {
+			options.bytecodeCache = false;
+		}
+		else if (strcmp(argv[i], "--no-import-prescan") == 0) {
+			options.importPrescan = false;
+		}
+		else if (strcmp(argv[i], "--max-frames") == 0 && i + 1 < argc && parsePositive(argv[i + 1], &number) && number >= 1) {
+			options.frameMax = (size_t)number;
+			i++;
+		}
+		else if (strcmp(argv[i], "--precompile") == 0 && i + 1 < argc && precompile == NULL) {
+			precompile = argv[++i];
+		}
+		else if (strncmp(argv[i], "-O", 2) == 0 && argv[i][2] >= '0' && argv[i][2] <= '9' && argv[i][3] == '\0') {
+			options.optimizationLevel = argv[i][2] - '0';
+		}
+		else if (path == NULL && argv[i][0] != '-') {
+			path = argv[i];
+		}
+		else {
+			fprintf(stderr, "Usage: %s [-O<level>] [--cache-stats] [--gc-stats] [--gc-incremental] [--gc-slice objects] [--gc-max-pause ms] [--gc-growth factor] [--gc-min-heap size] [--gc-soft-limit size] [--gc-hard-limit size] [--opcode-stats] [--jit] [--profile sample|instrument] [--profile-interval us] [--profile-output path] [--no-bytecode-cache] [--no-import-prescan] [--max-frames count] [--precompile directory] [path]\n", argv[0]);
+			return 120;
+		}
+	}
+
+	if (precompile != NULL) {
+		precompileDirectory(precompile, &options);
+		if (path == NULL) return 0;
 	}
-	else if (argc == 2) {
-		runFile(argv[1]);
+
+	if (path == NULL) {
+		repl(&options);
 	}
 	else {
-		fprintf(stderr, "Usage: %s [path]\n", argv[0]);
-		return 120;
+		runFile(path, &options);
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
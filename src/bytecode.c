@@ -0,0 +1,531 @@
+#include "bytecode.h"
+#include "memory.h"
+#include "file.h"
+#include "vm.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+  File layout, integers are unsigned LEB128 unless noted and u64s are 8 bytes little endian.
+  - Header: "DGNC", version, optimization level, source modification time (u64), source size (u64), source hash (u64),
+    time written (u64), payload hash (u64), payload length.
+  - Payload: global count, the global names in slot order, then the script function.
+  - Function: name (0 for none, otherwise length + 1 then the characters), arity, upvalue count, flags (lambda, varargs),
+    code, line table, constants (tagged, functions nest), inline caches (opcode, line), exception handlers (start, end,
+    handler, depth), switch tables (default target, case count, then each case's key tagged like a constant and target).
+  BYTECODE_VERSION must change whenever the opcodes, their operands or this layout do.
+*/
+
+#define BYTECODE_MAGIC "DGNC"
+#define BYTECODE_VERSION 9
+
+#define FLAG_LAMBDA 0x01
+#define FLAG_VARARGS 0x02
+
+typedef enum {
+	CONSTANT_NUMBER,
+	CONSTANT_STRING,
+	CONSTANT_FUNCTION
+} ConstantTag;
+
+static uint64_t hashBytes(const uint8_t* data, size_t length) {
+	// FNV-1a
+	uint64_t hash = 14695981039346656037u;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 1099511628211u;
+	}
+	return hash;
+}
+
+char* bytecodePath(const char* sourcePath) {
+	size_t length = strlen(sourcePath);
+	if (hasExtension(sourcePath, ".dgn")) length -= 4;
+
+	size_t extensionLength = strlen(BYTECODE_EXTENSION);
+	char* path = malloc(length + extensionLength + 1);
+	if (path == NULL) {
+		fprintf(stderr, "Could not allocate path %s\n", sourcePath);
+		exit(120);
+	}
+	memcpy(path, sourcePath, length);
+	memcpy(path + length, BYTECODE_EXTENSION, extensionLength + 1);
+	return path;
+}
+
+/*
+  Writing
+  The file is built in a buffer outside of the VM's heap, so saving never triggers a collection.
+*/
+
+typedef struct {
+	uint8_t* data;
+	size_t count;
+	size_t capacity;
+	bool failed;
+} Writer;
+
+static void writeBytes(Writer* writer, const void* bytes, size_t length) {
+	if (writer->failed) return;
+	if (writer->count + length > writer->capacity) {
+		size_t capacity = writer->capacity < 256 ? 256 : writer->capacity;
+		while (capacity < writer->count + length) capacity *= 2;
+		uint8_t* data = realloc(writer->data, capacity);
+		if (data == NULL) {
+			writer->failed = true;
+			return;
+		}
+		writer->data = data;
+		writer->capacity = capacity;
+	}
+	memcpy(writer->data + writer->count, bytes, length);
+	writer->count += length;
+}
+
+static void writeByte(Writer* writer, uint8_t byte) {
+	writeBytes(writer, &byte, 1);
+}
+
+static void writeSize(Writer* writer, size_t value) {
+	do {
+		uint8_t byte = value & 0x7f;
+		value >>= 7;
+		if (value != 0) byte |= 0x80;
+		writeByte(writer, byte);
+	} while (value != 0);
+}
+
+static void writeU64(Writer* writer, uint64_t value) {
+	uint8_t bytes[8];
+	for (int i = 0; i < 8; i++) bytes[i] = (uint8_t)(value >> (i * 8));
+	writeBytes(writer, bytes, 8);
+}
+
+static void writeString(Writer* writer, ObjString* string) {
+	writeSize(writer, string->length);
+	writeBytes(writer, string->chars, string->length);
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function) {
+	if (function->name == NULL) {
+		writeSize(writer, 0);
+	}
+	else {
+		writeSize(writer, function->name->length + 1);
+		writeBytes(writer, function->name->chars, function->name->length);
+	}
+	writeSize(writer, function->arity);
+	writeSize(writer, function->upvalueCount);
+	writeByte(writer, (function->isLambda ? FLAG_LAMBDA : 0) | (function->varargs ? FLAG_VARARGS : 0));
+
+	Chunk* chunk = &function->chunk;
+	writeSize(writer, chunk->count);
+	writeBytes(writer, chunk->code, chunk->count);
+
+	// Each run of lines as its offset and line, the table is encoded again while reading.
+	writeSize(writer, chunk->lines.runCount);
+	size_t position = 0;
+	size_t offset = 0;
+	size_t line = 0;
+	for (size_t i = 0; i < chunk->lines.runCount; i++) {
+		position = readLineRun(&chunk->lines, position, &offset, &line);
+		writeSize(writer, offset);
+		writeSize(writer, line);
+	}
+
+	writeSize(writer, chunk->constants.count);
+	for (size_t i = 0; i < chunk->constants.count; i++) {
+		Value constant = chunk->constants.values[i];
+		if (IS_NUMBER(constant)) {
+			double number = AS_NUMBER(constant);
+			uint64_t bits;
+			memcpy(&bits, &number, sizeof(bits));
+			writeByte(writer, CONSTANT_NUMBER);
+			writeU64(writer, bits);
+		}
+		else if (IS_STRING(constant)) {
+			writeByte(writer, CONSTANT_STRING);
+			writeString(writer, AS_STRING(constant));
+		}
+		else if (IS_FUNCTION(constant)) {
+			writeByte(writer, CONSTANT_FUNCTION);
+			writeFunction(writer, AS_FUNCTION(constant));
+		}
+		else {
+			// The compiler only emits the constants above.
+			writer->failed = true;
+		}
+	}
+
+	writeSize(writer, chunk->cacheCount);
+	for (size_t i = 0; i < chunk->cacheCount; i++) {
+		writeByte(writer, chunk->caches[i].opcode);
+		writeSize(writer, chunk->caches[i].line);
+	}
+
+	writeSize(writer, chunk->handlerCount);
+	for (size_t i = 0; i < chunk->handlerCount; i++) {
+		ExceptionHandler* handler = &chunk->handlers[i];
+		writeSize(writer, handler->start);
+		writeSize(writer, handler->end);
+		writeSize(writer, handler->handler);
+		writeSize(writer, handler->depth);
+	}
+
+	// Only the cases themselves, tables are rebuilt as they are read.
+	writeSize(writer, chunk->switchCount);
+	for (size_t i = 0; i < chunk->switchCount; i++) {
+		SwitchTable* table = &chunk->switches[i];
+		size_t count = 0;
+		for (size_t j = 0; j < table->count; j++) {
+			if (!IS_NULL(table->cases[j].key)) count++;
+		}
+		writeSize(writer, table->defaultTarget);
+		writeSize(writer, count);
+		for (size_t j = 0; j < table->count; j++) {
+			SwitchCase* entry = &table->cases[j];
+			if (IS_NULL(entry->key)) continue;
+			if (IS_NUMBER(entry->key)) {
+				double number = AS_NUMBER(entry->key);
+				uint64_t bits;
+				memcpy(&bits, &number, sizeof(bits));
+				writeByte(writer, CONSTANT_NUMBER);
+				writeU64(writer, bits);
+			}
+			else {
+				writeByte(writer, CONSTANT_STRING);
+				writeString(writer, AS_STRING(entry->key));
+			}
+			writeSize(writer, entry->target);
+		}
+	}
+}
+
+static bool writeGlobals(Writer* writer, Module* module) {
+	size_t count = module->slots.count;
+	ObjString** names = calloc(count == 0 ? 1 : count, sizeof(ObjString*));
+	if (names == NULL) return false;
+
+	for (size_t i = 0; i < module->globals.capacity; i++) {
+		Entry* entry = &module->globals.entries[i];
+		if (entry->key == NULL) continue;
+		size_t slot = (size_t)AS_NUMBER(entry->value);
+		if (slot < count) names[slot] = entry->key;
+	}
+
+	bool valid = true;
+	writeSize(writer, count);
+	for (size_t i = 0; i < count && valid; i++) {
+		if (names[i] == NULL) valid = false;
+		else writeString(writer, names[i]);
+	}
+	free(names);
+	return valid;
+}
+
+uint8_t* encodeBytecode(VM* vm, Module* module, ObjFunction* function, const char* sourcePath, const char* source, size_t* length) {
+	FileInfo info;
+	if (!getFileInfo(sourcePath, &info)) return NULL;
+
+	Writer payload = { NULL, 0, 0, false };
+	bool valid = writeGlobals(&payload, module);
+	writeFunction(&payload, function);
+
+	if (!valid || payload.failed) {
+		free(payload.data);
+		return NULL;
+	}
+
+	Writer writer = { NULL, 0, 0, false };
+	writeBytes(&writer, BYTECODE_MAGIC, 4);
+	writeSize(&writer, BYTECODE_VERSION);
+	writeSize(&writer, (size_t)vm->optimizationLevel);
+	writeU64(&writer, (uint64_t)info.modified);
+	writeU64(&writer, info.size);
+	writeU64(&writer, hashBytes((const uint8_t*)source, strlen(source)));
+	writeU64(&writer, (uint64_t)time(NULL));
+	writeU64(&writer, hashBytes(payload.data, payload.count));
+	writeSize(&writer, payload.count);
+	writeBytes(&writer, payload.data, payload.count);
+	free(payload.data);
+
+	if (writer.failed) {
+		free(writer.data);
+		return NULL;
+	}
+	*length = writer.count;
+	return writer.data;
+}
+
+bool saveBytecode(VM* vm, Module* module, ObjFunction* function, const char* path, const char* sourcePath, const char* source) {
+	size_t length;
+	uint8_t* data = encodeBytecode(vm, module, function, sourcePath, source, &length);
+	if (data == NULL) return false;
+
+	bool saved = writeFileAtomic(path, data, length);
+	free(data);
+	return saved;
+}
+
+/*
+  Reading
+  Objects are kept on the VM's stack while they are being filled in, as reading allocates.
+*/
+
+typedef struct {
+	const uint8_t* data;
+	size_t length;
+	size_t offset;
+	bool failed;
+} Reader;
+
+static const uint8_t* readBytes(Reader* reader, size_t length) {
+	if (reader->failed || length > reader->length - reader->offset) {
+		reader->failed = true;
+		return NULL;
+	}
+	const uint8_t* bytes = reader->data + reader->offset;
+	reader->offset += length;
+	return bytes;
+}
+
+static uint8_t readByte(Reader* reader) {
+	const uint8_t* byte = readBytes(reader, 1);
+	return byte == NULL ? 0 : *byte;
+}
+
+static size_t readSize(Reader* reader) {
+	size_t value = 0;
+	for (unsigned shift = 0; shift < sizeof(size_t) * 8; shift += 7) {
+		uint8_t byte = readByte(reader);
+		value |= (size_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) return value;
+	}
+	reader->failed = true;
+	return 0;
+}
+
+static uint64_t readU64(Reader* reader) {
+	const uint8_t* bytes = readBytes(reader, 8);
+	if (bytes == NULL) return 0;
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) value |= (uint64_t)bytes[i] << (i * 8);
+	return value;
+}
+
+static ObjString* readString(VM* vm, Reader* reader, size_t length) {
+	const uint8_t* chars = readBytes(reader, length);
+	if (chars == NULL) return NULL;
+	return copyString(vm, (const char*)chars, length);
+}
+
+// Leaves the function on the stack, returning NULL if the file is malformed.
+static ObjFunction* readFunction(VM* vm, Reader* reader) {
+	ObjFunction* function = newFunction(vm);
+	push(vm, OBJ_VAL(function));
+
+	size_t nameLength = readSize(reader);
+	if (nameLength > 0) {
+		function->name = readString(vm, reader, nameLength - 1);
+		WRITE_BARRIER_OBJ(vm, function, function->name);
+	}
+	function->arity = readSize(reader);
+	function->upvalueCount = readSize(reader);
+	uint8_t flags = readByte(reader);
+	function->isLambda = (flags & FLAG_LAMBDA) != 0;
+	function->varargs = (flags & FLAG_VARARGS) != 0;
+
+	Chunk* chunk = &function->chunk;
+	size_t codeCount = readSize(reader);
+	const uint8_t* code = readBytes(reader, codeCount);
+	if (reader->failed) return NULL;
+	if (codeCount > 0) {
+		chunk->code = ALLOCATE(vm, uint8_t, codeCount);
+		memcpy(chunk->code, code, codeCount);
+		chunk->capacity = codeCount;
+		chunk->count = codeCount;
+	}
+
+	size_t runCount = readSize(reader);
+	if (reader->failed || runCount > reader->length - reader->offset) return NULL;
+	for (size_t i = 0; i < runCount; i++) {
+		size_t offset = readSize(reader);
+		size_t line = readSize(reader);
+		if (reader->failed || offset < chunk->lines.lastOffset) return NULL;
+		writeLineNumberTable(vm, &chunk->lines, offset, line);
+	}
+
+	size_t constantCount = readSize(reader);
+	for (size_t i = 0; i < constantCount && !reader->failed; i++) {
+		switch (readByte(reader)) {
+			case CONSTANT_NUMBER: {
+				uint64_t bits = readU64(reader);
+				double number;
+				memcpy(&number, &bits, sizeof(number));
+				writeValueArray(vm, &chunk->constants, NUMBER_VAL(number));
+				break;
+			}
+			case CONSTANT_STRING: {
+				ObjString* string = readString(vm, reader, readSize(reader));
+				if (string == NULL) return NULL;
+				push(vm, OBJ_VAL(string));
+				writeValueArray(vm, &chunk->constants, OBJ_VAL(string));
+				WRITE_BARRIER_OBJ(vm, function, string);
+				pop(vm);
+				break;
+			}
+			case CONSTANT_FUNCTION: {
+				ObjFunction* nested = readFunction(vm, reader);
+				if (nested == NULL) return NULL;
+				writeValueArray(vm, &chunk->constants, OBJ_VAL(nested));
+				WRITE_BARRIER_OBJ(vm, function, nested);
+				pop(vm);
+				break;
+			}
+			default:
+				reader->failed = true;
+				break;
+		}
+	}
+
+	size_t cacheCount = readSize(reader);
+	for (size_t i = 0; i < cacheCount && !reader->failed; i++) {
+		uint8_t opcode = readByte(reader);
+		addInlineCache(vm, chunk, opcode, readSize(reader));
+	}
+
+	size_t handlerCount = readSize(reader);
+	for (size_t i = 0; i < handlerCount && !reader->failed; i++) {
+		size_t start = readSize(reader);
+		size_t end = readSize(reader);
+		size_t handler = readSize(reader);
+		size_t depth = readSize(reader);
+		if (reader->failed || start > end || end > chunk->count || handler >= chunk->count) return NULL;
+		addExceptionHandler(vm, chunk, start, end, handler, depth);
+	}
+
+	size_t switchCount = readSize(reader);
+	for (size_t i = 0; i < switchCount && !reader->failed; i++) {
+		size_t defaultTarget = readSize(reader);
+		size_t count = readSize(reader);
+		if (reader->failed || defaultTarget >= chunk->count || count > reader->length - reader->offset) return NULL;
+
+		// The keys are held by a list on the stack until the table holds them.
+		ValueArray array;
+		initValueArray(&array);
+		ObjList* keys = newList(vm, array);
+		push(vm, OBJ_VAL(keys));
+		SwitchCase* cases = ALLOCATE(vm, SwitchCase, count);
+		for (size_t j = 0; j < count && !reader->failed; j++) {
+			Value key = NULL_VAL;
+			switch (readByte(reader)) {
+				case CONSTANT_NUMBER: {
+					uint64_t bits = readU64(reader);
+					double number;
+					memcpy(&number, &bits, sizeof(number));
+					key = NUMBER_VAL(number);
+					break;
+				}
+				case CONSTANT_STRING: {
+					ObjString* string = readString(vm, reader, readSize(reader));
+					if (string == NULL) break;
+					key = OBJ_VAL(string);
+					push(vm, key);
+					writeValueArray(vm, &keys->items, key);
+					WRITE_BARRIER_OBJ(vm, keys, string);
+					pop(vm);
+					break;
+				}
+			}
+			cases[j] = (SwitchCase){ key, readSize(reader) };
+			if (IS_NULL(key) || (IS_NUMBER(key) && isnan(AS_NUMBER(key))) || cases[j].target >= chunk->count) reader->failed = true;
+		}
+		if (!reader->failed) {
+			addSwitchTable(vm, chunk, cases, count, defaultTarget);
+			for (size_t j = 0; j < keys->items.count; j++) WRITE_BARRIER_OBJ(vm, function, AS_OBJ(keys->items.values[j]));
+		}
+		FREE_ARRAY(vm, SwitchCase, cases, count);
+		pop(vm);
+	}
+
+	return reader->failed ? NULL : function;
+}
+
+static bool readGlobals(VM* vm, Reader* reader, Module* module) {
+	size_t count = readSize(reader);
+	for (size_t i = 0; i < count && !reader->failed; i++) {
+		ObjString* name = readString(vm, reader, readSize(reader));
+		if (name == NULL) return false;
+		if (moduleGlobalSlot(vm, module, name) != i) return false;
+	}
+	return !reader->failed;
+}
+
+// Whether the source is unchanged since the file was written: by modification time and size, or failing those its hash.
+static bool isUpToDate(const char* sourcePath, uint64_t modified, uint64_t size, uint64_t hash, uint64_t written) {
+	FileInfo info;
+	if (!getFileInfo(sourcePath, &info)) return true;
+
+	// A source modified in the same second the file was written could have changed without its time changing.
+	if ((uint64_t)info.modified == modified && info.size == size && modified < written) return true;
+
+	size_t length;
+	uint8_t* source = readFileBytes(sourcePath, &length);
+	if (source == NULL) return false;
+	bool same = hashBytes(source, length) == hash;
+	free(source);
+	return same;
+}
+
+// Reads and checks the header, leaving the reader at the payload.
+static bool readHeader(VM* vm, Reader* reader, const char* sourcePath) {
+	const uint8_t* magic = readBytes(reader, 4);
+	if (magic == NULL || memcmp(magic, BYTECODE_MAGIC, 4) != 0 || readSize(reader) != BYTECODE_VERSION) return false;
+
+	size_t optimizationLevel = readSize(reader);
+	uint64_t modified = readU64(reader);
+	uint64_t size = readU64(reader);
+	uint64_t sourceHash = readU64(reader);
+	uint64_t written = readU64(reader);
+	uint64_t payloadHash = readU64(reader);
+	size_t payloadLength = readSize(reader);
+
+	bool valid = !reader->failed && payloadLength == reader->length - reader->offset
+		&& hashBytes(reader->data + reader->offset, payloadLength) == payloadHash;
+	if (valid && sourcePath != NULL) {
+		valid = optimizationLevel == (size_t)vm->optimizationLevel && isUpToDate(sourcePath, modified, size, sourceHash, written);
+	}
+	return valid;
+}
+
+bool checkBytecode(VM* vm, const uint8_t* data, size_t length, const char* sourcePath) {
+	Reader reader = { data, length, 0, false };
+	return readHeader(vm, &reader, sourcePath);
+}
+
+ObjFunction* decodeBytecode(VM* vm, Module* module, const uint8_t* data, size_t length, const char* sourcePath) {
+	Reader reader = { data, length, 0, false };
+	if (!readHeader(vm, &reader, sourcePath)) return NULL;
+
+	ObjFunction* function = NULL;
+	Value* stackTop = vm->stackTop;
+	if (readGlobals(vm, &reader, module)) {
+		function = readFunction(vm, &reader);
+		if (reader.offset != reader.length) function = NULL;
+	}
+	vm->stackTop = stackTop;
+	return function;
+}
+
+ObjFunction* loadBytecode(VM* vm, Module* module, const char* path, const char* sourcePath) {
+	size_t length;
+	uint8_t* data = readFileBytes(path, &length);
+	if (data == NULL) return NULL;
+
+	ObjFunction* function = decodeBytecode(vm, module, data, length, sourcePath);
+	free(data);
+	return function;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "common.h"
+#include "object.h"
+#include "module.h"
+
+/*
+  Precompiled bytecode files ('.dgnc'), holding a compiled script and every function nested in it.
+  - The file records the module's global names in slot order, loading resolves them into the given module and fails
+    unless each one lands in the same slot (the module must have been set up as it was when compiling).
+  - A file is tied to the source it was compiled from by the source's modification time and size, falling back to a
+    hash of its contents when those differ, and to the format version and optimization level it was compiled with.
+  - Saving must happen straight after compiling, before the code runs and quickens any of its instructions.
+*/
+
+#define BYTECODE_EXTENSION ".dgnc"
+
+// The path of the bytecode file kept next to a source file (allocated with malloc), e.g. 'lib/list.dgn' to 'lib/list.dgnc'.
+char* bytecodePath(const char* sourcePath);
+
+// Writes the compiled function to path, source (and its path) are what it was compiled from.
+bool saveBytecode(VM* vm, Module* module, ObjFunction* function, const char* path, const char* sourcePath, const char* source);
+// Like saveBytecode, but returns the file's contents (allocated with malloc, length bytes long) rather than writing them.
+uint8_t* encodeBytecode(VM* vm, Module* module, ObjFunction* function, const char* sourcePath, const char* source, size_t* length);
+/*
+  Reads the function stored at path, or returns NULL if the file is missing or invalid.
+  - When sourcePath is given and the source exists the file must be up to date with it, otherwise it is used as is.
+*/
+ObjFunction* loadBytecode(VM* vm, Module* module, const char* path, const char* sourcePath);
+// loadBytecode, reading the file's contents from memory.
+ObjFunction* decodeBytecode(VM* vm, Module* module, const uint8_t* data, size_t length, const char* sourcePath);
+// Whether the file's contents are intact and (as for loadBytecode) up to date with sourcePath, without loading them.
+bool checkBytecode(VM* vm, const uint8_t* data, size_t length, const char* sourcePath);
@@ -2,35 +2,74 @@
 #include <stdlib.h>
 #include "memory.h"
 #include "vm.h"
+#include "leb128.h"
+#include "object.h"
+#include <math.h>
 
 void initLineNumberTable(LineNumberTable* table) {
 	table->count = 0;
 	table->capacity = 0;
-	table->lines = NULL;
+	table->runs = NULL;
+	table->runCount = 0;
+	table->checkpointCount = 0;
+	table->checkpointCapacity = 0;
+	table->checkpoints = NULL;
+	table->lastOffset = 0;
+	table->lastLine = 0;
+}
+
+static size_t zigzag(size_t from, size_t to) {
+	return to >= from ? (to - from) << 1 : ((from - to) << 1) - 1;
+}
+
+static size_t unzigzag(size_t value, size_t from) {
+	return (value & 1) == 0 ? from + (value >> 1) : from - ((value + 1) >> 1);
 }
 
 void writeLineNumberTable(VM* vm, LineNumberTable* table, size_t index, size_t line) {
-	if (table->count == 0) {
-		table->capacity = 8;
-		table->lines = GROW_ARRAY(vm, size_t, table->lines, 0, table->capacity);
-		table->lines[0] = index;
-		table->lines[1] = line;
-		table->count += 2;
+	if (table->runCount > 0 && table->lastLine == line) return;
+
+	size_t offsetDelta = index - table->lastOffset;
+	size_t lineDelta = zigzag(table->lastLine, line);
+	size_t size = uleb128Size(offsetDelta) + uleb128Size(lineDelta);
+	if (table->capacity < table->count + size) {
+		size_t oldCapacity = table->capacity;
+		table->capacity = max(GROW_CAPACITY(oldCapacity), table->count + size);
+		table->runs = GROW_ARRAY(vm, uint8_t, table->runs, oldCapacity, table->capacity);
 	}
-	else if(table->lines[table->count - 1] != line) {
-		if (table->capacity < table->count + 2) {
-			size_t oldCapacity = table->capacity;
-			table->capacity = GROW_CAPACITY(oldCapacity);
-			table->lines = GROW_ARRAY(vm, size_t, table->lines, oldCapacity, table->capacity);
+	table->count += encodeUleb128(table->runs + table->count, offsetDelta);
+	table->count += encodeUleb128(table->runs + table->count, lineDelta);
+
+	if (table->runCount % LINE_CHECKPOINT_INTERVAL == 0) {
+		if (table->checkpointCapacity < table->checkpointCount + 1) {
+			size_t oldCapacity = table->checkpointCapacity;
+			table->checkpointCapacity = GROW_CAPACITY(oldCapacity);
+			table->checkpoints = GROW_ARRAY(vm, LineCheckpoint, table->checkpoints, oldCapacity, table->checkpointCapacity);
 		}
-		table->lines[table->count] = index;
-		table->lines[table->count + 1] = line;
-		table->count += 2;
+		LineCheckpoint* checkpoint = &table->checkpoints[table->checkpointCount++];
+		checkpoint->offset = index;
+		checkpoint->line = line;
+		checkpoint->position = table->count;
 	}
+
+	table->runCount++;
+	table->lastOffset = index;
+	table->lastLine = line;
+}
+
+size_t readLineRun(LineNumberTable* table, size_t position, size_t* offset, size_t* line) {
+	size_t offsetDelta;
+	size_t lineDelta;
+	position += readUleb128(table->runs + position, &offsetDelta);
+	position += readUleb128(table->runs + position, &lineDelta);
+	*offset += offsetDelta;
+	*line = unzigzag(lineDelta, *line);
+	return position;
 }
 
 void freeLineNumberTable(VM* vm, LineNumberTable* table) {
-	FREE_ARRAY(vm, size_t, table->lines, table->capacity);
+	FREE_ARRAY(vm, uint8_t, table->runs, table->capacity);
+	FREE_ARRAY(vm, LineCheckpoint, table->checkpoints, table->checkpointCapacity);
 	initLineNumberTable(table);
 }
 
@@ -40,12 +79,25 @@ void initChunk(Chunk* chunk) {
 	chunk->code = NULL;
 	initValueArray(&chunk->constants);
 	initLineNumberTable(&chunk->lines);
+	chunk->cacheCount = 0;
+	chunk->cacheCapacity = 0;
+	chunk->caches = NULL;
+	chunk->handlerCount = 0;
+	chunk->handlerCapacity = 0;
+	chunk->handlers = NULL;
+	chunk->switchCount = 0;
+	chunk->switchCapacity = 0;
+	chunk->switches = NULL;
 }
 
 void freeChunk(VM* vm, Chunk* chunk) {
 	FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
 	freeValueArray(vm, &chunk->constants);
 	freeLineNumberTable(vm, &chunk->lines);
+	FREE_ARRAY(vm, InlineCache, chunk->caches, chunk->cacheCapacity);
+	FREE_ARRAY(vm, ExceptionHandler, chunk->handlers, chunk->handlerCapacity);
+	for (size_t i = 0; i < chunk->switchCount; i++) FREE_ARRAY(vm, SwitchCase, chunk->switches[i].cases, chunk->switches[i].count);
+	FREE_ARRAY(vm, SwitchTable, chunk->switches, chunk->switchCapacity);
 	initChunk(chunk);
 }
 
@@ -62,6 +114,114 @@ void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, size_t line) {
 }
 
 size_t addConstant(VM* vm, Chunk* chunk, Value value) {
+	push(vm, value); // GC
 	writeValueArray(vm, &chunk->constants, value);
+	pop(vm);
 	return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+size_t addInlineCache(VM* vm, Chunk* chunk, uint8_t opcode, size_t line) {
+	if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+		size_t oldCapacity = chunk->cacheCapacity;
+		chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->caches = GROW_ARRAY(vm, InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+	}
+
+	InlineCache* cache = &chunk->caches[chunk->cacheCount];
+	cache->opcode = opcode;
+	cache->count = 0;
+	cache->megamorphic = false;
+	cache->line = line;
+	cache->hits = 0;
+	cache->misses = 0;
+	return chunk->cacheCount++;
+}
+
+void addExceptionHandler(VM* vm, Chunk* chunk, size_t start, size_t end, size_t handler, size_t depth) {
+	if (chunk->handlerCapacity < chunk->handlerCount + 1) {
+		size_t oldCapacity = chunk->handlerCapacity;
+		chunk->handlerCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->handlers = GROW_ARRAY(vm, ExceptionHandler, chunk->handlers, oldCapacity, chunk->handlerCapacity);
+	}
+
+	chunk->handlers[chunk->handlerCount++] = (ExceptionHandler){ start, end, handler, depth };
+}
+
+ExceptionHandler* findExceptionHandler(Chunk* chunk, size_t offset) {
+	for (size_t i = 0; i < chunk->handlerCount; i++) {
+		ExceptionHandler* handler = &chunk->handlers[i];
+		if (offset >= handler->start && offset < handler->end) return handler;
+	}
+	return NULL;
+}
+
+static uint32_t hashSwitchKey(Value key) {
+	return IS_STRING(key) ? stringHash(AS_STRING(key)) : hashNumber(AS_NUMBER(key));
+}
+
+// Dense when every key is an integer and at least half of the range they span is filled.
+static bool isDense(SwitchCase* cases, size_t count, double* low, double* high) {
+	*low = 0;
+	*high = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (!IS_NUMBER(cases[i].key)) return false;
+		double number = AS_NUMBER(cases[i].key);
+		if (number != floor(number) || fabs(number) > 9007199254740992.0) return false;
+		if (i == 0 || number < *low) *low = number;
+		if (i == 0 || number > *high) *high = number;
+	}
+	return count > 0 && *high - *low < (double)count * 2;
+}
+
+size_t addSwitchTable(VM* vm, Chunk* chunk, SwitchCase* cases, size_t count, size_t defaultTarget) {
+	SwitchTable table;
+	table.defaultTarget = defaultTarget;
+	double high;
+	table.dense = isDense(cases, count, &table.low, &high);
+	if (table.dense) {
+		table.count = (size_t)(high - table.low) + 1;
+	}
+	else {
+		table.count = 1;
+		while (table.count < count * 2) table.count *= 2;
+	}
+
+	table.cases = ALLOCATE(vm, SwitchCase, table.count);
+	for (size_t i = 0; i < table.count; i++) table.cases[i] = (SwitchCase){ NULL_VAL, defaultTarget };
+	for (size_t i = 0; i < count; i++) {
+		size_t index;
+		if (table.dense) {
+			index = (size_t)(AS_NUMBER(cases[i].key) - table.low);
+		}
+		else {
+			index = hashSwitchKey(cases[i].key) & (table.count - 1);
+			while (!IS_NULL(table.cases[index].key)) index = (index + 1) & (table.count - 1);
+		}
+		table.cases[index] = cases[i];
+	}
+
+	if (chunk->switchCapacity < chunk->switchCount + 1) {
+		size_t oldCapacity = chunk->switchCapacity;
+		chunk->switchCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->switches = GROW_ARRAY(vm, SwitchTable, chunk->switches, oldCapacity, chunk->switchCapacity);
+	}
+	chunk->switches[chunk->switchCount] = table;
+	return chunk->switchCount++;
+}
+
+size_t switchTarget(SwitchTable* table, Value value) {
+	if (table->dense) {
+		if (!IS_NUMBER(value)) return table->defaultTarget;
+		double index = AS_NUMBER(value) - table->low;
+		if (index >= 0 && index < (double)table->count && index == (double)(size_t)index) return table->cases[(size_t)index].target;
+		return table->defaultTarget;
+	}
+
+	if (!IS_NUMBER(value) && !IS_STRING(value)) return table->defaultTarget;
+	size_t mask = table->count - 1;
+	for (size_t index = hashSwitchKey(value) & mask;; index = (index + 1) & mask) {
+		SwitchCase* entry = &table->cases[index];
+		if (IS_NULL(entry->key)) return table->defaultTarget;
+		if (valuesEqual(entry->key, value)) return entry->target;
+	}
+}
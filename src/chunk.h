@@ -10,6 +10,10 @@ typedef enum {
 	OP_OBJECT,
 	OP_LIST,
 	OP_RANGE,
+	OP_FOR_RANGE_INIT,
+	OP_FOR_RANGE,
+	OP_ITER_INIT,
+	OP_ITER_NEXT,
 	OP_GET_GLOBAL,
 	OP_DEFINE_GLOBAL,
 	OP_SET_GLOBAL,
@@ -56,36 +60,163 @@ typedef enum {
 	OP_JUMP_IF_FALSE_SC,
 	OP_JUMP,
 	OP_LOOP,
+	// Jumps to the case of a switch matching the value on top of the stack, through one of the chunk's switch tables.
+	OP_SWITCH,
 	OP_CALL,
+	// A call whose result is returned straight away, replacing the caller's frame (see vm.c).
+	OP_TAIL_CALL,
 	OP_CLOSURE,
 	OP_CLASS,
 	OP_INHERIT,
 	OP_METHOD,
 	OP_INVOKE,
+	OP_TAIL_INVOKE,
 	OP_SUPER_INVOKE,
 	OP_THROW,
-	OP_TRY_BEGIN,
-	OP_TRY_END,
 	OP_IMPORT,
 	OP_EXPORT,
-	OP_RETURN
+	OP_RETURN,
+
+	// Only in the built in list methods which call a function per item (see list.h).
+	OP_LIST_STEP,
+
+	// Superinstructions, only produced by the optimizer (see optimizer.h).
+	OP_GET_LOCAL_GET_LOCAL,
+	OP_GET_LOCAL_GET_PROPERTY,
+	OP_ADD_CONSTANT,
+	OP_SET_LOCAL_POP,
+	OP_SET_GLOBAL_POP,
+	OP_LESS_JUMP_IF_FALSE,
+	OP_POP_LOOP,
+
+	// Quickened instructions, only produced by the interpreter rewriting an instruction in place (see vm.c).
+	OP_ADD_NUM,
+	OP_ADD_STR,
+	OP_GET_INDEX_LIST,
+	OP_SET_INDEX_LIST
 } Opcode;
 
+/*
+  The lines of a chunk's code, as runs of instructions on the same line.
+  - Each run is two ULEB128 numbers: how many bytes after the previous run it starts, and the change in line (zigzag
+    encoded, as a line can come before the one of the previous run).
+  - Every LINE_CHECKPOINT_INTERVAL runs there is a checkpoint holding the run's offset and line, where decoding can
+    start, so getLine binary searches the checkpoints and then decodes at most that many runs.
+*/
+#define LINE_CHECKPOINT_INTERVAL 16
+
+typedef struct {
+	size_t offset;
+	size_t line;
+	// Where the run after this one starts in the encoded runs.
+	size_t position;
+} LineCheckpoint;
+
 typedef struct {
 	size_t count;
 	size_t capacity;
-	size_t* lines;
+	uint8_t* runs;
+	size_t runCount;
+	size_t checkpointCount;
+	size_t checkpointCapacity;
+	LineCheckpoint* checkpoints;
+	// The offset and line of the last run, which the next is encoded against.
+	size_t lastOffset;
+	size_t lastLine;
 } LineNumberTable;
 
+#define INLINE_CACHE_SIZE 4
+
+/*
+  A cached result of a property access, valid for any instance with the given shape.
+  - method is set when the name resolved to a class method (a closure), otherwise the name resolved to slot.
+  - next is set for property assignments that added the field, moving the instance from shape to next.
+*/
+typedef struct {
+	ObjShape* shape;
+	ObjShape* next;
+	ObjClosure* method;
+	size_t slot;
+} CacheEntry;
+
+/*
+  The inline cache for a single property access or invoke site.
+  - Up to INLINE_CACHE_SIZE shapes are cached, a site which sees more is marked megamorphic and is no longer updated.
+  - hits and misses are counted for '--cache-stats'.
+*/
+typedef struct {
+	uint8_t opcode;
+	uint8_t count;
+	bool megamorphic;
+	size_t line;
+	size_t hits;
+	size_t misses;
+	CacheEntry entries[INLINE_CACHE_SIZE];
+} InlineCache;
+
+/*
+  A try block, which catches exceptions thrown by the instructions in [start, end) (including those thrown from calls they
+  make) by dropping the stack back to depth slots above the frame's, pushing the exception and jumping to handler.
+  - Entering and leaving a try block runs no instructions, throwGeneral looks the handler up while unwinding.
+  - A chunk's handlers are in the order their try blocks end, so nested blocks come before the ones around them and the
+    first handler covering an offset is the innermost.
+*/
+typedef struct {
+	size_t start;
+	size_t end;
+	size_t handler;
+	size_t depth;
+} ExceptionHandler;
+
+typedef struct {
+	Value key;
+	size_t target;
+} SwitchCase;
+
+/*
+  The jump table of an OP_SWITCH, whose 16 bit operand is its index, for a switch whose cases all compare against number or
+  string constants (see compiler.c). Targets are offsets in the chunk, defaultTarget being where no case matches.
+  - Dense tables hold the integer cases from low up, indexed by the value minus low. Holes have null keys and jump to
+    defaultTarget.
+  - Sparse tables are open addressing hash tables of count (a power of two) cases, empty ones having null keys.
+*/
+typedef struct {
+	bool dense;
+	double low;
+	size_t count;
+	SwitchCase* cases;
+	size_t defaultTarget;
+} SwitchTable;
+
 typedef struct {
 	size_t count;
 	size_t capacity;
 	uint8_t* code;
 	ValueArray constants;
 	LineNumberTable lines;
+	size_t cacheCount;
+	size_t cacheCapacity;
+	InlineCache* caches;
+	size_t handlerCount;
+	size_t handlerCapacity;
+	ExceptionHandler* handlers;
+	size_t switchCount;
+	size_t switchCapacity;
+	SwitchTable* switches;
 } Chunk;
 
+void writeLineNumberTable(VM* vm, LineNumberTable* table, size_t index, size_t line);
+// Decodes the run at position, moving offset and line on to it, and returns the position of the next run.
+size_t readLineRun(LineNumberTable* table, size_t position, size_t* offset, size_t* line);
 void initChunk(Chunk* chunk);
 void freeChunk(VM* vm, Chunk* chunk);
 void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, size_t line);
-size_t addConstant(VM* vm, Chunk* chunk, Value value);
\ No newline at end of file
+size_t addConstant(VM* vm, Chunk* chunk, Value value);
+size_t addInlineCache(VM* vm, Chunk* chunk, uint8_t opcode, size_t line);
+void addExceptionHandler(VM* vm, Chunk* chunk, size_t start, size_t end, size_t handler, size_t depth);
+// The innermost handler whose try block covers offset, or NULL.
+ExceptionHandler* findExceptionHandler(Chunk* chunk, size_t offset);
+// Adds a table of the count cases (whose keys are distinct numbers and strings), dense if they are close enough integers.
+size_t addSwitchTable(VM* vm, Chunk* chunk, SwitchCase* cases, size_t count, size_t defaultTarget);
+// Where the switch jumps for value, which mustn't be a rope.
+size_t switchTarget(SwitchTable* table, Value value);
\ No newline at end of file
@@ -12,4 +12,11 @@
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
 #endif
-#define UINT8_COUNT (UINT8_MAX + 1)
\ No newline at end of file
+#define UINT8_COUNT (UINT8_MAX + 1)
+
+#ifndef max
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
\ No newline at end of file
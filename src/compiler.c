@@ -6,6 +6,7 @@
 #include "memory.h"
 #include "vm.h"
 #include "leb128.h"
+#include "optimizer.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,6 +17,8 @@ typedef struct {
 	Token previous;
 	bool hadError;
 	bool panicMode;
+	// False when compiling ahead of time (see prescan.h), the module is compiled again to report its errors.
+	bool reportErrors;
 } Parser;
 
 typedef struct {
@@ -54,7 +57,19 @@ struct Compiler {
 	bool isInLoop;
 	size_t continueJump;
 	size_t breakJump;
+	// How many try blocks the code being compiled is in.
+	size_t tryDepth;
+	// Where the last OP_CALL or OP_INVOKE starts and ends, so a return of its result can make it a tail call.
+	size_t lastCall;
+	size_t lastCallEnd;
+	// The calls ending the branches of the ternary that ends at tailCallsEnd, which a return of it makes tail calls.
+	// Entries below tailCallFloor belong to the branch of an enclosing ternary that was already compiled.
+	size_t tailCalls[UINT8_COUNT];
+	size_t tailCallCount;
+	size_t tailCallFloor;
+	size_t tailCallsEnd;
 	Parser* parser;
+	Module* module;
 	VM* vm;
 };
 
@@ -120,6 +135,26 @@ static void emitReturn(Compiler* compiler) {
 	emitByte(compiler, OP_RETURN);
 }
 
+static void markTailCall(Chunk* chunk, size_t offset) {
+	uint8_t* op = &chunk->code[offset];
+	if (*op == OP_CALL) *op = OP_TAIL_CALL;
+	else if (*op == OP_INVOKE) *op = OP_TAIL_INVOKE;
+}
+
+// Returns the value of the expression just compiled, as a tail call if the expression ended with a call (see vm.c).
+// A ternary ending it has the calls ending its branches marked too, their frame replacing the caller's before the
+// branch could jump to the return.
+static void emitValueReturn(Compiler* compiler) {
+	Chunk* chunk = currentChunk(compiler);
+	if (compiler->tryDepth == 0 && chunk->count > 0) {
+		if (compiler->lastCallEnd == chunk->count) markTailCall(chunk, compiler->lastCall);
+		if (compiler->tailCallsEnd == chunk->count) {
+			for (size_t i = 0; i < compiler->tailCallCount; i++) markTailCall(chunk, compiler->tailCalls[i]);
+		}
+	}
+	emitByte(compiler, OP_RETURN);
+}
+
 static size_t emitJump(Compiler* compiler, uint8_t instruction) {
 	emitByte(compiler, instruction);
 	emitPair(compiler, 0xff, 0xff);
@@ -151,6 +186,7 @@ static void initCompiler(Compiler* compiler, Compiler* parent, FunctionType type
 	vm->compiler = compiler;
 	compiler->vm = vm;
 	compiler->enclosing = parent;
+	compiler->module = parent == NULL ? NULL : parent->module;
 	compiler->function = NULL;
 	compiler->currentClass = NULL;
 	compiler->type = type;
@@ -159,6 +195,12 @@ static void initCompiler(Compiler* compiler, Compiler* parent, FunctionType type
 	compiler->parser = parser;
 	compiler->function = newFunction(vm);
 	compiler->isInLoop = false;
+	compiler->tryDepth = 0;
+	compiler->lastCall = 0;
+	compiler->lastCallEnd = 0;
+	compiler->tailCallCount = 0;
+	compiler->tailCallFloor = 0;
+	compiler->tailCallsEnd = 0;
 
 	if (compiler->enclosing != NULL) {
 		compiler->currentClass = compiler->enclosing->currentClass;
@@ -185,6 +227,26 @@ static void initCompiler(Compiler* compiler, Compiler* parent, FunctionType type
 static ObjFunction* endCompiler(Compiler* compiler) {
 	emitReturn(compiler);
 	ObjFunction* function = compiler->function;
+	if (compiler->vm->optimizationLevel > 0 && !compiler->parser->hadError) {
+		optimizeChunk(compiler->vm, currentChunk(compiler));
+	}
+
+	/*
+	  The function is filled in without write barriers, but a major collection during compilation may have promoted it
+	  (or marked it, in an incremental cycle) before its name, constants (nested functions, interned and folded strings)
+	  and switch cases were added. Applying the barrier for each remembers the function, so minor collections don't free
+	  them once compilation is over.
+	*/
+	VM* vm = compiler->vm;
+	WRITE_BARRIER_OBJ(vm, function, function->name);
+	for (size_t i = 0; i < function->chunk.constants.count; i++) {
+		WRITE_BARRIER(vm, function, function->chunk.constants.values[i]);
+	}
+	for (size_t i = 0; i < function->chunk.switchCount; i++) {
+		SwitchTable* table = &function->chunk.switches[i];
+		if (table->dense) continue;
+		for (size_t j = 0; j < table->count; j++) WRITE_BARRIER(vm, function, table->cases[j].key);
+	}
 #ifdef DEBUG_PRINT_CODE
 	if (!compiler->parser->hadError) {
 		disassembleChunk(compiler->vm, currentChunk(compiler), function->name != NULL ? function->name->chars : "<script>");
@@ -201,6 +263,8 @@ static bool identifiersEqual(Token* a, Token* b) {
 static void errorAt(Parser* parser, Token* token, const char* message) {
 	if (parser->panicMode) return;
 	parser->panicMode = true;
+	parser->hadError = true;
+	if (!parser->reportErrors) return;
 	fprintf(stderr, "[%zu] Error ", token->line);
 
 	if (token->type == TOKEN_EOF) {
@@ -213,7 +277,6 @@ static void errorAt(Parser* parser, Token* token, const char* message) {
 		fprintf(stderr, "at '%.*s'", (unsigned int)token->length, token->start);
 	}
 	fprintf(stderr, ": %s\n", message);
-	parser->hadError = true;
 }
 
 static void error(Parser* parser, const char* message) {
@@ -290,9 +353,18 @@ static void encodeConstant(Compiler* compiler, uint32_t constant) {
 	writeUleb128(compiler->vm, currentChunk(compiler), constant, compiler->parser->previous.line);
 }
 
+// Allocates an inline cache for the property access or invoke instruction just emitted, encoding its index.
+static void emitCache(Compiler* compiler, uint8_t opcode) {
+	Chunk* chunk = currentChunk(compiler);
+	size_t cache = addInlineCache(compiler->vm, chunk, opcode, compiler->parser->previous.line);
+	writeUleb128(compiler->vm, chunk, cache, compiler->parser->previous.line);
+}
+
+// The constant is added before the opcode is written, which may collect while value is only held here.
 static void emitConstant(Compiler* compiler, Value value) {
+	uint32_t constant = makeConstant(compiler, value);
 	emitByte(compiler, OP_CONSTANT);
-	encodeConstant(compiler, makeConstant(compiler, value));
+	encodeConstant(compiler, constant);
 }
 
 static uint32_t identifierConstant(Compiler* compiler, Token* name) {
@@ -390,13 +462,19 @@ static uint32_t parseVariable(Compiler* compiler, const char* errorMessage) {
 	return identifierConstant(compiler, &compiler->parser->previous);
 }
 
+// Resolves the global named by the given string constant to its slot in the module being compiled.
+static uint32_t globalSlot(Compiler* compiler, uint32_t constant) {
+	ObjString* name = AS_STRING(currentChunk(compiler)->constants.values[constant]);
+	return (uint32_t)moduleGlobalSlot(compiler->vm, compiler->module, name);
+}
+
 static void defineVariable(Compiler* compiler, uint32_t global) {
 	if (compiler->scopeDepth > 0) { 
 		markInitialized(compiler);
 		return;
 	}
 	emitByte(compiler, OP_DEFINE_GLOBAL);
-	encodeConstant(compiler, global);
+	encodeConstant(compiler, globalSlot(compiler, global));
 }
 
 static bool isInplaceOperator(Compiler* compiler) {
@@ -502,7 +580,7 @@ static void function(Compiler* compiler, FunctionType type) {
 		emitByte(compiler, functionCompiler.upvalues[i].index);
 	}
 
-	compiler->vm->compiler = compiler->enclosing;
+	compiler->vm->compiler = compiler;
 }
 
 static void method(Compiler* compiler) {
@@ -598,7 +676,7 @@ static void namedVariable(Compiler* compiler, Token name, bool canAssign) {
 		setOp = OP_SET_UPVALUE;
 	}
 	else {
-		arg = identifierConstant(compiler, &name);
+		arg = globalSlot(compiler, identifierConstant(compiler, &name));
 		getOp = OP_GET_GLOBAL;
 		setOp = OP_SET_GLOBAL;
 	}
@@ -697,6 +775,7 @@ static void object(Compiler* compiler, bool canAssign) {
 
 			emitByte(compiler, OP_SET_PROPERTY_KV);
 			encodeConstant(compiler, name);
+			emitCache(compiler, OP_SET_PROPERTY_KV);
 		} while (match(compiler, TOKEN_COMMA));
 	}
 
@@ -738,7 +817,7 @@ static void endLambda(Compiler* compiler, Compiler* functionCompiler, bool varar
 	}
 	else {
 		expression(functionCompiler);
-		emitByte(functionCompiler, OP_RETURN);
+		emitValueReturn(functionCompiler);
 	}
 
 	functionCompiler->vm = compiler->vm;
@@ -752,7 +831,7 @@ static void endLambda(Compiler* compiler, Compiler* functionCompiler, bool varar
 		emitByte(compiler, functionCompiler->upvalues[i].index);
 	}
 
-	compiler->vm->compiler = compiler->enclosing;
+	compiler->vm->compiler = compiler;
 }
 
 static void lambda(Compiler* compiler, bool canAssign) {
@@ -807,7 +886,9 @@ static void pipe(Compiler* compiler, bool canAssign) {
 
 static void call(Compiler* compiler, bool canAssign) {
 	uint8_t argCount = argumentList(compiler);
+	compiler->lastCall = currentChunk(compiler)->count;
 	emitPair(compiler, OP_CALL, argCount);
+	compiler->lastCallEnd = currentChunk(compiler)->count;
 }
 
 static void dot(Compiler* compiler, bool canAssign) {
@@ -818,6 +899,7 @@ static void dot(Compiler* compiler, bool canAssign) {
 		expression(compiler);
 		emitByte(compiler, OP_SET_PROPERTY);
 		encodeConstant(compiler, name);
+		emitCache(compiler, OP_SET_PROPERTY);
 	}
 	else if (canAssign && isInplaceOperator(compiler)) {
 		TokenType op = compiler->parser->previous.type;
@@ -825,26 +907,32 @@ static void dot(Compiler* compiler, bool canAssign) {
 		emitByte(compiler, OP_DUP);
 		emitByte(compiler, OP_GET_PROPERTY);
 		encodeConstant(compiler, name);
+		emitCache(compiler, OP_GET_PROPERTY);
 
 		expression(compiler);
 		inplaceOperator(compiler, op);
 
 		emitByte(compiler, OP_SET_PROPERTY);
 		encodeConstant(compiler, name);
+		emitCache(compiler, OP_SET_PROPERTY);
 	}
 	else if (match(compiler, TOKEN_LEFT_PAREN)) {
 		uint8_t argCount = argumentList(compiler);
+		compiler->lastCall = currentChunk(compiler)->count;
 		emitByte(compiler, OP_INVOKE);
 		encodeConstant(compiler, name);
 		emitByte(compiler, argCount);
+		emitCache(compiler, OP_INVOKE);
+		compiler->lastCallEnd = currentChunk(compiler)->count;
 	}
 	else {
 		emitByte(compiler, OP_GET_PROPERTY);
 		encodeConstant(compiler, name);
+		emitCache(compiler, OP_GET_PROPERTY);
 	}
 }
 
-static void index(Compiler* compiler, bool canAssign) {
+static void index_(Compiler* compiler, bool canAssign) {
 	expression(compiler);
 
 	consume(compiler, TOKEN_RIGHT_SQBR, "Expected ']' after index");
@@ -939,21 +1027,169 @@ static void or_(Compiler* compiler, bool canAssign) {
 	patchJump(compiler, endJump);
 }
 
+// Keeps the tail calls of a ternary branch that ended with one, and the call ending the branch.
+static void endTernaryBranch(Compiler* compiler, size_t branchCalls) {
+	size_t end = currentChunk(compiler)->count;
+	if (compiler->tailCallsEnd != end) compiler->tailCallCount = branchCalls;
+	if (compiler->lastCallEnd == end && compiler->tailCallCount < UINT8_COUNT) {
+		compiler->tailCalls[compiler->tailCallCount++] = compiler->lastCall;
+	}
+}
+
 static void ternary(Compiler* compiler, bool canAssign) {
+	// Ternaries compiled before this one in the same branch are followed by it, so their calls are not tail calls.
+	size_t outerCalls = compiler->tailCallFloor;
+	compiler->tailCallCount = outerCalls;
+
 	size_t elseJump = emitJump(compiler, OP_JUMP_IF_FALSE);
 
 	parsePrecedence(compiler, PREC_TERNARY);
+	endTernaryBranch(compiler, outerCalls);
 	
 	size_t trueJump = emitJump(compiler, OP_JUMP);
 	patchJump(compiler, elseJump);
 
+	size_t elseCalls = compiler->tailCallCount;
+	compiler->tailCallFloor = elseCalls;
 	if (match(compiler, TOKEN_COLON)) {
 		parsePrecedence(compiler, PREC_TERNARY);
 	}
 	else {
 		emitByte(compiler, OP_NULL);
 	}
+	endTernaryBranch(compiler, elseCalls);
 	patchJump(compiler, trueJump);
+
+	compiler->tailCallFloor = outerCalls;
+	compiler->tailCallsEnd = currentChunk(compiler)->count;
+}
+
+/*
+  Switches whose cases all compare against number or string literals (or else) jump straight to the matching case
+  through a table (see chunk.h) instead of trying the cases one by one.
+  - Both forms start the chain of cases with an OP_SWITCH. Each pattern's code is looked at once it is compiled, a
+    literal compiles to OP_CONSTANT (OP_NEGATE) OP_EQUAL and else to OP_POP OP_TRUE. The cases jump to where their body
+    starts, past its OP_JUMP_IF_FALSE, the subject being on the stack as it is there.
+  - As the cases are tried in order, a key jumps to the first case comparing equal to it and the cases after an else
+    are never reached. When no case matches the switch jumps to the else case if there is one, to its end otherwise.
+  - Switches with fewer than SWITCH_TABLE_MIN_CASES literals, or any other pattern, turn the OP_SWITCH into a jump
+    to the next instruction and keep the chain.
+*/
+
+#define SWITCH_TABLE_MIN_CASES 4
+
+typedef struct {
+	size_t op;
+	bool isConstant;
+	bool hasDefault;
+	size_t defaultTarget;
+	size_t caseStart;
+	size_t count;
+	size_t capacity;
+	SwitchCase* cases;
+} SwitchBuilder;
+
+static void beginSwitchTable(Compiler* compiler, SwitchBuilder* builder) {
+	builder->op = currentChunk(compiler)->count;
+	builder->isConstant = true;
+	builder->hasDefault = false;
+	builder->defaultTarget = 0;
+	builder->caseStart = 0;
+	builder->count = 0;
+	builder->capacity = 0;
+	builder->cases = NULL;
+	emitByte(compiler, OP_SWITCH);
+	emitPair(compiler, 0xff, 0xff);
+}
+
+// Looks at the pattern compiled from start on.
+static void switchTablePattern(Compiler* compiler, SwitchBuilder* builder, size_t start) {
+	if (!builder->isConstant || builder->hasDefault) return;
+	Chunk* chunk = currentChunk(compiler);
+	uint8_t* code = &chunk->code[start];
+	size_t length = chunk->count - start;
+
+	if (length == 2 && code[0] == OP_POP && code[1] == OP_TRUE) {
+		builder->hasDefault = true;
+		return;
+	}
+
+	if (length < 3 || code[0] != OP_CONSTANT || code[length - 1] != OP_EQUAL) {
+		builder->isConstant = false;
+		return;
+	}
+	size_t index;
+	size_t size = 1 + readUleb128(&code[1], &index);
+	bool negate = size + 2 == length && code[size] == OP_NEGATE;
+	if (size + (negate ? 2 : 1) != length) {
+		builder->isConstant = false;
+		return;
+	}
+	Value key = chunk->constants.values[index];
+	if (negate ? !IS_NUMBER(key) : !IS_NUMBER(key) && !IS_STRING(key)) {
+		builder->isConstant = false;
+		return;
+	}
+	if (negate) key = NUMBER_VAL(-AS_NUMBER(key));
+
+	for (size_t i = 0; i < builder->count; i++) {
+		if (valuesEqual(builder->cases[i].key, key)) return;
+	}
+	if (builder->capacity < builder->count + 1) {
+		size_t oldCapacity = builder->capacity;
+		builder->capacity = GROW_CAPACITY(oldCapacity);
+		builder->cases = GROW_ARRAY(compiler->vm, SwitchCase, builder->cases, oldCapacity, builder->capacity);
+	}
+	builder->cases[builder->count++] = (SwitchCase){ key, 0 };
+}
+
+// Points the keys of the case whose patterns were just compiled at its body, which starts here.
+static void switchTableCase(Compiler* compiler, SwitchBuilder* builder) {
+	if (!builder->isConstant || builder->caseStart == SIZE_MAX) return;
+	size_t target = currentChunk(compiler)->count;
+	for (size_t i = builder->caseStart; i < builder->count; i++) builder->cases[i].target = target;
+	builder->caseStart = builder->count;
+	if (builder->hasDefault) {
+		builder->defaultTarget = target;
+		builder->caseStart = SIZE_MAX;
+	}
+}
+
+// endTarget is where the switch goes on when no case matches and there is no else.
+static void endSwitchTable(Compiler* compiler, SwitchBuilder* builder, size_t endTarget) {
+	Chunk* chunk = currentChunk(compiler);
+	if (builder->isConstant && builder->count >= SWITCH_TABLE_MIN_CASES && chunk->switchCount < UINT16_MAX) {
+		size_t table = addSwitchTable(compiler->vm, chunk, builder->cases, builder->count,
+			builder->hasDefault ? builder->defaultTarget : endTarget);
+		chunk->code[builder->op + 1] = (table >> 8) & 0xff;
+		chunk->code[builder->op + 2] = table & 0xff;
+	}
+	else {
+		chunk->code[builder->op] = OP_JUMP;
+		chunk->code[builder->op + 1] = 0;
+		chunk->code[builder->op + 2] = 0;
+	}
+	FREE_ARRAY(compiler->vm, SwitchCase, builder->cases, builder->capacity);
+}
+
+// Compiles the patterns of a case, separated by commas, leaving whether any of them matched on the stack.
+static void casePatterns(Compiler* compiler, SwitchBuilder* builder) {
+	emitByte(compiler, OP_DUP);
+	size_t start = currentChunk(compiler)->count;
+	pattern(compiler);
+	switchTablePattern(compiler, builder, start);
+
+	while (match(compiler, TOKEN_COMMA)) {
+		size_t falseJump = emitJump(compiler, OP_JUMP_IF_FALSE);
+		emitByte(compiler, OP_TRUE);
+		size_t trueJump = emitJump(compiler, OP_JUMP);
+		patchJump(compiler, falseJump);
+		emitByte(compiler, OP_DUP);
+		start = currentChunk(compiler)->count;
+		pattern(compiler);
+		switchTablePattern(compiler, builder, start);
+		patchJump(compiler, trueJump);
+	}
 }
 
 static void switchExpression(Compiler* compiler, bool canAssign) {
@@ -970,21 +1206,14 @@ static void switchExpression(Compiler* compiler, bool canAssign) {
 	size_t breakJump = emitJump(compiler, OP_JUMP);
 	patchJump(compiler, breakSkipJump);
 
-	while (!check(compiler, TOKEN_RIGHT_BRACE) && !check(compiler, TOKEN_EOF)) {
-		emitByte(compiler, OP_DUP);
-
-		pattern(compiler);
+	SwitchBuilder builder;
+	beginSwitchTable(compiler, &builder);
 
-		while (match(compiler, TOKEN_COMMA)) {
-			size_t falseJump = emitJump(compiler, OP_JUMP_IF_FALSE);
-			size_t trueJump = emitJump(compiler, OP_JUMP);
-			patchJump(compiler, falseJump);
-			emitByte(compiler, OP_DUP);
-			pattern(compiler);
-			patchJump(compiler, trueJump);
-		}
+	while (!check(compiler, TOKEN_RIGHT_BRACE) && !check(compiler, TOKEN_EOF)) {
+		casePatterns(compiler, &builder);
 
 		size_t jump = emitJump(compiler, OP_JUMP_IF_FALSE);
+		switchTableCase(compiler, &builder);
 
 		consume(compiler, TOKEN_ARROW, "Expected '->' after case condition.");
 
@@ -997,6 +1226,7 @@ static void switchExpression(Compiler* compiler, bool canAssign) {
 		patchJump(compiler, jump);
 	}
 
+	endSwitchTable(compiler, &builder, currentChunk(compiler)->count);
 	emitByte(compiler, OP_NULL);
 
 	patchJump(compiler, breakJump);
@@ -1007,6 +1237,15 @@ static void switchExpression(Compiler* compiler, bool canAssign) {
 	endScope(compiler);
 }
 
+// Parses the infix operators following an operand, for as long as they bind at least as tightly as precedence.
+static void parseInfix(Compiler* compiler, Precedence precedence, bool canAssign) {
+	while (precedence <= getRule(compiler->parser->current.type)->precedence) {
+		advance(compiler);
+		ParseFn infixRule = getRule(compiler->parser->previous.type)->infix;
+		infixRule(compiler, canAssign);
+	}
+}
+
 static void parsePrecedence(Compiler* compiler, Precedence precedence) {
 	advance(compiler);
 	ParseFn prefixRule = getRule(compiler->parser->previous.type)->prefix;
@@ -1017,12 +1256,7 @@ static void parsePrecedence(Compiler* compiler, Precedence precedence) {
 
 	bool canAssign = precedence <= PREC_ASSIGNMENT;
 	prefixRule(compiler, canAssign);
-
-	while (precedence <= getRule(compiler->parser->current.type)->precedence) {
-		advance(compiler);
-		ParseFn infixRule = getRule(compiler->parser->previous.type)->infix;
-		infixRule(compiler, canAssign);
-	}
+	parseInfix(compiler, precedence, canAssign);
 
 	if (canAssign && (match(compiler, TOKEN_EQUAL) || isInplaceOperator(compiler))) {
 		error(compiler->parser, "Invalid assignment target.");
@@ -1069,7 +1303,7 @@ static void returnStatement(Compiler* compiler) {
 		}
 		expression(compiler);
 		consume(compiler, TOKEN_SEMICOLON, "Expected ';' after return value");
-		emitByte(compiler, OP_RETURN);
+		emitValueReturn(compiler);
 	}
 }
 
@@ -1156,75 +1390,75 @@ static void forStatement(Compiler* compiler) {
 	compiler->breakJump = prevBreakJump;
 }
 
-static void foreachStatement(Compiler* compiler) {
-	bool wasLoop = compiler->isInLoop;
-	size_t prevContinueJump = compiler->continueJump;
-	size_t prevBreakJump = compiler->breakJump;
-
-	beginScope(compiler);
-	compiler->isInLoop = true;
+static void addHiddenLocal(Compiler* compiler) {
+	addLocal(compiler, syntheticToken(""));
+	markInitialized(compiler);
+}
 
-	// ----------- Parse Clause
-	consume(compiler, TOKEN_LEFT_PAREN, "Expected '(' after 'foreach'.");
-	consume(compiler, TOKEN_VAR, "Expected 'var' in foreach clause.");
+/*
+  The loop of 'foreach (var item in start..end)', with the range's start and end on the stack.
+  - The counter, end and step are kept in hidden locals, OP_FOR_RANGE exits once the counter passes the end and
+    otherwise pushes it and steps it.
+  - 'break' pushes false and loops back to the exit jump (see breakStatement), so one is placed before the loop.
+*/
+static void countedForeach(Compiler* compiler, Token* item) {
+	addHiddenLocal(compiler);
+	addHiddenLocal(compiler);
+	emitByte(compiler, OP_FOR_RANGE_INIT);
+	addHiddenLocal(compiler);
 
-	uint32_t var = parseVariable(compiler, "Expected variable name.");
-	Token item = compiler->parser->previous;
-	defineVariable(compiler, var);
+	size_t entryJump = emitJump(compiler, OP_JUMP);
+	size_t breakJump = emitJump(compiler, OP_JUMP_IF_FALSE);
+	compiler->breakJump = breakJump;
+	patchJump(compiler, entryJump);
 
-	emitByte(compiler, OP_NULL);
+	size_t loopStart = currentChunk(compiler)->count;
+	compiler->continueJump = loopStart;
 
-	uint8_t local = (uint8_t)resolveLocal(compiler, &item);
+	size_t exitJump = emitJump(compiler, OP_FOR_RANGE);
 	emitByte(compiler, OP_SET_LOCAL);
-	emitByte(compiler, local);
-
-	compiler->locals[local].depth = -1;
-
-	consume(compiler, TOKEN_IN, "Expected 'in' after variable in foreach clause.");
-
-	expression(compiler);
-
-	consume(compiler, TOKEN_RIGHT_PAREN, "Expected ')' after foreach clause.");
-	defineVariable(compiler, var);
+	emitByte(compiler, (uint8_t)resolveLocal(compiler, item));
+	emitByte(compiler, OP_POP);
 
-	// ----------- Emit Looping Code
+	statement(compiler);
 
-	// expr.iterator()
-	Token iteratorToken = syntheticToken("iterator");
-	uint32_t iterator = identifierConstant(compiler, &iteratorToken);
+	emitLoop(compiler, loopStart);
+	patchJump(compiler, exitJump);
+	patchJump(compiler, breakJump);
+}
 
-	emitByte(compiler, OP_INVOKE);
-	encodeConstant(compiler, iterator);
-	emitByte(compiler, 0);
+/*
+  The loop of 'foreach (var item in expression)', with the value of the expression on the stack.
+  - OP_ITER_INIT turns the value into a cursor kept in two hidden locals, OP_ITER_NEXT walks lists, strings and ranges
+    itself, jumping straight to the body with the item.
+  - Other values follow the iterator protocol, OP_ITER_NEXT calls 'more' and falls through to the exit jump and the
+    call to 'next'. When a native cursor runs out it pushes false for the exit jump too.
+*/
+static void iteratorForeach(Compiler* compiler, Token* item) {
+	addHiddenLocal(compiler);
+	emitByte(compiler, OP_ITER_INIT);
+	addHiddenLocal(compiler);
 
 	size_t loopStart = currentChunk(compiler)->count;
 	compiler->continueJump = loopStart;
 
-	emitByte(compiler, OP_DUP);
-
-	// iter.more()
-	Token moreToken = syntheticToken("more");
-	uint32_t more = identifierConstant(compiler, &moreToken);
-
-	emitByte(compiler, OP_INVOKE);
-	encodeConstant(compiler, more);
-	emitByte(compiler, 0);
-
+	size_t bodyJump = emitJump(compiler, OP_ITER_NEXT);
 	size_t exitJump = emitJump(compiler, OP_JUMP_IF_FALSE);
 	compiler->breakJump = exitJump;
 
-	emitByte(compiler, OP_DUP);
-
 	// iter.next()
 	Token nextToken = syntheticToken("next");
 	uint32_t next = identifierConstant(compiler, &nextToken);
 
+	emitByte(compiler, OP_DUP);
 	emitByte(compiler, OP_INVOKE);
 	encodeConstant(compiler, next);
 	emitByte(compiler, 0);
+	emitCache(compiler, OP_INVOKE);
 
+	patchJump(compiler, bodyJump);
 	emitByte(compiler, OP_SET_LOCAL);
-	emitByte(compiler, (uint8_t)resolveLocal(compiler, &item));
+	emitByte(compiler, (uint8_t)resolveLocal(compiler, item));
 
 	emitByte(compiler, OP_POP);
 
@@ -1234,6 +1468,53 @@ static void foreachStatement(Compiler* compiler) {
 
 	emitLoop(compiler, loopStart);
 	patchJump(compiler, exitJump);
+}
+
+static void foreachStatement(Compiler* compiler) {
+	bool wasLoop = compiler->isInLoop;
+	size_t prevContinueJump = compiler->continueJump;
+	size_t prevBreakJump = compiler->breakJump;
+
+	beginScope(compiler);
+	compiler->isInLoop = true;
+
+	// ----------- Parse Clause
+	consume(compiler, TOKEN_LEFT_PAREN, "Expected '(' after 'foreach'.");
+	consume(compiler, TOKEN_VAR, "Expected 'var' in foreach clause.");
+
+	uint32_t var = parseVariable(compiler, "Expected variable name.");
+	Token item = compiler->parser->previous;
+	defineVariable(compiler, var);
+
+	emitByte(compiler, OP_NULL);
+
+	uint8_t local = (uint8_t)resolveLocal(compiler, &item);
+	emitByte(compiler, OP_SET_LOCAL);
+	emitByte(compiler, local);
+
+	compiler->locals[local].depth = -1;
+
+	consume(compiler, TOKEN_IN, "Expected 'in' after variable in foreach clause.");
+
+	// A range literal on its own is looped over by counting, without creating the range or an iterator.
+	bool counted = false;
+	parsePrecedence(compiler, PREC_RANGE + 1);
+	if (match(compiler, TOKEN_D_ELLIPSIS)) {
+		parsePrecedence(compiler, PREC_RANGE + 1);
+		counted = check(compiler, TOKEN_RIGHT_PAREN);
+		if (!counted) emitByte(compiler, OP_RANGE);
+	}
+	if (!counted) parseInfix(compiler, PREC_ASSIGNMENT, false);
+
+	consume(compiler, TOKEN_RIGHT_PAREN, "Expected ')' after foreach clause.");
+	defineVariable(compiler, var);
+
+	if (counted) {
+		countedForeach(compiler, &item);
+	}
+	else {
+		iteratorForeach(compiler, &item);
+	}
 
 	endScope(compiler);
 
@@ -1254,21 +1535,26 @@ static void throwStatement(Compiler* compiler) {
 	consume(compiler, TOKEN_SEMICOLON, "Expected ';' after throw statement.");
 }
 
+/*
+  The try block emits no instructions of its own, an exception table entry maps its instructions to the catch block (see
+  ExceptionHandler). The catch block starts with the exception pushed where the stack was when the try block began.
+*/
 static void tryStatement(Compiler* compiler) {
-	emitByte(compiler, OP_TRY_BEGIN);
-
-	size_t catchLocation = currentChunk(compiler)->count;
-	emitPair(compiler, 0xff, 0xff);
+	Chunk* chunk = currentChunk(compiler);
+	size_t start = chunk->count;
+	size_t depth = compiler->localCount;
 
+	compiler->tryDepth++;
 	statement(compiler);
-	emitByte(compiler, OP_TRY_END);
+	compiler->tryDepth--;
+	size_t end = chunk->count;
 
 	size_t tryFinallyJump = emitJump(compiler, OP_JUMP);
 
 	if (!match(compiler, TOKEN_CATCH)) {
 		error(compiler->parser, "Expected 'catch' block after try.");
 	}
-	patchJump(compiler, catchLocation);
+	addExceptionHandler(compiler->vm, chunk, start, end, chunk->count, depth);
 
 	beginScope(compiler);
 
@@ -1297,6 +1583,8 @@ static void switchStatement(Compiler* compiler) {
 	consume(compiler, TOKEN_LEFT_PAREN, "Expected '(' after switch.");
 
 	expression(compiler);
+	// A local rather than a temporary, so a try block in a case knows how deep the stack is.
+	addHiddenLocal(compiler);
 
 	consume(compiler, TOKEN_RIGHT_PAREN, "Expected ')' after switch clause.");
 
@@ -1306,21 +1594,14 @@ static void switchStatement(Compiler* compiler) {
 	size_t breakJump = emitJump(compiler, OP_JUMP);
 	patchJump(compiler, breakSkipJump);
 
-	while (!check(compiler, TOKEN_RIGHT_BRACE) && !check(compiler, TOKEN_EOF)) {
-		emitByte(compiler, OP_DUP);
-
-		pattern(compiler);
+	SwitchBuilder builder;
+	beginSwitchTable(compiler, &builder);
 
-		while (match(compiler, TOKEN_COMMA)) {
-			size_t falseJump = emitJump(compiler, OP_JUMP_IF_FALSE);
-			size_t trueJump = emitJump(compiler, OP_JUMP);
-			patchJump(compiler, falseJump);
-			emitByte(compiler, OP_DUP);
-			pattern(compiler);
-			patchJump(compiler, trueJump);
-		}
+	while (!check(compiler, TOKEN_RIGHT_BRACE) && !check(compiler, TOKEN_EOF)) {
+		casePatterns(compiler, &builder);
 
 		size_t jump = emitJump(compiler, OP_JUMP_IF_FALSE);
+		switchTableCase(compiler, &builder);
 
 		consume(compiler, TOKEN_ARROW, "Expected '->' after case condition.");
 
@@ -1331,8 +1612,8 @@ static void switchStatement(Compiler* compiler) {
 		patchJump(compiler, jump);
 	}
 
+	endSwitchTable(compiler, &builder, currentChunk(compiler)->count);
 	patchJump(compiler, breakJump);
-	emitByte(compiler, OP_POP);
 
 	consume(compiler, TOKEN_RIGHT_BRACE, "Expected '}' after switch body.");
 
@@ -1525,13 +1806,13 @@ static void importDeclaration(Compiler* compiler) {
 		length += 1;
 	} while (match(compiler, TOKEN_DOT));
 
-	ObjString* path = copyString(compiler->vm, buffer, length - 1);
+	uint32_t pathConstant = makeConstant(compiler, OBJ_VAL(copyString(compiler->vm, buffer, length - 1)));
 
 	uint32_t nameConstant = identifierConstant(compiler, &compiler->parser->previous);
 	declareVariable(compiler);
 
 	emitByte(compiler, OP_IMPORT);
-	encodeConstant(compiler, makeConstant(compiler, OBJ_VAL(path)));
+	encodeConstant(compiler, pathConstant);
 
 	defineVariable(compiler, nameConstant);
 
@@ -1563,7 +1844,7 @@ ParseRule rules[] = {
   [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
   [TOKEN_LEFT_BRACE] = {objectCreation, object, PREC_CALL},
   [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
-  [TOKEN_LEFT_SQBR] = {list, index, PREC_CALL},
+  [TOKEN_LEFT_SQBR] = {list, index_, PREC_CALL},
   [TOKEN_RIGHT_SQBR] = {NULL, NULL, PREC_NONE},
   [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
   [TOKEN_DOT] = {NULL, dot, PREC_CALL},
@@ -1654,7 +1935,7 @@ void markCompilerRoots(Compiler* compiler) {
 	}
 }
 
-ObjFunction* compile(VM* vm, const char* source) {
+ObjFunction* compile(VM* vm, Module* module, const char* source) {
 	Scanner scanner;
 	initScanner(&scanner, source);
 
@@ -1662,9 +1943,11 @@ ObjFunction* compile(VM* vm, const char* source) {
 	parser.scanner = &scanner;
 	parser.hadError = false;
 	parser.panicMode = false;
+	parser.reportErrors = vm->reportCompileErrors;
 
 	Compiler compiler;
 	initCompiler(&compiler, NULL, TYPE_SCRIPT, vm, &parser);
+	compiler.module = module;
 
 	advance(&compiler);
 	
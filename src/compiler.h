@@ -5,5 +5,5 @@
 
 typedef struct Compiler Compiler;
 
-ObjFunction* compile(VM* vm, const char* source);
+ObjFunction* compile(VM* vm, Module* module, const char* source);
 void markCompilerRoots(Compiler* compiler);
\ No newline at end of file
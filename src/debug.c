@@ -2,18 +2,37 @@
 #include "value.h"
 #include "object.h"
 #include "leb128.h"
+#include "vm.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <inttypes.h>
 
 size_t getLine(LineNumberTable* table, size_t index) {
+	if (table->checkpointCount == 0) return 0;
 
-	size_t offset = 0;
-
-	while (offset < table->count && table->lines[offset] <= index) {
-		offset += 2;
+	// The last checkpoint at or before index.
+	size_t low = 0;
+	size_t high = table->checkpointCount;
+	while (high - low > 1) {
+		size_t middle = low + (high - low) / 2;
+		if (table->checkpoints[middle].offset <= index) low = middle;
+		else high = middle;
 	}
 
-	return table->lines[offset - 1];
+	LineCheckpoint* checkpoint = &table->checkpoints[low];
+	size_t line = checkpoint->line;
+	size_t position = checkpoint->position;
+	size_t offset = checkpoint->offset;
+	while (position < table->count) {
+		size_t nextOffset = offset;
+		size_t nextLine = line;
+		size_t next = readLineRun(table, position, &nextOffset, &nextLine);
+		if (nextOffset > index) break;
+		offset = nextOffset;
+		line = nextLine;
+		position = next;
+	}
+	return line;
 }
 
 void disassembleChunk(VM* vm, Chunk* chunk, const char* name) {
@@ -22,6 +41,21 @@ void disassembleChunk(VM* vm, Chunk* chunk, const char* name) {
 	for (int offset = 0; offset < chunk->count;) {
 		offset = disassembleInstruction(vm, chunk, offset);
 	}
+
+	for (size_t i = 0; i < chunk->handlerCount; i++) {
+		ExceptionHandler* handler = &chunk->handlers[i];
+		printf("try %04zu-%04zu -> %04zu (depth %zu)\n", handler->start, handler->end, handler->handler, handler->depth);
+	}
+
+	for (size_t i = 0; i < chunk->switchCount; i++) {
+		SwitchTable* table = &chunk->switches[i];
+		printf("switch %zu (%s):", i, table->dense ? "dense" : "hashed");
+		for (size_t j = 0; j < table->count; j++) {
+			if (IS_NULL(table->cases[j].key)) continue;
+			printf(" %s -> %04zu", valueToRepr(vm, table->cases[j].key)->chars, table->cases[j].target);
+		}
+		printf(" else -> %04zu\n", table->defaultTarget);
+	}
 }
 
 static int simpleInstruction(const char* name, int offset) {
@@ -39,12 +73,26 @@ static int constantInstruction(const char* name, VM* vm, Chunk* chunk, int offse
 	return offset + (int)size + 1;
 }
 
+static int indexInstruction(const char* name, Chunk* chunk, int offset) {
+	size_t index;
+	size_t size = readUleb128(&chunk->code[offset + 1], &index);
+	printf("%-16s %4zu\n", name, index);
+	return offset + (int)size + 1;
+}
+
 static int byteInstruction(const char* name, Chunk* chunk, int offset) {
 	uint8_t slot = chunk->code[offset + 1];
 	printf("%-16s %4d\n", name, slot);
 	return offset + 2;
 }
 
+static int byteByteInstruction(const char* name, Chunk* chunk, int offset) {
+	uint8_t first = chunk->code[offset + 1];
+	uint8_t second = chunk->code[offset + 2];
+	printf("%-16s %4d %4d\n", name, first, second);
+	return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
 	uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
 	jump |= chunk->code[offset + 2];
@@ -52,14 +100,56 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
 	return offset + 3;
 }
 
+static int switchInstruction(Chunk* chunk, int offset) {
+	uint16_t table = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+	printf("%-16s %4d\n", "SWITCH", table);
+	return offset + 3;
+}
+
 static int invokeInstruction(const char* name, VM* vm, Chunk* chunk, int offset) {
 	size_t constant;
 	size_t size = readUleb128(&chunk->code[offset + 1], &constant);
-	uint8_t argCount = chunk->code[offset + 2];
+	uint8_t argCount = chunk->code[offset + 1 + size];
 	printf("%-16s (%d args) %4zu ", name, argCount, constant);
 	printf("%s", valueToRepr(vm, chunk->constants.values[constant])->chars);
 	printf("\n");
-	return offset + size + 2;
+	return offset + (int)size + 2;
+}
+
+static int cachedInstruction(const char* name, VM* vm, Chunk* chunk, int offset, bool hasArgCount) {
+	size_t constant;
+	size_t size = readUleb128(&chunk->code[offset + 1], &constant);
+	uint8_t argCount = 0;
+	if (hasArgCount) {
+		argCount = chunk->code[offset + 1 + size];
+		size++;
+	}
+	size_t cache;
+	size += readUleb128(&chunk->code[offset + 1 + size], &cache);
+
+	if (hasArgCount) {
+		printf("%-16s (%d args) %4zu ", name, argCount, constant);
+	}
+	else {
+		printf("%-16s %4zu ", name, constant);
+	}
+	printf("%s [cache %zu]", valueToRepr(vm, chunk->constants.values[constant])->chars, cache);
+	printf("\n");
+	return offset + (int)size + 1;
+}
+
+// A GET_LOCAL fused with the cached instruction following it, the slot is printed before the cached operands.
+static int localCachedInstruction(const char* name, VM* vm, Chunk* chunk, int offset) {
+	uint8_t slot = chunk->code[offset + 1];
+	size_t constant;
+	size_t size = readUleb128(&chunk->code[offset + 2], &constant);
+	size_t cache;
+	size += readUleb128(&chunk->code[offset + 2 + size], &cache);
+
+	printf("%-16s %4d %4zu ", name, slot, constant);
+	printf("%s [cache %zu]", valueToRepr(vm, chunk->constants.values[constant])->chars, cache);
+	printf("\n");
+	return offset + (int)size + 2;
 }
 
 int disassembleInstruction(VM* vm, Chunk* chunk, int offset) {
@@ -71,9 +161,9 @@ int disassembleInstruction(VM* vm, Chunk* chunk, int offset) {
 
 	switch (instruction) {
 		case OP_CONSTANT: return constantInstruction("CONSTANT", vm, chunk, offset);
-		case OP_GET_GLOBAL: return constantInstruction("GET_GLOBAL", vm, chunk, offset);
-		case OP_DEFINE_GLOBAL: return constantInstruction("DEFINE_GLOBAL", vm, chunk, offset);
-		case OP_SET_GLOBAL: return constantInstruction("SET_GLOBAL", vm, chunk, offset);
+		case OP_GET_GLOBAL: return indexInstruction("GET_GLOBAL", chunk, offset);
+		case OP_DEFINE_GLOBAL: return indexInstruction("DEFINE_GLOBAL", chunk, offset);
+		case OP_SET_GLOBAL: return indexInstruction("SET_GLOBAL", chunk, offset);
 		case OP_GET_LOCAL: return byteInstruction("GET_LOCAL", chunk, offset);
 		case OP_SET_LOCAL: return byteInstruction("SET_LOCAL", chunk, offset);
 		case OP_NULL: return simpleInstruction("NULL", offset);
@@ -81,7 +171,11 @@ int disassembleInstruction(VM* vm, Chunk* chunk, int offset) {
 		case OP_FALSE: return simpleInstruction("FALSE", offset);
 		case OP_OBJECT: return simpleInstruction("OBJECT", offset);
 		case OP_LIST: return byteInstruction("LIST", chunk, offset);
-		case OP_RANGE: return simpleInstruction("RANGE", chunk, offset);
+		case OP_RANGE: return simpleInstruction("RANGE", offset);
+		case OP_FOR_RANGE_INIT: return simpleInstruction("FOR_RANGE_INIT", offset);
+		case OP_FOR_RANGE: return jumpInstruction("FOR_RANGE", 1, chunk, offset);
+		case OP_ITER_INIT: return simpleInstruction("ITER_INIT", offset);
+		case OP_ITER_NEXT: return jumpInstruction("ITER_NEXT", 1, chunk, offset);
 		case OP_DUP: return simpleInstruction("DUP", offset);
 		case OP_DUP_X2: return simpleInstruction("DUP_X2", offset);
 		case OP_SWAP: return simpleInstruction("SWAP", offset);
@@ -112,13 +206,16 @@ int disassembleInstruction(VM* vm, Chunk* chunk, int offset) {
 		case OP_TYPEOF: return simpleInstruction("TYPEOF", offset);
 		case OP_JUMP: return jumpInstruction("JUMP", 1, chunk, offset);
 		case OP_LOOP: return jumpInstruction("LOOP", -1, chunk, offset);
+		case OP_SWITCH: return switchInstruction(chunk, offset);
 		case OP_JUMP_IF_FALSE: return jumpInstruction("JUMP_IF_FALSE", 1, chunk, offset);
 		case OP_JUMP_IF_FALSE_SC: return jumpInstruction("JUMP_IF_FALSE_SC", 1, chunk, offset);
 		case OP_CALL: return byteInstruction("CALL", chunk, offset);
+		case OP_TAIL_CALL: return byteInstruction("TAIL_CALL", chunk, offset);
 		case OP_CLOSURE: {
 			offset++;
-			uint8_t constant = chunk->code[offset++];
-			printf("%-16s %4d ", "CLOSURE", constant);
+			size_t constant;
+			offset += (int)readUleb128(&chunk->code[offset], &constant);
+			printf("%-16s %4zu ", "CLOSURE", constant);
 			printf("%s", valueToRepr(vm, chunk->constants.values[constant])->chars);
 			printf("\n");
 
@@ -137,29 +234,311 @@ int disassembleInstruction(VM* vm, Chunk* chunk, int offset) {
 		case OP_CLASS: return constantInstruction("CLASS", vm, chunk, offset);
 		case OP_INHERIT: return simpleInstruction("INHERIT", offset);
 		case OP_METHOD: return constantInstruction("METHOD", vm, chunk, offset);
-		case OP_INVOKE: return invokeInstruction("INVOKE", vm, chunk, offset);
+		case OP_INVOKE: return cachedInstruction("INVOKE", vm, chunk, offset, true);
+		case OP_TAIL_INVOKE: return cachedInstruction("TAIL_INVOKE", vm, chunk, offset, true);
 		case OP_SUPER_INVOKE: return invokeInstruction("SUPER_INVOKE", vm, chunk, offset);
-		case OP_GET_PROPERTY: return constantInstruction("GET_PROPERTY", vm, chunk, offset);
-		case OP_SET_PROPERTY: return constantInstruction("SET_PROPERTY", vm, chunk, offset);
-		case OP_SET_PROPERTY_KV: return constantInstruction("SET_PROPERTY_KV", vm, chunk, offset);
+		case OP_GET_PROPERTY: return cachedInstruction("GET_PROPERTY", vm, chunk, offset, false);
+		case OP_SET_PROPERTY: return cachedInstruction("SET_PROPERTY", vm, chunk, offset, false);
+		case OP_SET_PROPERTY_KV: return cachedInstruction("SET_PROPERTY_KV", vm, chunk, offset, false);
 		case OP_GET_INDEX: return simpleInstruction("GET_INDEX", offset);
 		case OP_SET_INDEX: return simpleInstruction("SET_INDEX", offset);
 		case OP_GET_SUPER: return constantInstruction("GET_SUPER", vm, chunk, offset);
 		case OP_THROW: return simpleInstruction("THROW", offset);
-		case OP_TRY_BEGIN: {
-			uint16_t jump = chunk->code[offset + 1] << 8;
-			jump |= chunk->code[offset + 2];
-
-			printf("%-16s %4d\n", "TRY_BEGIN", offset + jump);
-			return offset + 3;
-		}
-		case OP_TRY_END: return simpleInstruction("TRY_END", offset);
 		case OP_IMPORT: return constantInstruction("IMPORT", vm, chunk, offset);
 		case OP_EXPORT: return constantInstruction("EXPORT", vm, chunk, offset);
 		case OP_RETURN: return simpleInstruction("RETURN", offset);
+		case OP_LIST_STEP: return byteInstruction("LIST_STEP", chunk, offset);
+		case OP_GET_LOCAL_GET_LOCAL: return byteByteInstruction("GET_LOCAL_GET_LOCAL", chunk, offset);
+		case OP_GET_LOCAL_GET_PROPERTY: return localCachedInstruction("GET_LOCAL_GET_PROPERTY", vm, chunk, offset);
+		case OP_ADD_CONSTANT: return constantInstruction("ADD_CONSTANT", vm, chunk, offset);
+		case OP_SET_LOCAL_POP: return byteInstruction("SET_LOCAL_POP", chunk, offset);
+		case OP_SET_GLOBAL_POP: return indexInstruction("SET_GLOBAL_POP", chunk, offset);
+		case OP_LESS_JUMP_IF_FALSE: return jumpInstruction("LESS_JUMP_IF_FALSE", 1, chunk, offset);
+		case OP_POP_LOOP: return jumpInstruction("POP_LOOP", -1, chunk, offset);
+		case OP_ADD_NUM: return simpleInstruction("ADD_NUM", offset);
+		case OP_ADD_STR: return simpleInstruction("ADD_STR", offset);
+		case OP_GET_INDEX_LIST: return simpleInstruction("GET_INDEX_LIST", offset);
+		case OP_SET_INDEX_LIST: return simpleInstruction("SET_INDEX_LIST", offset);
 		default: {
 			printf("Unknown Opcode %d\n", instruction);
 			return offset + 1;
 		}
 	}
-}
\ No newline at end of file
+}
+
+static const char* opcodeNames[UINT8_COUNT] = {
+	[OP_CONSTANT] = "CONSTANT",
+	[OP_NULL] = "NULL",
+	[OP_TRUE] = "TRUE",
+	[OP_FALSE] = "FALSE",
+	[OP_OBJECT] = "OBJECT",
+	[OP_LIST] = "LIST",
+	[OP_RANGE] = "RANGE",
+	[OP_FOR_RANGE_INIT] = "FOR_RANGE_INIT",
+	[OP_FOR_RANGE] = "FOR_RANGE",
+	[OP_ITER_INIT] = "ITER_INIT",
+	[OP_ITER_NEXT] = "ITER_NEXT",
+	[OP_GET_GLOBAL] = "GET_GLOBAL",
+	[OP_DEFINE_GLOBAL] = "DEFINE_GLOBAL",
+	[OP_SET_GLOBAL] = "SET_GLOBAL",
+	[OP_GET_LOCAL] = "GET_LOCAL",
+	[OP_SET_LOCAL] = "SET_LOCAL",
+	[OP_GET_UPVALUE] = "GET_UPVALUE",
+	[OP_SET_UPVALUE] = "SET_UPVALUE",
+	[OP_CLOSE_UPVALUE] = "CLOSE_UPVALUE",
+	[OP_GET_PROPERTY] = "GET_PROPERTY",
+	[OP_SET_PROPERTY] = "SET_PROPERTY",
+	[OP_SET_PROPERTY_KV] = "SET_PROPERTY_KV",
+	[OP_GET_INDEX] = "GET_INDEX",
+	[OP_SET_INDEX] = "SET_INDEX",
+	[OP_GET_SUPER] = "GET_SUPER",
+	[OP_DUP] = "DUP",
+	[OP_DUP_X2] = "DUP_X2",
+	[OP_SWAP] = "SWAP",
+	[OP_POP] = "POP",
+	[OP_NOT] = "NOT",
+	[OP_NEGATE] = "NEGATE",
+	[OP_ADD] = "ADD",
+	[OP_SUB] = "SUB",
+	[OP_MUL] = "MUL",
+	[OP_DIV] = "DIV",
+	[OP_MOD] = "MOD",
+	[OP_BIT_NOT] = "BIT_NOT",
+	[OP_AND] = "AND",
+	[OP_OR] = "OR",
+	[OP_XOR] = "XOR",
+	[OP_LSH] = "LSH",
+	[OP_ASH] = "ASH",
+	[OP_RSH] = "RSH",
+	[OP_EQUAL] = "EQUAL",
+	[OP_NOT_EQUAL] = "NOT_EQUAL",
+	[OP_IS] = "IS",
+	[OP_GREATER] = "GREATER",
+	[OP_GREATER_EQ] = "GREATER_EQ",
+	[OP_LESS] = "LESS",
+	[OP_LESS_EQ] = "LESS_EQ",
+	[OP_IN] = "IN",
+	[OP_INSTANCEOF] = "INSTANCEOF",
+	[OP_TYPEOF] = "TYPEOF",
+	[OP_JUMP_IF_FALSE] = "JUMP_IF_FALSE",
+	[OP_JUMP_IF_FALSE_SC] = "JUMP_IF_FALSE_SC",
+	[OP_JUMP] = "JUMP",
+	[OP_LOOP] = "LOOP",
+	[OP_SWITCH] = "SWITCH",
+	[OP_CALL] = "CALL",
+	[OP_TAIL_CALL] = "TAIL_CALL",
+	[OP_CLOSURE] = "CLOSURE",
+	[OP_CLASS] = "CLASS",
+	[OP_INHERIT] = "INHERIT",
+	[OP_METHOD] = "METHOD",
+	[OP_INVOKE] = "INVOKE",
+	[OP_TAIL_INVOKE] = "TAIL_INVOKE",
+	[OP_SUPER_INVOKE] = "SUPER_INVOKE",
+	[OP_THROW] = "THROW",
+	[OP_IMPORT] = "IMPORT",
+	[OP_EXPORT] = "EXPORT",
+	[OP_RETURN] = "RETURN",
+	[OP_LIST_STEP] = "LIST_STEP",
+	[OP_GET_LOCAL_GET_LOCAL] = "GET_LOCAL_GET_LOCAL",
+	[OP_GET_LOCAL_GET_PROPERTY] = "GET_LOCAL_GET_PROPERTY",
+	[OP_ADD_CONSTANT] = "ADD_CONSTANT",
+	[OP_SET_LOCAL_POP] = "SET_LOCAL_POP",
+	[OP_SET_GLOBAL_POP] = "SET_GLOBAL_POP",
+	[OP_LESS_JUMP_IF_FALSE] = "LESS_JUMP_IF_FALSE",
+	[OP_POP_LOOP] = "POP_LOOP",
+	[OP_ADD_NUM] = "ADD_NUM",
+	[OP_ADD_STR] = "ADD_STR",
+	[OP_GET_INDEX_LIST] = "GET_INDEX_LIST",
+	[OP_SET_INDEX_LIST] = "SET_INDEX_LIST"
+};
+
+const char* opcodeName(uint8_t opcode) {
+	return opcodeNames[opcode] == NULL ? "UNKNOWN" : opcodeNames[opcode];
+}
+
+typedef struct {
+	ObjFunction* function;
+	InlineCache* cache;
+} CacheSite;
+
+static int compareCacheSites(const void* a, const void* b) {
+	size_t missesA = ((const CacheSite*)a)->cache->misses;
+	size_t missesB = ((const CacheSite*)b)->cache->misses;
+	return (missesA < missesB) - (missesA > missesB);
+}
+
+void printCacheStats(VM* vm) {
+	Obj* generations[] = { vm->objects, vm->youngObjects, vm->sweepObjects };
+	size_t siteCount = 0;
+	for (size_t g = 0; g < 3; g++) {
+		for (Obj* object = generations[g]; object != NULL; object = object->next) {
+			if (object->type == OBJ_FUNCTION) siteCount += ((ObjFunction*)object)->chunk.cacheCount;
+		}
+	}
+
+	// Allocated outside of the VM's heap so this doesn't trigger a collection.
+	CacheSite* sites = malloc(sizeof(CacheSite) * (siteCount == 0 ? 1 : siteCount));
+	if (sites == NULL) return;
+
+	size_t count = 0;
+	size_t totalHits = 0;
+	size_t totalMisses = 0;
+	for (size_t g = 0; g < 3; g++) {
+		for (Obj* object = generations[g]; object != NULL; object = object->next) {
+			if (object->type != OBJ_FUNCTION) continue;
+			ObjFunction* function = (ObjFunction*)object;
+			for (size_t i = 0; i < function->chunk.cacheCount; i++) {
+				InlineCache* cache = &function->chunk.caches[i];
+				if (cache->hits + cache->misses == 0) continue;
+				totalHits += cache->hits;
+				totalMisses += cache->misses;
+				sites[count].function = function;
+				sites[count].cache = cache;
+				count++;
+			}
+		}
+	}
+
+	qsort(sites, count, sizeof(CacheSite), compareCacheSites);
+
+	fprintf(stderr, "==== inline caches ====\n");
+	fprintf(stderr, "%-24s %6s %-16s %12s %12s %7s  %s\n", "function", "line", "instruction", "hits", "misses", "hit %", "state");
+	for (size_t i = 0; i < count; i++) {
+		InlineCache* cache = sites[i].cache;
+		const char* name = sites[i].function->name == NULL ? "<script>" : sites[i].function->name->chars;
+		double rate = 100.0 * (double)cache->hits / (double)(cache->hits + cache->misses);
+
+		const char* state = "uncached";
+		if (cache->megamorphic) state = "megamorphic";
+		else if (cache->count > 1) state = "polymorphic";
+		else if (cache->count == 1) state = "monomorphic";
+
+		fprintf(stderr, "%-24s %6zu %-16s %12zu %12zu %6.1f%%  %s\n", name, cache->line, opcodeName(cache->opcode), cache->hits, cache->misses, rate, state);
+	}
+
+	if (totalHits + totalMisses > 0) {
+		fprintf(stderr, "total: %zu hits, %zu misses (%.1f%% hit)\n", totalHits, totalMisses, 100.0 * (double)totalHits / (double)(totalHits + totalMisses));
+	}
+	free(sites);
+}
+
+void printGCStats(VM* vm) {
+	GCStats* stats = &vm->gcStats;
+	fprintf(stderr, "==== garbage collector ====\n");
+	fprintf(stderr, "%-6s %10s %12s %12s %12s\n", "kind", "count", "total ms", "mean ms", "max ms");
+	fprintf(stderr, "%-6s %10zu %12.3f %12.3f %12.3f\n", "minor", stats->minorCount, stats->minorSeconds * 1000,
+		stats->minorCount == 0 ? 0.0 : stats->minorSeconds * 1000 / (double)stats->minorCount, stats->maxMinorPause * 1000);
+	fprintf(stderr, "%-6s %10zu %12.3f %12.3f %12.3f\n", "major", stats->majorCount, stats->majorSeconds * 1000,
+		stats->majorCount == 0 ? 0.0 : stats->majorSeconds * 1000 / (double)stats->majorCount, stats->maxMajorPause * 1000);
+	fprintf(stderr, "%-6s %10zu %12.3f %12.3f %12.3f\n", "slice", stats->sliceCount, stats->sliceSeconds * 1000,
+		stats->sliceCount == 0 ? 0.0 : stats->sliceSeconds * 1000 / (double)stats->sliceCount, stats->maxSlicePause * 1000);
+	if (stats->incrementalCount > 0) fprintf(stderr, "incremental majors: %zu\n", stats->incrementalCount);
+	fprintf(stderr, "heap: %zu bytes (peak %zu), next major at %zu\n", vm->bytesAllocated, stats->peakBytes, vm->nextGC);
+
+	Allocator* allocator = &vm->allocator;
+	fprintf(stderr, "==== object pools ====\n");
+	fprintf(stderr, "%-6s %12s %10s %8s\n", "cell", "allocations", "live", "slabs");
+	size_t slabCount = 0;
+	for (size_t i = 0; i < POOL_CLASS_COUNT; i++) {
+		Pool* pool = &allocator->pools[i];
+		slabCount += pool->slabCount;
+		if (pool->allocations == 0) continue;
+		fprintf(stderr, "%-6zu %12zu %10zu %8zu\n", poolCellSize(i), pool->allocations, pool->liveCells, pool->slabCount);
+	}
+	fprintf(stderr, "%-6s %12zu %10zu %8s\n", "large", allocator->largeAllocations, allocator->liveLarge, "-");
+	fprintf(stderr, "slabs: %zu bytes\n", slabCount * POOL_SLAB_SIZE);
+}
+
+#ifdef DRAGON_OPCODE_STATS
+#define TRIPLE_TABLE_SIZE 65536
+
+typedef struct {
+	uint32_t key;
+	size_t count;
+} SequenceCount;
+
+/*
+  Dynamic opcode sequence counts, recorded by the interpreter loop for every dispatched instruction.
+  - Pairs are counted directly, triples in an open addressed table keyed by the three opcodes (key 0 is empty,
+    so keys are stored plus one).
+  - The sequence crosses calls, returns and jumps, it is the order the instructions executed in.
+*/
+static size_t opcodeCounts[UINT8_COUNT];
+static size_t pairCounts[UINT8_COUNT][UINT8_COUNT];
+static SequenceCount tripleCounts[TRIPLE_TABLE_SIZE];
+static size_t recordedCount = 0;
+static uint8_t previous[2];
+
+void recordOpcode(uint8_t opcode) {
+	opcodeCounts[opcode]++;
+	if (recordedCount >= 1) pairCounts[previous[1]][opcode]++;
+	if (recordedCount >= 2) {
+		uint32_t key = (((uint32_t)previous[0] << 16) | ((uint32_t)previous[1] << 8) | opcode) + 1;
+		uint32_t index = (key * 2654435761u) & (TRIPLE_TABLE_SIZE - 1);
+		while (tripleCounts[index].key != 0 && tripleCounts[index].key != key) {
+			index = (index + 1) & (TRIPLE_TABLE_SIZE - 1);
+		}
+		tripleCounts[index].key = key;
+		tripleCounts[index].count++;
+	}
+	previous[0] = previous[1];
+	previous[1] = opcode;
+	recordedCount++;
+}
+
+static int compareSequenceCounts(const void* a, const void* b) {
+	size_t countA = ((const SequenceCount*)a)->count;
+	size_t countB = ((const SequenceCount*)b)->count;
+	return (countA < countB) - (countA > countB);
+}
+
+static void printSequences(SequenceCount* sequences, size_t count, int length, size_t limit) {
+	qsort(sequences, count, sizeof(SequenceCount), compareSequenceCounts);
+	for (size_t i = 0; i < count && i < limit; i++) {
+		uint32_t key = sequences[i].key;
+		double share = 100.0 * (double)sequences[i].count / (double)recordedCount;
+		fprintf(stderr, "%12zu %6.2f%%  ", sequences[i].count, share);
+		for (int j = length - 1; j >= 0; j--) {
+			fprintf(stderr, "%s%s", opcodeName((uint8_t)(key >> (j * 8))), j == 0 ? "\n" : " ");
+		}
+	}
+}
+
+void printOpcodeStats(size_t limit) {
+	if (recordedCount == 0) return;
+
+	// Allocated outside of the VM's heap, the VM may already have been freed.
+	SequenceCount* sequences = malloc(sizeof(SequenceCount) * (UINT8_COUNT * UINT8_COUNT));
+	if (sequences == NULL) return;
+
+	fprintf(stderr, "==== opcodes (%zu executed) ====\n", recordedCount);
+	size_t count = 0;
+	for (int i = 0; i < UINT8_COUNT; i++) {
+		if (opcodeCounts[i] == 0) continue;
+		sequences[count].key = (uint32_t)i;
+		sequences[count++].count = opcodeCounts[i];
+	}
+	printSequences(sequences, count, 1, limit);
+
+	fprintf(stderr, "==== opcode pairs ====\n");
+	count = 0;
+	for (int i = 0; i < UINT8_COUNT; i++) {
+		for (int j = 0; j < UINT8_COUNT; j++) {
+			if (pairCounts[i][j] == 0) continue;
+			sequences[count].key = ((uint32_t)i << 8) | (uint32_t)j;
+			sequences[count++].count = pairCounts[i][j];
+		}
+	}
+	printSequences(sequences, count, 2, limit);
+	free(sequences);
+
+	fprintf(stderr, "==== opcode triples ====\n");
+	count = 0;
+	for (size_t i = 0; i < TRIPLE_TABLE_SIZE; i++) {
+		if (tripleCounts[i].key == 0) continue;
+		tripleCounts[count].key = tripleCounts[i].key - 1;
+		tripleCounts[count++].count = tripleCounts[i].count;
+	}
+	printSequences(tripleCounts, count, 3, limit);
+}
+#endif
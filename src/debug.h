@@ -4,4 +4,12 @@
 
 void disassembleChunk(VM* vm, Chunk* chunk, const char* name);
 int disassembleInstruction(VM* vm, Chunk* chunk, int offset);
-size_t getLine(LineNumberTable* table, size_t index);
\ No newline at end of file
+size_t getLine(LineNumberTable* table, size_t index);
+void printCacheStats(VM* vm);
+void printGCStats(VM* vm);
+const char* opcodeName(uint8_t opcode);
+
+#ifdef DRAGON_OPCODE_STATS
+void recordOpcode(uint8_t opcode);
+void printOpcodeStats(size_t limit);
+#endif
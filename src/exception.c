@@ -1,4 +1,7 @@
 #include "exception.h"
+#include "debug.h"
+#include "memory.h"
+#include <stdio.h>
 #include <string.h>
 
 static void defineException(VM* vm, Module* mod, ObjClass* exception, const char* name) {
@@ -8,7 +11,7 @@ static void defineException(VM* vm, Module* mod, ObjClass* exception, const char
 	push(vm, OBJ_VAL(exceptionClass));
 	tableAddAll(vm, &exception->methods, &exceptionClass->methods);
 	exceptionClass->superclass = exception;
-	tableSet(vm, &mod->globals, nameString, OBJ_VAL(exceptionClass));
+	defineModuleGlobal(vm, mod, nameString, OBJ_VAL(exceptionClass));
 	popN(vm, 2);
 }
 
@@ -19,7 +22,7 @@ void defineExceptionClasses(VM* vm, Module* mod) {
 	push(vm, OBJ_VAL(exception));
 	tableAddAll(vm, &vm->objectClass->methods, &exception->methods);
 	exception->superclass = vm->objectClass;
-	tableSet(vm, &mod->globals, exceptionName, OBJ_VAL(exception));
+	defineModuleGlobal(vm, mod, exceptionName, OBJ_VAL(exception));
 	popN(vm, 2);
 
 
@@ -29,6 +32,89 @@ void defineExceptionClasses(VM* vm, Module* mod) {
 	defineException(vm, mod, exception, "IndexException");
 	defineException(vm, mod, exception, "UndefinedVariableException");
 	defineException(vm, mod, exception, "StackOverflowException");
+	defineException(vm, mod, exception, "WorkerException");
+	defineException(vm, mod, exception, "OutOfMemoryException");
+	defineException(vm, mod, exception, "IOException");
 
 	vm->exceptionClass = exception;
-}
\ No newline at end of file
+}
+
+static void writeTraceLine(VM* vm, ValueArray* lines, ObjString* line) {
+	if (lines == NULL) printf("%s\n", line->chars);
+	else writeValueArray(vm, lines, OBJ_VAL(line));
+}
+
+/*
+  Appends the lines of a stack trace to lines, or prints them if it is NULL. Frames in a row on the same line of the same
+  function are folded into "[Previous * n]", apart from the last frame of a caught exception, the one which caught it.
+  The lines are only held by lines, so the caller must stop the GC from running.
+*/
+static void writeTraceLines(VM* vm, ObjString* className, ObjString* message, TraceFrame* frames, size_t count, bool caught, ValueArray* lines) {
+	writeTraceLine(vm, lines, makeStringf(vm, "%s: %s", className->chars, message->chars));
+
+	size_t prevLine = 0;
+	ObjFunction* prevFunction = NULL;
+	size_t repeats = 0;
+	bool repeating = false;
+
+	for (size_t i = 0; i < count; i++) {
+		ObjFunction* function = frames[i].function;
+		size_t line = getLine(&function->chunk.lines, frames[i].offset);
+		const char* name = function->name == NULL ? "<script>" : function->name->chars;
+
+		if (caught && i == count - 1) {
+			writeTraceLine(vm, lines, makeStringf(vm, "[%zu] in %s", line, name));
+			break;
+		}
+
+		if (line != prevLine || function != prevFunction) {
+			if (repeating) {
+				writeTraceLine(vm, lines, makeStringf(vm, "[Previous * %zu]", repeats));
+				repeating = false;
+				repeats = 0;
+			}
+			writeTraceLine(vm, lines, makeStringf(vm, "[%zu] in %s", line, name));
+			prevFunction = function;
+			prevLine = line;
+		}
+		else {
+			repeating = true;
+			repeats++;
+		}
+
+		if (frames[i].repeats > 0) {
+			repeating = true;
+			repeats += frames[i].repeats;
+		}
+	}
+}
+
+void printStackTrace(VM* vm, ObjString* className, ObjString* message, TraceFrame* frames, size_t count) {
+	bool shouldGC = vm->shouldGC;
+	vm->shouldGC = false;
+	writeTraceLines(vm, className, message, frames, count, false, NULL);
+	vm->shouldGC = shouldGC;
+}
+
+Value resolveStackTrace(VM* vm, ObjInstance* instance) {
+	Value value;
+	if (!instanceGet(instance, vm->stringConstants[STR_STACK_TRACE], &value)) return NULL_VAL;
+	if (!IS_TRACE(value)) return value;
+
+	ObjTrace* trace = AS_TRACE(value);
+	ValueArray lines;
+	initValueArray(&lines);
+
+	bool shouldGC = vm->shouldGC;
+	vm->shouldGC = false;
+	writeTraceLines(vm, trace->className, trace->message, trace->frames, trace->count, true, &lines);
+	Value list = OBJ_VAL(newList(vm, lines));
+	vm->shouldGC = shouldGC;
+
+	// The instance may already have been popped by the caller.
+	push(vm, OBJ_VAL(instance)); // GC
+	push(vm, list);
+	instanceSet(vm, instance, vm->stringConstants[STR_STACK_TRACE], list);
+	popN(vm, 2);
+	return list;
+}
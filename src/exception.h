@@ -2,4 +2,9 @@
 #include "common.h"
 #include "vm.h"
 
-void defineExceptionClasses(VM* vm, Module* mod);
\ No newline at end of file
+void defineExceptionClasses(VM* vm, Module* mod);
+
+// Prints the lines of a stack trace for an exception which wasn't caught.
+void printStackTrace(VM* vm, ObjString* className, ObjString* message, TraceFrame* frames, size_t count);
+// Replaces the ObjTrace held by instance's stackTrace field with its list of lines, if it hasn't been already.
+Value resolveStackTrace(VM* vm, ObjInstance* instance);
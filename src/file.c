@@ -1,7 +1,19 @@
 #include "file.h"
+#include "thread.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 char* readFile(const char* path) {
 	FILE* file = fopen(path, "rb");
@@ -65,4 +77,203 @@ char* getDirectory(const char* path) {
 
 	free(pathCopy);
 	return directory;
-}
\ No newline at end of file
+}
+uint8_t* readFileBytes(const char* path, size_t* length) {
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) return NULL;
+
+	fseek(file, 0L, SEEK_END);
+	long fileSize = ftell(file);
+	rewind(file);
+	if (fileSize < 0) {
+		fclose(file);
+		return NULL;
+	}
+
+	uint8_t* buffer = malloc((size_t)fileSize + 1);
+	if (buffer == NULL) {
+		fclose(file);
+		return NULL;
+	}
+	size_t bytesRead = fread(buffer, 1, (size_t)fileSize, file);
+	fclose(file);
+	if (bytesRead < (size_t)fileSize) {
+		free(buffer);
+		return NULL;
+	}
+
+	*length = bytesRead;
+	return buffer;
+}
+
+#ifdef _WIN32
+bool mapFile(const char* path, MappedFile* file) {
+	size_t length;
+	uint8_t* data = readFileBytes(path, &length);
+	if (data == NULL) return false;
+	data[length] = '\0';
+	file->data = (const char*)data;
+	file->length = length;
+	file->mapped = false;
+	return true;
+}
+
+bool mapFileView(const char* path, MappedFile* file) {
+	return mapFile(path, file);
+}
+
+void unmapFile(MappedFile* file) {
+	free((void*)file->data);
+	file->data = NULL;
+}
+#else
+static bool mapFileWith(const char* path, MappedFile* file, bool terminated) {
+	int descriptor = open(path, O_RDONLY);
+	if (descriptor < 0) return false;
+
+	struct stat status;
+	if (fstat(descriptor, &status) != 0) {
+		close(descriptor);
+		return false;
+	}
+
+	// The rest of a mapping's last page reads as zeroes, which terminates the text, unless the file fills the page.
+	size_t length = (size_t)status.st_size;
+	long pageSize = sysconf(_SC_PAGESIZE);
+	if (length > 0 && pageSize > 0 && (!terminated || length % (size_t)pageSize != 0)) {
+		void* data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+		close(descriptor);
+		if (data == MAP_FAILED) return false;
+		file->data = data;
+		file->length = length;
+		file->mapped = true;
+		return true;
+	}
+	close(descriptor);
+
+	uint8_t* data = readFileBytes(path, &length);
+	if (data == NULL) return false;
+	data[length] = '\0';
+	file->data = (const char*)data;
+	file->length = length;
+	file->mapped = false;
+	return true;
+}
+
+bool mapFile(const char* path, MappedFile* file) {
+	return mapFileWith(path, file, true);
+}
+
+bool mapFileView(const char* path, MappedFile* file) {
+	return mapFileWith(path, file, false);
+}
+
+void unmapFile(MappedFile* file) {
+	if (file->mapped) munmap((void*)file->data, file->length);
+	else free((void*)file->data);
+	file->data = NULL;
+}
+#endif
+
+bool writeFileAtomic(const char* path, const uint8_t* data, size_t length) {
+	size_t pathLength = strlen(path);
+	char* temporary = malloc(pathLength + 64);
+	if (temporary == NULL) return false;
+	// Unique to the thread as well as the process, as workers may write the same file at once.
+	snprintf(temporary, pathLength + 64, "%s.%d.%llx.tmp", path, (int)getpid(), (unsigned long long)currentThreadId());
+
+	FILE* file = fopen(temporary, "wb");
+	if (file == NULL) {
+		free(temporary);
+		return false;
+	}
+	bool written = fwrite(data, 1, length, file) == length;
+	written &= fclose(file) == 0;
+
+#ifdef _WIN32
+	// rename doesn't replace an existing file on Windows.
+	if (written) remove(path);
+#endif
+	if (!written || rename(temporary, path) != 0) {
+		remove(temporary);
+		free(temporary);
+		return false;
+	}
+
+	free(temporary);
+	return true;
+}
+
+bool getFileInfo(const char* path, FileInfo* info) {
+	struct stat status;
+	if (stat(path, &status) != 0) return false;
+	info->modified = (int64_t)status.st_mtime;
+	info->size = (uint64_t)status.st_size;
+	return true;
+}
+
+bool hasExtension(const char* path, const char* extension) {
+	size_t length = strlen(path);
+	size_t extensionLength = strlen(extension);
+	return length > extensionLength && strcmp(path + length - extensionLength, extension) == 0;
+}
+
+static char* joinPath(const char* directory, const char* name) {
+	size_t length = strlen(directory) + strlen(name) + 2;
+	char* path = malloc(length);
+	if (path == NULL) {
+		fprintf(stderr, "Could not allocate path %s/%s\n", directory, name);
+		exit(120);
+	}
+	snprintf(path, length, "%s/%s", directory, name);
+	return path;
+}
+
+#ifdef _WIN32
+bool forEachFile(const char* directory, const char* extension, FileVisitor visitor, void* context) {
+	char* pattern = joinPath(directory, "*");
+	struct _finddata_t entry;
+	intptr_t handle = _findfirst(pattern, &entry);
+	free(pattern);
+	if (handle == -1) return false;
+
+	do {
+		if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) continue;
+		char* path = joinPath(directory, entry.name);
+		if (entry.attrib & _A_SUBDIR) {
+			forEachFile(path, extension, visitor, context);
+		}
+		else if (hasExtension(path, extension)) {
+			visitor(path, context);
+		}
+		free(path);
+	} while (_findnext(handle, &entry) == 0);
+
+	_findclose(handle);
+	return true;
+}
+#else
+bool forEachFile(const char* directory, const char* extension, FileVisitor visitor, void* context) {
+	DIR* dir = opendir(directory);
+	if (dir == NULL) return false;
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+		char* path = joinPath(directory, entry->d_name);
+		struct stat status;
+		if (stat(path, &status) == 0) {
+			if (S_ISDIR(status.st_mode)) {
+				forEachFile(path, extension, visitor, context);
+			}
+			else if (hasExtension(path, extension)) {
+				visitor(path, context);
+			}
+		}
+		free(path);
+	}
+
+	closedir(dir);
+	return true;
+}
+#endif
@@ -1,4 +1,32 @@
 #pragma once
+#include "common.h"
+
+typedef struct {
+	int64_t modified;
+	uint64_t size;
+} FileInfo;
+
+// A file's contents, followed by a NUL so they can be read as text (unless from mapFileView).
+typedef struct {
+	const char* data;
+	size_t length;
+	bool mapped;
+} MappedFile;
+
+typedef void (*FileVisitor)(const char* path, void* context);
 
 char* readFile(const char* path);
-char* getDirectory(const char* path);
\ No newline at end of file
+char* getDirectory(const char* path);
+// Like readFile, but returns NULL (rather than exiting) if the file can't be read, the length is stored in length.
+uint8_t* readFileBytes(const char* path, size_t* length);
+// Maps the file into memory read only where the platform allows it, otherwise reads it. Returns false if it can't be read.
+bool mapFile(const char* path, MappedFile* file);
+// Like mapFile, but the contents needn't be followed by a NUL, so files filling whole pages are mapped too.
+bool mapFileView(const char* path, MappedFile* file);
+void unmapFile(MappedFile* file);
+// Writes to a temporary file which is then renamed over path, so readers never see a partially written file.
+bool writeFileAtomic(const char* path, const uint8_t* data, size_t length);
+bool getFileInfo(const char* path, FileInfo* info);
+bool hasExtension(const char* path, const char* extension);
+// Calls visitor for every file below directory (recursively) with the given extension.
+bool forEachFile(const char* directory, const char* extension, FileVisitor visitor, void* context);
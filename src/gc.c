@@ -0,0 +1,144 @@
+#include "gc.h"
+#include "natives.h"
+#include "memory.h"
+#include "object.h"
+#include <string.h>
+
+static const char* objectTypeNames[] = {
+	[OBJ_BOUND_METHOD] = "boundMethod",
+	[OBJ_CLASS] = "class",
+	[OBJ_CLOSURE] = "closure",
+	[OBJ_FUNCTION] = "function",
+	[OBJ_INSTANCE] = "instance",
+	[OBJ_LIST] = "list",
+	[OBJ_MAP] = "map",
+	[OBJ_NATIVE] = "native",
+	[OBJ_RANGE] = "range",
+	[OBJ_ROPE] = "rope",
+	[OBJ_SET] = "set",
+	[OBJ_SHAPE] = "shape",
+	[OBJ_STRING] = "string",
+	[OBJ_TRACE] = "trace",
+	[OBJ_TYPED_ARRAY] = "typedArray",
+	[OBJ_UPVALUE] = "upvalue"
+};
+
+#define OBJECT_TYPE_COUNT (sizeof(objectTypeNames) / sizeof(objectTypeNames[0]))
+
+// Sets a field of the instance on top of the stack.
+static void setField(VM* vm, const char* name, Value value) {
+	push(vm, value); // GC
+	push(vm, OBJ_VAL(copyString(vm, name, strlen(name))));
+	instanceSet(vm, AS_INSTANCE(vm->stackTop[-3]), AS_STRING(vm->stackTop[-1]), vm->stackTop[-2]);
+	popN(vm, 2);
+}
+
+static Value gcCollectNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	size_t before = vm->bytesAllocated;
+	collectGarbage(vm);
+	return NUMBER_VAL(before > vm->bytesAllocated ? (double)(before - vm->bytesAllocated) : 0);
+}
+
+static Value gcStatsNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	size_t counts[OBJECT_TYPE_COUNT] = { 0 };
+	Obj* generations[] = { vm->objects, vm->youngObjects, vm->sweepObjects };
+	for (size_t g = 0; g < 3; g++) {
+		for (Obj* object = generations[g]; object != NULL; object = object->next) counts[object->type]++;
+	}
+
+	GCStats* stats = &vm->gcStats;
+	push(vm, OBJ_VAL(newInstance(vm, vm->objectClass)));
+	setField(vm, "minorCollections", NUMBER_VAL((double)stats->minorCount));
+	setField(vm, "majorCollections", NUMBER_VAL((double)stats->majorCount));
+	setField(vm, "incrementalCollections", NUMBER_VAL((double)stats->incrementalCount));
+	setField(vm, "pauseSeconds", NUMBER_VAL(stats->minorSeconds + stats->majorSeconds + stats->sliceSeconds));
+	double maxPause = stats->maxMinorPause > stats->maxMajorPause ? stats->maxMinorPause : stats->maxMajorPause;
+	setField(vm, "maxPauseSeconds", NUMBER_VAL(maxPause > stats->maxSlicePause ? maxPause : stats->maxSlicePause));
+	setField(vm, "bytesAllocated", NUMBER_VAL((double)vm->bytesAllocated));
+	setField(vm, "totalAllocated", NUMBER_VAL((double)stats->allocatedBytes));
+	setField(vm, "totalFreed", NUMBER_VAL((double)stats->freedBytes));
+	setField(vm, "peakBytes", NUMBER_VAL((double)stats->peakBytes));
+	setField(vm, "nextCollection", NUMBER_VAL((double)vm->nextGC));
+
+	push(vm, OBJ_VAL(newInstance(vm, vm->objectClass)));
+	for (size_t i = 0; i < OBJECT_TYPE_COUNT; i++) setField(vm, objectTypeNames[i], NUMBER_VAL((double)counts[i]));
+	setField(vm, "objects", pop(vm));
+	return pop(vm);
+}
+
+static Value gcSettingsNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	push(vm, OBJ_VAL(newInstance(vm, vm->objectClass)));
+	setField(vm, "growthFactor", NUMBER_VAL(vm->gcGrowthFactor));
+	setField(vm, "minHeap", NUMBER_VAL((double)vm->gcMinHeap));
+	setField(vm, "softLimit", NUMBER_VAL((double)vm->gcSoftLimit));
+	setField(vm, "hardLimit", NUMBER_VAL((double)vm->gcHardLimit));
+	setField(vm, "incremental", BOOL_VAL(vm->gcIncremental));
+	return pop(vm);
+}
+
+// Reads a number of at least minimum from the named field into number, if settings has one.
+static bool readSetting(VM* vm, ObjInstance* settings, const char* name, double minimum, double* number, ObjInstance** exception) {
+	Value value;
+	if (!instanceGet(settings, copyString(vm, name, strlen(name)), &value)) return true;
+	if (!IS_NUMBER(value) || AS_NUMBER(value) < minimum) {
+		*exception = makeException(vm, "TypeException", "Expected '%s' to be a number of at least %g.", name, minimum);
+		return false;
+	}
+	*number = AS_NUMBER(value);
+	return true;
+}
+
+static Value gcConfigureNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	if (!IS_INSTANCE(args[0])) {
+		*hasError = true;
+		*exception = makeException(vm, "TypeException", "Expected an object of settings.");
+		return NULL_VAL;
+	}
+	ObjInstance* settings = AS_INSTANCE(args[0]);
+
+	// Nothing changes unless every setting given is valid.
+	double growthFactor = vm->gcGrowthFactor;
+	double minHeap = (double)vm->gcMinHeap;
+	double softLimit = (double)vm->gcSoftLimit;
+	double hardLimit = (double)vm->gcHardLimit;
+	if (!readSetting(vm, settings, "growthFactor", 1, &growthFactor, exception) ||
+		!readSetting(vm, settings, "minHeap", 0, &minHeap, exception) ||
+		!readSetting(vm, settings, "softLimit", 0, &softLimit, exception) ||
+		!readSetting(vm, settings, "hardLimit", 0, &hardLimit, exception)) {
+		*hasError = true;
+		return NULL_VAL;
+	}
+
+	Value incremental;
+	if (instanceGet(settings, copyString(vm, "incremental", 11), &incremental)) {
+		if (!IS_BOOL(incremental)) {
+			*hasError = true;
+			*exception = makeException(vm, "TypeException", "Expected 'incremental' to be a boolean.");
+			return NULL_VAL;
+		}
+		vm->gcIncremental = AS_BOOL(incremental);
+	}
+
+	vm->gcGrowthFactor = growthFactor;
+	vm->gcMinHeap = (size_t)minHeap;
+	vm->gcSoftLimit = (size_t)softLimit;
+	vm->gcHardLimit = (size_t)hardLimit;
+	updateHeapTarget(vm);
+	return NULL_VAL;
+}
+
+void defineGCModule(VM* vm) {
+	ObjInstance* module = newInstance(vm, vm->importClass);
+	push(vm, OBJ_VAL(module)); // GC
+	instanceMakeDictionary(vm, module);
+
+	defineNative(vm, &module->fields, "collect", 0, false, gcCollectNative);
+	defineNative(vm, &module->fields, "stats", 0, false, gcStatsNative);
+	defineNative(vm, &module->fields, "settings", 0, false, gcSettingsNative);
+	defineNative(vm, &module->fields, "configure", 1, false, gcConfigureNative);
+
+	// Imports look in the import table before the file system.
+	push(vm, OBJ_VAL(copyString(vm, "gc", 2)));
+	tableSet(vm, &vm->importTable, AS_STRING(peek(vm, 0)), OBJ_VAL(module));
+	popN(vm, 2);
+}
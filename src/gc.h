@@ -0,0 +1,13 @@
+#pragma once
+#include "common.h"
+#include "vm.h"
+
+/*
+  The gc module ('import gc;'), built into every VM rather than read from a file.
+  - collect() runs a full collection, returning the number of bytes it freed.
+  - stats() returns an Object of the collector's counters, with the live objects of each type under 'objects'.
+  - settings() returns the tunables (growthFactor, minHeap, softLimit, hardLimit and incremental), configure(settings)
+    changes any of them given as fields of an Object. Limits of 0 are no limit.
+*/
+
+void defineGCModule(VM* vm);
@@ -0,0 +1,588 @@
+#include "io.h"
+#include "natives.h"
+#include "memory.h"
+#include "object.h"
+#include "file.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef _WIN32
+#include <io.h>
+#define isatty _isatty
+#define fileno _fileno
+#else
+#include <unistd.h>
+#endif
+
+typedef enum {
+	FILE_READ,
+	FILE_WRITE,
+	FILE_MAPPED
+} FileMode;
+
+struct IOFile {
+	FILE* stream;
+	FileMode mode;
+	bool open;
+	// The standard streams are only written out when closed, never closed themselves.
+	bool standard;
+	// Writes go straight to the stream (io.stderr).
+	bool unbuffered;
+	// Reads stop at line breaks rather than waiting for the buffer to fill (a terminal's standard input).
+	bool interactive;
+	bool atEnd;
+	// When reading the unread bytes are buffer[start, end), when writing buffer[0, end) waits to be written out. A mapped
+	// file's buffer is its mapping.
+	char* buffer;
+	size_t capacity;
+	size_t start;
+	size_t end;
+	MappedFile map;
+};
+
+#define STDIN_ID 0
+#define STDOUT_ID 1
+#define STDERR_ID 2
+
+/*
+  Helper functions
+*/
+
+static IOFile* makeFile(FILE* stream, FileMode mode, bool standard) {
+	IOFile* file = malloc(sizeof(IOFile));
+	if (file == NULL) return NULL;
+	file->stream = stream;
+	file->mode = mode;
+	file->open = true;
+	file->standard = standard;
+	file->unbuffered = false;
+	file->interactive = false;
+	file->atEnd = false;
+	file->buffer = NULL;
+	file->capacity = 0;
+	file->start = 0;
+	file->end = 0;
+	return file;
+}
+
+// Adds the file to the VM's files, returning an instance of File holding its id.
+static Value addFile(VM* vm, IOFile* file) {
+	if (vm->fileCount == vm->fileCapacity) {
+		size_t oldCapacity = vm->fileCapacity;
+		vm->fileCapacity = GROW_CAPACITY(oldCapacity);
+		vm->files = GROW_ARRAY(vm, IOFile*, vm->files, oldCapacity, vm->fileCapacity);
+	}
+	size_t id = vm->fileCount;
+	vm->files[vm->fileCount++] = file;
+
+	ObjInstance* instance = newInstance(vm, vm->fileClass);
+	push(vm, OBJ_VAL(instance)); // GC
+	instanceSet(vm, instance, vm->stringConstants[STR_ID], NUMBER_VAL((double)id));
+	return pop(vm);
+}
+
+static IOFile* lookupFile(VM* vm, Value receiver, bool* hasError, ObjInstance** exception) {
+	Value id;
+	if (!IS_INSTANCE(receiver) || !instanceGet(AS_INSTANCE(receiver), vm->stringConstants[STR_ID], &id) || !IS_NUMBER(id) ||
+		AS_NUMBER(id) < 0 || AS_NUMBER(id) >= vm->fileCount || AS_NUMBER(id) != (size_t)AS_NUMBER(id)) {
+		*hasError = true;
+		*exception = makeException(vm, "PropertyException", "File object must have the 'id' field of an opened file.");
+		return NULL;
+	}
+	return vm->files[(size_t)AS_NUMBER(id)];
+}
+
+static IOFile* getFile(VM* vm, Value receiver, bool* hasError, ObjInstance** exception) {
+	IOFile* file = lookupFile(vm, receiver, hasError, exception);
+	if (file != NULL && !file->open) {
+		*hasError = true;
+		*exception = makeException(vm, "IOException", "File is closed.");
+		return NULL;
+	}
+	return file;
+}
+
+static IOFile* getReader(VM* vm, Value receiver, bool* hasError, ObjInstance** exception) {
+	IOFile* file = getFile(vm, receiver, hasError, exception);
+	if (file != NULL && file->mode == FILE_WRITE) {
+		*hasError = true;
+		*exception = makeException(vm, "IOException", "File is not open for reading.");
+		return NULL;
+	}
+	return file;
+}
+
+static IOFile* getWriter(VM* vm, Value receiver, bool* hasError, ObjInstance** exception) {
+	IOFile* file = getFile(vm, receiver, hasError, exception);
+	if (file != NULL && file->mode != FILE_WRITE) {
+		*hasError = true;
+		*exception = makeException(vm, "IOException", "File is not open for writing.");
+		return NULL;
+	}
+	return file;
+}
+
+static IOFile* getMapped(VM* vm, Value receiver, const char* method, bool* hasError, ObjInstance** exception) {
+	IOFile* file = getFile(vm, receiver, hasError, exception);
+	if (file != NULL && file->mode != FILE_MAPPED) {
+		*hasError = true;
+		*exception = makeException(vm, "IOException", "Only mapped files support %s.", method);
+		return NULL;
+	}
+	return file;
+}
+
+static bool writeOut(IOFile* file) {
+	size_t length = file->end;
+	file->end = 0;
+	return length == 0 || fwrite(file->buffer, 1, length, file->stream) == length;
+}
+
+static bool writeBytes(IOFile* file, const char* chars, size_t length) {
+	if (file->buffer == NULL && !file->unbuffered) {
+		file->buffer = malloc(IO_BUFFER_SIZE);
+		file->capacity = file->buffer == NULL ? 0 : IO_BUFFER_SIZE;
+	}
+	if (file->end + length > file->capacity && !writeOut(file)) return false;
+	if (length >= file->capacity) return fwrite(chars, 1, length, file->stream) == length;
+
+	memcpy(file->buffer + file->end, chars, length);
+	file->end += length;
+	return true;
+}
+
+// Writes out what the file holds and the stream's own buffer.
+static bool flushFile(IOFile* file) {
+	if (file->mode != FILE_WRITE) return true;
+	bool written = writeOut(file);
+	return fflush(file->stream) == 0 && written;
+}
+
+static bool closeFile(IOFile* file) {
+	if (!file->open) return true;
+	file->open = false;
+
+	bool closed = true;
+	if (file->mode == FILE_MAPPED) {
+		unmapFile(&file->map);
+		file->buffer = NULL;
+	}
+	else {
+		closed = flushFile(file);
+		if (!file->standard) closed = fclose(file->stream) == 0 && closed;
+		free(file->buffer);
+		file->buffer = NULL;
+	}
+	file->capacity = 0;
+	file->start = 0;
+	file->end = 0;
+	return closed;
+}
+
+/*
+  Moves the unread bytes to the front of the buffer, growing it when they fill it, and reads more after them. Returns
+  false once the stream has ended (or failed), a mapped file having been read in full.
+*/
+static bool fillBuffer(IOFile* file) {
+	if (file->mode == FILE_MAPPED || file->atEnd) return false;
+
+	if (file->start > 0) {
+		memmove(file->buffer, file->buffer + file->start, file->end - file->start);
+		file->end -= file->start;
+		file->start = 0;
+	}
+	if (file->end == file->capacity) {
+		size_t capacity = file->capacity == 0 ? IO_BUFFER_SIZE : file->capacity * 2;
+		char* buffer = realloc(file->buffer, capacity);
+		if (buffer == NULL) return false;
+		file->buffer = buffer;
+		file->capacity = capacity;
+	}
+
+	size_t count = 0;
+	if (file->interactive) {
+		int c;
+		while (file->end + count < file->capacity && (c = getc(file->stream)) != EOF) {
+			file->buffer[file->end + count++] = (char)c;
+			if (c == '\n') break;
+		}
+	}
+	else {
+		count = fread(file->buffer + file->end, 1, file->capacity - file->end, file->stream);
+	}
+	file->end += count;
+	if (count == 0) file->atEnd = true;
+	return count > 0;
+}
+
+static bool readFailed(IOFile* file) {
+	return file->stream != NULL && ferror(file->stream);
+}
+
+// Takes the next line from the file, or returns false at its end.
+static bool nextLine(IOFile* file, const char** line, size_t* length) {
+	size_t scanned = 0;
+	for (;;) {
+		if (file->start + scanned < file->end) {
+			const char* from = file->buffer + file->start;
+			const char* newline = memchr(from + scanned, '\n', file->end - file->start - scanned);
+			if (newline != NULL) {
+				*line = from;
+				*length = (size_t)(newline - from);
+				file->start += *length + 1;
+				if (*length > 0 && from[*length - 1] == '\r') (*length)--;
+				return true;
+			}
+		}
+
+		scanned = file->end - file->start;
+		if (!fillBuffer(file)) {
+			if (file->start == file->end) return false;
+			*line = file->buffer + file->start;
+			*length = file->end - file->start;
+			file->start = file->end;
+			return true;
+		}
+	}
+}
+
+static bool readCount(VM* vm, uint8_t argCount, Value* args, size_t* count, bool* hasError, ObjInstance** exception) {
+	if (argCount > 1) {
+		*hasError = true;
+		*exception = makeException(vm, "ArityException", "Expected at most 1 argument(s) but got %u.", argCount);
+		return false;
+	}
+	if (argCount == 0) {
+		*count = SIZE_MAX;
+		return true;
+	}
+	if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0 || AS_NUMBER(args[0]) != floor(AS_NUMBER(args[0]))) {
+		*hasError = true;
+		*exception = makeException(vm, "TypeException", "Expected a non-negative integer count in read.");
+		return false;
+	}
+	*count = AS_NUMBER(args[0]) >= (double)SIZE_MAX ? SIZE_MAX : (size_t)AS_NUMBER(args[0]);
+	return true;
+}
+
+static bool readIndex(VM* vm, Value value, size_t length, const char* method, size_t* index, bool* hasError, ObjInstance** exception) {
+	if (!IS_NUMBER(value) || AS_NUMBER(value) != floor(AS_NUMBER(value))) {
+		*hasError = true;
+		*exception = makeException(vm, "TypeException", "Expected integer indices in %s.", method);
+		return false;
+	}
+	double number = AS_NUMBER(value);
+	if (number < 0) number += (double)length;
+	if (number < 0 || number > (double)length) {
+		*hasError = true;
+		*exception = makeException(vm, "IndexException", "Index %g is out of bounds for length %zu.", AS_NUMBER(value), length);
+		return false;
+	}
+	*index = (size_t)number;
+	return true;
+}
+
+static const char* findBytes(const char* haystack, size_t length, const char* needle, size_t needleLength) {
+	if (needleLength == 0) return haystack;
+	if (needleLength > length) return NULL;
+	const char* last = haystack + length - needleLength;
+	for (const char* at = haystack; at <= last; at++) {
+		at = memchr(at, needle[0], (size_t)(last - at) + 1);
+		if (at == NULL) return NULL;
+		if (memcmp(at, needle, needleLength) == 0) return at;
+	}
+	return NULL;
+}
+
+static void ioError(VM* vm, const char* action, const char* path, bool* hasError, ObjInstance** exception) {
+	*hasError = true;
+	*exception = makeException(vm, "IOException", "Could not %s \"%s\" (%s).", action, path, strerror(errno));
+}
+
+/*
+  Module functions
+*/
+
+static Value ioOpenNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+		*hasError = true;
+		*exception = makeException(vm, "TypeException", "Expected a path and a mode string in open.");
+		return NULL_VAL;
+	}
+
+	const char* mode = AS_CSTRING(args[1]);
+	FileMode fileMode;
+	const char* streamMode;
+	if (strcmp(mode, "r") == 0) {
+		fileMode = FILE_READ;
+		streamMode = "rb";
+	}
+	else if (strcmp(mode, "w") == 0) {
+		fileMode = FILE_WRITE;
+		streamMode = "wb";
+	}
+	else if (strcmp(mode, "a") == 0) {
+		fileMode = FILE_WRITE;
+		streamMode = "ab";
+	}
+	else {
+		*hasError = true;
+		*exception = makeException(vm, "TypeException", "Expected mode \"r\", \"w\" or \"a\" in open, got \"%s\".", mode);
+		return NULL_VAL;
+	}
+
+	FILE* stream = fopen(AS_CSTRING(args[0]), streamMode);
+	if (stream == NULL) {
+		ioError(vm, "open", AS_CSTRING(args[0]), hasError, exception);
+		return NULL_VAL;
+	}
+	IOFile* file = makeFile(stream, fileMode, false);
+	if (file == NULL) {
+		fclose(stream);
+		*hasError = true;
+		*exception = makeException(vm, "OutOfMemoryException", "Not enough memory to open a file.");
+		return NULL_VAL;
+	}
+	return addFile(vm, file);
+}
+
+static Value ioMapNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	if (!IS_STRING(args[0])) {
+		*hasError = true;
+		*exception = makeException(vm, "TypeException", "Expected string as first argument in map.");
+		return NULL_VAL;
+	}
+
+	MappedFile map;
+	if (!mapFileView(AS_CSTRING(args[0]), &map)) {
+		ioError(vm, "map", AS_CSTRING(args[0]), hasError, exception);
+		return NULL_VAL;
+	}
+	IOFile* file = makeFile(NULL, FILE_MAPPED, false);
+	if (file == NULL) {
+		unmapFile(&map);
+		*hasError = true;
+		*exception = makeException(vm, "OutOfMemoryException", "Not enough memory to map a file.");
+		return NULL_VAL;
+	}
+	file->map = map;
+	file->buffer = (char*)map.data;
+	file->capacity = map.length;
+	file->end = map.length;
+	return addFile(vm, file);
+}
+
+/*
+  File methods
+*/
+
+static Value fileCloseNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	IOFile* file = lookupFile(vm, *bound, hasError, exception);
+	if (file == NULL) return NULL_VAL;
+
+	if (!closeFile(file)) {
+		*hasError = true;
+		*exception = makeException(vm, "IOException", "Could not close file (%s).", strerror(errno));
+	}
+	return NULL_VAL;
+}
+
+static Value fileFlushNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	IOFile* file = getFile(vm, *bound, hasError, exception);
+	if (file == NULL) return NULL_VAL;
+
+	if (!flushFile(file)) {
+		*hasError = true;
+		*exception = makeException(vm, "IOException", "Could not write to file (%s).", strerror(errno));
+	}
+	return NULL_VAL;
+}
+
+// indexOf(string, from), from defaulting to 0. Returns the byte offset of the first match, or -1.
+static Value fileIndexOfNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	IOFile* file = getMapped(vm, *bound, "indexOf", hasError, exception);
+	if (file == NULL) return NULL_VAL;
+	if (argCount > 2) {
+		*hasError = true;
+		*exception = makeException(vm, "ArityException", "Expected at most 2 argument(s) but got %u.", argCount);
+		return NULL_VAL;
+	}
+	if (!IS_STRING(args[0])) {
+		*hasError = true;
+		*exception = makeException(vm, "TypeException", "Expected string as first argument in indexOf.");
+		return NULL_VAL;
+	}
+
+	size_t from = 0;
+	if (argCount == 2 && !readIndex(vm, args[1], file->map.length, "indexOf", &from, hasError, exception)) return NULL_VAL;
+
+	ObjString* needle = AS_STRING(args[0]);
+	const char* found = findBytes(file->map.data + from, file->map.length - from, needle->chars, needle->length);
+	return NUMBER_VAL(found == NULL ? -1 : (double)(found - file->map.data));
+}
+
+static Value fileLengthNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	IOFile* file = getMapped(vm, *bound, "length", hasError, exception);
+	if (file == NULL) return NULL_VAL;
+	return NUMBER_VAL((double)file->map.length);
+}
+
+static Value fileReadNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	IOFile* file = getReader(vm, *bound, hasError, exception);
+	if (file == NULL) return NULL_VAL;
+
+	size_t count;
+	if (!readCount(vm, argCount, args, &count, hasError, exception)) return NULL_VAL;
+	while (file->end - file->start < count && fillBuffer(file));
+	if (readFailed(file)) {
+		*hasError = true;
+		*exception = makeException(vm, "IOException", "Could not read from file.");
+		return NULL_VAL;
+	}
+
+	size_t available = file->end - file->start;
+	if (count == 0) return OBJ_VAL(copyString(vm, "", 0));
+	if (available == 0) return NULL_VAL;
+	if (count > available) count = available;
+	ObjString* string = copyTransientString(vm, file->buffer + file->start, count);
+	file->start += count;
+	return OBJ_VAL(string);
+}
+
+static Value fileReadLineNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	IOFile* file = getReader(vm, *bound, hasError, exception);
+	if (file == NULL) return NULL_VAL;
+
+	const char* line;
+	size_t length;
+	if (!nextLine(file, &line, &length)) {
+		if (readFailed(file)) {
+			*hasError = true;
+			*exception = makeException(vm, "IOException", "Could not read from file.");
+		}
+		return NULL_VAL;
+	}
+	if (length == 1) return OBJ_VAL(CHAR_STRING(vm, line[0]));
+	return OBJ_VAL(copyTransientString(vm, line, length));
+}
+
+// slice(start, end), end defaulting to the length, as a string. Negative indices count back from the end.
+static Value fileSliceNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	IOFile* file = getMapped(vm, *bound, "slice", hasError, exception);
+	if (file == NULL) return NULL_VAL;
+	if (argCount > 2) {
+		*hasError = true;
+		*exception = makeException(vm, "ArityException", "Expected at most 2 argument(s) but got %u.", argCount);
+		return NULL_VAL;
+	}
+
+	size_t start = 0;
+	size_t end = file->map.length;
+	if (argCount > 0 && !readIndex(vm, args[0], file->map.length, "slice", &start, hasError, exception)) return NULL_VAL;
+	if (argCount > 1 && !readIndex(vm, args[1], file->map.length, "slice", &end, hasError, exception)) return NULL_VAL;
+	if (start > end) {
+		*hasError = true;
+		*exception = makeException(vm, "IndexException", "Slice out of bounds.");
+		return NULL_VAL;
+	}
+	return OBJ_VAL(copyTransientString(vm, file->map.data + start, end - start));
+}
+
+static Value fileWriteNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	IOFile* file = getWriter(vm, *bound, hasError, exception);
+	if (file == NULL) return NULL_VAL;
+
+	for (uint8_t i = 0; i < argCount; i++) {
+		ObjString* string = valueToString(vm, args[i], hasError, exception);
+		if (*hasError) return NULL_VAL;
+		// A toString method may have closed it.
+		if (!file->open || !writeBytes(file, string->chars, string->length)) {
+			*hasError = true;
+			*exception = file->open ? makeException(vm, "IOException", "Could not write to file (%s).", strerror(errno))
+				: makeException(vm, "IOException", "File is closed.");
+			return NULL_VAL;
+		}
+	}
+	return NULL_VAL;
+}
+
+/*
+  Module setup
+*/
+
+// Sets a field of the module on top of the stack.
+static void setField(VM* vm, const char* name, Value value) {
+	push(vm, value); // GC
+	push(vm, OBJ_VAL(copyString(vm, name, strlen(name))));
+	instanceSet(vm, AS_INSTANCE(vm->stackTop[-3]), AS_STRING(vm->stackTop[-1]), vm->stackTop[-2]);
+	popN(vm, 2);
+}
+
+void defineIOModule(VM* vm) {
+	ObjString* fileClassName = copyString(vm, "File", 4);
+	push(vm, OBJ_VAL(fileClassName)); // GC
+	vm->fileClass = newClass(vm, fileClassName);
+	pop(vm);
+
+	tableAddAll(vm, &vm->objectClass->methods, &vm->fileClass->methods);
+	vm->fileClass->superclass = vm->objectClass;
+	defineNative(vm, &vm->fileClass->methods, "close", 0, false, fileCloseNative);
+	defineNative(vm, &vm->fileClass->methods, "flush", 0, false, fileFlushNative);
+	defineNative(vm, &vm->fileClass->methods, "indexOf", 1, true, fileIndexOfNative);
+	defineNative(vm, &vm->fileClass->methods, "length", 0, false, fileLengthNative);
+	defineNative(vm, &vm->fileClass->methods, "read", 0, true, fileReadNative);
+	defineNative(vm, &vm->fileClass->methods, "readLine", 0, false, fileReadLineNative);
+	defineNative(vm, &vm->fileClass->methods, "slice", 0, true, fileSliceNative);
+	defineNative(vm, &vm->fileClass->methods, "write", 0, true, fileWriteNative);
+
+	ObjInstance* module = newInstance(vm, vm->importClass);
+	push(vm, OBJ_VAL(module)); // GC
+	instanceMakeDictionary(vm, module);
+
+	defineNative(vm, &module->fields, "open", 2, false, ioOpenNative);
+	defineNative(vm, &module->fields, "map", 1, false, ioMapNative);
+
+	// The standard streams are the first files, so their ids are known.
+	IOFile* in = makeFile(stdin, FILE_READ, true);
+	IOFile* out = makeFile(stdout, FILE_WRITE, true);
+	IOFile* err = makeFile(stderr, FILE_WRITE, true);
+	if (in == NULL || out == NULL || err == NULL) {
+		fprintf(stderr, "Could not allocate the standard streams.\n");
+		exit(120);
+	}
+	in->interactive = isatty(fileno(stdin));
+	err->unbuffered = true;
+	setField(vm, "stdin", addFile(vm, in));
+	setField(vm, "stdout", addFile(vm, out));
+	setField(vm, "stderr", addFile(vm, err));
+
+	// Imports look in the import table before the file system.
+	push(vm, OBJ_VAL(copyString(vm, "io", 2)));
+	tableSet(vm, &vm->importTable, AS_STRING(peek(vm, 0)), OBJ_VAL(module));
+	popN(vm, 2);
+}
+
+void flushStandardOutput(VM* vm) {
+	if (vm->fileCount > STDOUT_ID && vm->files[STDOUT_ID]->open) writeOut(vm->files[STDOUT_ID]);
+}
+
+ObjString* readInputLine(VM* vm) {
+	IOFile* file = vm->files[STDIN_ID];
+	const char* line;
+	size_t length;
+	if (!file->open || !nextLine(file, &line, &length)) return copyString(vm, "", 0);
+	return copyTransientString(vm, line, length);
+}
+
+void freeFiles(VM* vm) {
+	for (size_t i = 0; i < vm->fileCount; i++) {
+		closeFile(vm->files[i]);
+		free(vm->files[i]);
+	}
+	FREE_ARRAY(vm, IOFile*, vm->files, vm->fileCapacity);
+	vm->files = NULL;
+	vm->fileCount = 0;
+	vm->fileCapacity = 0;
+}
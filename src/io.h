@@ -0,0 +1,27 @@
+#pragma once
+#include "common.h"
+#include "vm.h"
+
+/*
+  The io module ('import io;'), built into every VM like gc, streaming files through buffers of its own.
+  - io.open(path, mode) opens a File for reading ("r"), writing ("w") or appending ("a"). io.map(path) maps a file into
+    memory read only, its File reads like one opened with "r" and can also be sliced and searched without copying it.
+    io.stdin, io.stdout and io.stderr are Files of the standard streams.
+  - readLine() returns the next line without its line break (null at the end), read(count) up to count bytes (the rest
+    when no count is given). Lines may be of any length, only the unread part of the buffer is kept.
+  - write(values...) appends the values as toString gives them to an IO_BUFFER_SIZE buffer, which is written out when it
+    fills, on flush(), on close(), and when the VM is freed. io.stderr isn't buffered. print and input write out
+    io.stdout first, so their output stays in order with it.
+  - A VM owns its files, which stay open until closed or the VM is freed. Their instances hold the file's index in
+    vm->files as 'id' (like workers), closed files keep their index.
+*/
+
+#define IO_BUFFER_SIZE (64 * 1024)
+
+void defineIOModule(VM* vm);
+// Writes out what io.stdout holds, before anything else is printed.
+void flushStandardOutput(VM* vm);
+// The next line of standard input (read through io.stdin's buffer), the empty string at the end of it.
+ObjString* readInputLine(VM* vm);
+// Writes out and closes every file the VM opened.
+void freeFiles(VM* vm);
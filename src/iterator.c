@@ -1,12 +1,13 @@
 #include "iterator.h"
 #include "natives.h"
+#include "range.h"
 #include <math.h>
 
 Value iteratorConstructorNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
 	ObjInstance* instance = AS_INSTANCE(*bound);
 
-	tableSet(vm, &instance->fields, vm->stringConstants[STR_INDEX], NUMBER_VAL(0));
-	tableSet(vm, &instance->fields, vm->stringConstants[STR_DATA], args[0]);
+	instanceSet(vm, instance, vm->stringConstants[STR_INDEX], NUMBER_VAL(0));
+	instanceSet(vm, instance, vm->stringConstants[STR_DATA], args[0]);
 
 	return OBJ_VAL(instance);
 }
@@ -19,14 +20,14 @@ static Value iteratorNextNative(VM* vm, Value* bound, uint8_t argCount, Value* a
 	ObjInstance* instance = AS_INSTANCE(*bound);
 
 	Value data;
-	if (!tableGet(&instance->fields, vm->stringConstants[STR_DATA], &data)) {
+	if (!instanceGet(instance, vm->stringConstants[STR_DATA], &data)) {
 		*hasError = true;
 		*exception = makeException(vm, "PropertyException", "Iterator object must have a 'data' field.");
 		return NULL_VAL;
 	}
 
 	Value indexVal;
-	if (!tableGet(&instance->fields, vm->stringConstants[STR_INDEX], &indexVal)) {
+	if (!instanceGet(instance, vm->stringConstants[STR_INDEX], &indexVal)) {
 		*hasError = true;
 		*exception = makeException(vm, "PropertyException", "Iterator object must have a 'index' field.");
 		return NULL_VAL;
@@ -72,16 +73,26 @@ static Value iteratorNextNative(VM* vm, Value* bound, uint8_t argCount, Value* a
 			returnValue = NULL_VAL;
 		}
 		else {
-			returnValue = OBJ_VAL(copyString(vm, &string->chars[index], 1));
+			returnValue = OBJ_VAL(CHAR_STRING(vm, string->chars[index]));
 		}
 	}
+	else if (IS_RANGE(data)) {
+		ObjRange* range = AS_RANGE(data);
+		size_t length = rangeLength(range);
+
+		if (indexSigned < 0) {
+			index = length - (-indexSigned);
+		}
+
+		returnValue = index >= length ? NULL_VAL : rangeGet(range, index);
+	}
 	else {
 		*hasError = true;
 		*exception = makeException(vm, "TypeException", "Iterator object's 'data' must be a string or a list.");
 		return NULL_VAL;
 	}
 
-	tableSet(vm, &instance->fields, vm->stringConstants[STR_INDEX], NUMBER_VAL(index + 1));
+	instanceSet(vm, instance, vm->stringConstants[STR_INDEX], NUMBER_VAL(index + 1));
 
 	return returnValue;
 }
@@ -90,14 +101,14 @@ static Value iteratorMoreNative(VM* vm, Value* bound, uint8_t argCount, Value* a
 	ObjInstance* instance = AS_INSTANCE(*bound);
 
 	Value data;
-	if (!tableGet(&instance->fields, vm->stringConstants[STR_DATA], &data)) {
+	if (!instanceGet(instance, vm->stringConstants[STR_DATA], &data)) {
 		*hasError = true;
 		*exception = makeException(vm, "PropertyException", "Iterator object must have a 'data' field.");
 		return NULL_VAL;
 	}
 
 	Value indexVal;
-	if (!tableGet(&instance->fields, vm->stringConstants[STR_INDEX], &indexVal)) {
+	if (!instanceGet(instance, vm->stringConstants[STR_INDEX], &indexVal)) {
 		*hasError = true;
 		*exception = makeException(vm, "PropertyException", "Iterator object must have a 'index' field.");
 		return NULL_VAL;
@@ -133,6 +144,14 @@ static Value iteratorMoreNative(VM* vm, Value* bound, uint8_t argCount, Value* a
 		}
 		return BOOL_VAL(index < length);
 	}
+	else if (IS_RANGE(data)) {
+		size_t length = rangeLength(AS_RANGE(data));
+
+		if (indexSigned < 0) {
+			index = length - (-indexSigned);
+		}
+		return BOOL_VAL(index < length);
+	}
 
 	*hasError = true;
 	*exception = makeException(vm, "TypeException", "Iterator object's 'data' must be a string or a list.");
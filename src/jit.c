@@ -0,0 +1,1096 @@
+#include "jit.h"
+
+#ifdef JIT_SUPPORTED
+
+#include "optimizer.h"
+#include "leb128.h"
+#include "memory.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+  The code of a function is entered through its prologue, called as a JitFunction with the native address to start at.
+  - The prologue saves the callee-saved registers it uses, loads the ones below and jumps to the start, the epilogue
+    writes the stack top back and returns the ip in rax. Each instruction's exit loads its ip and jumps to the epilogue.
+  - Instructions follow in the order of the chunk, so falling through from one to the next is falling through in the
+    chunk. Jumps between instructions and to exits are patched once the whole chunk has been emitted.
+  - Values stay in the VM's stack and the frame's slots, rax, rcx, rdx, rsi, rdi and xmm0 to xmm3 are only used within
+    an instruction.
+*/
+
+typedef uint8_t* (*JitFunction)(VM* vm, CallFrame* frame, uint8_t* start);
+
+enum {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum {
+	XMM0, XMM1, XMM2, XMM3
+};
+
+// Condition codes, a jump on the opposite condition is the code with the low bit flipped.
+enum {
+	CC_B = 0x2,
+	CC_AE = 0x3,
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_BE = 0x6,
+	CC_A = 0x7,
+	CC_P = 0xa,
+	CC_NP = 0xb,
+	CC_NS = 0x9,
+	CC_ALWAYS = -1
+};
+
+// Held for the whole of the code: the frame's slots, vm->stackTop, the VM and the frame, and QNAN with NaN boxing.
+#define SLOTS RBX
+#define TOP R12
+#define VM_REG R13
+#define FRAME R14
+#define QNAN_REG R15
+
+#define VALUE_SIZE ((int32_t)sizeof(Value))
+#define VALUE_SHIFT (sizeof(Value) == 16 ? 4 : 3)
+// The displacement from TOP of the value distance below the top of the stack.
+#define PEEK(distance) (-VALUE_SIZE * ((distance) + 1))
+
+#ifdef DRAGON_NAN_BOXING
+#define PAYLOAD 0
+#define OBJ_MASK (SIGN_BIT | QNAN)
+// A number has some of the bits of QNAN clear.
+#define NOT_NUMBER CC_E
+#else
+#define PAYLOAD ((int32_t)offsetof(Value, number))
+#define NOT_NUMBER CC_NE
+#endif
+
+typedef struct {
+	// Where a rel32 displacement is, the instruction (or the exit of the instruction) at target in the chunk it jumps to.
+	size_t at;
+	size_t target;
+	bool exit;
+} Patch;
+
+typedef struct {
+	Chunk* chunk;
+	JitCode* jit;
+	uint8_t* code;
+	size_t count;
+	size_t capacity;
+	Patch* patches;
+	size_t patchCount;
+	size_t patchCapacity;
+	size_t epilogue;
+	// The offset being compiled, which guards exit at.
+	size_t offset;
+	bool failed;
+} Assembler;
+
+/*
+  Helpers called from the code, with pointers to the values on the stack. None of them allocate.
+*/
+
+static bool isFalseyAt(Value* value) {
+	return isFalsey(*value);
+}
+
+static bool valuesEqualAt(Value* values) {
+	return valuesEqual(values[0], values[1]);
+}
+
+static uint8_t* switchEntry(JitCode* jit, SwitchTable* table, Value* value) {
+	return jit->code + (jit->entries[switchTarget(table, *value)] & ~JIT_EXITS);
+}
+
+static void writeBarrier(VM* vm, Obj* owner, Value* value) {
+	WRITE_BARRIER(vm, owner, *value);
+}
+
+/*
+  Encoding
+*/
+
+static void emitByte(Assembler* a, uint8_t byte) {
+	if (a->count == a->capacity) {
+		size_t capacity = a->capacity < 256 ? 256 : a->capacity * 2;
+		uint8_t* code = realloc(a->code, capacity);
+		if (code == NULL) {
+			a->failed = true;
+			a->count = 0;
+			return;
+		}
+		a->code = code;
+		a->capacity = capacity;
+	}
+	a->code[a->count++] = byte;
+}
+
+static void emitInt32(Assembler* a, int32_t value) {
+	uint32_t bits = (uint32_t)value;
+	for (int i = 0; i < 4; i++) emitByte(a, (uint8_t)(bits >> (8 * i)));
+}
+
+static void emitInt64(Assembler* a, uint64_t value) {
+	for (int i = 0; i < 8; i++) emitByte(a, (uint8_t)(value >> (8 * i)));
+}
+
+// A mandatory prefix (0 for none), a REX prefix when one is needed and the opcode, of size bytes.
+static void emitOpcode(Assembler* a, uint8_t prefix, bool wide, int reg, int rm, uint32_t opcode, int size) {
+	if (prefix != 0) emitByte(a, prefix);
+	uint8_t rex = (uint8_t)(0x40 | (wide ? 8 : 0) | (reg & 8 ? 4 : 0) | (rm & 8 ? 1 : 0));
+	if (rex != 0x40) emitByte(a, rex);
+	for (int i = size - 1; i >= 0; i--) emitByte(a, (uint8_t)(opcode >> (8 * i)));
+}
+
+// An instruction on reg (or an opcode extension) and [base + disp].
+static void emitMem(Assembler* a, uint8_t prefix, bool wide, uint32_t opcode, int size, int reg, int base, int32_t disp) {
+	emitOpcode(a, prefix, wide, reg, base, opcode, size);
+	int mod = disp == 0 && (base & 7) != RBP ? 0 : disp >= -128 && disp <= 127 ? 1 : 2;
+	emitByte(a, (uint8_t)(mod << 6 | (reg & 7) << 3 | (base & 7)));
+	if ((base & 7) == RSP) emitByte(a, 0x24);
+	if (mod == 1) emitByte(a, (uint8_t)(int8_t)disp);
+	else if (mod == 2) emitInt32(a, disp);
+}
+
+// An instruction on two registers, reg (or an opcode extension) and rm.
+static void emitRegs(Assembler* a, uint8_t prefix, bool wide, uint32_t opcode, int size, int reg, int rm) {
+	emitOpcode(a, prefix, wide, reg, rm, opcode, size);
+	emitByte(a, (uint8_t)(0xc0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+static void load(Assembler* a, int reg, int base, int32_t disp) {
+	emitMem(a, 0, true, 0x8b, 1, reg, base, disp);
+}
+
+static void store(Assembler* a, int base, int32_t disp, int reg) {
+	emitMem(a, 0, true, 0x89, 1, reg, base, disp);
+}
+
+static void lea(Assembler* a, int reg, int base, int32_t disp) {
+	emitMem(a, 0, true, 0x8d, 1, reg, base, disp);
+}
+
+static void moveTop(Assembler* a, int32_t values) {
+	if (values != 0) lea(a, TOP, TOP, values * VALUE_SIZE);
+}
+
+static void moveImmediate(Assembler* a, int reg, uint64_t value) {
+	if (value <= UINT32_MAX) {
+		emitOpcode(a, 0, false, 0, reg, 0xb8 + (reg & 7), 1);
+		emitInt32(a, (int32_t)(uint32_t)value);
+	}
+	else {
+		emitOpcode(a, 0, true, 0, reg, 0xb8 + (reg & 7), 1);
+		emitInt64(a, value);
+	}
+}
+
+static void moveRegister(Assembler* a, int dest, int source) {
+	emitRegs(a, 0, true, 0x89, 1, source, dest);
+}
+
+static void storeInt32(Assembler* a, int base, int32_t disp, int32_t value) {
+	emitMem(a, 0, false, 0xc7, 1, 0, base, disp);
+	emitInt32(a, value);
+}
+
+// Compares the 32 bits at [base + disp] to a value below 128.
+static void compareInt32(Assembler* a, int base, int32_t disp, uint8_t value) {
+	emitMem(a, 0, false, 0x83, 1, 7, base, disp);
+	emitByte(a, value);
+}
+
+static void compareByte(Assembler* a, int base, int32_t disp, uint8_t value) {
+	emitMem(a, 0, false, 0x80, 1, 7, base, disp);
+	emitByte(a, value);
+}
+
+static void compareRegisters(Assembler* a, int left, int right) {
+	emitRegs(a, 0, true, 0x39, 1, right, left);
+}
+
+static void andRegisters(Assembler* a, int dest, int source) {
+	emitRegs(a, 0, true, 0x21, 1, source, dest);
+}
+
+static void xorRegisters(Assembler* a, int dest, int source) {
+	emitRegs(a, 0, true, 0x31, 1, source, dest);
+}
+
+static void addRegisters(Assembler* a, int dest, int source) {
+	emitRegs(a, 0, true, 0x01, 1, source, dest);
+}
+
+static void testRegisters(Assembler* a, int left, int right) {
+	emitRegs(a, 0, true, 0x85, 1, right, left);
+}
+
+static void shiftLeft(Assembler* a, int reg, uint8_t count) {
+	emitRegs(a, 0, true, 0xc1, 1, 4, reg);
+	emitByte(a, count);
+}
+
+// al = the condition.
+static void setCondition(Assembler* a, int cc) {
+	emitRegs(a, 0, false, 0x0f90 | (uint32_t)cc, 2, 0, RAX);
+}
+
+static void testAl(Assembler* a) {
+	emitByte(a, 0x84);
+	emitByte(a, 0xc0);
+}
+
+static void callFunction(Assembler* a, void* function) {
+	moveImmediate(a, RAX, (uint64_t)(uintptr_t)function);
+	emitRegs(a, 0, false, 0xff, 1, 2, RAX);
+}
+
+static void loadDouble(Assembler* a, int xmm, int base, int32_t disp) {
+	emitMem(a, 0xf2, false, 0x0f10, 2, xmm, base, disp);
+}
+
+static void storeDouble(Assembler* a, int base, int32_t disp, int xmm) {
+	emitMem(a, 0xf2, false, 0x0f11, 2, xmm, base, disp);
+}
+
+// One of addsd (0x58), mulsd (0x59), subsd (0x5c) and divsd (0x5e) with a memory operand.
+static void arithmetic(Assembler* a, uint8_t opcode, int xmm, int base, int32_t disp) {
+	emitMem(a, 0xf2, false, 0x0f00 | opcode, 2, xmm, base, disp);
+}
+
+static void compareDoubles(Assembler* a, int xmm, int base, int32_t disp) {
+	emitMem(a, 0x66, false, 0x0f2e, 2, xmm, base, disp);
+}
+
+static void compareDoubleRegisters(Assembler* a, int left, int right) {
+	emitRegs(a, 0x66, false, 0x0f2e, 2, left, right);
+}
+
+static void loadDoubleConstant(Assembler* a, int xmm, double value) {
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	moveImmediate(a, RAX, bits);
+	emitRegs(a, 0x66, true, 0x0f6e, 2, xmm, RAX);
+}
+
+/*
+  Copies a value through rcx and rdi. The tag and payload are moved separately, the way they are stored, as loading
+  more than one store wrote stalls instead of forwarding the stored data.
+*/
+static void copyValue(Assembler* a, int destBase, int32_t destDisp, int sourceBase, int32_t sourceDisp) {
+#ifdef DRAGON_NAN_BOXING
+	load(a, RDI, sourceBase, sourceDisp);
+	store(a, destBase, destDisp, RDI);
+#else
+	emitMem(a, 0, false, 0x8b, 1, RCX, sourceBase, sourceDisp);
+	load(a, RDI, sourceBase, sourceDisp + PAYLOAD);
+	emitMem(a, 0, false, 0x89, 1, RCX, destBase, destDisp);
+	store(a, destBase, destDisp + PAYLOAD, RDI);
+#endif
+}
+
+static void storeNumber(Assembler* a, int base, int32_t disp, int xmm) {
+#ifndef DRAGON_NAN_BOXING
+	storeInt32(a, base, disp, VAL_NUMBER);
+#endif
+	storeDouble(a, base, disp + PAYLOAD, xmm);
+}
+
+static void storeConstant(Assembler* a, int base, int32_t disp, Value value) {
+#ifdef DRAGON_NAN_BOXING
+	moveImmediate(a, RAX, value);
+	store(a, base, disp, RAX);
+#else
+	uint64_t payload;
+	memcpy(&payload, (uint8_t*)&value + PAYLOAD, sizeof(payload));
+	storeInt32(a, base, disp, value.type);
+	moveImmediate(a, RAX, payload);
+	store(a, base, disp + PAYLOAD, RAX);
+#endif
+}
+
+// Stores al as a bool.
+static void storeBool(Assembler* a, int base, int32_t disp) {
+	emitRegs(a, 0, false, 0x0fb6, 2, RAX, RAX);
+#ifdef DRAGON_NAN_BOXING
+	moveImmediate(a, RCX, FALSE_VAL);
+	addRegisters(a, RAX, RCX);
+	store(a, base, disp, RAX);
+#else
+	storeInt32(a, base, disp, VAL_BOOL);
+	store(a, base, disp + PAYLOAD, RAX);
+#endif
+}
+
+/*
+  Jumps
+*/
+
+// Emits a jump whose displacement is filled in later, returning where it is.
+static size_t emitJump(Assembler* a, int cc) {
+	if (cc == CC_ALWAYS) {
+		emitByte(a, 0xe9);
+	}
+	else {
+		emitByte(a, 0x0f);
+		emitByte(a, (uint8_t)(0x80 | cc));
+	}
+	size_t at = a->count;
+	emitInt32(a, 0);
+	return at;
+}
+
+static void patchJump(Assembler* a, size_t at, size_t destination) {
+	if (a->failed) return;
+	int32_t displacement = (int32_t)((int64_t)destination - (int64_t)(at + 4));
+	memcpy(&a->code[at], &displacement, sizeof(displacement));
+}
+
+// Makes the jump at at land on the next instruction emitted.
+static void bindJump(Assembler* a, size_t at) {
+	patchJump(a, at, a->count);
+}
+
+static void addPatch(Assembler* a, size_t at, size_t target, bool exit) {
+	if (a->patchCount == a->patchCapacity) {
+		size_t capacity = a->patchCapacity < 16 ? 16 : a->patchCapacity * 2;
+		Patch* patches = realloc(a->patches, sizeof(Patch) * capacity);
+		if (patches == NULL) {
+			a->failed = true;
+			return;
+		}
+		a->patches = patches;
+		a->patchCapacity = capacity;
+	}
+	a->patches[a->patchCount++] = (Patch){ at, target, exit };
+}
+
+// A jump to the instruction at target in the chunk.
+static void jumpTo(Assembler* a, int cc, size_t target) {
+	addPatch(a, emitJump(a, cc), target, false);
+}
+
+// A jump to the exit of the instruction being compiled, which leaves it to the interpreter.
+static void exitIf(Assembler* a, int cc) {
+	addPatch(a, emitJump(a, cc), a->offset, true);
+}
+
+static void emitExit(Assembler* a, size_t offset) {
+	moveImmediate(a, RAX, (uint64_t)(uintptr_t)&a->chunk->code[offset]);
+	patchJump(a, emitJump(a, CC_ALWAYS), a->epilogue);
+}
+
+/*
+  Guards
+*/
+
+// Compares the value's tag, leaving NOT_NUMBER set when it isn't a number.
+static void testNumber(Assembler* a, int base, int32_t disp) {
+#ifdef DRAGON_NAN_BOXING
+	load(a, RAX, base, disp);
+	andRegisters(a, RAX, QNAN_REG);
+	compareRegisters(a, RAX, QNAN_REG);
+#else
+	compareInt32(a, base, disp, VAL_NUMBER);
+#endif
+}
+
+static void guardNumber(Assembler* a, int base, int32_t disp) {
+	testNumber(a, base, disp);
+	exitIf(a, NOT_NUMBER);
+}
+
+// Loads the object in the value into reg (not rax or rcx), returning a jump taken when it isn't an object.
+static size_t loadObject(Assembler* a, int reg, int base, int32_t disp) {
+#ifdef DRAGON_NAN_BOXING
+	load(a, reg, base, disp);
+	moveRegister(a, RCX, reg);
+	moveImmediate(a, RAX, OBJ_MASK);
+	andRegisters(a, RCX, RAX);
+	compareRegisters(a, RCX, RAX);
+	size_t notObject = emitJump(a, CC_NE);
+	moveImmediate(a, RAX, ~OBJ_MASK);
+	andRegisters(a, reg, RAX);
+	return notObject;
+#else
+	compareInt32(a, base, disp, VAL_OBJ);
+	size_t notObject = emitJump(a, CC_NE);
+	load(a, reg, base, disp + PAYLOAD);
+	return notObject;
+#endif
+}
+
+// Loads the list in the value into reg, exiting when it isn't one.
+static void guardList(Assembler* a, int reg, int base, int32_t disp) {
+	addPatch(a, loadObject(a, reg, base, disp), a->offset, true);
+	compareInt32(a, reg, (int32_t)offsetof(Obj, type), OBJ_LIST);
+	exitIf(a, CC_NE);
+}
+
+/*
+  Points rdx at the item of the list in rsi at the number index (already guarded), exiting when the index isn't an
+  integer or is out of bounds. Negative indices count from the end, as validateListIndex.
+*/
+static void listItem(Assembler* a, int32_t indexDisp) {
+	loadDouble(a, XMM0, TOP, indexDisp + PAYLOAD);
+	emitRegs(a, 0xf2, true, 0x0f2c, 2, RCX, XMM0);
+	emitRegs(a, 0xf2, true, 0x0f2a, 2, XMM1, RCX);
+	compareDoubleRegisters(a, XMM0, XMM1);
+	exitIf(a, CC_NE);
+	exitIf(a, CC_P);
+	load(a, RDX, RSI, (int32_t)(offsetof(ObjList, items) + offsetof(ValueArray, count)));
+	testRegisters(a, RCX, RCX);
+	size_t positive = emitJump(a, CC_NS);
+	addRegisters(a, RCX, RDX);
+	bindJump(a, positive);
+	compareRegisters(a, RCX, RDX);
+	exitIf(a, CC_AE);
+	load(a, RDX, RSI, (int32_t)(offsetof(ObjList, items) + offsetof(ValueArray, values)));
+	shiftLeft(a, RCX, VALUE_SHIFT);
+	addRegisters(a, RDX, RCX);
+}
+
+// al = isFalsey(value), bools are tested inline.
+static void falsey(Assembler* a, int base, int32_t disp) {
+#ifdef DRAGON_NAN_BOXING
+	load(a, RAX, base, disp);
+	moveRegister(a, RDX, RAX);
+	emitRegs(a, 0, true, 0x83, 1, 1, RDX);
+	emitByte(a, 1);
+	moveImmediate(a, RCX, TRUE_VAL);
+	compareRegisters(a, RDX, RCX);
+	size_t notBool = emitJump(a, CC_NE);
+	compareRegisters(a, RAX, RCX);
+	setCondition(a, CC_NE);
+#else
+	compareInt32(a, base, disp, VAL_BOOL);
+	size_t notBool = emitJump(a, CC_NE);
+	compareByte(a, base, disp + PAYLOAD, 0);
+	setCondition(a, CC_E);
+#endif
+	size_t done = emitJump(a, CC_ALWAYS);
+	bindJump(a, notBool);
+	lea(a, RDI, base, disp);
+	callFunction(a, (void*)isFalseyAt);
+	bindJump(a, done);
+}
+
+// Points rax at the slot of a global in the frame's module, exiting when it hasn't been defined.
+static void globalSlot(Assembler* a, int32_t disp) {
+	load(a, RAX, FRAME, (int32_t)offsetof(CallFrame, closure));
+	load(a, RAX, RAX, (int32_t)offsetof(ObjClosure, owner));
+	load(a, RAX, RAX, (int32_t)(offsetof(Module, slots) + offsetof(ValueArray, values)));
+#ifdef DRAGON_NAN_BOXING
+	load(a, RCX, RAX, disp);
+	moveImmediate(a, RDX, UNDEFINED_GLOBAL_VAL);
+	compareRegisters(a, RCX, RDX);
+	exitIf(a, CC_E);
+#else
+	compareInt32(a, RAX, disp, VAL_OBJ);
+	size_t defined = emitJump(a, CC_NE);
+	emitMem(a, 0, true, 0x83, 1, 7, RAX, disp + PAYLOAD);
+	emitByte(a, 0);
+	exitIf(a, CC_E);
+	bindJump(a, defined);
+#endif
+}
+
+// Loads the integer in the number (already guarded) into reg, exiting when it isn't one, as isInteger.
+static void loadInteger(Assembler* a, int reg, int32_t disp) {
+	loadDouble(a, XMM0, TOP, disp + PAYLOAD);
+	emitRegs(a, 0xf2, true, 0x0f2c, 2, reg, XMM0);
+	emitRegs(a, 0xf2, true, 0x0f2a, 2, XMM1, reg);
+	compareDoubleRegisters(a, XMM0, XMM1);
+	exitIf(a, CC_NE);
+	exitIf(a, CC_P);
+}
+
+/*
+  Finds the instance in rsi's shape among the entries of an inline cache, pointing rdx at the field's slot. Exits when
+  it isn't cached, or is cached as a method (get) or as adding the field (set), which the interpreter handles.
+*/
+static void cachedField(Assembler* a, InlineCache* cache, bool set) {
+	moveImmediate(a, R8, (uint64_t)(uintptr_t)cache);
+	load(a, RAX, RSI, (int32_t)offsetof(ObjInstance, shape));
+	size_t found[INLINE_CACHE_SIZE];
+	for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+		compareByte(a, R8, (int32_t)offsetof(InlineCache, count), (uint8_t)i);
+		exitIf(a, CC_BE);
+		lea(a, RDX, R8, (int32_t)(offsetof(InlineCache, entries) + i * sizeof(CacheEntry)));
+		emitMem(a, 0, true, 0x3b, 1, RAX, RDX, (int32_t)offsetof(CacheEntry, shape));
+		found[i] = emitJump(a, CC_E);
+	}
+	exitIf(a, CC_ALWAYS);
+	for (int i = 0; i < INLINE_CACHE_SIZE; i++) bindJump(a, found[i]);
+	emitMem(a, 0, true, 0x83, 1, 7, RDX, set ? (int32_t)offsetof(CacheEntry, next) : (int32_t)offsetof(CacheEntry, method));
+	emitByte(a, 0);
+	exitIf(a, CC_NE);
+	emitMem(a, 0, true, 0xff, 1, 0, R8, (int32_t)offsetof(InlineCache, hits));
+	load(a, RCX, RDX, (int32_t)offsetof(CacheEntry, slot));
+	shiftLeft(a, RCX, VALUE_SHIFT);
+	load(a, RDX, RSI, (int32_t)offsetof(ObjInstance, slots));
+	addRegisters(a, RDX, RCX);
+}
+
+// Loads the instance in the value into rsi, exiting when it isn't one.
+static void guardInstance(Assembler* a, int base, int32_t disp) {
+	addPatch(a, loadObject(a, RSI, base, disp), a->offset, true);
+	compareInt32(a, RSI, (int32_t)offsetof(Obj, type), OBJ_INSTANCE);
+	exitIf(a, CC_NE);
+}
+
+// Calls the write barrier for storing the value into the object in rsi (which it must be left in).
+static void writeBarrierFor(Assembler* a, int32_t disp) {
+	size_t notObject = loadObject(a, RDX, TOP, disp);
+	moveRegister(a, RDI, VM_REG);
+	lea(a, RDX, TOP, disp);
+	callFunction(a, (void*)writeBarrier);
+	bindJump(a, notObject);
+}
+
+/*
+  Instructions
+*/
+
+static size_t jumpTarget(uint8_t* ip, size_t offset) {
+	return offset + 3 + (size_t)((ip[1] << 8) | ip[2]);
+}
+
+// The condition a comparison of two numbers is true on, having compared them with the operands ordered by it.
+static int compareNumbers(Assembler* a, uint8_t op) {
+	guardNumber(a, TOP, PEEK(0));
+	guardNumber(a, TOP, PEEK(1));
+	// ucomisd sets CF for unordered operands, so only 'above' conditions are false for NaN as they should be.
+	bool swap = op == OP_LESS || op == OP_LESS_EQ || op == OP_LESS_JUMP_IF_FALSE;
+	loadDouble(a, XMM0, TOP, PEEK(swap ? 0 : 1) + PAYLOAD);
+	compareDoubles(a, XMM0, TOP, PEEK(swap ? 1 : 0) + PAYLOAD);
+	return op == OP_LESS_EQ || op == OP_GREATER_EQ ? CC_AE : CC_A;
+}
+
+// al = whether the two values on top of the stack are equal.
+static void compareEqual(Assembler* a) {
+	testNumber(a, TOP, PEEK(0));
+	size_t notNumber = emitJump(a, NOT_NUMBER);
+	testNumber(a, TOP, PEEK(1));
+	size_t otherNotNumber = emitJump(a, NOT_NUMBER);
+	loadDouble(a, XMM0, TOP, PEEK(1) + PAYLOAD);
+	compareDoubles(a, XMM0, TOP, PEEK(0) + PAYLOAD);
+	setCondition(a, CC_E);
+	emitRegs(a, 0, false, 0x0f90 | CC_NP, 2, 0, RCX);
+	emitByte(a, 0x20);
+	emitByte(a, 0xc8);
+	size_t done = emitJump(a, CC_ALWAYS);
+	bindJump(a, notNumber);
+	bindJump(a, otherNotNumber);
+	lea(a, RDI, TOP, PEEK(1));
+	callFunction(a, (void*)valuesEqualAt);
+	bindJump(a, done);
+}
+
+/*
+  A comparison followed by OP_JUMP_IF_FALSE jumps on the comparison's flags, skipping over the jump's own code, which is
+  still emitted as it may be jumped to or entered.
+*/
+static bool fusesJump(Assembler* a, size_t next) {
+	return next < a->chunk->count && a->chunk->code[next] == OP_JUMP_IF_FALSE;
+}
+
+static void fusedJump(Assembler* a, int falseCc, size_t next) {
+	moveTop(a, -2);
+	jumpTo(a, falseCc, jumpTarget(&a->chunk->code[next], next));
+	jumpTo(a, CC_ALWAYS, next + 3);
+}
+
+// Emits the instruction at offset, returning false if it's left to the interpreter.
+static bool compileInstruction(Assembler* a, ObjFunction* function, size_t offset, size_t next) {
+	Chunk* chunk = &function->chunk;
+	uint8_t* ip = &chunk->code[offset];
+	size_t index;
+
+	switch (*ip) {
+		case OP_CONSTANT:
+			readUleb128(ip + 1, &index);
+			storeConstant(a, TOP, 0, chunk->constants.values[index]);
+			moveTop(a, 1);
+			return true;
+		case OP_NULL: storeConstant(a, TOP, 0, NULL_VAL); moveTop(a, 1); return true;
+		case OP_TRUE: storeConstant(a, TOP, 0, BOOL_VAL(true)); moveTop(a, 1); return true;
+		case OP_FALSE: storeConstant(a, TOP, 0, BOOL_VAL(false)); moveTop(a, 1); return true;
+		case OP_POP: moveTop(a, -1); return true;
+		case OP_DUP:
+			copyValue(a, TOP, 0, TOP, PEEK(0));
+			moveTop(a, 1);
+			return true;
+		case OP_DUP_X2:
+			copyValue(a, TOP, 0, TOP, PEEK(1));
+			copyValue(a, TOP, VALUE_SIZE, TOP, PEEK(0));
+			moveTop(a, 2);
+			return true;
+		case OP_SWAP:
+			load(a, RAX, TOP, PEEK(1) + PAYLOAD);
+			load(a, RDX, TOP, PEEK(0) + PAYLOAD);
+#ifndef DRAGON_NAN_BOXING
+			emitMem(a, 0, false, 0x8b, 1, RCX, TOP, PEEK(0));
+			emitMem(a, 0, false, 0x8b, 1, RDI, TOP, PEEK(1));
+			emitMem(a, 0, false, 0x89, 1, RDI, TOP, PEEK(0));
+			emitMem(a, 0, false, 0x89, 1, RCX, TOP, PEEK(1));
+#endif
+			store(a, TOP, PEEK(0) + PAYLOAD, RAX);
+			store(a, TOP, PEEK(1) + PAYLOAD, RDX);
+			return true;
+
+		case OP_GET_LOCAL:
+			copyValue(a, TOP, 0, SLOTS, ip[1] * VALUE_SIZE);
+			moveTop(a, 1);
+			return true;
+		case OP_SET_LOCAL:
+			copyValue(a, SLOTS, ip[1] * VALUE_SIZE, TOP, PEEK(0));
+			return true;
+		case OP_SET_LOCAL_POP:
+			copyValue(a, SLOTS, ip[1] * VALUE_SIZE, TOP, PEEK(0));
+			moveTop(a, -1);
+			return true;
+		case OP_GET_LOCAL_GET_LOCAL:
+			copyValue(a, TOP, 0, SLOTS, ip[1] * VALUE_SIZE);
+			copyValue(a, TOP, VALUE_SIZE, SLOTS, ip[2] * VALUE_SIZE);
+			moveTop(a, 2);
+			return true;
+		case OP_GET_UPVALUE:
+			load(a, RAX, FRAME, (int32_t)offsetof(CallFrame, closure));
+			load(a, RAX, RAX, (int32_t)offsetof(ObjClosure, upvalues));
+			load(a, RAX, RAX, ip[1] * (int32_t)sizeof(ObjUpvalue*));
+			load(a, RAX, RAX, (int32_t)offsetof(ObjUpvalue, location));
+			copyValue(a, TOP, 0, RAX, 0);
+			moveTop(a, 1);
+			return true;
+
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_SET_GLOBAL_POP: {
+			readUleb128(ip + 1, &index);
+			if (index >= INT32_MAX / sizeof(Value)) return false;
+			int32_t disp = (int32_t)index * VALUE_SIZE;
+			globalSlot(a, disp);
+			if (*ip == OP_GET_GLOBAL) {
+				copyValue(a, TOP, 0, RAX, disp);
+				moveTop(a, 1);
+			}
+			else {
+				copyValue(a, RAX, disp, TOP, PEEK(0));
+				if (*ip == OP_SET_GLOBAL_POP) moveTop(a, -1);
+			}
+			return true;
+		}
+
+		case OP_ADD:
+		case OP_ADD_NUM:
+		case OP_SUB:
+		case OP_MUL:
+		case OP_DIV: {
+			static const uint8_t opcodes[] = { [OP_ADD] = 0x58, [OP_ADD_NUM] = 0x58, [OP_SUB] = 0x5c, [OP_MUL] = 0x59, [OP_DIV] = 0x5e };
+			guardNumber(a, TOP, PEEK(0));
+			guardNumber(a, TOP, PEEK(1));
+			loadDouble(a, XMM0, TOP, PEEK(1) + PAYLOAD);
+			arithmetic(a, opcodes[*ip], XMM0, TOP, PEEK(0) + PAYLOAD);
+			storeDouble(a, TOP, PEEK(1) + PAYLOAD, XMM0);
+			moveTop(a, -1);
+			return true;
+		}
+		case OP_ADD_CONSTANT: {
+			readUleb128(ip + 1, &index);
+			Value constant = chunk->constants.values[index];
+			if (!IS_NUMBER(constant)) return false;
+			guardNumber(a, TOP, PEEK(0));
+			loadDoubleConstant(a, XMM1, AS_NUMBER(constant));
+			loadDouble(a, XMM0, TOP, PEEK(0) + PAYLOAD);
+			emitRegs(a, 0xf2, false, 0x0f58, 2, XMM0, XMM1);
+			storeDouble(a, TOP, PEEK(0) + PAYLOAD, XMM0);
+			return true;
+		}
+		case OP_MOD:
+			guardNumber(a, TOP, PEEK(0));
+			guardNumber(a, TOP, PEEK(1));
+			loadDouble(a, XMM0, TOP, PEEK(1) + PAYLOAD);
+			loadDouble(a, XMM1, TOP, PEEK(0) + PAYLOAD);
+			callFunction(a, (void*)fmod);
+			storeDouble(a, TOP, PEEK(1) + PAYLOAD, XMM0);
+			moveTop(a, -1);
+			return true;
+		case OP_NEGATE:
+			guardNumber(a, TOP, PEEK(0));
+			load(a, RAX, TOP, PEEK(0) + PAYLOAD);
+			moveImmediate(a, RCX, (uint64_t)1 << 63);
+			xorRegisters(a, RAX, RCX);
+			store(a, TOP, PEEK(0) + PAYLOAD, RAX);
+			return true;
+
+		case OP_GREATER:
+		case OP_GREATER_EQ:
+		case OP_LESS:
+		case OP_LESS_EQ: {
+			int cc = compareNumbers(a, *ip);
+			if (fusesJump(a, next)) {
+				fusedJump(a, cc ^ 1, next);
+				return true;
+			}
+			setCondition(a, cc);
+			storeBool(a, TOP, PEEK(1));
+			moveTop(a, -1);
+			return true;
+		}
+		case OP_LESS_JUMP_IF_FALSE: {
+			int cc = compareNumbers(a, *ip);
+			moveTop(a, -2);
+			jumpTo(a, cc ^ 1, jumpTarget(ip, offset));
+			return true;
+		}
+		case OP_EQUAL:
+		case OP_NOT_EQUAL:
+			compareEqual(a);
+			if (fusesJump(a, next)) {
+				testAl(a);
+				fusedJump(a, *ip == OP_EQUAL ? CC_E : CC_NE, next);
+				return true;
+			}
+			if (*ip == OP_NOT_EQUAL) {
+				emitByte(a, 0x34);
+				emitByte(a, 1);
+			}
+			storeBool(a, TOP, PEEK(1));
+			moveTop(a, -1);
+			return true;
+		case OP_NOT:
+			lea(a, RDI, TOP, PEEK(0));
+			callFunction(a, (void*)isFalseyAt);
+			storeBool(a, TOP, PEEK(0));
+			return true;
+
+		case OP_JUMP:
+			jumpTo(a, CC_ALWAYS, jumpTarget(ip, offset));
+			return true;
+		case OP_JUMP_IF_FALSE:
+			moveTop(a, -1);
+			falsey(a, TOP, 0);
+			testAl(a);
+			jumpTo(a, CC_NE, jumpTarget(ip, offset));
+			return true;
+		case OP_JUMP_IF_FALSE_SC:
+			falsey(a, TOP, PEEK(0));
+			testAl(a);
+			jumpTo(a, CC_NE, jumpTarget(ip, offset));
+			return true;
+		case OP_LOOP:
+		case OP_POP_LOOP: {
+			size_t jump = (size_t)((ip[1] << 8) | ip[2]);
+			if (jump > offset + 3) return false;
+			compareByte(a, VM_REG, (int32_t)offsetof(VM, outOfMemory), 0);
+			exitIf(a, CC_NE);
+			if (*ip == OP_POP_LOOP) moveTop(a, -1);
+			jumpTo(a, CC_ALWAYS, offset + 3 - jump);
+			return true;
+		}
+		case OP_SWITCH: {
+			size_t table = (size_t)((ip[1] << 8) | ip[2]);
+			if (table >= chunk->switchCount) return false;
+			// A rope is flattened by the interpreter first.
+			size_t notObject = loadObject(a, RSI, TOP, PEEK(0));
+			compareInt32(a, RSI, (int32_t)offsetof(Obj, type), OBJ_ROPE);
+			exitIf(a, CC_E);
+			bindJump(a, notObject);
+			moveImmediate(a, RDI, (uint64_t)(uintptr_t)a->jit);
+			moveImmediate(a, RSI, (uint64_t)(uintptr_t)&chunk->switches[table]);
+			lea(a, RDX, TOP, PEEK(0));
+			callFunction(a, (void*)switchEntry);
+			emitRegs(a, 0, false, 0xff, 1, 4, RAX);
+			return true;
+		}
+
+		case OP_FOR_RANGE: {
+			loadDouble(a, XMM0, TOP, PEEK(2) + PAYLOAD);
+			loadDouble(a, XMM1, TOP, PEEK(1) + PAYLOAD);
+			loadDouble(a, XMM2, TOP, PEEK(0) + PAYLOAD);
+			emitRegs(a, 0x66, false, 0x0f57, 2, XMM3, XMM3);
+			compareDoubleRegisters(a, XMM2, XMM3);
+			size_t down = emitJump(a, CC_BE);
+			compareDoubleRegisters(a, XMM0, XMM1);
+			jumpTo(a, CC_A, jumpTarget(ip, offset));
+			size_t body = emitJump(a, CC_ALWAYS);
+			bindJump(a, down);
+			compareDoubleRegisters(a, XMM1, XMM0);
+			jumpTo(a, CC_A, jumpTarget(ip, offset));
+			bindJump(a, body);
+			emitRegs(a, 0xf2, false, 0x0f10, 2, XMM3, XMM0);
+			emitRegs(a, 0xf2, false, 0x0f58, 2, XMM3, XMM2);
+			storeDouble(a, TOP, PEEK(2) + PAYLOAD, XMM3);
+			storeNumber(a, TOP, 0, XMM0);
+			moveTop(a, 1);
+			return true;
+		}
+		case OP_ITER_NEXT: {
+			// Only lists are walked here, the position is null for iterator objects.
+			guardNumber(a, TOP, PEEK(1));
+			guardList(a, RSI, TOP, PEEK(0));
+			loadDouble(a, XMM0, TOP, PEEK(1) + PAYLOAD);
+			emitRegs(a, 0xf2, true, 0x0f2c, 2, RCX, XMM0);
+			load(a, RDX, RSI, (int32_t)(offsetof(ObjList, items) + offsetof(ValueArray, count)));
+			compareRegisters(a, RCX, RDX);
+			size_t done = emitJump(a, CC_AE);
+			load(a, RDX, RSI, (int32_t)(offsetof(ObjList, items) + offsetof(ValueArray, values)));
+			shiftLeft(a, RCX, VALUE_SHIFT);
+			addRegisters(a, RDX, RCX);
+			copyValue(a, TOP, 0, RDX, 0);
+			loadDoubleConstant(a, XMM1, 1);
+			emitRegs(a, 0xf2, false, 0x0f58, 2, XMM0, XMM1);
+			storeDouble(a, TOP, PEEK(1) + PAYLOAD, XMM0);
+			moveTop(a, 1);
+			jumpTo(a, CC_ALWAYS, jumpTarget(ip, offset));
+			bindJump(a, done);
+			storeConstant(a, TOP, 0, BOOL_VAL(false));
+			moveTop(a, 1);
+			return true;
+		}
+
+		case OP_GET_INDEX:
+		case OP_GET_INDEX_LIST:
+			guardList(a, RSI, TOP, PEEK(1));
+			guardNumber(a, TOP, PEEK(0));
+			listItem(a, PEEK(0));
+			copyValue(a, TOP, PEEK(1), RDX, 0);
+			moveTop(a, -1);
+			return true;
+		case OP_SET_INDEX:
+		case OP_SET_INDEX_LIST: {
+			guardList(a, RSI, TOP, PEEK(2));
+			guardNumber(a, TOP, PEEK(1));
+			listItem(a, PEEK(1));
+			copyValue(a, RDX, 0, TOP, PEEK(0));
+			writeBarrierFor(a, PEEK(0));
+			copyValue(a, TOP, PEEK(2), TOP, PEEK(0));
+			moveTop(a, -2);
+			return true;
+		}
+
+		case OP_GET_PROPERTY:
+		case OP_GET_LOCAL_GET_PROPERTY: {
+			// Fields of instances through the inline cache, anything else is left to the interpreter.
+			uint8_t* operands = ip + (*ip == OP_GET_PROPERTY ? 1 : 2);
+			operands += readUleb128(operands, &index);
+			readUleb128(operands, &index);
+			if (*ip == OP_GET_PROPERTY) guardInstance(a, TOP, PEEK(0));
+			else guardInstance(a, SLOTS, ip[1] * VALUE_SIZE);
+			cachedField(a, &chunk->caches[index], false);
+			if (*ip == OP_GET_PROPERTY) {
+				copyValue(a, TOP, PEEK(0), RDX, 0);
+			}
+			else {
+				copyValue(a, TOP, 0, RDX, 0);
+				moveTop(a, 1);
+			}
+			return true;
+		}
+		case OP_SET_PROPERTY:
+		case OP_SET_PROPERTY_KV:
+			readUleb128(ip + 1 + readUleb128(ip + 1, &index), &index);
+			guardInstance(a, TOP, PEEK(1));
+			cachedField(a, &chunk->caches[index], true);
+			copyValue(a, RDX, 0, TOP, PEEK(0));
+			writeBarrierFor(a, PEEK(0));
+			if (*ip == OP_SET_PROPERTY) copyValue(a, TOP, PEEK(1), TOP, PEEK(0));
+			moveTop(a, -1);
+			return true;
+
+		case OP_AND:
+		case OP_OR:
+		case OP_XOR:
+		case OP_LSH:
+		case OP_ASH:
+		case OP_RSH: {
+			guardNumber(a, TOP, PEEK(0));
+			guardNumber(a, TOP, PEEK(1));
+			loadInteger(a, RCX, PEEK(0));
+			loadInteger(a, RAX, PEEK(1));
+			switch (*ip) {
+				case OP_AND: andRegisters(a, RAX, RCX); break;
+				case OP_OR: emitRegs(a, 0, true, 0x09, 1, RCX, RAX); break;
+				case OP_XOR: xorRegisters(a, RAX, RCX); break;
+				default:
+					// Shifts by a count the hardware would mask are left to the interpreter.
+					emitRegs(a, 0, true, 0x83, 1, 7, RCX);
+					emitByte(a, 63);
+					exitIf(a, CC_A);
+					emitRegs(a, 0, true, 0xd3, 1, *ip == OP_LSH ? 4 : *ip == OP_ASH ? 7 : 5, RAX);
+					break;
+			}
+			emitRegs(a, 0xf2, true, 0x0f2a, 2, XMM0, RAX);
+			storeDouble(a, TOP, PEEK(1) + PAYLOAD, XMM0);
+			moveTop(a, -1);
+			return true;
+		}
+		case OP_BIT_NOT:
+			guardNumber(a, TOP, PEEK(0));
+			loadInteger(a, RAX, PEEK(0));
+			emitRegs(a, 0, true, 0xf7, 1, 2, RAX);
+			emitRegs(a, 0xf2, true, 0x0f2a, 2, XMM0, RAX);
+			storeDouble(a, TOP, PEEK(0) + PAYLOAD, XMM0);
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+// Whether every switch table's targets are instructions, as switchEntry expects.
+static bool switchTargetsValid(Chunk* chunk, uint32_t* entries) {
+	for (size_t i = 0; i < chunk->switchCount; i++) {
+		SwitchTable* table = &chunk->switches[i];
+		if (table->defaultTarget >= chunk->count || entries[table->defaultTarget] == 0) return false;
+		for (size_t j = 0; j < table->count; j++) {
+			size_t target = table->cases[j].target;
+			if (target >= chunk->count || entries[target] == 0) return false;
+		}
+	}
+	return true;
+}
+
+void compileJit(VM* vm, ObjFunction* function) {
+	(void)vm;
+	Chunk* chunk = &function->chunk;
+	if (chunk->count == 0 || chunk->count >= JIT_EXITS) return;
+
+	JitCode* jit = malloc(sizeof(JitCode));
+	uint32_t* entries = calloc(chunk->count, sizeof(uint32_t));
+	size_t* exits = calloc(chunk->count, sizeof(size_t));
+	if (jit == NULL || entries == NULL || exits == NULL) {
+		free(jit);
+		free(entries);
+		free(exits);
+		return;
+	}
+	jit->entries = entries;
+	jit->entryCount = chunk->count;
+
+	Assembler a;
+	a.chunk = chunk;
+	a.jit = jit;
+	a.code = NULL;
+	a.count = 0;
+	a.capacity = 0;
+	a.patches = NULL;
+	a.patchCount = 0;
+	a.patchCapacity = 0;
+	a.offset = 0;
+	a.failed = false;
+
+	// Prologue, called with the VM, the frame and where to start. Five pushes keep the stack aligned for calls.
+	static const int saved[] = { RBX, R12, R13, R14, R15 };
+	for (int i = 0; i < 5; i++) emitOpcode(&a, 0, false, 0, saved[i], 0x50 + (saved[i] & 7), 1);
+	moveRegister(&a, VM_REG, RDI);
+	moveRegister(&a, FRAME, RSI);
+	load(&a, SLOTS, FRAME, (int32_t)offsetof(CallFrame, slots));
+	load(&a, TOP, VM_REG, (int32_t)offsetof(VM, stackTop));
+#ifdef DRAGON_NAN_BOXING
+	moveImmediate(&a, QNAN_REG, QNAN);
+#endif
+	emitRegs(&a, 0, false, 0xff, 1, 4, RDX);
+
+	a.epilogue = a.count;
+	store(&a, VM_REG, (int32_t)offsetof(VM, stackTop), TOP);
+	for (int i = 4; i >= 0; i--) emitOpcode(&a, 0, false, 0, saved[i], 0x58 + (saved[i] & 7), 1);
+	emitByte(&a, 0xc3);
+
+	for (size_t offset = 0; offset < chunk->count && !a.failed;) {
+		size_t next = offset + instructionLength(chunk, offset);
+		if (next > chunk->count) {
+			a.failed = true;
+			break;
+		}
+		a.offset = offset;
+		entries[offset] = (uint32_t)a.count;
+		if (!compileInstruction(&a, function, offset, next)) {
+			entries[offset] |= JIT_EXITS;
+			emitExit(&a, offset);
+		}
+		offset = next;
+	}
+
+	for (size_t i = 0; i < a.patchCount && !a.failed; i++) {
+		Patch* patch = &a.patches[i];
+		if (patch->target >= chunk->count || entries[patch->target] == 0) {
+			a.failed = true;
+			break;
+		}
+		if (patch->exit) {
+			if (exits[patch->target] == 0) {
+				exits[patch->target] = a.count;
+				emitExit(&a, patch->target);
+			}
+			patchJump(&a, patch->at, exits[patch->target]);
+		}
+		else {
+			patchJump(&a, patch->at, entries[patch->target] & ~JIT_EXITS);
+		}
+	}
+	if (!a.failed && a.count >= JIT_EXITS) a.failed = true;
+	if (!a.failed && !switchTargetsValid(chunk, entries)) a.failed = true;
+
+	uint8_t* code = MAP_FAILED;
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t size = (a.count + pageSize - 1) / pageSize * pageSize;
+	if (!a.failed) code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code != MAP_FAILED) {
+		memcpy(code, a.code, a.count);
+		if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+			munmap(code, size);
+			code = MAP_FAILED;
+		}
+	}
+
+	free(a.code);
+	free(a.patches);
+	free(exits);
+	if (code == MAP_FAILED) {
+		free(entries);
+		free(jit);
+		return;
+	}
+	jit->code = code;
+	jit->size = size;
+	function->jit = jit;
+}
+
+void freeJit(JitCode* jit) {
+	munmap(jit->code, jit->size);
+	free(jit->entries);
+	free(jit);
+}
+
+uint8_t* runJit(VM* vm, CallFrame* frame, uint8_t* ip) {
+	ObjFunction* function = frame->closure->function;
+	JitCode* jit = function->jit;
+	JitFunction code;
+	memcpy(&code, &jit->code, sizeof(code));
+	return code(vm, frame, jit->code + jit->entries[ip - function->chunk.code]);
+}
+
+#else
+
+void compileJit(VM* vm, ObjFunction* function) {
+	(void)vm;
+	(void)function;
+}
+
+void freeJit(JitCode* jit) {
+	(void)jit;
+}
+
+uint8_t* runJit(VM* vm, CallFrame* frame, uint8_t* ip) {
+	(void)vm;
+	(void)frame;
+	return ip;
+}
+
+#endif
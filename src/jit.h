@@ -0,0 +1,59 @@
+#pragma once
+#include "common.h"
+#include "vm.h"
+#include "object.h"
+
+/*
+  A baseline JIT ('--jit'), translating the chunk of a hot function into x86-64 machine code an instruction at a time.
+  - Only built with DRAGON_JIT, on x86-64 with GCC or Clang outside of Windows (JIT_SUPPORTED), elsewhere every function
+    stays interpreted.
+  - A function is compiled once its calls and loop iterations reach JIT_THRESHOLD, counted in call and at OP_LOOP.
+  - The code keeps the VM's stack and the function's frame exactly as the interpreter would, operands are pushed and
+    popped in memory. Numbers (bitwise operators included), locals, globals, list indexing, comparisons, jumps, loops
+    and switches are done inline, as are fields found in the site's inline cache. Everything else (calls, returns,
+    methods, anything which allocates or throws) leaves the code for the interpreter, which runs that one instruction
+    and comes back into the code at the next (see op_jit in vm.c).
+  - An inline fast path whose guard fails (e.g. adding two strings, an index out of bounds) also leaves before it has
+    changed anything, so the interpreter runs the instruction as it always would, including raising its exception.
+  - As the code never allocates, calls into Dragon code or throws, no collection can happen while it runs and frames,
+    stack traces and exception handlers are never seen in a state the interpreter wouldn't leave them in. The only
+    helpers it calls are valuesEqual, isFalsey, switchTarget, fmod and the write barrier.
+  - Backward jumps check vm->outOfMemory, leaving for the interpreter to raise OutOfMemoryException at the OP_LOOP.
+  - The code is written to a buffer mapped writable, which is then made executable (and no longer writable).
+*/
+
+#if defined(DRAGON_JIT) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && !defined(_WIN32)
+#define JIT_SUPPORTED
+#endif
+
+#define JIT_THRESHOLD 1000
+
+// Set on an entry of an instruction the code leaves for the interpreter straight away.
+#define JIT_EXITS 0x80000000u
+
+struct JitCode {
+	uint8_t* code;
+	size_t size;
+	// The offset into code of each instruction of the chunk, by its offset in the chunk (0 for operand bytes).
+	uint32_t* entries;
+	size_t entryCount;
+};
+
+// Compiles function, which keeps jit NULL if it can't be (e.g. executable memory can't be mapped).
+void compileJit(VM* vm, ObjFunction* function);
+void freeJit(JitCode* jit);
+// Runs the code of the frame's function from ip, which must be an entry without JIT_EXITS. Returns the ip of the
+// instruction the interpreter has to run next, having written the stack top back to the VM.
+uint8_t* runJit(VM* vm, CallFrame* frame, uint8_t* ip);
+
+// Whether the code of function can be entered at ip.
+static inline bool jitEnters(ObjFunction* function, uint8_t* ip) {
+	uint32_t entry = function->jit->entries[ip - function->chunk.code];
+	return entry != 0 && (entry & JIT_EXITS) == 0;
+}
+
+// Counts a call of function or a loop iteration in it, compiling it when it becomes hot. Returns whether it has code.
+static inline bool countJit(VM* vm, ObjFunction* function) {
+	if (function->hotness < JIT_THRESHOLD && ++function->hotness == JIT_THRESHOLD) compileJit(vm, function);
+	return function->jit != NULL;
+}
@@ -31,6 +31,22 @@ size_t readUleb128(uint8_t* start, size_t* value) {
 	return count;
 }
 
+size_t encodeUleb128(uint8_t* dest, size_t value) {
+	size_t count = 0;
+
+	do {
+		uint8_t byte = value & 0x7f;
+		value >>= 7;
+
+		if (value != 0)
+			byte |= 0x80;
+
+		dest[count++] = byte;
+	} while (value != 0);
+
+	return count;
+}
+
 size_t writeUleb128(VM* vm, Chunk* chunk, size_t value, size_t line) {
 	size_t count = 0;
 
@@ -4,4 +4,6 @@
 
 size_t uleb128Size(size_t value);
 size_t readUleb128(uint8_t* start, size_t* value);
+// Writes value to dest, which must have room for uleb128Size(value) bytes.
+size_t encodeUleb128(uint8_t* dest, size_t value);
 size_t writeUleb128(VM* vm, Chunk* chunk, size_t value, size_t line);
\ No newline at end of file
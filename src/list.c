@@ -1,13 +1,49 @@
 #include "list.h"
 #include "natives.h"
 #include "iterator.h"
+#include "memory.h"
+#include "range.h"
+#include "rope.h"
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 /*
-  Utility functions for listSortNative
+  Utility functions for listSortNative and listSortByNative, a stable merge sort in the manner of timsort.
+  - Runs of minrun items are sorted by binary insertion, then merged bottom up. A merge copies its left run into one
+    scratch buffer allocated for the whole sort, and once either run has won MIN_GALLOP comparisons in a row it gallops,
+    finding how far that run keeps winning with an exponential search and moving that many items at once.
+  - Equal items are never reordered: an item from the right run only goes before one from the left run if it is less.
+  - Without a comparator, lists of only numbers or only strings are compared natively. sortBy sorts the indices of the
+    items by keys computed once per item, then puts the items in that order.
+  - Calling the comparator can run the GC, so in that case the scratch buffer is a list on the VM's stack.
 */
 
+#define MIN_GALLOP 7
+
+typedef enum {
+	SORT_NUMBERS,
+	SORT_STRINGS,
+	SORT_COMPARATOR
+} SortOrder;
+
+typedef struct {
+	VM* vm;
+	SortOrder order;
+	Value comparator;
+	// Set for sortBy, the items being sorted are then indices into keys.
+	Value* keys;
+	// The list being sorted, which the comparator must not resize.
+	ObjList* list;
+	Value* items;
+	size_t count;
+	Value* scratch;
+	// The list holding scratch when the comparator is called, for the write barrier, otherwise NULL.
+	ObjList* scratchOwner;
+	bool* hasError;
+	ObjInstance** exception;
+} Sorter;
+
 static size_t findMinrun(size_t n) {
 	size_t r = 0;
 	while(n >= 32) {
@@ -17,81 +53,217 @@ static size_t findMinrun(size_t n) {
 	return n + r;
 }
 
-static double compare(VM* vm, Value a, Value b, Value comparator, bool* hasError, ObjInstance** exception) {
+static int compareStrings(ObjString* a, ObjString* b) {
+	int result = memcmp(a->chars, b->chars, min(a->length, b->length));
+	if (result != 0) return result;
+	return a->length < b->length ? -1 : a->length > b->length ? 1 : 0;
+}
+
+static bool callComparator(Sorter* sorter, Value a, Value b) {
+	VM* vm = sorter->vm;
 	push(vm, a);
 	push(vm, b);
 
-	Value result = callDragonFromNative(vm, NULL, comparator, 2, hasError, exception);
-	if (*hasError) return 0;
+	Value result = callDragonFromNative(vm, NULL, sorter->comparator, 2, sorter->hasError, sorter->exception);
+	if (*sorter->hasError) return false;
+
+	if (sorter->list->items.values != sorter->items || sorter->list->items.count != sorter->count) {
+		// The items may have moved, so they are left as they are.
+		sorter->items = NULL;
+		*sorter->hasError = true;
+		*sorter->exception = makeException(vm, "IndexException", "List was modified during sort.");
+		return false;
+	}
 
 	if (!IS_NUMBER(result)) {
-		*hasError = true;
-		*exception = makeException(vm, "TypeException", "Expected comparator to return a number, in sort.");
-		return 0;
+		*sorter->hasError = true;
+		*sorter->exception = makeException(vm, "TypeException", "Expected comparator to return a number, in sort.");
+		return false;
 	}
 
-	return AS_NUMBER(result);
+	return AS_NUMBER(result) < 0;
 }
 
-static ObjList* insertionSort(VM* vm, ObjList* list, intmax_t left, intmax_t right, Value comparator, bool* hasError, ObjInstance** exception) {
-	ValueArray arr = list->items;
-	for (intmax_t i = left + 1; i <= right; i++) {
-		Value element = arr.values[i];
-		intmax_t j = i - 1;
+// Whether a sorts before b, always false once an error has been raised.
+static inline bool lessThan(Sorter* sorter, Value a, Value b) {
+	if (*sorter->hasError) return false;
+	if (sorter->keys != NULL) {
+		a = sorter->keys[(size_t)AS_NUMBER(a)];
+		b = sorter->keys[(size_t)AS_NUMBER(b)];
+	}
 
-		while (j >= left && compare(vm, element, arr.values[j], comparator, hasError, exception) < 0 ) {
-			arr.values[j + 1] = arr.values[j];
-			j--;
-		}
-		arr.values[j + 1] = element;
+	switch (sorter->order) {
+		case SORT_NUMBERS: return AS_NUMBER(a) < AS_NUMBER(b);
+		case SORT_STRINGS: return compareStrings(AS_STRING(a), AS_STRING(b)) < 0;
+		case SORT_COMPARATOR: return callComparator(sorter, a, b);
 	}
+	return false;
+}
+
+static void binaryInsertionSort(Sorter* sorter, size_t low, size_t high) {
+	Value* items = sorter->items;
+	for (size_t i = low + 1; i < high; i++) {
+		Value item = items[i];
+
+		// After every item it isn't less than, so equal items keep their order.
+		size_t left = low;
+		size_t right = i;
+		while (left < right) {
+			size_t middle = left + (right - left) / 2;
+			if (lessThan(sorter, item, items[middle])) right = middle;
+			else left = middle + 1;
+		}
+		if (*sorter->hasError) return;
 
-	return list;
+		memmove(&items[left + 1], &items[left], (i - left) * sizeof(Value));
+		items[left] = item;
+	}
 }
 
-static void merge(VM* vm, ObjList* list, size_t l, size_t m, size_t r, Value comparator, bool* hasError, ObjInstance** exception) {
-	ValueArray array = list->items;
-	size_t arrayLength1 = m - l + 1;
-	size_t arrayLength2 = r - m;
+// How many of the count sorted values at base key isn't less than, found by exponential then binary search.
+static size_t gallopRight(Sorter* sorter, Value key, Value* base, size_t count) {
+	size_t low = 0;
+	size_t high = count;
+	for (size_t step = 1; low + step - 1 < count; step *= 2) {
+		size_t probe = low + step - 1;
+		if (lessThan(sorter, key, base[probe])) {
+			high = probe;
+			break;
+		}
+		low = probe + 1;
+	}
 
-	ValueArray left;
-	ValueArray right;
-	initValueArray(&left);
-	initValueArray(&right);
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (lessThan(sorter, key, base[middle])) high = middle;
+		else low = middle + 1;
+	}
+	return low;
+}
 
-	for (size_t i = 0; i < arrayLength1; i++) {
-		writeValueArray(vm, &left, array.values[l + i]);
+// How many of the count sorted values at base are less than key.
+static size_t gallopLeft(Sorter* sorter, Value key, Value* base, size_t count) {
+	size_t low = 0;
+	size_t high = count;
+	for (size_t step = 1; low + step - 1 < count; step *= 2) {
+		size_t probe = low + step - 1;
+		if (!lessThan(sorter, base[probe], key)) {
+			high = probe;
+			break;
+		}
+		low = probe + 1;
+	}
+
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (!lessThan(sorter, base[middle], key)) high = middle;
+		else low = middle + 1;
 	}
-	for (size_t i = 0; i < arrayLength2; i++) {
-		writeValueArray(vm, &right, array.values[m + 1 + i]);
+	return low;
+}
+
+// Merges the sorted runs [low, middle) and [middle, high).
+static void merge(Sorter* sorter, size_t low, size_t middle, size_t high) {
+	Value* items = sorter->items;
+	// Already in order, as when the list was nearly sorted.
+	if (!lessThan(sorter, items[middle], items[middle - 1])) return;
+	if (*sorter->hasError) return;
+
+	Value* scratch = sorter->scratch;
+	size_t leftCount = middle - low;
+	for (size_t i = 0; i < leftCount; i++) {
+		scratch[i] = items[low + i];
+		if (sorter->scratchOwner != NULL) WRITE_BARRIER(sorter->vm, sorter->scratchOwner, scratch[i]);
 	}
 
+	// The left run is taken from scratch[i] and the right from items[j], the gap at items[k] is always as long as what is
+	// left of the left run.
 	size_t i = 0;
-	size_t j = 0;
-	size_t k = l;
+	size_t j = middle;
+	size_t k = low;
+	while (i < leftCount && j < high) {
+		size_t leftWins = 0;
+		size_t rightWins = 0;
+		while (i < leftCount && j < high && leftWins < MIN_GALLOP && rightWins < MIN_GALLOP) {
+			if (lessThan(sorter, items[j], scratch[i])) {
+				items[k++] = items[j++];
+				rightWins++;
+				leftWins = 0;
+			}
+			else {
+				items[k++] = scratch[i++];
+				leftWins++;
+				rightWins = 0;
+			}
+			if (*sorter->hasError) goto done;
+		}
 
-	while (j < arrayLength2 && i < arrayLength1) {
-		if (compare(vm, left.values[i], right.values[j], comparator, hasError, exception) <= 0) {
-			array.values[k] = left.values[i];
-			i++;
+		while (i < leftCount && j < high) {
+			size_t leftRun = gallopRight(sorter, items[j], &scratch[i], leftCount - i);
+			if (*sorter->hasError) goto done;
+			memcpy(&items[k], &scratch[i], leftRun * sizeof(Value));
+			i += leftRun;
+			k += leftRun;
+			if (i == leftCount) break;
+			// The search stopped at a left item greater than items[j].
+			items[k++] = items[j++];
+			if (j == high) break;
+
+			size_t rightRun = gallopLeft(sorter, scratch[i], &items[j], high - j);
+			if (*sorter->hasError) goto done;
+			memmove(&items[k], &items[j], rightRun * sizeof(Value));
+			j += rightRun;
+			k += rightRun;
+			if (j == high) break;
+			// And this one at a right item scratch[i] isn't greater than.
+			items[k++] = scratch[i++];
+
+			if (leftRun < MIN_GALLOP && rightRun < MIN_GALLOP) break;
 		}
-		else {
-			array.values[k] = right.values[j];
-			j++;
+	}
+
+done:
+	// Whatever is left of the right run is already in place.
+	if (sorter->items != NULL) memcpy(&items[k], &scratch[i], (leftCount - i) * sizeof(Value));
+}
+
+static void sortItems(Sorter* sorter) {
+	size_t n = sorter->count;
+	size_t minrun = findMinrun(n);
+
+	for (size_t start = 0; start < n; start += minrun) {
+		binaryInsertionSort(sorter, start, min(start + minrun, n));
+		if (*sorter->hasError) return;
+	}
+
+	for (size_t size = minrun; size < n; size *= 2) {
+		for (size_t low = 0; low + size < n; low += 2 * size) {
+			merge(sorter, low, low + size, min(low + 2 * size, n));
+			if (*sorter->hasError) return;
 		}
-		k++;
 	}
+}
 
-	while (i < arrayLength1) {
-		array.values[k] = left.values[i];
-		k++;
-		i++;
+// Flattens any ropes among the count values of owner, then finds whether they can be sorted natively.
+static bool nativeOrder(VM* vm, Obj* owner, Value* values, size_t count, SortOrder* order, const char* method, bool* hasError, ObjInstance** exception) {
+	bool numbers = true;
+	bool strings = true;
+	for (size_t i = 0; i < count; i++) {
+		if (IS_ROPE(values[i])) {
+			values[i] = OBJ_VAL(flattenRope(vm, AS_ROPE(values[i])));
+			WRITE_BARRIER(vm, owner, values[i]);
+		}
+		numbers &= IS_NUMBER(values[i]);
+		strings &= IS_STRING(values[i]);
 	}
-	while (j < arrayLength2) {
-		array.values[k] = right.values[j];
-		k++;
-		j++;
+
+	if (!numbers && !strings) {
+		*hasError = true;
+		*exception = makeException(vm, "TypeException", "Expected only numbers or only strings to compare, in %s.", method);
+		return false;
 	}
+	*order = numbers ? SORT_NUMBERS : SORT_STRINGS;
+	return true;
 }
 
 /*
@@ -117,6 +289,7 @@ static Value listClearNative(VM* vm, Value* bound, uint8_t argCount, Value* args
 static Value listConcatNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
 	ObjList* listA = AS_LIST(*bound);
 
+	if (IS_RANGE(args[0])) rangeToList(vm, AS_RANGE(args[0]));
 	if (!IS_LIST(args[0])) {
 		*hasError = true;
 		*exception = makeException(vm, "TypeException", "Expected list as first argument in concat.");
@@ -153,6 +326,7 @@ static Value listEveryNative(VM* vm, Value* bound, uint8_t argCount, Value* args
 static Value listExtendNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
 	ObjList* listA = AS_LIST(*bound);
 
+	if (IS_RANGE(args[0])) rangeToList(vm, AS_RANGE(args[0]));
 	if (!IS_LIST(args[0])) {
 		*hasError = true;
 		*exception = makeException(vm, "TypeException", "Expected list as first argument in extend.");
@@ -163,36 +337,11 @@ static Value listExtendNative(VM* vm, Value* bound, uint8_t argCount, Value* arg
 
 	for (size_t i = 0; i < listB->items.count; i++) {
 		writeValueArray(vm, &listA->items, listB->items.values[i]);
+		WRITE_BARRIER(vm, listA, listB->items.values[i]);
 	}
 	return OBJ_VAL(listA);
 }
 
-static Value listFilterNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
-	ObjList* list = AS_LIST(*bound);
-
-	ValueArray array;
-	initValueArray(&array);
-
-	size_t added = 0;
-	for (size_t i = 0; i < list->items.count; i++) {
-		Value value = list->items.values[i];
-		push(vm, value);
-		push(vm, NUMBER_VAL((double)i));
-		push(vm, OBJ_VAL(list));
-		Value condition = callDragonFromNative(vm, NULL, args[0], 3, hasError, exception);
-		if (*hasError) return NULL_VAL;
-
-		if (!isFalsey(condition)) {
-			push(vm, value);
-			writeValueArray(vm, &array, value);
-			added++;
-		}
-	}
-	popN(vm, added);
-	ObjList* filteredList = newList(vm, array);
-	return OBJ_VAL(filteredList);
-}
-
 static Value listFillNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
 	ObjList* list = AS_LIST(*bound);
 
@@ -200,21 +349,10 @@ static Value listFillNative(VM* vm, Value* bound, uint8_t argCount, Value* args,
 	for (size_t i = 0; i < list->items.count; i++) {
 		list->items.values[i] = filler;
 	}
+	WRITE_BARRIER(vm, list, filler);
 	return OBJ_VAL(list);
 }
 
-static Value listForEachNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
-	ObjList* list = AS_LIST(*bound);
-	for (size_t i = 0; i < list->items.count; i++) {
-		push(vm, list->items.values[i]);
-		push(vm, NUMBER_VAL((double)i));
-		push(vm, OBJ_VAL(list));
-		callDragonFromNative(vm, NULL, args[0], 3, hasError, exception);
-		if (*hasError) break;
-	}
-	return NULL_VAL;
-}
-
 static Value listIndexOfNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
 	ObjList* list = AS_LIST(*bound);
 
@@ -247,26 +385,6 @@ static Value listLengthNative(VM* vm, Value* bound, uint8_t argCount, Value* arg
 	return NUMBER_VAL((double)AS_LIST(*bound)->items.count);
 }
 
-static Value listMapNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
-	ObjList* list = AS_LIST(*bound);
-
-	ValueArray array;
-	initValueArray(&array);
-
-	for (size_t i = 0; i < list->items.count; i++) {
-		push(vm, list->items.values[i]);
-		push(vm, NUMBER_VAL((double)i));
-		push(vm, OBJ_VAL(list));
-		Value mapped = callDragonFromNative(vm, NULL, args[0], 3, hasError, exception);
-		if (*hasError) return NULL_VAL;
-		push(vm, mapped);
-		writeValueArray(vm, &array, mapped);
-	}
-	popN(vm, list->items.count);
-	ObjList* mappedList = newList(vm, array);
-	return OBJ_VAL(mappedList);
-}
-
 static Value listOfLengthNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
 	ObjList* list = AS_LIST(*bound);
 
@@ -282,23 +400,30 @@ static Value listOfLengthNative(VM* vm, Value* bound, uint8_t argCount, Value* a
 		return NULL_VAL;
 	}
 
-	intmax_t size = (intmax_t)AS_NUMBER(args[0]);
-
-	if (size < 0) {
-		size = list->items.count + size;
-		size = max(0, size);
+	double length = AS_NUMBER(args[0]);
+	if (length < 0) length = max(0, (double)list->items.count + length);
+	// Checked before the conversion, which is undefined for lengths size_t can't hold.
+	if (length > (double)(SIZE_MAX / sizeof(Value))) {
+		*hasError = true;
+		*exception = makeException(vm, "OutOfMemoryException", "A list of %.17g items is too large.", length);
+		return NULL_VAL;
 	}
+	size_t size = (size_t)length;
 
 	ValueArray array;
 	initValueArray(&array);
-
-	for (intmax_t i = 0; i < size; i++) {
-		if (i < (intmax_t)list->items.count) {
-			writeValueArray(vm, &array, list->items.values[i]);
-		}
-		else {
-			writeValueArray(vm, &array, NULL_VAL);
+	if (size > 0) {
+		array.values = TRY_ALLOCATE(vm, Value, size);
+		if (array.values == NULL) {
+			*hasError = true;
+			*exception = makeException(vm, "OutOfMemoryException", "Not enough memory for a list of %zu items.", size);
+			return NULL_VAL;
 		}
+		array.capacity = size;
+		array.count = size;
+	}
+	for (size_t i = 0; i < size; i++) {
+		array.values[i] = i < list->items.count ? list->items.values[i] : NULL_VAL;
 	}
 
 	ObjList* ofLength = newList(vm, array);
@@ -313,29 +438,10 @@ static Value listPopNative(VM* vm, Value* bound, uint8_t argCount, Value* args,
 static Value listPushNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
 	ObjList* list = AS_LIST(*bound);
 	writeValueArray(vm, &list->items, args[0]);
+	WRITE_BARRIER(vm, list, args[0]);
 	return args[0];
 }
 
-static Value listReduceNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
-	ObjList* list = AS_LIST(*bound);
-
-	if (list->items.count == 0) return NULL_VAL;
-	if (list->items.count == 1) return list->items.values[0];
-
-	Value previousValue = list->items.values[0];
-
-	for (size_t i = 1; i < list->items.count; i++) {
-		push(vm, previousValue);
-		push(vm, list->items.values[i]); // currentValue
-		push(vm, NUMBER_VAL((double)i));
-		push(vm, OBJ_VAL(list));
-
-		previousValue = callDragonFromNative(vm, NULL, args[0], 4, hasError, exception);
-		if (*hasError) break;
-	}
-	return previousValue;
-}
-
 static Value listReverseNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
 	ObjList* list = AS_LIST(*bound);
 
@@ -349,35 +455,177 @@ static Value listReverseNative(VM* vm, Value* bound, uint8_t argCount, Value* ar
 	return OBJ_VAL(reversedList);
 }
 
-/*
-  Implements the 'timsort' algorithm
-*/
 static Value listSortNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
 	ObjList* list = AS_LIST(*bound);
 
-	Value comparator = args[0];
+	if (argCount > 1) {
+		*hasError = true;
+		*exception = makeException(vm, "ArityException", "Expected at most 1 argument(s) but got %u.", argCount);
+		return NULL_VAL;
+	}
 
 	size_t n = list->items.count;
+	if (n < 2) return OBJ_VAL(list);
+
+	Sorter sorter = { vm, SORT_COMPARATOR, NULL_VAL, NULL, list, NULL, n, NULL, NULL, hasError, exception };
+	if (argCount == 1) {
+		sorter.comparator = args[0];
+
+		ValueArray scratch;
+		initValueArray(&scratch);
+		scratch.values = ALLOCATE(vm, Value, n);
+		scratch.capacity = n;
+		scratch.count = n;
+		for (size_t i = 0; i < n; i++) scratch.values[i] = NULL_VAL;
+		sorter.scratchOwner = newList(vm, scratch);
+		push(vm, OBJ_VAL(sorter.scratchOwner)); // GC
+		sorter.scratch = scratch.values;
+
+		sorter.items = list->items.values;
+		sortItems(&sorter);
+		pop(vm);
+	}
+	else {
+		if (!nativeOrder(vm, (Obj*)list, list->items.values, n, &sorter.order, "sort", hasError, exception)) return NULL_VAL;
+
+		// Nothing is allocated while sorting, so the GC can't run.
+		sorter.scratch = ALLOCATE(vm, Value, n);
+		sorter.items = list->items.values;
+		sortItems(&sorter);
+		FREE_ARRAY(vm, Value, sorter.scratch, n);
+	}
 
-	size_t minrun = findMinrun(n);
+	if (*hasError) return NULL_VAL;
+	return OBJ_VAL(list);
+}
 
-	for (size_t start = 0; start < n; start += minrun) {
-		size_t end = min(start + minrun - 1, n - 1);
-		insertionSort(vm, list, start, end, comparator, hasError, exception);
+static Value listSortByNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjList* list = AS_LIST(*bound);
+
+	ValueArray keyArray;
+	initValueArray(&keyArray);
+	ObjList* keys = newList(vm, keyArray);
+	push(vm, OBJ_VAL(keys)); // GC
+
+	for (size_t i = 0; i < list->items.count; i++) {
+		push(vm, list->items.values[i]);
+		Value key = callDragonFromNative(vm, NULL, args[0], 1, hasError, exception);
+		if (*hasError) return NULL_VAL;
+		push(vm, key); // GC
+		writeValueArray(vm, &keys->items, key);
+		WRITE_BARRIER(vm, keys, key);
+		pop(vm);
 	}
 
-	size_t size = minrun;
+	size_t n = list->items.count;
+	if (keys->items.count != n) {
+		*hasError = true;
+		*exception = makeException(vm, "IndexException", "List was modified during sortBy.");
+		return NULL_VAL;
+	}
+
+	SortOrder order;
+	if (!nativeOrder(vm, (Obj*)keys, keys->items.values, n, &order, "sortBy", hasError, exception)) return NULL_VAL;
+
+	Value* indices = ALLOCATE(vm, Value, n);
+	Value* scratch = ALLOCATE(vm, Value, n);
+	for (size_t i = 0; i < n; i++) indices[i] = NUMBER_VAL((double)i);
+
+	Sorter sorter = { vm, order, NULL_VAL, keys->items.values, list, indices, n, scratch, NULL, hasError, exception };
+	sortItems(&sorter);
+
+	// The scratch buffer is free again to hold the items in their old order.
+	memcpy(scratch, list->items.values, n * sizeof(Value));
+	for (size_t i = 0; i < n; i++) list->items.values[i] = scratch[(size_t)AS_NUMBER(indices[i])];
+
+	FREE_ARRAY(vm, Value, indices, n);
+	FREE_ARRAY(vm, Value, scratch, n);
+	pop(vm);
+	return OBJ_VAL(list);
+}
+
+/*
+  map, filter, reduce and forEach (see list.h)
+*/
 
-	while (size < n) {
-		for (size_t left = 0; left < n; left += 2 * size) {
-			size_t mid = min(n - 1, left + size - 1);
-			size_t right = min((left + 2 * size - 1), n - 1);
-			merge(vm, list, left, mid, right, comparator, hasError, exception);
+#define STEP_LIST 0
+#define STEP_FUNCTION 1
+#define STEP_INDEX 2
+#define STEP_RESULT 3
+#define STEP_ITEM 4
+
+bool stepListMethod(VM* vm, ListStep step, Value* slots) {
+	ObjList* list = AS_LIST(slots[STEP_LIST]);
+
+	size_t index;
+	if (IS_NULL(slots[STEP_INDEX])) {
+		index = 0;
+		if (step == LIST_STEP_MAP || step == LIST_STEP_FILTER) {
+			ValueArray items;
+			initValueArray(&items);
+			slots[STEP_RESULT] = OBJ_VAL(newList(vm, items));
 		}
-		size *= 2;
+		else if (step == LIST_STEP_REDUCE && list->items.count > 0) {
+			slots[STEP_RESULT] = list->items.values[0];
+			index = 1;
+		}
+	}
+	else {
+		// The callback's result stays on the stack until it is stored, as appending it may collect.
+		Value result = peek(vm, 0);
+		index = (size_t)AS_NUMBER(slots[STEP_INDEX]) + 1;
+
+		switch (step) {
+			case LIST_STEP_FILTER:
+				if (isFalsey(result)) break;
+				result = slots[STEP_ITEM];
+				// Fallthrough, the item is kept.
+			case LIST_STEP_MAP: {
+				ObjList* results = AS_LIST(slots[STEP_RESULT]);
+				writeValueArray(vm, &results->items, result);
+				WRITE_BARRIER(vm, results, result);
+				break;
+			}
+			case LIST_STEP_REDUCE:
+				slots[STEP_RESULT] = result;
+				break;
+			case LIST_STEP_FOR_EACH:
+				break;
+		}
+		pop(vm);
 	}
 
-	return OBJ_VAL(list);
+	if (index >= list->items.count) {
+		push(vm, slots[STEP_RESULT]);
+		return false;
+	}
+
+	Value item = list->items.values[index];
+	slots[STEP_INDEX] = NUMBER_VAL((double)index);
+	slots[STEP_ITEM] = item;
+
+	push(vm, slots[STEP_FUNCTION]);
+	if (step == LIST_STEP_REDUCE) push(vm, slots[STEP_RESULT]);
+	push(vm, item);
+	push(vm, NUMBER_VAL((double)index));
+	push(vm, OBJ_VAL(list));
+	return true;
+}
+
+#undef STEP_LIST
+#undef STEP_FUNCTION
+#undef STEP_INDEX
+#undef STEP_RESULT
+#undef STEP_ITEM
+
+static void defineListStepMethod(VM* vm, const char* name, ListStep step) {
+	// The three nulls are the index, result and item slots.
+	uint8_t code[] = { OP_NULL, OP_NULL, OP_NULL, OP_LIST_STEP, (uint8_t)step, OP_RETURN };
+
+	push(vm, OBJ_VAL(newIntrinsic(vm, name, 1, code, sizeof(code))));
+	push(vm, OBJ_VAL(copyString(vm, name, strlen(name))));
+	tableSet(vm, &vm->listMethods, AS_STRING(peek(vm, 0)), peek(vm, 1));
+	popN(vm, 2);
 }
 
 void defineListMethods(VM* vm) {
@@ -386,18 +634,25 @@ void defineListMethods(VM* vm) {
 	defineNative(vm, &vm->listMethods, "concat", 1, false, listConcatNative);
 	defineNative(vm, &vm->listMethods, "every", 0, false, listEveryNative);
 	defineNative(vm, &vm->listMethods, "extend", 1, false, listExtendNative);
-	defineNative(vm, &vm->listMethods, "filter", 1, false, listFilterNative);
 	defineNative(vm, &vm->listMethods, "fill", 1, false, listFillNative);
-	defineNative(vm, &vm->listMethods, "forEach", 1, false, listForEachNative);
 	defineNative(vm, &vm->listMethods, "indexOf", 1, false, listIndexOfNative);
 	defineNative(vm, &vm->listMethods, "iterator", 0, false, listIteratorNative);
 	defineNative(vm, &vm->listMethods, "lastIndexOf", 1, false, listLastIndexOfNative);
 	defineNative(vm, &vm->listMethods, "length", 0, false, listLengthNative);
-	defineNative(vm, &vm->listMethods, "map", 1, false, listMapNative);
 	defineNative(vm, &vm->listMethods, "ofLength", 1, false, listOfLengthNative);
 	defineNative(vm, &vm->listMethods, "pop", 0, false, listPopNative);
 	defineNative(vm, &vm->listMethods, "push", 1, false, listPushNative);
-	defineNative(vm, &vm->listMethods, "reduce", 1, false, listReduceNative);
 	defineNative(vm, &vm->listMethods, "reverse", 0, false, listReverseNative);
-	defineNative(vm, &vm->listMethods, "sort", 1, false, listSortNative);
+	defineNative(vm, &vm->listMethods, "sort", 0, true, listSortNative);
+	defineNative(vm, &vm->listMethods, "sortBy", 1, false, listSortByNative);
+
+	keepRopeArguments(vm, &vm->listMethods, "fill");
+	keepRopeArguments(vm, &vm->listMethods, "indexOf");
+	keepRopeArguments(vm, &vm->listMethods, "lastIndexOf");
+	keepRopeArguments(vm, &vm->listMethods, "push");
+
+	defineListStepMethod(vm, "filter", LIST_STEP_FILTER);
+	defineListStepMethod(vm, "forEach", LIST_STEP_FOR_EACH);
+	defineListStepMethod(vm, "map", LIST_STEP_MAP);
+	defineListStepMethod(vm, "reduce", LIST_STEP_REDUCE);
 }
\ No newline at end of file
@@ -2,4 +2,28 @@
 #include "common.h"
 #include "vm.h"
 
-void defineListMethods(VM* vm);
\ No newline at end of file
+/*
+  The list methods which call a function per item (map, filter, reduce, forEach) aren't natives, which would run a nested
+  interpreter loop per call. Each is a method whose code is a single OP_LIST_STEP loop, run in the interpreter's loop like
+  any other method: the instruction calls the function for the next item and is resumed when it returns.
+  - The method's slots hold the list, the function, the index of the current item, the result built so far and the
+    current item (the slots are null until the first step).
+  - As with the natives they replace, the length is checked again after every call, and the function is passed the item,
+    its index and the list (after the result so far for reduce).
+*/
+typedef enum {
+	LIST_STEP_FILTER,
+	LIST_STEP_FOR_EACH,
+	LIST_STEP_MAP,
+	LIST_STEP_REDUCE
+} ListStep;
+
+// The number of arguments the function of the given method is called with.
+#define LIST_STEP_ARG_COUNT(step) ((step) == LIST_STEP_REDUCE ? 4 : 3)
+
+void defineListMethods(VM* vm);
+/*
+  Takes the result of the last call (if there was one) off the stack and moves on to the next item, returning true with
+  the function and its arguments pushed, or false with the method's result pushed once there are no items left.
+*/
+bool stepListMethod(VM* vm, ListStep step, Value* slots);
\ No newline at end of file
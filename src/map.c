@@ -0,0 +1,413 @@
+#include "map.h"
+#include "natives.h"
+#include "memory.h"
+#include "range.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAP_MIN_CAPACITY 8
+
+static uint32_t hashKey(Value key) {
+	uint32_t hash;
+	if (IS_NUMBER(key)) hash = isnan(AS_NUMBER(key)) ? 0x7ff80000u : hashNumber(AS_NUMBER(key));
+	else if (IS_STRING(key)) hash = stringHash(AS_STRING(key));
+	else if (IS_OBJ(key)) hash = hashBits((uint64_t)(uintptr_t)AS_OBJ(key));
+	else if (IS_BOOL(key)) hash = AS_BOOL(key) ? 0x9e3779b9u : 0x7f4a7c15u;
+	else hash = 0x85ebca6bu;
+	return hash == 0 ? 1 : hash;
+}
+
+static bool keysEqual(Value a, Value b) {
+	if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		double x = AS_NUMBER(a);
+		double y = AS_NUMBER(b);
+		return x == y || (isnan(x) && isnan(y));
+	}
+	if (IS_STRING(a) && IS_STRING(b)) {
+		ObjString* x = AS_STRING(a);
+		ObjString* y = AS_STRING(b);
+		return x == y || (x->length == y->length && memcmp(x->chars, y->chars, x->length) == 0);
+	}
+#ifdef DRAGON_NAN_BOXING
+	return a == b;
+#else
+	if (a.type != b.type) return false;
+	switch (a.type) {
+		case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
+		case VAL_NULL: return true;
+		case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+		default: return false;
+	}
+#endif
+}
+
+static MapEntry* findEntry(ObjMap* map, Value key, uint32_t hash) {
+	if (map->count == 0) return NULL;
+	size_t mask = map->indexCapacity - 1;
+	for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+		uint32_t index = map->index[slot];
+		if (index == MAP_EMPTY) return NULL;
+		MapEntry* entry = &map->entries[index];
+		if (entry->hash == hash && keysEqual(entry->key, key)) return entry;
+	}
+}
+
+// Slots of deleted entries aren't reused, they are dropped when the index is rebuilt after compacting the entries.
+static void indexEntry(ObjMap* map, uint32_t index) {
+	size_t mask = map->indexCapacity - 1;
+	size_t slot = map->entries[index].hash & mask;
+	while (map->index[slot] != MAP_EMPTY) slot = (slot + 1) & mask;
+	map->index[slot] = index;
+}
+
+// Replaces the map's index with the one given, indexing every entry into it.
+static void replaceIndex(VM* vm, ObjMap* map, uint32_t* index, size_t indexCapacity) {
+	FREE_ARRAY(vm, uint32_t, map->index, map->indexCapacity);
+	map->index = index;
+	map->indexCapacity = indexCapacity;
+	memset(map->index, 0xff, indexCapacity * sizeof(uint32_t));
+	for (size_t i = 0; i < map->entryCount; i++) indexEntry(map, (uint32_t)i);
+}
+
+static void rebuildIndex(VM* vm, ObjMap* map, size_t indexCapacity) {
+	replaceIndex(vm, map, ALLOCATE(vm, uint32_t, indexCapacity), indexCapacity);
+}
+
+// The index capacity for capacity entries, keeping the index at most half full.
+static size_t indexCapacityFor(ObjMap* map, size_t capacity) {
+	size_t indexCapacity = map->indexCapacity == 0 ? MAP_MIN_CAPACITY * 2 : map->indexCapacity;
+	while (indexCapacity < capacity * 2) indexCapacity *= 2;
+	return indexCapacity;
+}
+
+static void compactEntries(ObjMap* map) {
+	size_t count = 0;
+	for (size_t i = 0; i < map->entryCount; i++) {
+		if (map->entries[i].hash != 0) map->entries[count++] = map->entries[i];
+	}
+	map->entryCount = count;
+}
+
+void mapReserve(VM* vm, ObjMap* map, size_t capacity) {
+	if (capacity <= map->entryCapacity) return;
+	map->entries = GROW_ARRAY(vm, MapEntry, map->entries, map->entryCapacity, capacity);
+	map->entryCapacity = capacity;
+
+	size_t indexCapacity = indexCapacityFor(map, capacity);
+	if (indexCapacity != map->indexCapacity) rebuildIndex(vm, map, indexCapacity);
+}
+
+bool mapTryReserve(VM* vm, ObjMap* map, size_t capacity) {
+	if (capacity <= map->entryCapacity) return true;
+
+	// The index is allocated first, so the entries are only grown once it is certain to fit.
+	size_t indexCapacity = indexCapacityFor(map, capacity);
+	uint32_t* index = NULL;
+	if (indexCapacity != map->indexCapacity) {
+		index = TRY_ALLOCATE(vm, uint32_t, indexCapacity);
+		if (index == NULL) return false;
+	}
+	MapEntry* entries = TRY_GROW_ARRAY(vm, MapEntry, map->entries, map->entryCapacity, capacity);
+	if (entries == NULL) {
+		if (index != NULL) FREE_ARRAY(vm, uint32_t, index, indexCapacity);
+		return false;
+	}
+	map->entries = entries;
+	map->entryCapacity = capacity;
+	if (index != NULL) replaceIndex(vm, map, index, indexCapacity);
+	return true;
+}
+
+// Called when every entry is used, compacting the entries if enough of them are deleted and growing them otherwise.
+static void makeRoom(VM* vm, ObjMap* map) {
+	if (map->entryCount - map->count >= map->entryCount / 4 && map->entryCount > map->count) {
+		compactEntries(map);
+		rebuildIndex(vm, map, map->indexCapacity);
+		return;
+	}
+	mapReserve(vm, map, map->entryCapacity < MAP_MIN_CAPACITY ? MAP_MIN_CAPACITY : map->entryCapacity * 2);
+}
+
+bool mapGet(ObjMap* map, Value key, Value* value) {
+	MapEntry* entry = findEntry(map, key, hashKey(key));
+	if (entry == NULL) return false;
+	*value = entry->value;
+	return true;
+}
+
+bool mapSet(VM* vm, ObjMap* map, Value key, Value value) {
+	uint32_t hash = hashKey(key);
+	MapEntry* entry = findEntry(map, key, hash);
+	if (entry != NULL) {
+		entry->value = value;
+		WRITE_BARRIER(vm, map, value);
+		return false;
+	}
+
+	if (map->entryCount == map->entryCapacity) makeRoom(vm, map);
+	uint32_t index = (uint32_t)map->entryCount++;
+	map->entries[index] = (MapEntry){ key, value, hash };
+	map->count++;
+	indexEntry(map, index);
+	WRITE_BARRIER(vm, map, key);
+	WRITE_BARRIER(vm, map, value);
+	return true;
+}
+
+bool mapDelete(ObjMap* map, Value key) {
+	MapEntry* entry = findEntry(map, key, hashKey(key));
+	if (entry == NULL) return false;
+	*entry = (MapEntry){ NULL_VAL, NULL_VAL, 0 };
+	map->count--;
+	return true;
+}
+
+static void mapClear(ObjMap* map) {
+	map->count = 0;
+	map->entryCount = 0;
+	if (map->index != NULL) memset(map->index, 0xff, map->indexCapacity * sizeof(uint32_t));
+}
+
+static void appendChars(VM* vm, char** chars, size_t* length, size_t* capacity, const char* append, size_t appendLength) {
+	// The chars, "}" and the terminator.
+	if (*length + appendLength + 2 > *capacity) {
+		size_t newCapacity = max(*capacity * 2, *length + appendLength + 2);
+		*chars = GROW_ARRAY(vm, char, *chars, *capacity, newCapacity);
+		*capacity = newCapacity;
+	}
+	memcpy(*chars + *length, append, appendLength);
+	*length += appendLength;
+}
+
+// Keys and values are written as their repr, which can't fail (or run any of the script's code).
+ObjString* mapToString(VM* vm, ObjMap* map) {
+	bool isSet = map->obj.type == OBJ_SET;
+	size_t capacity = 64;
+	size_t length = 0;
+	char* chars = ALLOCATE(vm, char, capacity);
+	appendChars(vm, &chars, &length, &capacity, isSet ? "Set{" : "Map{", 4);
+
+	bool first = true;
+	for (size_t i = mapNextEntry(map, 0); i < map->entryCount; i = mapNextEntry(map, i + 1)) {
+		if (!first) appendChars(vm, &chars, &length, &capacity, ", ", 2);
+		first = false;
+		// Growing chars may collect, so each repr is kept on the stack while it is appended.
+		ObjString* key = valueToRepr(vm, map->entries[i].key);
+		push(vm, OBJ_VAL(key));
+		appendChars(vm, &chars, &length, &capacity, key->chars, key->length);
+		pop(vm);
+		if (isSet) continue;
+		appendChars(vm, &chars, &length, &capacity, ": ", 2);
+		ObjString* value = valueToRepr(vm, map->entries[i].value);
+		push(vm, OBJ_VAL(value));
+		appendChars(vm, &chars, &length, &capacity, value->chars, value->length);
+		pop(vm);
+	}
+	chars[length++] = '}';
+	chars[length] = '\0';
+
+	chars = GROW_ARRAY(vm, char, chars, capacity, length + 1);
+	return takeTransientString(vm, chars, length);
+}
+
+/*
+  Constructors
+*/
+
+static bool capacityArgument(VM* vm, Value value, const char* name, size_t* capacity, bool* hasError, ObjInstance** exception) {
+	if (!IS_NUMBER(value) || AS_NUMBER(value) < 0 || floor(AS_NUMBER(value)) != AS_NUMBER(value)) {
+		*hasError = true;
+		*exception = makeException(vm, "TypeException", "Expected a non-negative integer capacity in %s.", name);
+		return false;
+	}
+	if (AS_NUMBER(value) > MAP_MAX_CAPACITY) {
+		*hasError = true;
+		*exception = makeException(vm, "OutOfMemoryException", "%s of %g entries is too large.", name, AS_NUMBER(value));
+		return false;
+	}
+	*capacity = (size_t)AS_NUMBER(value);
+	return true;
+}
+
+static Value mapNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	if (argCount > 1) {
+		*hasError = true;
+		*exception = makeException(vm, "ArityException", "Expected at most 1 argument(s) but got %u.", argCount);
+		return NULL_VAL;
+	}
+	size_t capacity = 0;
+	if (argCount == 1 && !capacityArgument(vm, args[0], "Map", &capacity, hasError, exception)) return NULL_VAL;
+
+	ObjMap* map = newMap(vm, OBJ_MAP);
+	push(vm, OBJ_VAL(map)); // GC
+	if (!mapTryReserve(vm, map, capacity)) {
+		pop(vm);
+		*hasError = true;
+		*exception = makeException(vm, "OutOfMemoryException", "Not enough memory for a map of %zu entries.", capacity);
+		return NULL_VAL;
+	}
+	pop(vm);
+	return OBJ_VAL(map);
+}
+
+static Value setNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	if (argCount > 1) {
+		*hasError = true;
+		*exception = makeException(vm, "ArityException", "Expected at most 1 argument(s) but got %u.", argCount);
+		return NULL_VAL;
+	}
+
+	size_t capacity = 0;
+	Value source = argCount == 1 ? args[0] : NULL_VAL;
+	if (IS_LIST(source)) capacity = AS_LIST(source)->items.count;
+	else if (IS_RANGE(source)) capacity = rangeLength(AS_RANGE(source));
+	else if (IS_SET(source)) capacity = AS_MAP(source)->count;
+	else if (argCount == 1) {
+		if (!IS_NUMBER(source)) {
+			*hasError = true;
+			*exception = makeException(vm, "TypeException", "Expected a capacity, list, range or set in Set.");
+			return NULL_VAL;
+		}
+		if (!capacityArgument(vm, source, "Set", &capacity, hasError, exception)) return NULL_VAL;
+	}
+	if (capacity > MAP_MAX_CAPACITY) capacity = MAP_MAX_CAPACITY;
+
+	ObjMap* set = newMap(vm, OBJ_SET);
+	push(vm, OBJ_VAL(set)); // GC
+	if (!mapTryReserve(vm, set, capacity)) {
+		pop(vm);
+		*hasError = true;
+		*exception = makeException(vm, "OutOfMemoryException", "Not enough memory for a set of %zu entries.", capacity);
+		return NULL_VAL;
+	}
+	if (IS_LIST(source)) {
+		ObjList* list = AS_LIST(source);
+		for (size_t i = 0; i < list->items.count; i++) mapSet(vm, set, list->items.values[i], NULL_VAL);
+	}
+	else if (IS_RANGE(source)) {
+		ObjRange* range = AS_RANGE(source);
+		size_t length = rangeLength(range);
+		for (size_t i = 0; i < length; i++) mapSet(vm, set, rangeGet(range, i), NULL_VAL);
+	}
+	else if (IS_SET(source)) {
+		ObjMap* from = AS_MAP(source);
+		for (size_t i = mapNextEntry(from, 0); i < from->entryCount; i = mapNextEntry(from, i + 1)) {
+			mapSet(vm, set, from->entries[i].key, NULL_VAL);
+		}
+	}
+	pop(vm);
+	return OBJ_VAL(set);
+}
+
+/*
+  Methods, shared by maps and sets where they behave the same
+*/
+
+// A list of the keys or the values of the entries, or of both as [key, value] lists.
+static ObjList* entryList(VM* vm, ObjMap* map, bool keys, bool values) {
+	ValueArray items;
+	initValueArray(&items);
+	ObjList* list = newList(vm, items);
+	if (map->count == 0) return list;
+
+	push(vm, OBJ_VAL(list)); // GC
+	list->items.values = ALLOCATE(vm, Value, map->count);
+	list->items.capacity = map->count;
+	for (size_t i = mapNextEntry(map, 0); i < map->entryCount; i = mapNextEntry(map, i + 1)) {
+		MapEntry* entry = &map->entries[i];
+		Value item;
+		if (keys && values) {
+			ValueArray pair;
+			initValueArray(&pair);
+			pair.values = ALLOCATE(vm, Value, 2);
+			pair.capacity = 2;
+			pair.count = 2;
+			pair.values[0] = entry->key;
+			pair.values[1] = entry->value;
+			item = OBJ_VAL(newList(vm, pair));
+		}
+		else {
+			item = keys ? entry->key : entry->value;
+		}
+		list->items.values[list->items.count++] = item;
+		WRITE_BARRIER(vm, list, item);
+	}
+	pop(vm);
+	return list;
+}
+
+static Value mapClearNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	mapClear(AS_MAP(*bound));
+	return NULL_VAL;
+}
+
+static Value mapDeleteNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	return BOOL_VAL(mapDelete(AS_MAP(*bound), args[0]));
+}
+
+static Value mapHasNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	Value _;
+	return BOOL_VAL(mapGet(AS_MAP(*bound), args[0], &_));
+}
+
+static Value mapLengthNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	return NUMBER_VAL((double)AS_MAP(*bound)->count);
+}
+
+static Value mapEntriesNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	return OBJ_VAL(entryList(vm, AS_MAP(*bound), true, true));
+}
+
+static Value mapGetNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	if (argCount > 2) {
+		*hasError = true;
+		*exception = makeException(vm, "ArityException", "Expected at most 2 argument(s) but got %u.", argCount);
+		return NULL_VAL;
+	}
+	Value value;
+	if (mapGet(AS_MAP(*bound), args[0], &value)) return value;
+	return argCount == 2 ? args[1] : NULL_VAL;
+}
+
+static Value mapKeysNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	return OBJ_VAL(entryList(vm, AS_MAP(*bound), true, false));
+}
+
+static Value mapSetNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	mapSet(vm, AS_MAP(*bound), args[0], args[1]);
+	return *bound;
+}
+
+static Value mapValuesNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	return OBJ_VAL(entryList(vm, AS_MAP(*bound), false, true));
+}
+
+static Value setAddNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	mapSet(vm, AS_MAP(*bound), args[0], NULL_VAL);
+	return *bound;
+}
+
+void defineMapMethods(VM* vm) {
+	defineNative(vm, &vm->mapMethods, "clear", 0, false, mapClearNative);
+	defineNative(vm, &vm->mapMethods, "delete", 1, false, mapDeleteNative);
+	defineNative(vm, &vm->mapMethods, "entries", 0, false, mapEntriesNative);
+	defineNative(vm, &vm->mapMethods, "get", 1, true, mapGetNative);
+	defineNative(vm, &vm->mapMethods, "has", 1, false, mapHasNative);
+	defineNative(vm, &vm->mapMethods, "keys", 0, false, mapKeysNative);
+	defineNative(vm, &vm->mapMethods, "length", 0, false, mapLengthNative);
+	defineNative(vm, &vm->mapMethods, "set", 2, false, mapSetNative);
+	defineNative(vm, &vm->mapMethods, "values", 0, false, mapValuesNative);
+
+	defineNative(vm, &vm->setMethods, "add", 1, false, setAddNative);
+	defineNative(vm, &vm->setMethods, "clear", 0, false, mapClearNative);
+	defineNative(vm, &vm->setMethods, "delete", 1, false, mapDeleteNative);
+	defineNative(vm, &vm->setMethods, "has", 1, false, mapHasNative);
+	defineNative(vm, &vm->setMethods, "length", 0, false, mapLengthNative);
+	defineNative(vm, &vm->setMethods, "toList", 0, false, mapKeysNative);
+}
+
+void defineMapNatives(VM* vm, Module* mod) {
+	defineModuleNative(vm, mod, "Map", 0, true, mapNative);
+	defineModuleNative(vm, mod, "Set", 0, true, setNative);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include "common.h"
+#include "vm.h"
+
+/*
+  Map and Set, hash tables keyed by any value which keep their entries in insertion order.
+  - Map(capacity) and Set(capacity) make room for capacity entries up front, so loading that many never grows them.
+    Set(list) adds the items of a list, range or set.
+  - Numbers, bools, null and strings are keys by value (0 and -0 are the same key, as are all NaNs), anything else by
+    identity, so two lists with the same items are different keys.
+  - map[key] is the key's value or null, map[key] = value sets it. 'key in map' and 'value in set' test membership,
+    foreach loops over a map's keys or a set's values in insertion order.
+  - Deleted entries are left in place and compacted away when the map next runs out of room, if they are at least a
+    quarter of its entries. A foreach reaches the entries added while it loops unless adding one compacts the map.
+*/
+
+#define MAP_EMPTY UINT32_MAX
+#define MAP_MAX_CAPACITY (UINT32_MAX / 2)
+
+// key must not be a rope (nor the keys given to the functions below).
+bool mapGet(ObjMap* map, Value key, Value* value);
+// Returns whether key was added rather than having its value replaced.
+bool mapSet(VM* vm, ObjMap* map, Value key, Value value);
+bool mapDelete(ObjMap* map, Value key);
+// Makes room for capacity entries (at most MAP_MAX_CAPACITY).
+void mapReserve(VM* vm, ObjMap* map, size_t capacity);
+// As mapReserve, but returns false (leaving the map as it was) when the memory can't be had rather than exiting.
+bool mapTryReserve(VM* vm, ObjMap* map, size_t capacity);
+ObjString* mapToString(VM* vm, ObjMap* map);
+void defineMapMethods(VM* vm);
+void defineMapNatives(VM* vm, Module* mod);
+
+// The first entry from position on which wasn't deleted, entryCount if there is none.
+static inline size_t mapNextEntry(ObjMap* map, size_t position) {
+	while (position < map->entryCount && map->entries[position].hash == 0) position++;
+	return position;
+}
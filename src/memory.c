@@ -3,30 +3,140 @@
 #include "object.h"
 #include "table.h"
 #include "compiler.h"
+#include "rope.h"
+#include "typedarray.h"
+#include "profiler.h"
+#include "jit.h"
 #include <stdlib.h>
 #include <math.h>
-#ifdef DEBUG_LOG_GC
+#include <time.h>
 #include <stdio.h>
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef DEBUG_LOG_GC
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+/*
+  Generational mark-sweep collection.
+  - New objects are young, a minor collection runs once GC_NURSERY_SIZE bytes have been allocated since the last
+    collection. It traces from the roots and the remembered set without entering old objects, frees the unreached
+    young objects and promotes the rest, leaving the young generation empty.
+  - A major collection runs once the heap passes nextGC, tracing and sweeping both generations. Only major collections
+    run during compilation, as the compiler fills in its functions without write barriers.
+  - Objects aren't moved when promoted since native code holds raw pointers to them across allocations.
+
+  Incremental major collection ('--gc-incremental') runs the same mark-sweep in slices, one every GC_SLICE_BYTES
+  allocated, each doing at most vm->gcSliceBudget objects of work or running for vm->gcMaxPause seconds.
+  - Marking starts from the roots, stores into marked objects mark what they store (see WRITE_BARRIER_OBJ). Once no
+    gray objects remain, marking is finished in one step which marks the roots again (the stack, globals and the VM's
+    tables aren't behind a barrier) and promotes every young object, moving the whole heap to vm->sweepObjects.
+  - The intern table is then pruned of unmarked old strings, and the objects are swept back onto the old list.
+  - Minor collections don't run until the intern table is pruned, young objects are traced along with the old ones.
+    No slices run during compilation, a cycle is finished in one go if the heap grows past nextGC times the growth
+    factor before it completes.
+
+  Heap limits ('--gc-soft-limit', '--gc-hard-limit', or 'gc.configure'):
+  - After a major collection nextGC is the live heap times vm->gcGrowthFactor, at least vm->gcMinHeap. It is lowered
+    to the soft limit (leaving at least a nursery's worth of room), so collections run more often close to it.
+  - An allocation taking the heap past the hard limit first runs a full collection. If the heap is still over the limit
+    the allocation goes ahead, but vm->outOfMemory is set and OutOfMemoryException is raised at the next call or loop
+    iteration (see SAFEPOINT in vm.c), so no allocation site needs a way to fail. The limit isn't checked again until
+    then, so the exception itself can be made.
+  - The system running out of memory is handled the same way, retrying the allocation after a full collection and then
+    with vm->gcReserve freed, only exiting when the reserve is already spent. As the reserve is small, that is also where an allocation larger than
+    it, which the system refuses, ends up.
+  - Sizes taken from the script (typed array lengths, map and set capacities, list.ofLength) are allocated with
+    tryReallocate instead, leaving the native to raise OutOfMemoryException straight away when the memory can't be had.
+*/
+
+#ifndef GC_NURSERY_SIZE
+#define GC_NURSERY_SIZE (256 * 1024)
+#endif
+#ifndef GC_SLICE_BYTES
+#define GC_SLICE_BYTES (64 * 1024)
+#endif
 
 static void freeObject(VM* vm, Obj* object);
+static void collect(VM* vm, bool minor);
+static void startIncremental(VM* vm);
+static void incrementalStep(VM* vm);
+static void completeIncremental(VM* vm);
 
-void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
-
-	vm->bytesAllocated += max(0, (intmax_t)newSize - (intmax_t)oldSize);
+// Counts the allocation and runs any collection it makes due.
+static void trackAllocation(VM* vm, size_t oldSize, size_t newSize) {
+	vm->bytesAllocated += newSize - oldSize;
 
+	if (newSize < oldSize) vm->gcStats.freedBytes += oldSize - newSize;
 	if (newSize > oldSize) {
+		size_t growth = newSize - oldSize;
+		vm->nurseryBytes += growth;
+		vm->gcStats.allocatedBytes += growth;
+		if (vm->bytesAllocated > vm->gcStats.peakBytes) vm->gcStats.peakBytes = vm->bytesAllocated;
+		if (vm->profiler != NULL && vm->frameCount > 0) profileAllocation(vm, growth);
 #ifdef DEBUG_STRESS_GC
 		collectGarbage(vm);
 #endif
+		if (vm->shouldGC && vm->gcPhase != GC_PHASE_IDLE && vm->compiler == NULL) {
+			vm->gcDebt += growth;
+			if (vm->bytesAllocated > vm->nextGC * vm->gcGrowthFactor) {
+				completeIncremental(vm);
+			}
+			else if (vm->gcDebt > GC_SLICE_BYTES) {
+				incrementalStep(vm);
+			}
+		}
+
+		if (vm->shouldGC) {
+			if (vm->bytesAllocated > vm->nextGC && vm->gcPhase == GC_PHASE_IDLE) {
+				if (vm->gcIncremental && vm->compiler == NULL) {
+					startIncremental(vm);
+				}
+				else {
+					collect(vm, false);
+				}
+			}
+			else if (vm->nurseryBytes > GC_NURSERY_SIZE && vm->compiler == NULL &&
+				(vm->gcPhase == GC_PHASE_IDLE || vm->gcPhase == GC_PHASE_SWEEP)) {
+				collect(vm, true);
+			}
+
+			if (vm->gcHardLimit != 0 && vm->bytesAllocated > vm->gcHardLimit && !vm->outOfMemory) {
+				collectGarbage(vm);
+				if (vm->bytesAllocated > vm->gcHardLimit) vm->outOfMemory = true;
+			}
+		}
 	}
+}
 
-	if (vm->bytesAllocated > vm->nextGC && vm->shouldGC) {
-		collectGarbage(vm);
+// Runs a full collection before a failed allocation is retried, as the memory may only be held by garbage (where
+// collecting is allowed). Returns whether it ran.
+static bool collectForRetry(VM* vm) {
+	if (!vm->shouldGC) return false;
+	collectGarbage(vm);
+	return true;
+}
+
+// Lets the allocation which failed be retried, exiting if there is nothing left to free.
+static void allocationFailed(VM* vm) {
+	if (vm->gcReserve == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
 	}
+	free(vm->gcReserve);
+	vm->gcReserve = NULL;
+	vm->outOfMemory = true;
+}
+
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
+	trackAllocation(vm, oldSize, newSize);
 
 	if (newSize == 0) {
 		free(pointer);
@@ -34,15 +144,66 @@ void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
 	}
 
 	void* result = realloc(pointer, newSize);
-	// TODO Provide a clean error message
-	if (result == NULL) exit(1);
+	if (result == NULL && collectForRetry(vm)) result = realloc(pointer, newSize);
+	while (result == NULL) {
+		allocationFailed(vm);
+		result = realloc(pointer, newSize);
+	}
+	return result;
+}
+
+void* tryReallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
+	trackAllocation(vm, oldSize, newSize);
+
+	void* result = realloc(pointer, newSize);
+	if (result == NULL && collectForRetry(vm)) result = realloc(pointer, newSize);
+	if (result == NULL && newSize > oldSize) {
+		// Nothing was allocated after all.
+		size_t growth = newSize - oldSize;
+		vm->bytesAllocated -= growth;
+		vm->nurseryBytes = vm->nurseryBytes > growth ? vm->nurseryBytes - growth : 0;
+		vm->gcStats.allocatedBytes -= growth;
+	}
+	return result;
+}
 
+void* allocateObjectMemory(VM* vm, size_t size) {
+	trackAllocation(vm, 0, size);
+
+	void* result = poolAllocate(&vm->allocator, size);
+	if (result == NULL && collectForRetry(vm)) result = poolAllocate(&vm->allocator, size);
+	while (result == NULL) {
+		allocationFailed(vm);
+		result = poolAllocate(&vm->allocator, size);
+	}
 	return result;
 }
 
+void freeObjectMemory(VM* vm, void* pointer, size_t size) {
+	vm->bytesAllocated -= size;
+	vm->gcStats.freedBytes += size;
+	poolFree(&vm->allocator, pointer, size);
+}
+
+void rememberObject(VM* vm, Obj* object) {
+	if (object->isRemembered) return;
+	object->isRemembered = true;
+
+	if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+		vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+		vm->remembered = (Obj**)realloc(vm->remembered, sizeof(Obj*) * vm->rememberedCapacity);
+
+		if (vm->remembered == NULL) exit(1);
+	}
+
+	vm->remembered[vm->rememberedCount++] = object;
+}
+
 void markObject(VM* vm, Obj* object) {
 	if (object == NULL) return;
 	if (object->isMarked) return;
+	// Old objects are left unmarked by minor collections, the ones referencing young objects have been remembered.
+	if (object->isOld && vm->gcMinor) return;
 
 #ifdef DEBUG_LOG_GC
 	printf("%p mark ", (void*)object);
@@ -89,21 +250,35 @@ static void markRoots(VM* vm) {
 
 	while (mod != NULL) {
 		markTable(vm, &mod->globals);
+		markArray(vm, &mod->slots);
+		markTable(vm, &mod->exports);
 		mod = mod->next;
 	}
 
 	markTable(vm, &vm->listMethods);
 	markTable(vm, &vm->stringMethods);
+	markTable(vm, &vm->rangeMethods);
+	markTable(vm, &vm->typedArrayMethods);
+	markTable(vm, &vm->mapMethods);
+	markTable(vm, &vm->setMethods);
 	markTable(vm, &vm->importTable);
 	
-	for (size_t i = 0; i < STR_CONSTANT_COUNT; i++) {
-		markObject(vm, (Obj*)vm->stringConstants[i]);
+	if (vm->stringConstants != NULL) {
+		for (size_t i = 0; i < STR_CONSTANT_COUNT; i++) {
+			markObject(vm, (Obj*)vm->stringConstants[i]);
+		}
 	}
 
+	for (size_t i = 0; i < UINT8_COUNT; i++) markObject(vm, (Obj*)vm->charStrings[i]);
+
 	markObject(vm, (Obj*)vm->objectClass);
 	markObject(vm, (Obj*)vm->exceptionClass);
 	markObject(vm, (Obj*)vm->iteratorClass);
+	markObject(vm, (Obj*)vm->stringBuilderClass);
 	markObject(vm, (Obj*)vm->importClass);
+	markObject(vm, (Obj*)vm->workerClass);
+	markObject(vm, (Obj*)vm->fileClass);
+	if (vm->profiler != NULL) markProfiler(vm);
 	if(vm->compiler != NULL) markCompilerRoots(vm->compiler);
 }
 
@@ -123,15 +298,30 @@ static void blackenObject(VM* vm, Obj* object) {
 		case OBJ_CLASS: {
 			ObjClass* klass = (ObjClass*)object;
 			markObject(vm, (Obj*)klass->name);
+			markObject(vm, (Obj*)klass->rootShape);
 			markTable(vm, &klass->methods);
 			break;
 		}
 		case OBJ_INSTANCE: {
 			ObjInstance* instance = (ObjInstance*)object;
 			markObject(vm, (Obj*)instance->klass);
+			if (instance->shape != NULL) {
+				markObject(vm, (Obj*)instance->shape);
+				for (size_t i = 0; i < instance->shape->count; i++) {
+					markValue(vm, instance->slots[i]);
+				}
+			}
 			markTable(vm, &instance->fields);
 			break;
 		}
+		case OBJ_SHAPE: {
+			ObjShape* shape = (ObjShape*)object;
+			markObject(vm, (Obj*)shape->parent);
+			markObject(vm, (Obj*)shape->name);
+			markTable(vm, &shape->slots);
+			markTable(vm, &shape->transitions);
+			break;
+		}
 		case OBJ_CLOSURE: {
 			ObjClosure* closure = (ObjClosure*)object;
 			markObject(vm, (Obj*)closure->function);
@@ -148,13 +338,51 @@ static void blackenObject(VM* vm, Obj* object) {
 		case OBJ_FUNCTION: {
 			ObjFunction* function = (ObjFunction*)object;
 			markObject(vm, (Obj*)function->name);
+			markObject(vm, (Obj*)function->sharedClosure);
 			markArray(vm, &function->chunk.constants);
+			for (size_t i = 0; i < function->chunk.switchCount; i++) {
+				SwitchTable* table = &function->chunk.switches[i];
+				if (table->dense) continue;
+				for (size_t j = 0; j < table->count; j++) markValue(vm, table->cases[j].key);
+			}
+			for (size_t i = 0; i < function->chunk.cacheCount; i++) {
+				InlineCache* cache = &function->chunk.caches[i];
+				for (uint8_t j = 0; j < cache->count; j++) {
+					markObject(vm, (Obj*)cache->entries[j].shape);
+					markObject(vm, (Obj*)cache->entries[j].next);
+					markObject(vm, (Obj*)cache->entries[j].method);
+				}
+			}
 			break;
 		}
 		case OBJ_UPVALUE:
 			markValue(vm, ((ObjUpvalue*)object)->closed);
 			break;
+		case OBJ_ROPE:
+			markObject(vm, (Obj*)((ObjRope*)object)->parent);
+			markObject(vm, (Obj*)((ObjRope*)object)->flat);
+			break;
+		case OBJ_TRACE: {
+			ObjTrace* trace = (ObjTrace*)object;
+			markObject(vm, (Obj*)trace->className);
+			markObject(vm, (Obj*)trace->message);
+			for (size_t i = 0; i < trace->count; i++) markObject(vm, (Obj*)trace->frames[i].function);
+			break;
+		}
+		case OBJ_TYPED_ARRAY:
+			markObject(vm, (Obj*)((ObjTypedArray*)object)->parent);
+			break;
+		case OBJ_MAP:
+		case OBJ_SET: {
+			ObjMap* map = (ObjMap*)object;
+			for (size_t i = 0; i < map->entryCount; i++) {
+				markValue(vm, map->entries[i].key);
+				markValue(vm, map->entries[i].value);
+			}
+			break;
+		}
 		case OBJ_NATIVE:
+		case OBJ_RANGE:
 		case OBJ_STRING:
 			break;
 	}
@@ -167,6 +395,16 @@ static void traceReferences(VM* vm) {
 	}
 }
 
+// Traces the remembered objects' references, and empties the set since every young object is promoted afterwards.
+static void markRemembered(VM* vm, bool minor) {
+	for (size_t i = 0; i < vm->rememberedCount; i++) {
+		Obj* object = vm->remembered[i];
+		object->isRemembered = false;
+		if (minor) blackenObject(vm, object);
+	}
+	vm->rememberedCount = 0;
+}
+
 static void sweep(VM* vm) {
 	Obj* previous = NULL;
 	Obj* object = vm->objects;
@@ -191,22 +429,70 @@ static void sweep(VM* vm) {
 	}
 }
 
-void collectGarbage(VM* vm) {
+/*
+  Frees the unmarked young objects and moves the rest to the old generation.
+  - Minor collections drop the freed strings from the intern table here, rather than scanning the whole table.
+*/
+static void sweepYoung(VM* vm, bool minor) {
+	Obj* object = vm->youngObjects;
+	while (object != NULL) {
+		Obj* next = object->next;
+		if (object->isMarked) {
+			object->isMarked = false;
+			object->isOld = true;
+			object->next = vm->objects;
+			vm->objects = object;
+		}
+		else {
+			if (minor && object->type == OBJ_STRING && ((ObjString*)object)->isInterned) {
+				tableDelete(&vm->strings, (ObjString*)object);
+			}
+			freeObject(vm, object);
+		}
+		object = next;
+	}
+	vm->youngObjects = NULL;
+}
+
+static void collect(VM* vm, bool minor) {
 #ifdef DEBUG_LOG_GC
-	printf("-- gc begin\n");
+	printf("-- %s gc begin\n", minor ? "minor" : "major");
 	size_t before = vm->bytesAllocated;
 #endif
+	clock_t start = clock();
 
 	vm->shouldGC = false;
+	vm->gcMinor = minor;
 
 	markRoots(vm);
+	markRemembered(vm, minor);
 	traceReferences(vm);
-	tableRemoveWhite(&vm->strings);
-	sweep(vm);
+	if (!minor) {
+		tableRemoveWhite(&vm->strings);
+		sweep(vm);
+	}
+	sweepYoung(vm, minor);
 
+	vm->gcMinor = false;
 	vm->shouldGC = true;
+	vm->nurseryBytes = 0;
 
-	vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+	if (!minor) {
+		updateHeapTarget(vm);
+	}
+
+	double pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+	GCStats* stats = &vm->gcStats;
+	if (minor) {
+		stats->minorCount++;
+		stats->minorSeconds += pause;
+		stats->maxMinorPause = max(stats->maxMinorPause, pause);
+	}
+	else {
+		stats->majorCount++;
+		stats->majorSeconds += pause;
+		stats->maxMajorPause = max(stats->maxMajorPause, pause);
+	}
 
 #ifdef DEBUG_LOG_GC
 	printf("-- gc end\n");
@@ -214,6 +500,152 @@ void collectGarbage(VM* vm) {
 #endif
 }
 
+static void startIncremental(VM* vm) {
+	vm->shouldGC = false;
+	vm->gcPhase = GC_PHASE_MARK;
+	vm->gcDebt = 0;
+	vm->gcStats.incrementalCount++;
+	markRoots(vm);
+	vm->shouldGC = true;
+}
+
+static bool sliceOver(size_t work, size_t budget, clock_t deadline) {
+	if (work >= budget) return true;
+	// Reading the clock is more expensive than blackening or sweeping most objects.
+	return deadline != 0 && (work & 63) == 63 && clock() > deadline;
+}
+
+// Blackens gray objects until none are left (returning true) or the slice is over.
+static bool traceSome(VM* vm, size_t budget, clock_t deadline) {
+	for (size_t work = 0; vm->grayCount > 0; work++) {
+		if (sliceOver(work, budget, deadline)) return false;
+		Obj* object = vm->grayStack[--vm->grayCount];
+		blackenObject(vm, object);
+	}
+	return true;
+}
+
+// Ends marking with every reachable object marked, then hands the whole heap to the sweep.
+static void finishMarking(VM* vm) {
+	markRoots(vm);
+	traceReferences(vm);
+	markRemembered(vm, false);
+
+	// The young objects are swept as old ones, so the unmarked strings among them are pruned from the intern table.
+	Obj* object = vm->youngObjects;
+	while (object != NULL) {
+		Obj* next = object->next;
+		object->isOld = true;
+		object->next = vm->objects;
+		vm->objects = object;
+		object = next;
+	}
+	vm->youngObjects = NULL;
+	vm->nurseryBytes = 0;
+
+	vm->sweepObjects = vm->objects;
+	vm->objects = NULL;
+	vm->gcStringIndex = 0;
+	vm->gcStringRehashes = vm->strings.rehashes;
+	vm->gcPhase = GC_PHASE_SWEEP_STRINGS;
+}
+
+// Prunes dead strings from the intern table until it is done (returning true) or the slice is over.
+static bool sweepStrings(VM* vm, size_t budget) {
+	Table* strings = &vm->strings;
+	// Rehashing the table (to grow it or clear deleted slots) moves entries behind the index.
+	if (strings->rehashes != vm->gcStringRehashes) {
+		vm->gcStringIndex = 0;
+		vm->gcStringRehashes = strings->rehashes;
+	}
+
+	// Checking an entry is much cheaper than sweeping an object.
+	vm->gcStringIndex = tableRemoveWhiteOld(strings, vm->gcStringIndex, budget * 16);
+	if (vm->gcStringIndex < strings->capacity) return false;
+
+	vm->gcPhase = GC_PHASE_SWEEP;
+	return true;
+}
+
+// Sweeps objects until none are left (returning true) or the slice is over.
+static bool sweepSome(VM* vm, size_t budget, clock_t deadline) {
+	for (size_t work = 0; vm->sweepObjects != NULL; work++) {
+		if (sliceOver(work, budget, deadline)) return false;
+		Obj* object = vm->sweepObjects;
+		vm->sweepObjects = object->next;
+		if (object->isMarked) {
+			object->isMarked = false;
+			object->next = vm->objects;
+			vm->objects = object;
+		}
+		else {
+			freeObject(vm, object);
+		}
+	}
+
+	vm->gcPhase = GC_PHASE_IDLE;
+	updateHeapTarget(vm);
+	return true;
+}
+
+static void incrementalStep(VM* vm) {
+	clock_t start = clock();
+	clock_t deadline = start + (clock_t)(vm->gcMaxPause * CLOCKS_PER_SEC);
+	vm->shouldGC = false;
+	vm->gcDebt = 0;
+
+	if (vm->gcPhase == GC_PHASE_MARK) {
+		if (traceSome(vm, vm->gcSliceBudget, deadline)) finishMarking(vm);
+	}
+	else if (vm->gcPhase == GC_PHASE_SWEEP_STRINGS) {
+		sweepStrings(vm, vm->gcSliceBudget);
+	}
+	else {
+		sweepSome(vm, vm->gcSliceBudget, deadline);
+	}
+
+	vm->shouldGC = true;
+
+	double pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+	GCStats* stats = &vm->gcStats;
+	stats->sliceCount++;
+	stats->sliceSeconds += pause;
+	stats->maxSlicePause = max(stats->maxSlicePause, pause);
+}
+
+// Runs the rest of the incremental collection in progress, if any, without pausing.
+static void completeIncremental(VM* vm) {
+	if (vm->gcPhase == GC_PHASE_IDLE) return;
+	clock_t start = clock();
+	vm->shouldGC = false;
+
+	if (vm->gcPhase == GC_PHASE_MARK) finishMarking(vm);
+	if (vm->gcPhase == GC_PHASE_SWEEP_STRINGS) sweepStrings(vm, SIZE_MAX / 16);
+	sweepSome(vm, SIZE_MAX, 0);
+
+	vm->shouldGC = true;
+
+	double pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+	GCStats* stats = &vm->gcStats;
+	stats->sliceCount++;
+	stats->sliceSeconds += pause;
+	stats->maxSlicePause = max(stats->maxSlicePause, pause);
+}
+
+void collectGarbage(VM* vm) {
+	completeIncremental(vm);
+	collect(vm, false);
+}
+
+void updateHeapTarget(VM* vm) {
+	size_t target = (size_t)((double)vm->bytesAllocated * vm->gcGrowthFactor);
+	if (target < vm->gcMinHeap) target = vm->gcMinHeap;
+	if (vm->gcSoftLimit != 0 && target > vm->gcSoftLimit) {
+		target = max(vm->gcSoftLimit, vm->bytesAllocated + GC_NURSERY_SIZE);
+	}
+	vm->nextGC = target;
+}
+
 static void freeObject(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
 	printf("%p free type %d\n", (void*)object, object->type);
@@ -221,62 +653,157 @@ static void freeObject(VM* vm, Obj* object) {
 
 	switch (object->type) {
 		case OBJ_BOUND_METHOD:
-			FREE(vm, ObjBoundMethod, object);
+			FREE_OBJ(vm, ObjBoundMethod, object);
 			break;
 		case OBJ_CLASS: {
 			ObjClass* klass = (ObjClass*)object;
 			freeTable(vm, &klass->methods);
-			FREE(vm, ObjClass, object);
+			FREE_OBJ(vm, ObjClass, object);
 			break;
 		}
 		case OBJ_INSTANCE: {
 			ObjInstance* instance = (ObjInstance*)object;
+			FREE_ARRAY(vm, Value, instance->slots, instance->slotCapacity);
 			freeTable(vm, &instance->fields);
-			FREE(vm, ObjInstance, object);
+			FREE_OBJ(vm, ObjInstance, object);
+			break;
+		}
+		case OBJ_SHAPE: {
+			ObjShape* shape = (ObjShape*)object;
+			freeTable(vm, &shape->slots);
+			freeTable(vm, &shape->transitions);
+			FREE_OBJ(vm, ObjShape, object);
 			break;
 		}
 		case OBJ_CLOSURE: {
 			ObjClosure* closure = (ObjClosure*)object;
 			FREE_ARRAY(vm, ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-			FREE(vm, ObjClosure, object);
+			FREE_OBJ(vm, ObjClosure, object);
 			break;
 		}
 		case OBJ_UPVALUE: {
-			FREE(vm, ObjUpvalue, object);
+			FREE_OBJ(vm, ObjUpvalue, object);
 			break;
 		}
 		case OBJ_LIST: {
 			ObjList* list = (ObjList*)object;
 			freeValueArray(vm, &list->items);
-			FREE(vm, ObjList, object);
+			FREE_OBJ(vm, ObjList, object);
 			break;
 		}
 		case OBJ_FUNCTION: {
 			ObjFunction* function = (ObjFunction*)object;
+			if (function->jit != NULL) freeJit(function->jit);
 			freeChunk(vm, &function->chunk);
-			FREE(vm, ObjFunction, object);
+			FREE_OBJ(vm, ObjFunction, object);
 			break;
 		}
 		case OBJ_NATIVE:
-			FREE(vm, ObjNative, object);
+			FREE_OBJ(vm, ObjNative, object);
+			break;
+		case OBJ_RANGE:
+			freeObjectMemory(vm, object, max(sizeof(ObjRange), sizeof(ObjList)));
+			break;
+		case OBJ_ROPE:
+			if (((ObjRope*)object)->buffer != NULL) releaseRopeBuffer(vm, ((ObjRope*)object)->buffer);
+			FREE_OBJ(vm, ObjRope, object);
+			break;
+		case OBJ_TYPED_ARRAY: {
+			ObjTypedArray* array = (ObjTypedArray*)object;
+			// Views share their parent's elements.
+			if (array->parent == NULL) FREE_ARRAY(vm, uint8_t, array->data, array->length * arrayElementSize[array->kind]);
+			FREE_OBJ(vm, ObjTypedArray, object);
+			break;
+		}
+		case OBJ_MAP:
+		case OBJ_SET: {
+			ObjMap* map = (ObjMap*)object;
+			FREE_ARRAY(vm, MapEntry, map->entries, map->entryCapacity);
+			FREE_ARRAY(vm, uint32_t, map->index, map->indexCapacity);
+			FREE_OBJ(vm, ObjMap, object);
+			break;
+		}
+		case OBJ_TRACE:
+			FREE_ARRAY(vm, TraceFrame, ((ObjTrace*)object)->frames, ((ObjTrace*)object)->count);
+			FREE_OBJ(vm, ObjTrace, object);
 			break;
 		case OBJ_STRING: {
 			ObjString* string = (ObjString*)object;
-			FREE_ARRAY(vm, char, string->chars, string->length + 1);
-			FREE(vm, ObjString, object);
+			if (string->chars == (char*)(string + 1)) {
+				freeObjectMemory(vm, string, sizeof(ObjString) + string->length + 1);
+			}
+			else {
+				FREE_ARRAY(vm, char, string->chars, string->length + 1);
+				FREE_OBJ(vm, ObjString, object);
+			}
 			break;
 		}
 	}
 }
 
-void freeObjects(VM* vm) {
-	vm->shouldGC = false;
-	Obj* object = vm->objects;
+static void freeObjectList(VM* vm, Obj* object) {
 	while (object != NULL) {
 		Obj* next = object->next;
 		freeObject(vm, object);
 		object = next;
 	}
+}
+
+void freeObjects(VM* vm) {
+	vm->shouldGC = false;
+	freeObjectList(vm, vm->objects);
+	freeObjectList(vm, vm->youngObjects);
+	freeObjectList(vm, vm->sweepObjects);
+	vm->objects = NULL;
+	vm->youngObjects = NULL;
+	vm->sweepObjects = NULL;
 	free(vm->grayStack);
+	free(vm->remembered);
+	freeAllocator(&vm->allocator);
 	vm->shouldGC = true;
-}
\ No newline at end of file
+}
+
+#ifdef _WIN32
+void* reserveMemory(size_t size) {
+	return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+bool commitMemory(void* base, size_t size) {
+	return size == 0 || VirtualAlloc(base, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+}
+
+void releaseMemory(void* base, size_t size) {
+	(void)size;
+	VirtualFree(base, 0, MEM_RELEASE);
+}
+
+size_t pageSize(void) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (size_t)info.dwPageSize;
+}
+#else
+void* reserveMemory(size_t size) {
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+	void* base = mmap(NULL, size, PROT_NONE, flags, -1, 0);
+	return base == MAP_FAILED ? NULL : base;
+}
+
+bool commitMemory(void* base, size_t size) {
+	size_t page = pageSize();
+	size_t length = (size + page - 1) / page * page;
+	return length == 0 || mprotect(base, length, PROT_READ | PROT_WRITE) == 0;
+}
+
+void releaseMemory(void* base, size_t size) {
+	munmap(base, size);
+}
+
+size_t pageSize(void) {
+	long size = sysconf(_SC_PAGESIZE);
+	return size > 0 ? (size_t)size : 4096;
+}
+#endif
@@ -17,8 +17,78 @@
 
 #define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
+// As GROW_ARRAY and ALLOCATE, but NULL when the memory can't be had, for sizes the script asks for (see tryReallocate).
+#define TRY_GROW_ARRAY(vm, type, pointer, oldCount, newCount) \
+	(type*)tryReallocate(vm, pointer, sizeof(type) * (oldCount), sizeof(type) * (newCount))
+
+#define TRY_ALLOCATE(vm, type, count) \
+	(type*)tryReallocate(vm, NULL, 0, sizeof(type) * (count))
+
+// Objects are allocated from the VM's pools (see pool.h) rather than with reallocate.
+#define FREE_OBJ(vm, type, pointer) freeObjectMemory(vm, pointer, sizeof(type))
+
+// The defaults of vm->gcGrowthFactor and vm->gcMinHeap.
+#define GC_HEAP_GROW_FACTOR 2
+#ifndef GC_MIN_HEAP
+#define GC_MIN_HEAP (1024 * 1024)
+#endif
+// Held by every VM to be freed when the system runs out of memory (see memory.c).
+#define GC_RESERVE_SIZE (256 * 1024)
+
+typedef enum {
+	GC_PHASE_IDLE,
+	GC_PHASE_MARK,
+	GC_PHASE_SWEEP_STRINGS,
+	GC_PHASE_SWEEP
+} GCPhase;
+
+/*
+  Write barriers, to be applied after owner (an object) is made to reference object.
+  - Old objects are only traced by minor collections when they're in the remembered set, so any store of a young object
+    into an old one must remember the old one.
+  - While an incremental collection is marking, a store of an unmarked object into a marked one marks it, so that no
+    marked object is left referencing an unmarked one once the gray objects have been traced.
+  - Stores into tables go through tableSet which applies the barrier for the table's owner.
+*/
+#define WRITE_BARRIER_OBJ(vm, owner, object) \
+	do { \
+		Obj* barrierOwner = (Obj*)(owner); \
+		Obj* barrierObject = (Obj*)(object); \
+		if (barrierObject != NULL) { \
+			if (barrierOwner->isOld && !barrierObject->isOld) rememberObject(vm, barrierOwner); \
+			if ((vm)->gcPhase == GC_PHASE_MARK && barrierOwner->isMarked) markObject(vm, barrierObject); \
+		} \
+	} while (false)
+
+#define WRITE_BARRIER(vm, owner, value) \
+	do { \
+		Value barrierValue = (value); \
+		if (IS_OBJ(barrierValue)) WRITE_BARRIER_OBJ(vm, owner, AS_OBJ(barrierValue)); \
+	} while (false)
+
 void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize);
+// Grows pointer (leaving it as it was) or returns NULL when even a full collection doesn't free enough, never exiting.
+void* tryReallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize);
+void* allocateObjectMemory(VM* vm, size_t size);
+void freeObjectMemory(VM* vm, void* pointer, size_t size);
+void rememberObject(VM* vm, Obj* object);
 void markObject(VM* vm, Obj* object);
 void markValue(VM* vm, Value value);
+// Runs a major collection of the whole heap, first finishing any incremental collection in progress.
 void collectGarbage(VM* vm);
-void freeObjects(VM* vm);
\ No newline at end of file
+// Sets when the next major collection runs from the heap's size and the tunables, which it has to follow changes to.
+void updateHeapTarget(VM* vm);
+void freeObjects(VM* vm);
+
+/*
+  Address space reserved up front and committed as it is needed, for memory which must never move (the VM's stacks).
+  - Reserved memory which hasn't been committed can't be touched, so running past the committed part faults rather than
+    corrupting whatever follows it. Committed memory reads as zeroes.
+  - It isn't counted in bytesAllocated, it isn't garbage collected.
+*/
+// Returns NULL if the range couldn't be reserved.
+void* reserveMemory(size_t size);
+// Commits the first size bytes (rounded up to whole pages) of a reservation, any already committed stay as they are.
+bool commitMemory(void* base, size_t size);
+void releaseMemory(void* base, size_t size);
+size_t pageSize(void);
\ No newline at end of file
@@ -2,24 +2,66 @@
 #include "vm.h"
 #include "natives.h"
 #include "exception.h"
+#include "worker.h"
+#include "typedarray.h"
+#include "map.h"
 #include <math.h>
 
 void initModule(VM* vm, Module* mod) {
-	mod->next = NULL;
 	initTable(&mod->globals);
+	initValueArray(&mod->slots);
 	initTable(&mod->exports);
 
-	tableSet(vm, &mod->globals, copyString(vm, "Object", 6), OBJ_VAL(vm->objectClass));
-	tableSet(vm, &mod->globals, copyString(vm, "Iterator", 8), OBJ_VAL(vm->iteratorClass));
-	tableSet(vm, &mod->globals, copyString(vm, "Import", 6), OBJ_VAL(vm->importClass));
-	tableSet(vm, &mod->globals, copyString(vm, "NaN", 3), NUMBER_VAL(nan("0")));
-	tableSet(vm, &mod->globals, copyString(vm, "Infinity", 8), NUMBER_VAL(INFINITY));
+	defineModuleGlobal(vm, mod, copyString(vm, "Object", 6), OBJ_VAL(vm->objectClass));
+	defineModuleGlobal(vm, mod, copyString(vm, "Iterator", 8), OBJ_VAL(vm->iteratorClass));
+	defineModuleGlobal(vm, mod, copyString(vm, "StringBuilder", 13), OBJ_VAL(vm->stringBuilderClass));
+	defineModuleGlobal(vm, mod, copyString(vm, "Import", 6), OBJ_VAL(vm->importClass));
+	defineModuleGlobal(vm, mod, copyString(vm, "Worker", 6), OBJ_VAL(vm->workerClass));
+	defineModuleGlobal(vm, mod, copyString(vm, "NaN", 3), NUMBER_VAL(nan("0")));
+	defineModuleGlobal(vm, mod, copyString(vm, "Infinity", 8), NUMBER_VAL(INFINITY));
 
 	defineGlobalNatives(vm, mod);
+	defineWorkerNatives(vm, mod);
+	defineTypedArrayNatives(vm, mod);
+	defineMapNatives(vm, mod);
 
 	defineExceptionClasses(vm, mod);
 }
 
 void freeModule(VM* vm, Module* mod) {
 	freeTable(vm, &mod->globals);
+	freeValueArray(vm, &mod->slots);
+	freeTable(vm, &mod->exports);
+}
+
+size_t moduleGlobalSlot(VM* vm, Module* mod, ObjString* name) {
+	Value slot;
+	if (tableGet(&mod->globals, name, &slot)) return (size_t)AS_NUMBER(slot);
+
+	push(vm, OBJ_VAL(name)); // GC
+	writeValueArray(vm, &mod->slots, UNDEFINED_GLOBAL_VAL);
+	tableSet(vm, &mod->globals, name, NUMBER_VAL((double)(mod->slots.count - 1)));
+	pop(vm);
+	return mod->slots.count - 1;
+}
+
+void defineModuleGlobal(VM* vm, Module* mod, ObjString* name, Value value) {
+	push(vm, value); // GC
+	size_t slot = moduleGlobalSlot(vm, mod, name);
+	mod->slots.values[slot] = pop(vm);
+}
+
+bool getModuleGlobal(Module* mod, ObjString* name, Value* value) {
+	Value slot;
+	if (!tableGet(&mod->globals, name, &slot)) return false;
+	*value = mod->slots.values[(size_t)AS_NUMBER(slot)];
+	return !IS_UNDEFINED_GLOBAL(*value);
+}
+
+ObjString* moduleGlobalName(Module* mod, size_t slot) {
+	for (size_t i = 0; i < mod->globals.capacity; i++) {
+		Entry* entry = &mod->globals.entries[i];
+		if (entry->key != NULL && (size_t)AS_NUMBER(entry->value) == slot) return entry->key;
+	}
+	return NULL;
 }
\ No newline at end of file
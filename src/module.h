@@ -1,12 +1,26 @@
 #pragma once
 #include "common.h"
 #include "table.h"
+#include "value.h"
+
+/*
+  Module level variables are stored in slots, the compiler resolves each global name to its slot index.
+  - globals maps each name to NUMBER_VAL(slot), it is used for lookups by name (THIS_MODULE, exception classes and error messages).
+  - A slot which has been referenced but not yet defined holds UNDEFINED_GLOBAL_VAL, no Dragon value is a null object.
+*/
+#define UNDEFINED_GLOBAL_VAL OBJ_VAL(NULL)
+#define IS_UNDEFINED_GLOBAL(value) (IS_OBJ(value) && AS_OBJ(value) == NULL)
 
 typedef struct Module {
 	Table globals;
+	ValueArray slots;
 	Table exports;
 	struct Module* next;
 } Module;
 
 void initModule(VM* vm, Module* mod);
-void freeModule(VM* vm, Module* mod);
\ No newline at end of file
+void freeModule(VM* vm, Module* mod);
+size_t moduleGlobalSlot(VM* vm, Module* mod, ObjString* name);
+void defineModuleGlobal(VM* vm, Module* mod, ObjString* name, Value value);
+bool getModuleGlobal(Module* mod, ObjString* name, Value* value);
+ObjString* moduleGlobalName(Module* mod, size_t slot);
\ No newline at end of file
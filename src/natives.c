@@ -1,5 +1,8 @@
 #include "natives.h"
 #include "value.h"
+#include "rope.h"
+#include "memory.h"
+#include "io.h"
 #include <stdio.h>
 #include <time.h>
 #include <math.h>
@@ -10,25 +13,38 @@
  Helper Functions
 */
 
-char* inputString(FILE* fp, size_t size) {
-	char* str;
-	int ch;
-	size_t len = 0;
-	str = realloc(NULL, sizeof(*str) * size);//size is start size
-	if (!str)return str;
-	while (EOF != (ch = fgetc(fp)) && ch != '\n') {
-		str[len++] = ch;
-		if (len == size) {
-			str = realloc(str, sizeof(*str) * (size += 16));
-			if (!str)return str;
+/*
+  Formats the arguments of print and input into line, each followed by a space (print's ends with a newline instead of
+  the last space it adds). Lines longer than the caller's buffer move to one allocated by the VM, which the caller frees.
+*/
+static bool formatLine(VM* vm, uint8_t argCount, Value* args, char** line, size_t* length, size_t* capacity, char* initial,
+	bool* hasError, ObjInstance** exception) {
+	for (size_t i = 0; i < argCount; i++) {
+		ObjString* value = valueToString(vm, args[i], hasError, exception);
+		if (*hasError) return false;
+
+		// Growing the line may collect, which mustn't free the string before it is copied.
+		push(vm, OBJ_VAL(value));
+		size_t needed = *length + value->length + 2;
+		if (needed > *capacity) {
+			size_t newCapacity = max(*capacity * 2, needed);
+			if (*line == initial) {
+				*line = ALLOCATE(vm, char, newCapacity);
+				memcpy(*line, initial, *length);
+			}
+			else {
+				*line = GROW_ARRAY(vm, char, *line, *capacity, newCapacity);
+			}
+			*capacity = newCapacity;
 		}
+		memcpy(*line + *length, value->chars, value->length);
+		pop(vm);
+		*length += value->length;
+		(*line)[(*length)++] = ' ';
 	}
-	str[len++] = '\0';
-
-	return realloc(str, sizeof(*str) * len);
+	return true;
 }
 
-
 /*
  Native Functions
 */
@@ -37,25 +53,35 @@ static Value clockNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bo
 }
 
 static Value printNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
-	for (size_t i = 0; i < argCount; i++) {
-		ObjString* value = valueToString(vm, args[i], hasError, exception);
-		if (*hasError) return NULL_VAL;
-		printf("%s", value->chars);
-		printf(" ");
+	char initial[256];
+	char* line = initial;
+	size_t length = 0;
+	size_t capacity = sizeof(initial);
+	if (formatLine(vm, argCount, args, &line, &length, &capacity, initial, hasError, exception)) {
+		// formatLine leaves room for the newline.
+		line[length++] = '\n';
+		flushStandardOutput(vm);
+		fwrite(line, 1, length, stdout);
 	}
-	printf("\n");
+	if (line != initial) FREE_ARRAY(vm, char, line, capacity);
 	return NULL_VAL;
 }
 
 static Value inputNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
-	for (size_t i = 0; i < argCount; i++) {
-		ObjString* value = valueToString(vm, args[i], hasError, exception);
-		if (*hasError) return NULL_VAL;
-		printf("%s", value->chars);
-		if(i != argCount - 1) printf(" ");
+	char initial[256];
+	char* line = initial;
+	size_t length = 0;
+	size_t capacity = sizeof(initial);
+	bool formatted = formatLine(vm, argCount, args, &line, &length, &capacity, initial, hasError, exception);
+	if (formatted) {
+		flushStandardOutput(vm);
+		// The prompt has no space after its last argument.
+		fwrite(line, 1, length > 0 ? length - 1 : 0, stdout);
+		fflush(stdout);
 	}
-	char* input = inputString(stdin, 128);
-	return OBJ_VAL(takeString(vm, input, strlen(input)));
+	if (line != initial) FREE_ARRAY(vm, char, line, capacity);
+	if (!formatted) return NULL_VAL;
+	return OBJ_VAL(readInputLine(vm));
 }
 
 static Value toStringNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
@@ -75,13 +101,21 @@ static Value sqrtNative(VM* vm, Value* bound, uint8_t argCount, Value* args, boo
 	return NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
 }
 
+void defineModuleNative(VM* vm, Module* mod, const char* name, size_t arity, bool varargs, NativeFn function) {
+	push(vm, OBJ_VAL(copyString(vm, name, strlen(name))));
+	push(vm, OBJ_VAL(newNative(vm, arity, varargs, function)));
+	defineModuleGlobal(vm, mod, AS_STRING(peek(vm, 1)), peek(vm, 0));
+	pop(vm);
+	pop(vm);
+}
+
 void defineGlobalNatives(VM* vm, Module* mod) {
-	defineNative(vm, &mod->globals, "toString", 1, false, toStringNative);
-	defineNative(vm, &mod->globals, "repr", 1, false, reprNative);
-	defineNative(vm, &mod->globals, "clock", 0, false, clockNative);
-	defineNative(vm, &mod->globals, "sqrt", 1, false, sqrtNative);
-	defineNative(vm, &mod->globals, "print", 0, true, printNative);
-	defineNative(vm, &mod->globals, "input", 0, true, inputNative);
+	defineModuleNative(vm, mod, "toString", 1, false, toStringNative);
+	defineModuleNative(vm, mod, "repr", 1, false, reprNative);
+	defineModuleNative(vm, mod, "clock", 0, false, clockNative);
+	defineModuleNative(vm, mod, "sqrt", 1, false, sqrtNative);
+	defineModuleNative(vm, mod, "print", 0, true, printNative);
+	defineModuleNative(vm, mod, "input", 0, true, inputNative);
 }
 
 /*
@@ -114,6 +148,8 @@ Value callDragonFromNative(VM* vm, Value* bound, Value callee, size_t argCount,
 			return NULL_VAL;
 		}
 
+		if (!native->keepsRopes) flattenRopes(vm, vm->stackTop - argCount, argCount);
+
 		bool functionErr = false;
 		Value returnValue = native->function(vm, bound == NULL ? &native->bound : bound, argCount, vm->stackTop - argCount, &functionErr, exception);
 		if (functionErr) {
@@ -130,4 +166,9 @@ void defineNative(VM* vm, Table* table, const char* name, size_t arity, bool var
 	tableSet(vm, table, AS_STRING(peek(vm, 1)), peek(vm, 0));
 	pop(vm);
 	pop(vm);
+}
+
+void keepRopeArguments(VM* vm, Table* table, const char* name) {
+	Value native;
+	if (tableGet(table, copyString(vm, name, strlen(name)), &native)) AS_NATIVE(native)->keepsRopes = true;
 }
\ No newline at end of file
@@ -4,5 +4,8 @@
 #include "vm.h"
 
 Value callDragonFromNative(VM* vm, Value* bound, Value callee, size_t argCount, bool* hasError, ObjInstance** exception);
+void defineModuleNative(VM* vm, Module* mod, const char* name, size_t arity, bool varargs, NativeFn function);
 void defineNative(VM* vm, Table* table, const char* name, size_t arity, bool varargs, NativeFn function);
+// Has the native defined as name in table take its arguments as they are, for natives which only store or compare them.
+void keepRopeArguments(VM* vm, Table* table, const char* name);
 void defineGlobalNatives(VM* vm, Module* mod);
\ No newline at end of file
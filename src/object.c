@@ -4,6 +4,11 @@
 #include "vm.h"
 #include "natives.h"
 #include "table.h"
+#include "range.h"
+#include "typedarray.h"
+#include "map.h"
+#include "rope.h"
+#include "exception.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
@@ -13,12 +18,14 @@
 	(type*)allocateObject(vm, sizeof(type), objectType)
 
 static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
-	Obj* object = (Obj*)reallocate(vm, NULL, 0, size);
+	Obj* object = (Obj*)allocateObjectMemory(vm, size);
 	object->type = type;
 	object->isMarked = false;
+	object->isOld = false;
+	object->isRemembered = false;
 
-	object->next = vm->objects;
-	vm->objects = object;
+	object->next = vm->youngObjects;
+	vm->youngObjects = object;
 
 #ifdef DEBUG_LOG_GC
 	printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -37,23 +44,229 @@ ObjClass* newClass(VM* vm, ObjString* name) {
 	ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
 	klass->name = name;
 	klass->superclass = NULL;
+	klass->rootShape = NULL;
+	klass->fieldCountHint = 0;
 	initTable(&klass->methods);
+	klass->methods.owner = (Obj*)klass;
 	return klass;
 }
 
+static ObjShape* newShape(VM* vm, ObjShape* parent, ObjString* name) {
+	ObjShape* shape = ALLOCATE_OBJ(vm, ObjShape, OBJ_SHAPE);
+	shape->parent = parent;
+	shape->name = name;
+	shape->count = parent == NULL ? 0 : parent->count + 1;
+	initTable(&shape->slots);
+	initTable(&shape->transitions);
+	shape->slots.owner = (Obj*)shape;
+	shape->transitions.owner = (Obj*)shape;
+
+	if (parent != NULL) {
+		push(vm, OBJ_VAL(shape)); // GC
+		tableAddAll(vm, &parent->slots, &shape->slots);
+		tableSet(vm, &shape->slots, name, NUMBER_VAL((double)parent->count));
+		tableSet(vm, &parent->transitions, name, OBJ_VAL(shape));
+		pop(vm);
+	}
+	return shape;
+}
+
 ObjList* newList(VM* vm, ValueArray array) {
 	ObjList* list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
 	list->items = array;
 	return list;
 }
 
+ObjRange* newRange(VM* vm, intmax_t start, intmax_t end) {
+	ObjRange* range = (ObjRange*)allocateObject(vm, max(sizeof(ObjRange), sizeof(ObjList)), OBJ_RANGE);
+	range->start = start;
+	range->end = end;
+	range->step = end >= start ? 1 : -1;
+	return range;
+}
+
+ObjTypedArray* newTypedArray(VM* vm, ArrayKind kind, void* data, size_t length, ObjTypedArray* parent) {
+	ObjTypedArray* array = ALLOCATE_OBJ(vm, ObjTypedArray, OBJ_TYPED_ARRAY);
+	array->kind = kind;
+	array->length = length;
+	array->data = data;
+	array->parent = parent;
+	return array;
+}
+
+ObjMap* newMap(VM* vm, ObjType type) {
+	ObjMap* map = ALLOCATE_OBJ(vm, ObjMap, type);
+	map->count = 0;
+	map->entryCount = 0;
+	map->entryCapacity = 0;
+	map->entries = NULL;
+	map->indexCapacity = 0;
+	map->index = NULL;
+	return map;
+}
+
+ObjRope* newRope(VM* vm, RopeBuffer* buffer, size_t length) {
+	ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+	rope->length = length;
+	rope->buffer = buffer;
+	rope->parent = NULL;
+	rope->start = 0;
+	rope->flat = NULL;
+	buffer->ropeCount++;
+	return rope;
+}
+
+ObjRope* newSlice(VM* vm, ObjString* parent, size_t start, size_t length) {
+	ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+	rope->length = length;
+	rope->buffer = NULL;
+	rope->parent = parent;
+	rope->start = start;
+	rope->flat = NULL;
+	return rope;
+}
+
+ObjTrace* newTrace(VM* vm, ObjString* className, ObjString* message, TraceFrame* frames, size_t count) {
+	ObjTrace* trace = ALLOCATE_OBJ(vm, ObjTrace, OBJ_TRACE);
+	trace->className = className;
+	trace->message = message;
+	trace->frames = frames;
+	trace->count = count;
+	return trace;
+}
+
 ObjInstance* newInstance(VM* vm, ObjClass* klass) {
+	if (klass->rootShape == NULL) {
+		klass->rootShape = newShape(vm, NULL, NULL);
+		WRITE_BARRIER_OBJ(vm, klass, klass->rootShape);
+	}
+
 	ObjInstance* instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
 	instance->klass = klass;
+	instance->shape = klass->rootShape;
+	instance->slots = NULL;
+	instance->slotCapacity = 0;
 	initTable(&instance->fields);
+	instance->fields.owner = (Obj*)instance;
+
+	// Size the slots from previous instances of the class, so constructors don't need to grow them field by field.
+	if (klass->fieldCountHint > 0) {
+		push(vm, OBJ_VAL(instance)); // GC
+		instance->slots = ALLOCATE(vm, Value, klass->fieldCountHint);
+		instance->slotCapacity = klass->fieldCountHint;
+		pop(vm);
+	}
 	return instance;
 }
 
+bool shapeGetSlot(ObjShape* shape, ObjString* name, size_t* slot) {
+	Value index;
+	if (!tableGet(&shape->slots, name, &index)) return false;
+	*slot = (size_t)AS_NUMBER(index);
+	return true;
+}
+
+bool instanceGet(ObjInstance* instance, ObjString* name, Value* value) {
+	if (instance->shape == NULL) {
+		return tableGet(&instance->fields, name, value);
+	}
+
+	size_t slot;
+	if (!shapeGetSlot(instance->shape, name, &slot)) return false;
+	*value = instance->slots[slot];
+	return true;
+}
+
+void instanceMakeDictionary(VM* vm, ObjInstance* instance) {
+	if (instance->shape == NULL) return;
+
+	Table* slots = &instance->shape->slots;
+	for (size_t i = 0; i < slots->capacity; i++) {
+		Entry* entry = &slots->entries[i];
+		if (entry->key != NULL) {
+			tableSet(vm, &instance->fields, entry->key, instance->slots[(size_t)AS_NUMBER(entry->value)]);
+		}
+	}
+
+	FREE_ARRAY(vm, Value, instance->slots, instance->slotCapacity);
+	instance->slots = NULL;
+	instance->slotCapacity = 0;
+	instance->shape = NULL;
+}
+
+bool instanceSet(VM* vm, ObjInstance* instance, ObjString* name, Value value) {
+	if (instance->shape != NULL) {
+		size_t slot;
+		if (shapeGetSlot(instance->shape, name, &slot)) {
+			instance->slots[slot] = value;
+			WRITE_BARRIER(vm, instance, value);
+			return false;
+		}
+
+		if (instance->shape->count >= SHAPE_MAX_FIELDS) {
+			push(vm, OBJ_VAL(instance)); // GC
+			push(vm, value);
+			instanceMakeDictionary(vm, instance);
+			popN(vm, 2);
+		}
+	}
+
+	if (instance->shape == NULL) {
+		return tableSet(vm, &instance->fields, name, value);
+	}
+
+	push(vm, OBJ_VAL(instance)); // GC
+	push(vm, value);
+
+	ObjShape* shape = instance->shape;
+	Value transition;
+	ObjShape* next = tableGet(&shape->transitions, name, &transition) ? AS_SHAPE(transition) : newShape(vm, shape, name);
+
+	if (next->count > instance->slotCapacity) {
+		size_t oldCapacity = instance->slotCapacity;
+		instance->slotCapacity = GROW_CAPACITY(oldCapacity);
+		instance->slots = GROW_ARRAY(vm, Value, instance->slots, oldCapacity, instance->slotCapacity);
+	}
+
+	instance->slots[shape->count] = value;
+	instance->shape = next;
+	WRITE_BARRIER(vm, instance, value);
+	WRITE_BARRIER_OBJ(vm, instance, next);
+
+	if (next->count > instance->klass->fieldCountHint) {
+		instance->klass->fieldCountHint = next->count;
+	}
+
+	popN(vm, 2);
+	return true;
+}
+
+size_t instanceFieldCount(ObjInstance* instance) {
+	return instance->shape == NULL ? instance->fields.count : instance->shape->count;
+}
+
+// Writes the names of the instance's fields to array, in slot order for shaped instances.
+static void writeFieldNames(VM* vm, ObjInstance* instance, ValueArray* array) {
+	if (instance->shape == NULL) {
+		for (size_t i = 0; i < instance->fields.capacity; i++) {
+			Entry* entry = &instance->fields.entries[i];
+			if (entry->key != NULL) {
+				writeValueArray(vm, array, OBJ_VAL(entry->key));
+			}
+		}
+		return;
+	}
+
+	size_t start = array->count;
+	size_t count = instanceFieldCount(instance);
+	for (size_t i = 0; i < count; i++) {
+		writeValueArray(vm, array, NULL_VAL);
+	}
+	for (ObjShape* shape = instance->shape; shape->parent != NULL; shape = shape->parent) {
+		array->values[start + shape->count - 1] = OBJ_VAL(shape->name);
+	}
+}
+
 ObjFunction* newFunction(VM* vm) {
 	ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
 	function->arity = 0;
@@ -61,6 +274,9 @@ ObjFunction* newFunction(VM* vm) {
 	function->name = NULL;
 	function->isLambda = false;
 	function->varargs = false;
+	function->sharedClosure = NULL;
+	function->hotness = 0;
+	function->jit = NULL;
 	initChunk(&function->chunk);
 	return function;
 }
@@ -72,6 +288,15 @@ ObjNative* newNative(VM* vm, size_t arity, bool varargs, NativeFn function) {
 	native->isBound = false;
 	native->varargs = varargs;
 	native->bound = NULL_VAL;
+	native->keepsRopes = false;
+	return native;
+}
+
+ObjNative* newBoundNative(VM* vm, ObjNative* method, Value receiver) {
+	ObjNative* native = newNative(vm, method->arity, method->varargs, method->function);
+	native->isBound = true;
+	native->bound = receiver;
+	native->keepsRopes = method->keepsRopes;
 	return native;
 }
 
@@ -97,7 +322,7 @@ ObjUpvalue* newUpvalue(VM* vm, Value* slot) {
 	return upvalue;
 }
 
-static uint32_t hashString(const char* key, size_t length) {
+uint32_t hashString(const char* key, size_t length) {
 	uint32_t hash = 2166136261u;
 	for (size_t i = 0; i < length; i++) {
 		hash ^= (uint8_t)key[i];
@@ -106,17 +331,48 @@ static uint32_t hashString(const char* key, size_t length) {
 	return hash;
 }
 
-static ObjString* allocateString(VM* vm, char* chars, size_t length, uint32_t hash) {
-	ObjString* string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
+static ObjString* initString(ObjString* string, char* chars, size_t length) {
 	string->length = length;
 	string->chars = chars;
-	string->hash = hash;
+	string->hash = 0;
+	string->isHashed = false;
+	string->isInterned = false;
+	return string;
+}
+
+// The characters are stored in the same allocation, straight after the string (freeObject checks for this).
+static ObjString* allocateInlineString(VM* vm, const char* chars, size_t length) {
+	ObjString* string = (ObjString*)allocateObject(vm, sizeof(ObjString) + length + 1, OBJ_STRING);
+	char* inlineChars = (char*)(string + 1);
+	memcpy(inlineChars, chars, length);
+	inlineChars[length] = '\0';
+	return initString(string, inlineChars, length);
+}
+
+static ObjString* addInterned(VM* vm, ObjString* string) {
+	string->isInterned = true;
 	push(vm, OBJ_VAL(string));
 	tableSet(vm, &vm->strings, string, NULL_VAL);
 	pop(vm);
 	return string;
 }
 
+ObjString* takeTransientString(VM* vm, char* chars, size_t length) {
+	return initString(ALLOCATE_OBJ(vm, ObjString, OBJ_STRING), chars, length);
+}
+
+ObjString* copyTransientString(VM* vm, const char* chars, size_t length) {
+	return allocateInlineString(vm, chars, length);
+}
+
+ObjString* internString(VM* vm, ObjString* string) {
+	if (string->isInterned) return string;
+
+	ObjString* interned = tableFindString(&vm->strings, string->chars, string->length, stringHash(string));
+	if (interned != NULL) return interned;
+	return addInterned(vm, string);
+}
+
 ObjString* takeString(VM* vm, char* chars, size_t length) {
 	uint32_t hash = hashString(chars, length);
 	ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
@@ -124,18 +380,22 @@ ObjString* takeString(VM* vm, char* chars, size_t length) {
 		FREE_ARRAY(vm, char, chars, length + 1);
 		return interned;
 	}
-	return allocateString(vm, chars, length, hash);
+
+	ObjString* string = takeTransientString(vm, chars, length);
+	string->hash = hash;
+	string->isHashed = true;
+	return addInterned(vm, string);
 }
 
 ObjString* copyString(VM* vm, const char* chars, size_t length) {
 	uint32_t hash = hashString(chars, length);
 	ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
 	if (interned != NULL) return interned;
-	char* heapChars = ALLOCATE(vm, char, length + 1);
 
-	memcpy(heapChars, chars, length);
-	heapChars[length] = '\0';
-	return allocateString(vm, heapChars, length, hash);
+	ObjString* string = allocateInlineString(vm, chars, length);
+	string->hash = hash;
+	string->isHashed = true;
+	return addInterned(vm, string);
 }
 
 ObjString* makeStringf(VM* vm, const char* format, ...) {
@@ -152,11 +412,16 @@ ObjString* makeStringvf(VM* vm, const char* format, va_list vsnargs) {
 	va_copy(vsargs, vsnargs);
 	int length = vsnprintf(NULL, 0, format, vsnargs);
 	va_end(vsnargs);
+	// Formatted outside of the VM's heap, a collection could free strings whose characters are among the arguments.
 	char* string = malloc((size_t)length + 1);
+	if (string == NULL) exit(1);
 
 	vsprintf(string, format, vsargs);
+	va_end(vsargs);
 
-	return takeString(vm, string, length);
+	ObjString* result = copyTransientString(vm, string, length);
+	free(string);
+	return result;
 }
 
 ObjString* functionToString(VM* vm, ObjFunction* function) {
@@ -175,7 +440,7 @@ ObjString* listToString(VM* vm, ObjList* list, bool* hasError, ObjInstance** exc
 		}
 		else {
 			Value v = list->items.values[i];
-			if(IS_STRING(v)) stringLength += valueToRepr(vm, v)->length;
+			if (isStringOrRope(v)) stringLength += valueToRepr(vm, v)->length;
 			else stringLength += valueToString(vm, v, hasError, exception)->length;
 		}
 		if (i != list->items.count - 1) stringLength += 2;
@@ -196,7 +461,7 @@ ObjString* listToString(VM* vm, ObjList* list, bool* hasError, ObjInstance** exc
 		}
 		else {
 			Value v = list->items.values[i];
-			if (IS_STRING(v)) str = valueToRepr(vm, v);
+			if (isStringOrRope(v)) str = valueToRepr(vm, v);
 			else str = valueToString(vm, v, hasError, exception);
 		}
 		memcpy(&buffer[bufferIndex], str->chars, str->length);
@@ -209,28 +474,35 @@ ObjString* listToString(VM* vm, ObjList* list, bool* hasError, ObjInstance** exc
 	buffer[stringLength - 1] = ']';
 	buffer[stringLength] = '\0';
 
-	return takeString(vm, buffer, stringLength);
+	return takeTransientString(vm, buffer, stringLength);
+}
+
+// The string returned by an instance's toString method.
+static ObjString* toStringResult(VM* vm, Value stringForm, bool* hasError, ObjInstance** exception) {
+	if (IS_ROPE(stringForm)) {
+		push(vm, stringForm); // GC
+		ObjString* string = flattenRope(vm, AS_ROPE(stringForm));
+		pop(vm);
+		return string;
+	}
+	if (!IS_STRING(stringForm)) {
+		*hasError = true;
+		*exception = makeException(vm, "TypeException", "Instance's 'toString' method must return a string.");
+		return NULL;
+	}
+	return AS_STRING(stringForm);
 }
 
 ObjString* instanceToString(VM* vm, ObjInstance* instance, bool* hasError, ObjInstance** exception) {
+	Value receiver = OBJ_VAL(instance);
 	Value method;
-	if (tableGet(&instance->fields, copyString(vm, "toString", 8), &method)) {
-		Value stringForm = callDragonFromNative(vm, &OBJ_VAL(instance), method, 0, hasError, exception);
-		if (!IS_STRING(stringForm)) { 
-			*hasError = true;
-			*exception = makeException(vm, "TypeException", "Instance's 'toString' method must return a string.");
-			return NULL;
-		}
-		return AS_STRING(stringForm);
+	if (instanceGet(instance, copyString(vm, "toString", 8), &method)) {
+		Value stringForm = callDragonFromNative(vm, &receiver, method, 0, hasError, exception);
+		return toStringResult(vm, stringForm, hasError, exception);
 	}
 	else if (tableGet(&instance->klass->methods, copyString(vm, "toString", 8), &method)) {
-		Value stringForm = callDragonFromNative(vm, &OBJ_VAL(instance), method, 0, hasError, exception);
-		if (!IS_STRING(stringForm)) {
-			*hasError = true;
-			*exception = makeException(vm, "TypeException", "Instance's 'toString' method must return a string.");
-			return NULL;
-		}
-		return AS_STRING(stringForm);
+		Value stringForm = callDragonFromNative(vm, &receiver, method, 0, hasError, exception);
+		return toStringResult(vm, stringForm, hasError, exception);
 	}
 
 	return makeStringf(vm, "<instance %s>", instance->klass->name->chars);
@@ -248,10 +520,23 @@ ObjString* objectToString(VM* vm, Value value, bool* hasError, ObjInstance** exc
 			return functionToString(vm, AS_CLOSURE(value)->function);
 		case OBJ_LIST:
 			return listToString(vm, AS_LIST(value), hasError, false, exception);
+		case OBJ_RANGE:
+			return listToString(vm, rangeToList(vm, AS_RANGE(value)), hasError, false, exception);
 		case OBJ_FUNCTION:
 			return functionToString(vm, AS_FUNCTION(value));
 		case OBJ_NATIVE:
 			return vm->stringConstants[STR_NATIVE_FUNCTION];
+		case OBJ_SHAPE:
+			return copyString(vm, "shape", 5);
+		case OBJ_TRACE:
+			return copyString(vm, "trace", 5);
+		case OBJ_TYPED_ARRAY:
+			return typedArrayToString(vm, AS_TYPED_ARRAY(value));
+		case OBJ_MAP:
+		case OBJ_SET:
+			return mapToString(vm, AS_MAP(value));
+		case OBJ_ROPE:
+			return flattenRope(vm, AS_ROPE(value));
 		case OBJ_STRING:
 			return AS_STRING(value);
 		case OBJ_UPVALUE:
@@ -303,7 +588,7 @@ static ObjString* unescapeString(VM* vm, ObjString* string) {
 	}
 	*dest = '\0';
 
-	return takeString(vm, destStart, length + count);
+	return takeTransientString(vm, destStart, length + count);
 #undef EXPAND
 }
 
@@ -319,13 +604,21 @@ ObjString* objectToRepr(VM* vm, Value value) {
 		case OBJ_CLOSURE:
 		case OBJ_FUNCTION:
 		case OBJ_NATIVE:
+		case OBJ_SHAPE:
+		case OBJ_TYPED_ARRAY:
+		case OBJ_MAP:
+		case OBJ_SET:
 		case OBJ_UPVALUE:
 			// The above types cannot fail.
 			return objectToString(vm, value, NULL, NULL);
 		case OBJ_LIST:
 			return listToString(vm, AS_LIST(value), NULL, NULL, true);
+		case OBJ_RANGE:
+			return listToString(vm, rangeToList(vm, AS_RANGE(value)), NULL, NULL, true);
 		case OBJ_INSTANCE:
 			return makeStringf(vm, "<instance %s>", AS_INSTANCE(value)->klass->name->chars);
+		case OBJ_ROPE:
+			return stringToRepr(vm, flattenRope(vm, AS_ROPE(value)));
 		case OBJ_STRING:
 			return stringToRepr(vm, AS_STRING(value));
 		default: return NULL; // Unreachable.
@@ -338,12 +631,7 @@ static Value keysNative(VM* vm, Value* bound, uint8_t argCount, Value* args, boo
 
 	ObjInstance* instance = AS_INSTANCE(*bound);
 
-	for (size_t i = 0; i < instance->fields.capacity; i++) {
-		Entry* entry = &instance->fields.entries[i];
-		if (entry->key != NULL) {
-			writeValueArray(vm, &array, OBJ_VAL(entry->key));
-		}
-	}
+	writeFieldNames(vm, instance, &array);
 
 	ObjList* list = newList(vm, array);
 	return OBJ_VAL(list);
@@ -354,11 +642,19 @@ static Value valuesNative(VM* vm, Value* bound, uint8_t argCount, Value* args, b
 	initValueArray(&array);
 
 	ObjInstance* instance = AS_INSTANCE(*bound);
-
-	for (size_t i = 0; i < instance->fields.capacity; i++) {
-		Entry* entry = &instance->fields.entries[i];
-		if (entry->key != NULL) {
-			writeValueArray(vm, &array, entry->value);
+	resolveStackTrace(vm, instance);
+
+	if (instance->shape == NULL) {
+		for (size_t i = 0; i < instance->fields.capacity; i++) {
+			Entry* entry = &instance->fields.entries[i];
+			if (entry->key != NULL) {
+				writeValueArray(vm, &array, entry->value);
+			}
+		}
+	}
+	else {
+		for (size_t i = 0; i < instance->shape->count; i++) {
+			writeValueArray(vm, &array, instance->slots[i]);
 		}
 	}
 
@@ -371,26 +667,30 @@ static Value entriesNative(VM* vm, Value* bound, uint8_t argCount, Value* args,
 	initValueArray(&array);
 
 	ObjInstance* instance = AS_INSTANCE(*bound);
+	resolveStackTrace(vm, instance);
 
-	size_t count = 0;
-	for (size_t i = 0; i < instance->fields.capacity; i++) {
-		Entry* entry = &instance->fields.entries[i];
-		if (entry->key != NULL) {
-			ValueArray entryArray;
-			initValueArray(&entryArray);
-			writeValueArray(vm, &entryArray, OBJ_VAL(entry->key));
-			writeValueArray(vm, &entryArray, entry->value);
-
-			ObjList* list = newList(vm, entryArray);
-			Value entryValue = OBJ_VAL(list);
-			writeValueArray(vm, &array, entryValue);
-			push(vm, entryValue); // Avoid GC
-			count++;
-		}
+	ValueArray names;
+	initValueArray(&names);
+	writeFieldNames(vm, instance, &names);
+
+	for (size_t i = 0; i < names.count; i++) {
+		Value value = NULL_VAL;
+		instanceGet(instance, AS_STRING(names.values[i]), &value);
+
+		ValueArray entryArray;
+		initValueArray(&entryArray);
+		writeValueArray(vm, &entryArray, names.values[i]);
+		writeValueArray(vm, &entryArray, value);
+
+		ObjList* list = newList(vm, entryArray);
+		Value entryValue = OBJ_VAL(list);
+		push(vm, entryValue); // Avoid GC
+		writeValueArray(vm, &array, entryValue);
 	}
 
 	ObjList* entries = newList(vm, array);
-	popN(vm, count);
+	popN(vm, names.count);
+	freeValueArray(vm, &names);
 	return OBJ_VAL(entries);
 }
 
@@ -408,7 +708,7 @@ static Value hasPropertyNative(VM* vm, Value* bound, uint8_t argCount, Value* ar
 	ObjString* propertyName = AS_STRING(propertyValue);
 
 	Value _;
-	return BOOL_VAL(tableGet(&instance->fields, propertyName, &_));
+	return BOOL_VAL(instanceGet(instance, propertyName, &_));
 }
 
 static Value toStringNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
@@ -468,7 +768,7 @@ static Value toStringNative(VM* vm, Value* bound, uint8_t argCount, Value* args,
 	str[length] = '\0';
 
 	pop(vm);
-	return OBJ_VAL(takeString(vm, str, length));
+	return OBJ_VAL(takeTransientString(vm, str, length));
 }
 
 void defineObjectNatives(VM* vm) {
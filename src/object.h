@@ -14,14 +14,25 @@ typedef enum {
 	OBJ_FUNCTION,
 	OBJ_INSTANCE,
 	OBJ_LIST,
+	OBJ_MAP,
 	OBJ_NATIVE,
+	OBJ_RANGE,
+	OBJ_ROPE,
+	OBJ_SET,
+	OBJ_SHAPE,
 	OBJ_STRING,
+	OBJ_TRACE,
+	OBJ_TYPED_ARRAY,
 	OBJ_UPVALUE
 } ObjType;
 
 struct Obj {
 	ObjType type;
 	bool isMarked;
+	// Survived a collection, see memory.c.
+	bool isOld;
+	// In the VM's remembered set, an old object which may reference young ones.
+	bool isRemembered;
 	struct Obj* next;
 };
 
@@ -33,6 +44,11 @@ struct ObjFunction {
 	bool isLambda;
 	bool varargs;
 	ObjString* name;
+	// The closure shared by every evaluation of a function which captures nothing (see OP_CLOSURE), once it has one.
+	ObjClosure* sharedClosure;
+	// Calls and loop iterations counted towards compiling the function with '--jit', and its code once it has been (see jit.h).
+	uint32_t hotness;
+	JitCode* jit;
 };
 
 typedef Value(*NativeFn)(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception);
@@ -44,6 +60,8 @@ typedef struct {
 	bool isBound;
 	Value bound;
 	bool varargs;
+	// Takes ropes as arguments rather than having them flattened first (see rope.h).
+	bool keepsRopes;
 } ObjNative;
 
 struct ObjUpvalue {
@@ -61,11 +79,18 @@ struct ObjClosure {
 	size_t upvalueCount;
 };
 
+/*
+  Strings used as names (identifiers, constants, table keys) are interned in vm->strings, so they can be compared by
+  pointer. Strings made at run time only for their chars (formatting, printing, concatenation) are transient: they are
+  hashed the first time a table needs it and interned only if they are used as a key (see internString).
+*/
 struct ObjString {
 	Obj obj;
 	size_t length;
 	char* chars;
 	uint32_t hash;
+	bool isHashed;
+	bool isInterned;
 };
 
 typedef struct {
@@ -73,16 +98,144 @@ typedef struct {
 	ValueArray items;
 } ObjList;
 
+/*
+  The integers from start to end inclusive, counting down when end is below start (the value of 'start..end').
+  - Behaves as the list it stands for, it is turned into that list in place (see rangeToList) the first time something
+    other than iterating, indexing, 'in' or length() needs one, so ranges are allocated with the size of a list.
+*/
+typedef struct {
+	Obj obj;
+	intmax_t start;
+	intmax_t end;
+	intmax_t step;
+} ObjRange;
+
+typedef enum {
+	ARRAY_FLOAT64,
+	ARRAY_INT32,
+	ARRAY_BYTE
+} ArrayKind;
+
+/*
+  Numbers packed into a buffer of a single element type (Float64Array, Int32Array, ByteArray), see typedarray.h.
+  - A slice is a view of part of its parent's buffer, which it keeps alive. parent is NULL for an array owning its buffer,
+    slices of a slice share the buffer's owner.
+*/
+typedef struct ObjTypedArray {
+	Obj obj;
+	ArrayKind kind;
+	size_t length;
+	void* data;
+	struct ObjTypedArray* parent;
+} ObjTypedArray;
+
+typedef struct {
+	Value key;
+	Value value;
+	// 0 once the entry is deleted, hashes are never 0.
+	uint32_t hash;
+} MapEntry;
+
+/*
+  A Map, or a Set (OBJ_SET, which leaves the values null), keyed by any value, see map.h.
+  - entries are in insertion order, deleted ones stay in place until the entries are compacted. entryCount counts them
+    too, count only the live ones.
+  - index is an open addressing table of indexCapacity (a power of two, at least twice entryCapacity) slots holding the
+    index of an entry or MAP_EMPTY.
+*/
+typedef struct {
+	Obj obj;
+	size_t count;
+	size_t entryCount;
+	size_t entryCapacity;
+	MapEntry* entries;
+	size_t indexCapacity;
+	uint32_t* index;
+} ObjMap;
+
+// The chars of one or more ropes, which are each a prefix of them. Freed with the last rope using it.
+typedef struct {
+	char* chars;
+	size_t length;
+	size_t capacity;
+	size_t ropeCount;
+} RopeBuffer;
+
+/*
+  A string made by concatenation or by taking a substring, which is only copied into an ObjString once something needs
+  it as one (see rope.c).
+  - The chars of a concatenation are the first length chars of buffer. Concatenating onto the rope which ends the
+    buffer appends to the buffer in place, so building a string up piece by piece doesn't copy it each time.
+  - A substring (slice) has a NULL buffer, its chars are the ones of parent from start, which it keeps alive.
+  - flat is the string it was turned into, once that has happened.
+*/
+typedef struct {
+	Obj obj;
+	size_t length;
+	RopeBuffer* buffer;
+	ObjString* parent;
+	size_t start;
+	ObjString* flat;
+} ObjRope;
+
+/*
+  A shape (hidden class) describes the layout of an instance's fields.
+  - Every class has a root shape with no fields, adding a field to an instance moves it to the child shape for that name.
+  - Instances of a class which had the same fields added in the same order share a shape.
+  - slots maps each field name to its index in the instance's slot array, transitions maps a name to the child shape.
+*/
+struct ObjShape {
+	Obj obj;
+	ObjShape* parent;
+	ObjString* name;
+	size_t count;
+	Table slots;
+	Table transitions;
+};
+
 typedef struct ObjClass {
 	Obj obj;
 	ObjString* name;
 	Table methods;
 	struct ObjClass* superclass;
+	ObjShape* rootShape;
+	size_t fieldCountHint;
 } ObjClass;
 
+/*
+  Instances store their fields in slots, laid out by shape.
+  - An instance whose fields are added dynamically (e.g. through index assignment) or which grows past SHAPE_MAX_FIELDS
+    switches to 'dictionary mode', shape is then NULL and the fields are held in the fields table instead.
+  - instanceGet and instanceSet should be used to access fields, rather than the slots or table directly.
+*/
+#define SHAPE_MAX_FIELDS 64
+
+typedef struct {
+	ObjFunction* function;
+	// The instruction the frame was at.
+	size_t offset;
+	// How many frames straight after it were at the same instruction, as in deep recursion.
+	size_t repeats;
+} TraceFrame;
+
+/*
+  The frames a caught exception unwound, held by its 'stackTrace' field in place of the list of lines until something
+  reads the field (see resolveStackTrace), so exceptions which are caught and dropped never format their trace.
+*/
+typedef struct {
+	Obj obj;
+	ObjString* className;
+	ObjString* message;
+	TraceFrame* frames;
+	size_t count;
+} ObjTrace;
+
 struct ObjInstance {
 	Obj obj;
 	ObjClass* klass;
+	ObjShape* shape;
+	Value* slots;
+	size_t slotCapacity;
 	Table fields;
 };
 
@@ -95,19 +248,51 @@ typedef struct {
 ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method);
 ObjClass* newClass(VM* vm, ObjString* name);
 ObjInstance* newInstance(VM* vm, ObjClass* klass);
+bool shapeGetSlot(ObjShape* shape, ObjString* name, size_t* slot);
+bool instanceGet(ObjInstance* instance, ObjString* name, Value* value);
+bool instanceSet(VM* vm, ObjInstance* instance, ObjString* name, Value value);
+void instanceMakeDictionary(VM* vm, ObjInstance* instance);
+size_t instanceFieldCount(ObjInstance* instance);
 ObjList* newList(VM* vm, ValueArray array);
+ObjRange* newRange(VM* vm, intmax_t start, intmax_t end);
+// A typed array of length elements at data, owned by the array (allocated with reallocate) unless parent is given.
+ObjTypedArray* newTypedArray(VM* vm, ArrayKind kind, void* data, size_t length, ObjTypedArray* parent);
+// An empty Map or Set (type OBJ_MAP or OBJ_SET).
+ObjMap* newMap(VM* vm, ObjType type);
+// A rope of the first length chars of buffer.
+ObjRope* newRope(VM* vm, RopeBuffer* buffer, size_t length);
+// A rope of length chars of parent from start, without copying them.
+ObjRope* newSlice(VM* vm, ObjString* parent, size_t start, size_t length);
+// A trace of count frames, which it takes ownership of.
+ObjTrace* newTrace(VM* vm, ObjString* className, ObjString* message, TraceFrame* frames, size_t count);
 ObjFunction* newFunction(VM* vm);
 ObjNative* newNative(VM* vm, size_t arity, bool varargs, NativeFn function);
+// A copy of method bound to receiver, for when a built in method is used as a value rather than called straight away.
+ObjNative* newBoundNative(VM* vm, ObjNative* method, Value receiver);
 ObjClosure* newClosure(VM* vm, Module* owner, ObjFunction* function);
 ObjUpvalue* newUpvalue(VM* vm, Value* slot);
 ObjString* takeString(VM* vm, char* chars, size_t length);
 ObjString* copyString(VM* vm, const char* chars, size_t length);
+// Strings which aren't interned (see ObjString).
+ObjString* takeTransientString(VM* vm, char* chars, size_t length);
+ObjString* copyTransientString(VM* vm, const char* chars, size_t length);
+// The interned string with the chars of string, which must be reachable by the GC.
+ObjString* internString(VM* vm, ObjString* string);
+uint32_t hashString(const char* key, size_t length);
 ObjString* makeStringf(VM* vm, const char* format, ...);
 ObjString* makeStringvf(VM* vm, const char* format, va_list args);
 ObjString* objectToString(VM* vm, Value value, bool* hasError, ObjInstance** exception);
 ObjString* objectToRepr(VM* vm, Value value);
 void defineObjectNatives(VM* vm);
 
+static inline uint32_t stringHash(ObjString* string) {
+	if (!string->isHashed) {
+		string->hash = hashString(string->chars, string->length);
+		string->isHashed = true;
+	}
+	return string->hash;
+}
+
 static inline bool isObjType(Value value, ObjType type) {
 	return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
@@ -120,8 +305,15 @@ static inline bool isObjType(Value value, ObjType type) {
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_RANGE(value) isObjType(value, OBJ_RANGE)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_SET(value) isObjType(value, OBJ_SET)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_TRACE(value) isObjType(value, OBJ_TRACE)
+#define IS_TYPED_ARRAY(value) isObjType(value, OBJ_TYPED_ARRAY)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
@@ -129,7 +321,14 @@ static inline bool isObjType(Value value, ObjType type) {
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 #define AS_LIST(value) ((ObjList*)AS_OBJ(value))
+// Sets too.
+#define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
 #define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
+#define AS_RANGE(value) ((ObjRange*)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
 #define AS_NATIVE_FN(value) (((ObjNative*)AS_OBJ(value))->function)
+#define AS_SHAPE(value) ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
+#define AS_TRACE(value) ((ObjTrace*)AS_OBJ(value))
+#define AS_TYPED_ARRAY(value) ((ObjTypedArray*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
\ No newline at end of file
@@ -0,0 +1,1009 @@
+#include "optimizer.h"
+#include "memory.h"
+#include "object.h"
+#include "leb128.h"
+#include "debug.h"
+#include "vm.h"
+#include <math.h>
+#include <string.h>
+
+/*
+  The optimizer decodes a chunk into an array of instructions, with jumps referring to the instruction they target rather
+  than a byte offset. Passes mark instructions as removed, compact the array, and the result is re-encoded into the chunk.
+  If the chunk cannot be decoded or re-encoded (e.g. a jump would no longer fit in 16 bits) it is left unchanged.
+*/
+
+#define MAX_ROUNDS 8
+#define MAX_THREAD_HOPS 16
+
+typedef enum {
+	OPERAND_NONE,
+	OPERAND_BYTE,
+	OPERAND_BYTE_BYTE,
+	OPERAND_BYTE_CONSTANT_CACHE,
+	OPERAND_INDEX,
+	OPERAND_CONSTANT,
+	OPERAND_CONSTANT_BYTE,
+	OPERAND_CONSTANT_CACHE,
+	OPERAND_CONSTANT_BYTE_CACHE,
+	OPERAND_JUMP,
+	OPERAND_LOOP,
+	OPERAND_CLOSURE,
+	OPERAND_SWITCH
+} OperandFormat;
+
+typedef struct {
+	uint8_t op;
+	bool removed;
+	bool isTarget;
+	uint8_t byte;
+	uint8_t secondByte;
+	size_t index;
+	size_t cache;
+	size_t target;
+	size_t line;
+	uint8_t* upvalues;
+	size_t upvalueCount;
+} Instruction;
+
+typedef struct {
+	VM* vm;
+	Chunk* chunk;
+	Instruction* code;
+	size_t count;
+	size_t capacity;
+	// The chunk's exception handlers, with instruction indices in place of byte offsets.
+	ExceptionHandler* handlers;
+	size_t handlerCount;
+	// The targets of the chunk's switch tables as instruction indices, each table's default followed by its cases. Those
+	// of table i are from switchStarts[i] up to switchStarts[i + 1].
+	size_t* switchTargets;
+	size_t switchTargetCount;
+	size_t* switchStarts;
+} Optimizer;
+
+static OperandFormat operandFormat(uint8_t op) {
+	switch (op) {
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+		case OP_CALL:
+		case OP_TAIL_CALL:
+		case OP_LIST:
+		case OP_SET_LOCAL_POP:
+		case OP_LIST_STEP:
+			return OPERAND_BYTE;
+		case OP_GET_LOCAL_GET_LOCAL:
+			return OPERAND_BYTE_BYTE;
+		case OP_GET_LOCAL_GET_PROPERTY:
+			return OPERAND_BYTE_CONSTANT_CACHE;
+		case OP_GET_GLOBAL:
+		case OP_DEFINE_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_SET_GLOBAL_POP:
+			return OPERAND_INDEX;
+		case OP_CONSTANT:
+		case OP_ADD_CONSTANT:
+		case OP_GET_SUPER:
+		case OP_CLASS:
+		case OP_METHOD:
+		case OP_IMPORT:
+		case OP_EXPORT:
+			return OPERAND_CONSTANT;
+		case OP_SUPER_INVOKE:
+			return OPERAND_CONSTANT_BYTE;
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+		case OP_SET_PROPERTY_KV:
+			return OPERAND_CONSTANT_CACHE;
+		case OP_INVOKE:
+		case OP_TAIL_INVOKE:
+			return OPERAND_CONSTANT_BYTE_CACHE;
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_JUMP_IF_FALSE_SC:
+		case OP_LESS_JUMP_IF_FALSE:
+		case OP_FOR_RANGE:
+		case OP_ITER_NEXT:
+			return OPERAND_JUMP;
+		case OP_LOOP:
+		case OP_POP_LOOP:
+			return OPERAND_LOOP;
+		case OP_CLOSURE:
+			return OPERAND_CLOSURE;
+		case OP_SWITCH:
+			return OPERAND_SWITCH;
+		default:
+			return OPERAND_NONE;
+	}
+}
+
+static bool isJump(uint8_t op) {
+	OperandFormat format = operandFormat(op);
+	return format == OPERAND_JUMP || format == OPERAND_LOOP;
+}
+
+static bool hasConstant(uint8_t op) {
+	switch (operandFormat(op)) {
+		case OPERAND_CONSTANT:
+		case OPERAND_CONSTANT_BYTE:
+		case OPERAND_CONSTANT_CACHE:
+		case OPERAND_CONSTANT_BYTE_CACHE:
+		case OPERAND_BYTE_CONSTANT_CACHE:
+		case OPERAND_CLOSURE:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Whether execution can continue to the following instruction.
+static bool fallsThrough(uint8_t op) {
+	return op != OP_JUMP && op != OP_LOOP && op != OP_POP_LOOP && op != OP_SWITCH && op != OP_RETURN && op != OP_THROW;
+}
+
+static size_t liveAt(Optimizer* opt, size_t index) {
+	while (index < opt->count && opt->code[index].removed) index++;
+	return index;
+}
+
+static size_t nextLive(Optimizer* opt, size_t index) {
+	return liveAt(opt, index + 1);
+}
+
+static bool decode(Optimizer* opt) {
+	Chunk* chunk = opt->chunk;
+	VM* vm = opt->vm;
+
+	opt->capacity = chunk->count;
+	opt->code = ALLOCATE(vm, Instruction, opt->capacity);
+	opt->count = 0;
+
+	size_t* instructionAt = ALLOCATE(vm, size_t, chunk->count);
+	for (size_t i = 0; i < chunk->count; i++) instructionAt[i] = SIZE_MAX;
+
+	bool valid = true;
+	size_t offset = 0;
+	while (offset < chunk->count) {
+		Instruction* instruction = &opt->code[opt->count];
+		instructionAt[offset] = opt->count++;
+
+		instruction->op = chunk->code[offset];
+		instruction->removed = false;
+		instruction->isTarget = false;
+		instruction->byte = 0;
+		instruction->secondByte = 0;
+		instruction->index = 0;
+		instruction->cache = 0;
+		instruction->target = 0;
+		instruction->line = getLine(&chunk->lines, offset);
+		instruction->upvalues = NULL;
+		instruction->upvalueCount = 0;
+
+		uint8_t* ip = &chunk->code[offset + 1];
+		switch (operandFormat(instruction->op)) {
+			case OPERAND_NONE: break;
+			case OPERAND_BYTE:
+				instruction->byte = *ip++;
+				break;
+			case OPERAND_BYTE_BYTE:
+				instruction->byte = *ip++;
+				instruction->secondByte = *ip++;
+				break;
+			case OPERAND_BYTE_CONSTANT_CACHE:
+				instruction->byte = *ip++;
+				ip += readUleb128(ip, &instruction->index);
+				ip += readUleb128(ip, &instruction->cache);
+				break;
+			case OPERAND_INDEX:
+			case OPERAND_CONSTANT:
+				ip += readUleb128(ip, &instruction->index);
+				break;
+			case OPERAND_CONSTANT_BYTE:
+				ip += readUleb128(ip, &instruction->index);
+				instruction->byte = *ip++;
+				break;
+			case OPERAND_CONSTANT_CACHE:
+				ip += readUleb128(ip, &instruction->index);
+				ip += readUleb128(ip, &instruction->cache);
+				break;
+			case OPERAND_CONSTANT_BYTE_CACHE:
+				ip += readUleb128(ip, &instruction->index);
+				instruction->byte = *ip++;
+				ip += readUleb128(ip, &instruction->cache);
+				break;
+			case OPERAND_JUMP: {
+				size_t jump = (size_t)((ip[0] << 8) | ip[1]);
+				ip += 2;
+				instruction->target = (size_t)(ip - chunk->code) + jump;
+				break;
+			}
+			case OPERAND_LOOP: {
+				size_t jump = (size_t)((ip[0] << 8) | ip[1]);
+				ip += 2;
+				size_t after = (size_t)(ip - chunk->code);
+				if (jump > after) valid = false;
+				instruction->target = after - jump;
+				break;
+			}
+			case OPERAND_CLOSURE: {
+				ip += readUleb128(ip, &instruction->index);
+				instruction->upvalues = ip;
+				instruction->upvalueCount = AS_FUNCTION(chunk->constants.values[instruction->index])->upvalueCount;
+				ip += instruction->upvalueCount * 2;
+				break;
+			}
+			case OPERAND_SWITCH:
+				instruction->index = (size_t)((ip[0] << 8) | ip[1]);
+				ip += 2;
+				if (instruction->index >= chunk->switchCount) valid = false;
+				break;
+		}
+		offset = (size_t)(ip - chunk->code);
+	}
+
+	// Jumps are converted from byte offsets to instruction indices, all of them must land on an instruction.
+	for (size_t i = 0; i < opt->count && valid; i++) {
+		Instruction* instruction = &opt->code[i];
+		if (!isJump(instruction->op)) continue;
+		if (instruction->target >= chunk->count || instructionAt[instruction->target] == SIZE_MAX) {
+			valid = false;
+			break;
+		}
+		instruction->target = instructionAt[instruction->target];
+	}
+
+	// So are the bounds of try blocks, a block can end at the end of the chunk.
+	opt->handlerCount = chunk->handlerCount;
+	opt->handlers = ALLOCATE(vm, ExceptionHandler, opt->handlerCount);
+	for (size_t i = 0; i < opt->handlerCount && valid; i++) {
+		ExceptionHandler handler = chunk->handlers[i];
+		if (handler.start > handler.end || handler.end > chunk->count || handler.handler >= chunk->count) {
+			valid = false;
+			break;
+		}
+		size_t start = handler.start < chunk->count ? instructionAt[handler.start] : opt->count;
+		size_t end = handler.end < chunk->count ? instructionAt[handler.end] : opt->count;
+		if (start == SIZE_MAX || end == SIZE_MAX || instructionAt[handler.handler] == SIZE_MAX) {
+			valid = false;
+			break;
+		}
+		opt->handlers[i] = (ExceptionHandler){ start, end, instructionAt[handler.handler], handler.depth };
+	}
+
+	// And the targets of switch tables.
+	opt->switchStarts = ALLOCATE(vm, size_t, chunk->switchCount + 1);
+	opt->switchTargetCount = 0;
+	for (size_t i = 0; i < chunk->switchCount; i++) {
+		opt->switchStarts[i] = opt->switchTargetCount;
+		opt->switchTargetCount += 1 + chunk->switches[i].count;
+	}
+	opt->switchStarts[chunk->switchCount] = opt->switchTargetCount;
+	opt->switchTargets = ALLOCATE(vm, size_t, opt->switchTargetCount);
+	for (size_t i = 0; i < chunk->switchCount; i++) {
+		SwitchTable* table = &chunk->switches[i];
+		size_t* targets = &opt->switchTargets[opt->switchStarts[i]];
+		for (size_t j = 0; j <= table->count; j++) {
+			size_t target = j == 0 ? table->defaultTarget : table->cases[j - 1].target;
+			if (target >= chunk->count || instructionAt[target] == SIZE_MAX) {
+				valid = false;
+				target = 0;
+			}
+			targets[j] = instructionAt[target];
+		}
+	}
+
+	FREE_ARRAY(vm, size_t, instructionAt, chunk->count);
+	return valid && offset == chunk->count;
+}
+
+// Removes the instructions marked as removed, jumps to a removed instruction land on the next live one.
+static void compact(Optimizer* opt) {
+	size_t oldCount = opt->count;
+	size_t* newIndex = ALLOCATE(opt->vm, size_t, oldCount + 1);
+
+	size_t live = 0;
+	for (size_t i = 0; i < opt->count; i++) {
+		newIndex[i] = live;
+		if (!opt->code[i].removed) live++;
+	}
+	newIndex[opt->count] = live;
+
+	size_t count = 0;
+	for (size_t i = 0; i < opt->count; i++) {
+		if (opt->code[i].removed) continue;
+		Instruction instruction = opt->code[i];
+		if (isJump(instruction.op)) instruction.target = newIndex[instruction.target];
+		opt->code[count++] = instruction;
+	}
+	opt->count = count;
+
+	for (size_t i = 0; i < opt->handlerCount; i++) {
+		ExceptionHandler* handler = &opt->handlers[i];
+		handler->start = newIndex[handler->start];
+		handler->end = newIndex[handler->end];
+		handler->handler = newIndex[handler->handler];
+	}
+	for (size_t i = 0; i < opt->switchTargetCount; i++) opt->switchTargets[i] = newIndex[opt->switchTargets[i]];
+
+	FREE_ARRAY(opt->vm, size_t, newIndex, oldCount + 1);
+}
+
+static void markTargets(Optimizer* opt) {
+	for (size_t i = 0; i < opt->count; i++) opt->code[i].isTarget = false;
+	for (size_t i = 0; i < opt->count; i++) {
+		Instruction* instruction = &opt->code[i];
+		if (instruction->removed || !isJump(instruction->op)) continue;
+		instruction->target = liveAt(opt, instruction->target);
+		if (instruction->target < opt->count) opt->code[instruction->target].isTarget = true;
+	}
+
+	// Nothing may be fused or folded across the bounds of a try block either.
+	for (size_t i = 0; i < opt->handlerCount; i++) {
+		ExceptionHandler* handler = &opt->handlers[i];
+		handler->start = liveAt(opt, handler->start);
+		handler->end = liveAt(opt, handler->end);
+		handler->handler = liveAt(opt, handler->handler);
+		if (handler->start < opt->count) opt->code[handler->start].isTarget = true;
+		if (handler->end < opt->count) opt->code[handler->end].isTarget = true;
+		if (handler->handler < opt->count) opt->code[handler->handler].isTarget = true;
+	}
+	for (size_t i = 0; i < opt->switchTargetCount; i++) {
+		opt->switchTargets[i] = liveAt(opt, opt->switchTargets[i]);
+		if (opt->switchTargets[i] < opt->count) opt->code[opt->switchTargets[i]].isTarget = true;
+	}
+}
+
+/*
+  Jump Threading
+*/
+
+static bool threadJumps(Optimizer* opt) {
+	bool changed = false;
+
+	for (size_t i = 0; i < opt->count; i++) {
+		Instruction* jump = &opt->code[i];
+		if (jump->removed) continue;
+
+		// 'break' pushes false and loops back to the loop's exit condition, jump straight to the exit instead.
+		if (jump->op == OP_FALSE || jump->op == OP_TRUE) {
+			size_t next = nextLive(opt, i);
+			if (next >= opt->count) continue;
+			Instruction* loop = &opt->code[next];
+			if ((loop->op != OP_JUMP && loop->op != OP_LOOP) || loop->isTarget) continue;
+
+			size_t condition = liveAt(opt, loop->target);
+			if (condition >= opt->count || opt->code[condition].op != OP_JUMP_IF_FALSE) continue;
+
+			jump->target = jump->op == OP_FALSE ? liveAt(opt, opt->code[condition].target) : nextLive(opt, condition);
+			jump->op = OP_JUMP;
+			changed = true;
+			continue;
+		}
+
+		if (jump->op != OP_JUMP && jump->op != OP_LOOP && jump->op != OP_JUMP_IF_FALSE && jump->op != OP_JUMP_IF_FALSE_SC) continue;
+
+		size_t target = liveAt(opt, jump->target);
+		for (size_t hops = 0; hops < MAX_THREAD_HOPS && target < opt->count; hops++) {
+			Instruction* destination = &opt->code[target];
+			size_t next;
+			if (destination->op == OP_JUMP || destination->op == OP_LOOP) {
+				next = liveAt(opt, destination->target);
+			}
+			else if (jump->op == OP_JUMP_IF_FALSE_SC && destination->op == OP_JUMP_IF_FALSE_SC) {
+				// The value is known to be falsey, so the second jump is taken too.
+				next = liveAt(opt, destination->target);
+			}
+			else {
+				break;
+			}
+			// Conditional jumps can only be encoded forwards.
+			if (next == target || (jump->op != OP_JUMP && jump->op != OP_LOOP && next <= i)) break;
+			target = next;
+		}
+
+		if (target != jump->target) {
+			jump->target = target;
+			changed = true;
+		}
+
+		if (target == nextLive(opt, i)) {
+			if (jump->op == OP_JUMP_IF_FALSE) {
+				jump->op = OP_POP;
+			}
+			else {
+				jump->removed = true;
+			}
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+/*
+  Constant Folding
+*/
+
+static bool literalValue(Optimizer* opt, Instruction* instruction, Value* value) {
+	if (instruction->removed) return false;
+	switch (instruction->op) {
+		case OP_NULL: *value = NULL_VAL; return true;
+		case OP_TRUE: *value = BOOL_VAL(true); return true;
+		case OP_FALSE: *value = BOOL_VAL(false); return true;
+		case OP_CONSTANT: {
+			Value constant = opt->chunk->constants.values[instruction->index];
+			if (!IS_NUMBER(constant) && !IS_STRING(constant)) return false;
+			*value = constant;
+			return true;
+		}
+		default: return false;
+	}
+}
+
+static void setLiteral(Optimizer* opt, Instruction* instruction, Value value) {
+	if (IS_BOOL(value)) {
+		instruction->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+	}
+	else if (IS_NULL(value)) {
+		instruction->op = OP_NULL;
+	}
+	else {
+		push(opt->vm, value); // GC
+		instruction->op = OP_CONSTANT;
+		instruction->index = addConstant(opt->vm, opt->chunk, value);
+		pop(opt->vm);
+	}
+}
+
+// Integer operands as the VM's bitwise operators require them, values which would throw or overflow aren't folded.
+static bool integerOperand(double value, intmax_t* result) {
+	if (floor(value) != value || fabs(value) >= 9007199254740992.0) return false;
+	*result = (intmax_t)value;
+	return true;
+}
+
+static bool foldUnary(uint8_t op, Value operand, Value* result) {
+	switch (op) {
+		case OP_NOT:
+			*result = BOOL_VAL(isFalsey(operand));
+			return true;
+		case OP_NEGATE:
+			if (!IS_NUMBER(operand)) return false;
+			*result = NUMBER_VAL(-AS_NUMBER(operand));
+			return true;
+		case OP_BIT_NOT: {
+			intmax_t value;
+			if (!IS_NUMBER(operand) || !integerOperand(AS_NUMBER(operand), &value)) return false;
+			*result = NUMBER_VAL((double)~value);
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+static bool foldBinary(VM* vm, uint8_t op, Value a, Value b, Value* result) {
+	if (op == OP_EQUAL || op == OP_NOT_EQUAL) {
+		bool equal = valuesEqual(a, b);
+		*result = BOOL_VAL(op == OP_EQUAL ? equal : !equal);
+		return true;
+	}
+
+	if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+		ObjString* left = AS_STRING(a);
+		ObjString* right = AS_STRING(b);
+		size_t length = left->length + right->length;
+		char* chars = ALLOCATE(vm, char, length + 1);
+		memcpy(chars, left->chars, left->length);
+		memcpy(chars + left->length, right->chars, right->length);
+		chars[length] = '\0';
+		*result = OBJ_VAL(takeString(vm, chars, length));
+		return true;
+	}
+
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+	double x = AS_NUMBER(a);
+	double y = AS_NUMBER(b);
+
+	switch (op) {
+		case OP_ADD: *result = NUMBER_VAL(x + y); return true;
+		case OP_SUB: *result = NUMBER_VAL(x - y); return true;
+		case OP_MUL: *result = NUMBER_VAL(x * y); return true;
+		case OP_DIV: *result = NUMBER_VAL(x / y); return true;
+		case OP_MOD: *result = NUMBER_VAL(fmod(x, y)); return true;
+		case OP_GREATER: *result = BOOL_VAL(x > y); return true;
+		case OP_GREATER_EQ: *result = BOOL_VAL(x >= y); return true;
+		case OP_LESS: *result = BOOL_VAL(x < y); return true;
+		case OP_LESS_EQ: *result = BOOL_VAL(x <= y); return true;
+		case OP_AND:
+		case OP_OR:
+		case OP_XOR:
+		case OP_LSH:
+		case OP_ASH:
+		case OP_RSH: {
+			intmax_t left, right;
+			if (!integerOperand(x, &left) || !integerOperand(y, &right)) return false;
+			switch (op) {
+				case OP_AND: *result = NUMBER_VAL((double)(left & right)); return true;
+				case OP_OR: *result = NUMBER_VAL((double)(left | right)); return true;
+				case OP_XOR: *result = NUMBER_VAL((double)(left ^ right)); return true;
+				default: break;
+			}
+			if (right < 0 || right >= 64 || left < 0) return false;
+			switch (op) {
+				case OP_LSH: *result = NUMBER_VAL((double)(left << right)); return true;
+				case OP_ASH: *result = NUMBER_VAL((double)(left >> right)); return true;
+				case OP_RSH: *result = NUMBER_VAL((double)((uintmax_t)left >> (uintmax_t)right)); return true;
+				default: return false;
+			}
+		}
+		default:
+			return false;
+	}
+}
+
+static bool foldConstants(Optimizer* opt) {
+	bool changed = false;
+
+	for (size_t i = 0; i < opt->count; i++) {
+		Instruction* first = &opt->code[i];
+		Value a;
+		if (!literalValue(opt, first, &a)) continue;
+
+		size_t secondIndex = nextLive(opt, i);
+		if (secondIndex >= opt->count) continue;
+		Instruction* second = &opt->code[secondIndex];
+		if (second->isTarget) continue;
+
+		Value result;
+		if (foldUnary(second->op, a, &result)) {
+			setLiteral(opt, first, result);
+			second->removed = true;
+			changed = true;
+			i--; // The result may fold with what follows.
+			continue;
+		}
+
+		// A condition on a literal is either always or never taken.
+		if (second->op == OP_JUMP_IF_FALSE) {
+			if (isFalsey(a)) {
+				first->op = OP_JUMP;
+				first->target = second->target;
+			}
+			else {
+				first->removed = true;
+			}
+			second->removed = true;
+			changed = true;
+			continue;
+		}
+
+		Value b;
+		if (!literalValue(opt, second, &b)) continue;
+
+		size_t thirdIndex = nextLive(opt, secondIndex);
+		if (thirdIndex >= opt->count) continue;
+		Instruction* third = &opt->code[thirdIndex];
+		if (third->isTarget) continue;
+
+		if (foldBinary(opt->vm, third->op, a, b, &result)) {
+			setLiteral(opt, first, result);
+			second->removed = true;
+			third->removed = true;
+			changed = true;
+			i--;
+		}
+	}
+
+	return changed;
+}
+
+/*
+  Dead Code Removal
+*/
+
+static bool eliminateDeadCode(Optimizer* opt) {
+	if (opt->count == 0) return false;
+
+	bool* reachable = ALLOCATE(opt->vm, bool, opt->count);
+	size_t* worklist = ALLOCATE(opt->vm, size_t, opt->count);
+	for (size_t i = 0; i < opt->count; i++) reachable[i] = false;
+
+	size_t pending = 0;
+	worklist[pending++] = 0;
+	reachable[0] = true;
+
+	while (pending > 0) {
+		while (pending > 0) {
+			size_t index = worklist[--pending];
+			Instruction* instruction = &opt->code[index];
+
+			size_t successors[2];
+			size_t successorCount = 0;
+			if (fallsThrough(instruction->op)) successors[successorCount++] = index + 1;
+			if (isJump(instruction->op)) successors[successorCount++] = instruction->target;
+
+			for (size_t i = 0; i < successorCount; i++) {
+				size_t successor = successors[i];
+				if (successor < opt->count && !reachable[successor]) {
+					reachable[successor] = true;
+					worklist[pending++] = successor;
+				}
+			}
+			if (instruction->op != OP_SWITCH) continue;
+			for (size_t i = opt->switchStarts[instruction->index]; i < opt->switchStarts[instruction->index + 1]; i++) {
+				size_t successor = opt->switchTargets[i];
+				if (successor < opt->count && !reachable[successor]) {
+					reachable[successor] = true;
+					worklist[pending++] = successor;
+				}
+			}
+		}
+
+		// A catch block is reachable if anything in its try block is.
+		for (size_t i = 0; i < opt->handlerCount; i++) {
+			ExceptionHandler* handler = &opt->handlers[i];
+			if (handler->handler >= opt->count || reachable[handler->handler]) continue;
+			for (size_t j = handler->start; j < handler->end; j++) {
+				if (reachable[j]) {
+					reachable[handler->handler] = true;
+					worklist[pending++] = handler->handler;
+					break;
+				}
+			}
+		}
+	}
+
+	bool changed = false;
+	for (size_t i = 0; i < opt->count; i++) {
+		if (!reachable[i]) {
+			opt->code[i].removed = true;
+			changed = true;
+		}
+	}
+
+	FREE_ARRAY(opt->vm, bool, reachable, opt->count);
+	FREE_ARRAY(opt->vm, size_t, worklist, opt->count);
+	return changed;
+}
+
+/*
+  Superinstructions
+  Run once after the other passes, as they only understand the instructions the compiler emits. A pair is fused when
+  nothing jumps to its second instruction, the fused instruction takes the operands of both.
+*/
+
+static bool fuse(Instruction* first, Instruction* second) {
+	switch (first->op) {
+		case OP_GET_LOCAL:
+			if (second->op == OP_GET_LOCAL) {
+				first->op = OP_GET_LOCAL_GET_LOCAL;
+				first->secondByte = second->byte;
+				return true;
+			}
+			if (second->op == OP_GET_PROPERTY) {
+				first->op = OP_GET_LOCAL_GET_PROPERTY;
+				first->index = second->index;
+				first->cache = second->cache;
+				return true;
+			}
+			return false;
+		case OP_CONSTANT:
+			if (second->op != OP_ADD) return false;
+			first->op = OP_ADD_CONSTANT;
+			return true;
+		case OP_SET_LOCAL:
+			if (second->op != OP_POP) return false;
+			first->op = OP_SET_LOCAL_POP;
+			return true;
+		case OP_SET_GLOBAL:
+			if (second->op != OP_POP) return false;
+			first->op = OP_SET_GLOBAL_POP;
+			return true;
+		case OP_LESS:
+			if (second->op != OP_JUMP_IF_FALSE) return false;
+			first->op = OP_LESS_JUMP_IF_FALSE;
+			first->target = second->target;
+			return true;
+		case OP_POP:
+			if (second->op != OP_LOOP) return false;
+			first->op = OP_POP_LOOP;
+			first->target = second->target;
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool fuseInstructions(Optimizer* opt) {
+	bool changed = false;
+	for (size_t i = 0; i + 1 < opt->count; i++) {
+		Instruction* first = &opt->code[i];
+		Instruction* second = &opt->code[i + 1];
+		if (second->isTarget) continue;
+		// A loop is only known to stay backwards if it already is.
+		if (second->op == OP_LOOP && second->target > i) continue;
+
+		if (fuse(first, second)) {
+			second->removed = true;
+			changed = true;
+			i++;
+		}
+	}
+	return changed;
+}
+
+/*
+  Encoding and Constant Deduplication
+*/
+
+static bool sameConstant(Value a, Value b) {
+	if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		// Compared bitwise, so that 0 and -0 are kept apart.
+		double x = AS_NUMBER(a);
+		double y = AS_NUMBER(b);
+		return memcmp(&x, &y, sizeof(double)) == 0;
+	}
+	if (IS_OBJ(a) && IS_OBJ(b)) return AS_OBJ(a) == AS_OBJ(b);
+	return false;
+}
+
+static size_t internConstant(VM* vm, ValueArray* constants, Table* strings, Value value) {
+	if (IS_STRING(value)) {
+		Value index;
+		if (tableGet(strings, AS_STRING(value), &index)) return (size_t)AS_NUMBER(index);
+		writeValueArray(vm, constants, value);
+		tableSet(vm, strings, AS_STRING(value), NUMBER_VAL((double)(constants->count - 1)));
+		return constants->count - 1;
+	}
+
+	for (size_t i = 0; i < constants->count; i++) {
+		if (sameConstant(constants->values[i], value)) return i;
+	}
+	writeValueArray(vm, constants, value);
+	return constants->count - 1;
+}
+
+static size_t instructionSize(Instruction* instruction) {
+	switch (operandFormat(instruction->op)) {
+		case OPERAND_NONE: return 1;
+		case OPERAND_BYTE: return 2;
+		case OPERAND_BYTE_BYTE: return 3;
+		case OPERAND_BYTE_CONSTANT_CACHE: return 2 + uleb128Size(instruction->index) + uleb128Size(instruction->cache);
+		case OPERAND_INDEX:
+		case OPERAND_CONSTANT: return 1 + uleb128Size(instruction->index);
+		case OPERAND_CONSTANT_BYTE: return 2 + uleb128Size(instruction->index);
+		case OPERAND_CONSTANT_CACHE: return 1 + uleb128Size(instruction->index) + uleb128Size(instruction->cache);
+		case OPERAND_CONSTANT_BYTE_CACHE: return 2 + uleb128Size(instruction->index) + uleb128Size(instruction->cache);
+		case OPERAND_JUMP:
+		case OPERAND_LOOP:
+		case OPERAND_SWITCH: return 3;
+		case OPERAND_CLOSURE: return 1 + uleb128Size(instruction->index) + instruction->upvalueCount * 2;
+	}
+	return 1;
+}
+
+static void encode(Optimizer* opt) {
+	VM* vm = opt->vm;
+	Chunk* chunk = opt->chunk;
+
+	ValueArray constants;
+	initValueArray(&constants);
+	Table strings;
+	initTable(&strings);
+
+	for (size_t i = 0; i < opt->count; i++) {
+		Instruction* instruction = &opt->code[i];
+		if (hasConstant(instruction->op)) {
+			instruction->index = internConstant(vm, &constants, &strings, chunk->constants.values[instruction->index]);
+		}
+	}
+	freeTable(vm, &strings);
+
+	size_t* offsets = ALLOCATE(vm, size_t, opt->count + 1);
+	size_t offset = 0;
+	for (size_t i = 0; i < opt->count; i++) {
+		offsets[i] = offset;
+		offset += instructionSize(&opt->code[i]);
+	}
+	offsets[opt->count] = offset;
+
+	// Unconditional jumps are encoded as OP_JUMP or OP_LOOP depending on their direction.
+	bool valid = true;
+	for (size_t i = 0; i < opt->count; i++) {
+		Instruction* instruction = &opt->code[i];
+		if (!isJump(instruction->op)) continue;
+		if (instruction->target >= opt->count) {
+			valid = false;
+			break;
+		}
+		size_t after = offsets[i] + 3;
+		size_t destination = offsets[instruction->target];
+
+		if (instruction->op == OP_JUMP || instruction->op == OP_LOOP) {
+			instruction->op = destination >= after ? OP_JUMP : OP_LOOP;
+		}
+		if (operandFormat(instruction->op) == OPERAND_LOOP ? destination > after || after - destination > UINT16_MAX : destination < after || destination - after > UINT16_MAX) {
+			valid = false;
+			break;
+		}
+	}
+
+	if (!valid) {
+		FREE_ARRAY(vm, size_t, offsets, opt->count + 1);
+		freeValueArray(vm, &constants);
+		return;
+	}
+
+	Chunk optimized;
+	initChunk(&optimized);
+	for (size_t i = 0; i < opt->count; i++) {
+		Instruction* instruction = &opt->code[i];
+		size_t line = instruction->line;
+		writeChunk(vm, &optimized, instruction->op, line);
+
+		switch (operandFormat(instruction->op)) {
+			case OPERAND_NONE: break;
+			case OPERAND_BYTE:
+				writeChunk(vm, &optimized, instruction->byte, line);
+				break;
+			case OPERAND_BYTE_BYTE:
+				writeChunk(vm, &optimized, instruction->byte, line);
+				writeChunk(vm, &optimized, instruction->secondByte, line);
+				break;
+			case OPERAND_BYTE_CONSTANT_CACHE:
+				writeChunk(vm, &optimized, instruction->byte, line);
+				writeUleb128(vm, &optimized, instruction->index, line);
+				writeUleb128(vm, &optimized, instruction->cache, line);
+				break;
+			case OPERAND_INDEX:
+			case OPERAND_CONSTANT:
+				writeUleb128(vm, &optimized, instruction->index, line);
+				break;
+			case OPERAND_CONSTANT_BYTE:
+				writeUleb128(vm, &optimized, instruction->index, line);
+				writeChunk(vm, &optimized, instruction->byte, line);
+				break;
+			case OPERAND_CONSTANT_CACHE:
+				writeUleb128(vm, &optimized, instruction->index, line);
+				writeUleb128(vm, &optimized, instruction->cache, line);
+				break;
+			case OPERAND_CONSTANT_BYTE_CACHE:
+				writeUleb128(vm, &optimized, instruction->index, line);
+				writeChunk(vm, &optimized, instruction->byte, line);
+				writeUleb128(vm, &optimized, instruction->cache, line);
+				break;
+			case OPERAND_JUMP:
+			case OPERAND_LOOP: {
+				size_t after = offsets[i] + 3;
+				size_t destination = offsets[instruction->target];
+				size_t jump = operandFormat(instruction->op) == OPERAND_LOOP ? after - destination : destination - after;
+				writeChunk(vm, &optimized, (jump >> 8) & 0xff, line);
+				writeChunk(vm, &optimized, jump & 0xff, line);
+				break;
+			}
+			case OPERAND_CLOSURE:
+				writeUleb128(vm, &optimized, instruction->index, line);
+				for (size_t j = 0; j < instruction->upvalueCount * 2; j++) {
+					writeChunk(vm, &optimized, instruction->upvalues[j], line);
+				}
+				break;
+			case OPERAND_SWITCH:
+				writeChunk(vm, &optimized, (instruction->index >> 8) & 0xff, line);
+				writeChunk(vm, &optimized, instruction->index & 0xff, line);
+				break;
+		}
+	}
+	// The old code, lines and constants are freed, the inline caches, exception handlers and switch tables are kept (the
+	// handlers and tables with their new offsets).
+	Chunk old = *chunk;
+	chunk->code = optimized.code;
+	chunk->count = optimized.count;
+	chunk->capacity = optimized.capacity;
+	chunk->lines = optimized.lines;
+	chunk->constants = constants;
+	// Try blocks left empty (by dead code removal) can't catch anything, so are dropped.
+	chunk->handlerCount = 0;
+	for (size_t i = 0; i < opt->handlerCount; i++) {
+		ExceptionHandler* handler = &opt->handlers[i];
+		if (handler->start >= handler->end) continue;
+		chunk->handlers[chunk->handlerCount++] = (ExceptionHandler){ offsets[handler->start], offsets[handler->end], offsets[handler->handler], handler->depth };
+	}
+	for (size_t i = 0; i < chunk->switchCount; i++) {
+		SwitchTable* table = &chunk->switches[i];
+		size_t* targets = &opt->switchTargets[opt->switchStarts[i]];
+		table->defaultTarget = offsets[targets[0]];
+		for (size_t j = 0; j < table->count; j++) table->cases[j].target = offsets[targets[j + 1]];
+	}
+
+	old.caches = NULL;
+	old.cacheCapacity = 0;
+	old.handlers = NULL;
+	old.handlerCapacity = 0;
+	old.switches = NULL;
+	old.switchCount = 0;
+	old.switchCapacity = 0;
+	freeChunk(vm, &old);
+	FREE_ARRAY(vm, size_t, offsets, opt->count + 1);
+}
+
+void optimizeChunk(VM* vm, Chunk* chunk) {
+	if (chunk->count == 0) return;
+
+	Optimizer opt;
+	opt.vm = vm;
+	opt.chunk = chunk;
+	opt.handlers = NULL;
+	opt.handlerCount = 0;
+	opt.switchTargets = NULL;
+	opt.switchTargetCount = 0;
+	opt.switchStarts = NULL;
+
+	if (decode(&opt)) {
+		bool changed = true;
+		for (size_t round = 0; changed && round < MAX_ROUNDS; round++) {
+			markTargets(&opt);
+			changed = threadJumps(&opt);
+			compact(&opt);
+
+			markTargets(&opt);
+			changed |= foldConstants(&opt);
+			compact(&opt);
+
+			changed |= eliminateDeadCode(&opt);
+			compact(&opt);
+		}
+
+		markTargets(&opt);
+		if (fuseInstructions(&opt)) compact(&opt);
+		encode(&opt);
+	}
+
+	FREE_ARRAY(vm, Instruction, opt.code, opt.capacity);
+	FREE_ARRAY(vm, ExceptionHandler, opt.handlers, opt.handlerCount);
+	FREE_ARRAY(vm, size_t, opt.switchTargets, opt.switchTargetCount);
+	FREE_ARRAY(vm, size_t, opt.switchStarts, chunk->switchCount + 1);
+}
+size_t instructionLength(Chunk* chunk, size_t offset) {
+	uint8_t* ip = &chunk->code[offset + 1];
+	size_t index;
+	switch (operandFormat(chunk->code[offset])) {
+		case OPERAND_NONE: break;
+		case OPERAND_BYTE: ip++; break;
+		case OPERAND_BYTE_BYTE: ip += 2; break;
+		case OPERAND_BYTE_CONSTANT_CACHE:
+			ip++;
+			ip += readUleb128(ip, &index);
+			ip += readUleb128(ip, &index);
+			break;
+		case OPERAND_INDEX:
+		case OPERAND_CONSTANT:
+			ip += readUleb128(ip, &index);
+			break;
+		case OPERAND_CONSTANT_BYTE:
+			ip += readUleb128(ip, &index);
+			ip++;
+			break;
+		case OPERAND_CONSTANT_CACHE:
+			ip += readUleb128(ip, &index);
+			ip += readUleb128(ip, &index);
+			break;
+		case OPERAND_CONSTANT_BYTE_CACHE:
+			ip += readUleb128(ip, &index);
+			ip++;
+			ip += readUleb128(ip, &index);
+			break;
+		case OPERAND_JUMP:
+		case OPERAND_LOOP:
+		case OPERAND_SWITCH:
+			ip += 2;
+			break;
+		case OPERAND_CLOSURE:
+			ip += readUleb128(ip, &index);
+			ip += AS_FUNCTION(chunk->constants.values[index])->upvalueCount * 2;
+			break;
+	}
+	return (size_t)(ip - &chunk->code[offset]);
+}
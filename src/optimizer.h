@@ -0,0 +1,15 @@
+#pragma once
+#include "common.h"
+#include "chunk.h"
+
+/*
+  Post-compile optimizations over a finished chunk, run at optimization level 1 and above ('-O1', the default).
+  - Constant folding of arithmetic, comparison and logical operators on literal operands.
+  - Jump threading, jumps to unconditional jumps are retargeted to the final destination.
+  - Dead code removal of instructions which can't be reached.
+  - Superinstructions, common pairs of instructions (e.g. GET_LOCAL then GET_PROPERTY, LESS then JUMP_IF_FALSE) are
+    fused into a single instruction. The pairs were chosen from opcode pair counts ('--opcode-stats').
+  - Constant pool deduplication, identical constants share a single index.
+*/
+void optimizeChunk(VM* vm, Chunk* chunk);// The size in bytes of the instruction at offset, opcode and operands.
+size_t instructionLength(Chunk* chunk, size_t offset);
@@ -0,0 +1,124 @@
+#include "pool.h"
+#include <stdlib.h>
+
+// Freed cells are poisoned under AddressSanitizer, so objects used after being swept are still caught.
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define POOL_ASAN
+#endif
+#endif
+#if defined(__SANITIZE_ADDRESS__)
+#define POOL_ASAN
+#endif
+
+#ifdef POOL_ASAN
+#include <sanitizer/asan_interface.h>
+#define POISON(pointer, size) ASAN_POISON_MEMORY_REGION(pointer, size)
+#define UNPOISON(pointer, size) ASAN_UNPOISON_MEMORY_REGION(pointer, size)
+#else
+#define POISON(pointer, size) ((void)(pointer), (void)(size))
+#define UNPOISON(pointer, size) ((void)(pointer), (void)(size))
+#endif
+
+struct PoolCell {
+	PoolCell* next;
+};
+
+struct PoolSlab {
+	PoolSlab* next;
+	// Keeps the cells following the header aligned for any object.
+	union {
+		double number;
+		void* pointer;
+	} align[];
+};
+
+void initAllocator(Allocator* allocator) {
+	for (size_t i = 0; i < POOL_CLASS_COUNT; i++) {
+		Pool* pool = &allocator->pools[i];
+		pool->freeCells = NULL;
+		pool->unused = NULL;
+		pool->unusedEnd = NULL;
+		pool->allocations = 0;
+		pool->liveCells = 0;
+		pool->slabCount = 0;
+	}
+	allocator->slabs = NULL;
+	allocator->largeAllocations = 0;
+	allocator->liveLarge = 0;
+}
+
+size_t poolCellSize(size_t poolIndex) {
+	return (poolIndex + 1) * POOL_GRANULE;
+}
+
+static bool addSlab(Allocator* allocator, Pool* pool) {
+	PoolSlab* slab = (PoolSlab*)malloc(POOL_SLAB_SIZE);
+	if (slab == NULL) return false;
+
+	slab->next = allocator->slabs;
+	allocator->slabs = slab;
+	pool->unused = (char*)slab->align;
+	pool->unusedEnd = (char*)slab + POOL_SLAB_SIZE;
+	pool->slabCount++;
+	POISON(pool->unused, pool->unusedEnd - pool->unused);
+	return true;
+}
+
+void* poolAllocate(Allocator* allocator, size_t size) {
+	if (size > POOL_MAX_CELL) {
+		void* pointer = malloc(size);
+		if (pointer == NULL) return NULL;
+		allocator->largeAllocations++;
+		allocator->liveLarge++;
+		return pointer;
+	}
+
+	size_t index = (size - 1) / POOL_GRANULE;
+	size_t cellSize = poolCellSize(index);
+	Pool* pool = &allocator->pools[index];
+
+	void* cell;
+	if (pool->freeCells != NULL) {
+		cell = pool->freeCells;
+		UNPOISON(cell, cellSize);
+		pool->freeCells = pool->freeCells->next;
+	}
+	else {
+		if ((size_t)(pool->unusedEnd - pool->unused) < cellSize && !addSlab(allocator, pool)) return NULL;
+		cell = pool->unused;
+		pool->unused += cellSize;
+		UNPOISON(cell, cellSize);
+	}
+
+	pool->allocations++;
+	pool->liveCells++;
+	return cell;
+}
+
+void poolFree(Allocator* allocator, void* pointer, size_t size) {
+	if (size > POOL_MAX_CELL) {
+		free(pointer);
+		allocator->liveLarge--;
+		return;
+	}
+
+	size_t index = (size - 1) / POOL_GRANULE;
+	Pool* pool = &allocator->pools[index];
+	PoolCell* cell = (PoolCell*)pointer;
+	cell->next = pool->freeCells;
+	pool->freeCells = cell;
+	pool->liveCells--;
+	POISON(cell, poolCellSize(index));
+}
+
+void freeAllocator(Allocator* allocator) {
+	PoolSlab* slab = allocator->slabs;
+	while (slab != NULL) {
+		PoolSlab* next = slab->next;
+		UNPOISON(slab, POOL_SLAB_SIZE);
+		free(slab);
+		slab = next;
+	}
+	initAllocator(allocator);
+}
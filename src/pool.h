@@ -0,0 +1,45 @@
+#pragma once
+#include "common.h"
+
+/*
+  Size-class pools for objects, so allocating and freeing the small fixed-size objects the VM churns through (upvalues,
+  bound methods, closures, strings, instances) doesn't go through malloc and free.
+  - Sizes are rounded up to a multiple of POOL_GRANULE, each size up to POOL_MAX_CELL has its own pool of cells carved
+    from POOL_SLAB_SIZE slabs, larger ones are left to malloc.
+  - Freed cells go on their pool's free list and are reused by the next allocation of that size. Slabs are only
+    released when the allocator is freed.
+  - A pool belongs to a single VM and so needs no locking.
+*/
+
+#define POOL_GRANULE 8
+#define POOL_MAX_CELL 256
+#define POOL_CLASS_COUNT (POOL_MAX_CELL / POOL_GRANULE)
+#define POOL_SLAB_SIZE (64 * 1024)
+
+typedef struct PoolCell PoolCell;
+typedef struct PoolSlab PoolSlab;
+
+typedef struct {
+	PoolCell* freeCells;
+	// The part of the newest slab which hasn't been handed out yet.
+	char* unused;
+	char* unusedEnd;
+	size_t allocations;
+	size_t liveCells;
+	size_t slabCount;
+} Pool;
+
+typedef struct {
+	Pool pools[POOL_CLASS_COUNT];
+	PoolSlab* slabs;
+	size_t largeAllocations;
+	size_t liveLarge;
+} Allocator;
+
+void initAllocator(Allocator* allocator);
+// Returns NULL when out of memory.
+void* poolAllocate(Allocator* allocator, size_t size);
+// Size must be the size the memory was allocated with.
+void poolFree(Allocator* allocator, void* pointer, size_t size);
+void freeAllocator(Allocator* allocator);
+size_t poolCellSize(size_t poolIndex);
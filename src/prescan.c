@@ -0,0 +1,282 @@
+#include "prescan.h"
+#include "bytecode.h"
+#include "file.h"
+#include "object.h"
+#include "scanner.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IMPORT_PATH_MAX 1024
+
+// Called with the lock held.
+static PrescanJob** findJob(Prescan* prescan, const char* path, uint32_t hash) {
+	size_t index = hash & (prescan->jobCapacity - 1);
+	for (;;) {
+		PrescanJob** entry = &prescan->jobs[index];
+		if (*entry == NULL || ((*entry)->hash == hash && strcmp((*entry)->path, path) == 0)) return entry;
+		index = (index + 1) & (prescan->jobCapacity - 1);
+	}
+}
+
+// Called with the lock held.
+static bool growJobs(Prescan* prescan) {
+	size_t capacity = prescan->jobCapacity < 16 ? 16 : prescan->jobCapacity * 2;
+	PrescanJob** jobs = calloc(capacity, sizeof(PrescanJob*));
+	if (jobs == NULL) return false;
+
+	PrescanJob** old = prescan->jobs;
+	size_t oldCapacity = prescan->jobCapacity;
+	prescan->jobs = jobs;
+	prescan->jobCapacity = capacity;
+	for (size_t i = 0; i < oldCapacity; i++) {
+		if (old[i] != NULL) *findJob(prescan, old[i]->path, old[i]->hash) = old[i];
+	}
+	free(old);
+	return true;
+}
+
+static void runJobs(void* argument);
+
+// Queues the module imported as importPath (e.g. 'lib/util') unless it already has a job.
+static void queueImport(Prescan* prescan, const char* importPath) {
+	size_t length = strlen(prescan->directory) + strlen(importPath) + 6;
+	char* path = malloc(length);
+	if (path == NULL) return;
+	// The same path OP_IMPORT looks the module up by.
+	snprintf(path, length, "%s/%s.dgn", prescan->directory, importPath);
+	uint32_t hash = hashString(path, strlen(path));
+
+	lockMutex(&prescan->lock);
+	if (prescan->stopping || ((prescan->jobCount + 1) * 4 > prescan->jobCapacity * 3 && !growJobs(prescan))) {
+		unlockMutex(&prescan->lock);
+		free(path);
+		return;
+	}
+
+	PrescanJob** entry = findJob(prescan, path, hash);
+	if (*entry != NULL) {
+		unlockMutex(&prescan->lock);
+		free(path);
+		return;
+	}
+
+	PrescanJob* job = malloc(sizeof(PrescanJob));
+	if (job == NULL) {
+		unlockMutex(&prescan->lock);
+		free(path);
+		return;
+	}
+	job->path = path;
+	job->hash = hash;
+	job->state = PRESCAN_QUEUED;
+	job->bytecode = NULL;
+	job->length = 0;
+	job->nextQueued = NULL;
+	*entry = job;
+	prescan->jobCount++;
+
+	if (prescan->queueTail == NULL) prescan->queueHead = job;
+	else prescan->queueTail->nextQueued = job;
+	prescan->queueTail = job;
+
+	// A thread which can't be started only leaves more for the others, or for the imports themselves.
+	if (prescan->idleThreads == 0 && prescan->threadCount < prescan->maxThreads) {
+		if (startThread(&prescan->threads[prescan->threadCount], runJobs, prescan)) prescan->threadCount++;
+	}
+	broadcastCondition(&prescan->changed);
+	unlockMutex(&prescan->lock);
+}
+
+// Queues every module named by an import statement in source, found by its tokens alone.
+static void scanImports(Prescan* prescan, const char* source) {
+	Scanner scanner;
+	initScanner(&scanner, source);
+
+	Token token = scanToken(&scanner);
+	while (token.type != TOKEN_EOF) {
+		if (token.type != TOKEN_IMPORT) {
+			token = scanToken(&scanner);
+			continue;
+		}
+
+		// Joined with '/' as the compiler does, e.g. 'import lib.util;' to 'lib/util'.
+		char path[IMPORT_PATH_MAX];
+		size_t length = 0;
+		bool valid = true;
+		token = scanToken(&scanner);
+		while (token.type == TOKEN_IDENTIFIER) {
+			if (length + token.length + 1 > IMPORT_PATH_MAX) valid = false;
+			if (valid) {
+				memcpy(&path[length], token.start, token.length);
+				length += token.length;
+				path[length++] = '/';
+			}
+			token = scanToken(&scanner);
+			if (token.type != TOKEN_DOT) break;
+			token = scanToken(&scanner);
+		}
+
+		if (valid && length > 0) {
+			path[length - 1] = '\0';
+			queueImport(prescan, path);
+		}
+	}
+}
+
+static void runJob(Prescan* prescan, VM* vm, PrescanJob* job) {
+	MappedFile source;
+	if (!mapFile(job->path, &source)) return;
+	scanImports(prescan, source.data);
+
+	char* cachePath = NULL;
+	if (prescan->bytecodeCache) {
+		cachePath = bytecodePath(job->path);
+		size_t length;
+		uint8_t* cached = readFileBytes(cachePath, &length);
+		if (cached != NULL && checkBytecode(vm, cached, length, job->path)) {
+			job->bytecode = cached;
+			job->length = length;
+			free(cachePath);
+			unmapFile(&source);
+			return;
+		}
+		free(cached);
+	}
+
+	job->bytecode = compileImport(vm, job->path, source.data, &job->length);
+	// A cache which can't be written (e.g. a read only directory) is only a missed speed up.
+	if (job->bytecode != NULL && cachePath != NULL) writeFileAtomic(cachePath, job->bytecode, job->length);
+
+	free(cachePath);
+	unmapFile(&source);
+}
+
+static void runJobs(void* argument) {
+	Prescan* prescan = argument;
+
+	VM vm;
+	initVM(&vm);
+	vm.optimizationLevel = prescan->optimizationLevel;
+	vm.bytecodeCache = prescan->bytecodeCache;
+	vm.importPrescan = false;
+	vm.reportCompileErrors = false;
+
+	lockMutex(&prescan->lock);
+	for (;;) {
+		// Jobs already taken by their imports are skipped.
+		while (prescan->queueHead != NULL && prescan->queueHead->state != PRESCAN_QUEUED) {
+			prescan->queueHead = prescan->queueHead->nextQueued;
+		}
+		if (prescan->queueHead == NULL) prescan->queueTail = NULL;
+		if (prescan->stopping) break;
+
+		if (prescan->queueHead == NULL) {
+			prescan->idleThreads++;
+			waitCondition(&prescan->changed, &prescan->lock);
+			prescan->idleThreads--;
+			continue;
+		}
+
+		PrescanJob* job = prescan->queueHead;
+		prescan->queueHead = job->nextQueued;
+		if (prescan->queueHead == NULL) prescan->queueTail = NULL;
+		job->state = PRESCAN_RUNNING;
+		unlockMutex(&prescan->lock);
+
+		runJob(prescan, &vm, job);
+
+		lockMutex(&prescan->lock);
+		job->state = PRESCAN_DONE;
+		broadcastCondition(&prescan->changed);
+	}
+	unlockMutex(&prescan->lock);
+
+	freeVM(&vm);
+}
+
+void prescanImports(VM* vm, const char* source) {
+	if (vm->prescan == NULL) {
+		Prescan* prescan = malloc(sizeof(Prescan));
+		if (prescan == NULL) return;
+
+		size_t directoryLength = strlen(vm->directory);
+		size_t maxThreads = processorCount() > 1 ? processorCount() - 1 : 1;
+		prescan->directory = malloc(directoryLength + 1);
+		prescan->threads = malloc(sizeof(Thread) * maxThreads);
+		if (prescan->directory == NULL || prescan->threads == NULL) {
+			free(prescan->directory);
+			free(prescan->threads);
+			free(prescan);
+			return;
+		}
+		memcpy(prescan->directory, vm->directory, directoryLength + 1);
+
+		initMutex(&prescan->lock);
+		initCondition(&prescan->changed);
+		prescan->optimizationLevel = vm->optimizationLevel;
+		prescan->bytecodeCache = vm->bytecodeCache;
+		prescan->jobs = NULL;
+		prescan->jobCount = 0;
+		prescan->jobCapacity = 0;
+		prescan->queueHead = NULL;
+		prescan->queueTail = NULL;
+		prescan->threadCount = 0;
+		prescan->maxThreads = maxThreads;
+		prescan->idleThreads = 0;
+		prescan->stopping = false;
+		vm->prescan = prescan;
+	}
+
+	scanImports(vm->prescan, source);
+}
+
+ObjFunction* takePrescanned(VM* vm, Module* module, const char* path) {
+	Prescan* prescan = vm->prescan;
+	uint32_t hash = hashString(path, strlen(path));
+
+	lockMutex(&prescan->lock);
+	PrescanJob* job = prescan->jobCapacity == 0 ? NULL : *findJob(prescan, path, hash);
+	if (job == NULL || job->state == PRESCAN_TAKEN) {
+		unlockMutex(&prescan->lock);
+		return NULL;
+	}
+	while (job->state == PRESCAN_RUNNING) waitCondition(&prescan->changed, &prescan->lock);
+	bool done = job->state == PRESCAN_DONE;
+	job->state = PRESCAN_TAKEN;
+	unlockMutex(&prescan->lock);
+
+	if (!done || job->bytecode == NULL) return NULL;
+
+	// Already checked against the source, or just compiled from it.
+	ObjFunction* function = decodeBytecode(vm, module, job->bytecode, job->length, NULL);
+	free(job->bytecode);
+	job->bytecode = NULL;
+	return function;
+}
+
+void freePrescan(VM* vm) {
+	Prescan* prescan = vm->prescan;
+	if (prescan == NULL) return;
+
+	lockMutex(&prescan->lock);
+	prescan->stopping = true;
+	broadcastCondition(&prescan->changed);
+	unlockMutex(&prescan->lock);
+	for (size_t i = 0; i < prescan->threadCount; i++) joinThread(prescan->threads[i]);
+
+	for (size_t i = 0; i < prescan->jobCapacity; i++) {
+		PrescanJob* job = prescan->jobs[i];
+		if (job == NULL) continue;
+		free(job->bytecode);
+		free(job->path);
+		free(job);
+	}
+	free(prescan->jobs);
+	free(prescan->threads);
+	free(prescan->directory);
+	freeCondition(&prescan->changed);
+	freeMutex(&prescan->lock);
+	free(prescan);
+	vm->prescan = NULL;
+}
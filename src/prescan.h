@@ -0,0 +1,64 @@
+#pragma once
+#include "common.h"
+#include "vm.h"
+#include "thread.h"
+
+/*
+  Compiles the modules a script imports ahead of time on a pool of threads, while the script starts running.
+  - The script's source is scanned for import statements (wherever they are, so some may never run), and so is each module
+    found, until the whole import graph is known.
+  - Every thread has a VM of its own, which turns a module into the contents of its bytecode file: those of the cached
+    file when it is up to date, otherwise compiling it (and writing the cache as the import would have). Only decoding
+    them into the importing VM's heap is left to the import.
+  - An import whose module no thread has started yet compiles it itself, rather than waiting behind the queue, one which
+    is being compiled waits for it. A module which doesn't compile ahead of time is compiled again by the import, which
+    reports its errors.
+*/
+
+typedef enum {
+	PRESCAN_QUEUED,
+	PRESCAN_RUNNING,
+	PRESCAN_DONE,
+	// Taken by the import, which compiles the module itself if the job never ran.
+	PRESCAN_TAKEN
+} PrescanState;
+
+typedef struct PrescanJob {
+	// The module's source, as the import looks it up.
+	char* path;
+	uint32_t hash;
+	PrescanState state;
+	// The bytecode file's contents once done, NULL if the module couldn't be read or compiled.
+	uint8_t* bytecode;
+	size_t length;
+	struct PrescanJob* nextQueued;
+} PrescanJob;
+
+struct Prescan {
+	Mutex lock;
+	// Broadcast when a job is queued or done, and when the pool stops.
+	Condition changed;
+	char* directory;
+	int optimizationLevel;
+	bool bytecodeCache;
+	// Every job by path, open addressed. Jobs are only freed along with the pool.
+	PrescanJob** jobs;
+	size_t jobCount;
+	size_t jobCapacity;
+	PrescanJob* queueHead;
+	PrescanJob* queueTail;
+	// Threads are started as jobs are queued, while none is idle, up to one less than the processors.
+	Thread* threads;
+	size_t threadCount;
+	size_t maxThreads;
+	size_t idleThreads;
+	bool stopping;
+};
+
+// Queues the modules imported by source, starting the pool on the first call.
+void prescanImports(VM* vm, const char* source);
+// Returns the function compiled ahead of time for the module at path, decoded into module, or NULL if the import must
+// compile it itself.
+ObjFunction* takePrescanned(VM* vm, Module* module, const char* path);
+// Stops the pool, waiting for the jobs being run.
+void freePrescan(VM* vm);
@@ -0,0 +1,331 @@
+#include "profiler.h"
+#include "chunk.h"
+#include "object.h"
+#include "memory.h"
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROFILE_FUNCTION_LIMIT 30
+#define PROFILE_OPCODE_LIMIT 15
+
+static void* allocateOrExit(size_t size) {
+	void* result = calloc(1, size);
+	if (result == NULL) exit(1);
+	return result;
+}
+
+static FunctionProfile** findSlot(FunctionProfile** entries, size_t capacity, ObjFunction* function) {
+	size_t index = (size_t)((uintptr_t)function >> 4) & (capacity - 1);
+	while (entries[index] != NULL && entries[index]->function != function) {
+		index = (index + 1) & (capacity - 1);
+	}
+	return &entries[index];
+}
+
+static FunctionProfile* functionProfile(Profiler* profiler, ObjFunction* function) {
+	if (profiler->functionCount + 1 > profiler->functionCapacity * 3 / 4) {
+		size_t capacity = profiler->functionCapacity < 64 ? 64 : profiler->functionCapacity * 2;
+		FunctionProfile** entries = allocateOrExit(sizeof(FunctionProfile*) * capacity);
+		for (size_t i = 0; i < profiler->functionCapacity; i++) {
+			FunctionProfile* entry = profiler->functions[i];
+			if (entry != NULL) *findSlot(entries, capacity, entry->function) = entry;
+		}
+		free(profiler->functions);
+		profiler->functions = entries;
+		profiler->functionCapacity = capacity;
+	}
+
+	FunctionProfile** slot = findSlot(profiler->functions, profiler->functionCapacity, function);
+	if (*slot == NULL) {
+		*slot = allocateOrExit(sizeof(FunctionProfile));
+		(*slot)->function = function;
+		profiler->functionCount++;
+	}
+	return *slot;
+}
+
+static ProfileNode* childNode(ProfileNode* parent, ObjFunction* function) {
+	for (ProfileNode* child = parent->children; child != NULL; child = child->sibling) {
+		if (child->function == function) return child;
+	}
+
+	ProfileNode* child = allocateOrExit(sizeof(ProfileNode));
+	child->function = function;
+	child->parent = parent;
+	child->sibling = parent->children;
+	parent->children = child;
+	return child;
+}
+
+static void freeNodes(ProfileNode* node) {
+	ProfileNode* child = node->children;
+	while (child != NULL) {
+		ProfileNode* next = child->sibling;
+		freeNodes(child);
+		free(child);
+		child = next;
+	}
+}
+
+static void timerMain(void* argument) {
+	Profiler* profiler = argument;
+	while (!atomicLoad(&profiler->stopping)) {
+		sleepMicroseconds(profiler->interval);
+		atomicStore(&profiler->samplePending, 1);
+	}
+}
+
+bool startProfiler(VM* vm, ProfileMode mode, uint32_t interval) {
+	Profiler* profiler = allocateOrExit(sizeof(Profiler));
+	profiler->mode = mode;
+	profiler->interval = interval;
+	profiler->previousOpcode = OP_NULL;
+	profiler->startTime = monotonicSeconds();
+	profiler->lastTime = profiler->startTime;
+
+	if (mode == PROFILE_SAMPLE && !startThread(&profiler->timer, timerMain, profiler)) {
+		free(profiler);
+		return false;
+	}
+	vm->profiler = profiler;
+	return true;
+}
+
+static void chargeSelf(Profiler* profiler, double now) {
+	if (profiler->frameCount > 0) {
+		ProfileFrame* top = &profiler->frames[profiler->frameCount - 1];
+		top->function->selfSeconds += now - profiler->lastTime;
+		top->node->selfSeconds += now - profiler->lastTime;
+	}
+	profiler->lastTime = now;
+}
+
+static void pushFrame(Profiler* profiler, ObjClosure* closure, double now) {
+	if (profiler->frameCount + 1 > profiler->frameCapacity) {
+		profiler->frameCapacity = profiler->frameCapacity < 64 ? 64 : profiler->frameCapacity * 2;
+		profiler->frames = realloc(profiler->frames, sizeof(ProfileFrame) * profiler->frameCapacity);
+		if (profiler->frames == NULL) exit(1);
+	}
+
+	ProfileNode* parent = profiler->frameCount == 0 ? &profiler->root : profiler->frames[profiler->frameCount - 1].node;
+	ProfileFrame* frame = &profiler->frames[profiler->frameCount++];
+	frame->closure = closure;
+	frame->node = childNode(parent, closure->function);
+	frame->function = functionProfile(profiler, closure->function);
+	frame->function->calls++;
+	frame->function->active++;
+	frame->start = now;
+}
+
+static void popFrame(Profiler* profiler, double now) {
+	ProfileFrame* frame = &profiler->frames[--profiler->frameCount];
+	if (--frame->function->active == 0) frame->function->totalSeconds += now - frame->start;
+}
+
+// Brings the shadow stack in step with the VM's frames. Below the top, frames only change through returns and calls.
+static void syncFrames(VM* vm, Profiler* profiler) {
+	size_t depth = vm->frameCount;
+	// A function returning to a native which calls it again leaves the frames as they were, so returns always pop. So
+	// does a tail call which replaced its caller's frame with one at the start of the callee (e.g. self recursion).
+	bool returned = profiler->previousOpcode == OP_RETURN;
+	if ((profiler->previousOpcode == OP_TAIL_CALL || profiler->previousOpcode == OP_TAIL_INVOKE) &&
+		profiler->frameCount == depth && depth > 0) {
+		CallFrame* top = &vm->frames[depth - 1];
+		returned = top->ip == top->closure->function->chunk.code;
+	}
+	if (!returned && profiler->frameCount == depth &&
+		(depth == 0 || profiler->frames[depth - 1].closure == vm->frames[depth - 1].closure)) return;
+
+	double now = monotonicSeconds();
+	chargeSelf(profiler, now);
+
+	if (returned && profiler->frameCount > 0) popFrame(profiler, now);
+	while (profiler->frameCount > depth) popFrame(profiler, now);
+	while (profiler->frameCount > 0 &&
+		profiler->frames[profiler->frameCount - 1].closure != vm->frames[profiler->frameCount - 1].closure) {
+		popFrame(profiler, now);
+	}
+	while (profiler->frameCount < depth) pushFrame(profiler, vm->frames[profiler->frameCount].closure, now);
+}
+
+static void takeSample(VM* vm, Profiler* profiler) {
+	if (vm->frameCount == 0) return;
+	size_t sample = ++profiler->sampleCount;
+
+	ProfileNode* node = &profiler->root;
+	for (size_t i = 0; i < vm->frameCount; i++) {
+		ObjFunction* function = vm->frames[i].closure->function;
+		node = childNode(node, function);
+
+		FunctionProfile* entry = functionProfile(profiler, function);
+		if (entry->lastSample != sample) {
+			entry->lastSample = sample;
+			entry->inclusiveSamples++;
+		}
+		if (i == vm->frameCount - 1) entry->samples++;
+	}
+	node->samples++;
+}
+
+void profileInstruction(VM* vm, uint8_t opcode) {
+	Profiler* profiler = vm->profiler;
+	profiler->opcodeCounts[opcode]++;
+
+	if (profiler->mode == PROFILE_INSTRUMENT) {
+		syncFrames(vm, profiler);
+		profiler->previousOpcode = opcode;
+	}
+	else if (atomicLoad(&profiler->samplePending)) {
+		atomicStore(&profiler->samplePending, 0);
+		takeSample(vm, profiler);
+	}
+}
+
+void profileAllocation(VM* vm, size_t bytes) {
+	functionProfile(vm->profiler, vm->frames[vm->frameCount - 1].closure->function)->bytesAllocated += bytes;
+}
+
+void markProfiler(VM* vm) {
+	Profiler* profiler = vm->profiler;
+	for (size_t i = 0; i < profiler->functionCapacity; i++) {
+		if (profiler->functions[i] != NULL) markObject(vm, (Obj*)profiler->functions[i]->function);
+	}
+}
+
+static const char* functionName(ObjFunction* function) {
+	return function->name == NULL ? "<script>" : function->name->chars;
+}
+
+static size_t functionLine(ObjFunction* function) {
+	return getLine(&function->chunk.lines, 0);
+}
+
+static int compareFunctions(const void* a, const void* b) {
+	const FunctionProfile* left = *(const FunctionProfile**)a;
+	const FunctionProfile* right = *(const FunctionProfile**)b;
+	if (left->samples != right->samples) return left->samples < right->samples ? 1 : -1;
+	if (left->selfSeconds != right->selfSeconds) return left->selfSeconds < right->selfSeconds ? 1 : -1;
+	return 0;
+}
+
+static int compareOpcodes(const void* a, const void* b) {
+	const size_t* left = a;
+	const size_t* right = b;
+	if (left[1] != right[1]) return left[1] < right[1] ? 1 : -1;
+	return left[0] < right[0] ? -1 : 1;
+}
+
+static void printSummary(Profiler* profiler, double elapsed) {
+	FunctionProfile** entries = allocateOrExit(sizeof(FunctionProfile*) * (profiler->functionCount + 1));
+	size_t count = 0;
+	for (size_t i = 0; i < profiler->functionCapacity; i++) {
+		if (profiler->functions[i] != NULL) entries[count++] = profiler->functions[i];
+	}
+	qsort(entries, count, sizeof(FunctionProfile*), compareFunctions);
+	size_t shown = count < PROFILE_FUNCTION_LIMIT ? count : PROFILE_FUNCTION_LIMIT;
+
+	if (profiler->mode == PROFILE_SAMPLE) {
+		fprintf(stderr, "==== profile (%zu samples every %uus, %.3f s) ====\n", profiler->sampleCount, profiler->interval, elapsed);
+		fprintf(stderr, "%-24s %6s %10s %7s %10s %7s %14s\n", "function", "line", "self", "self %", "total", "total %", "allocated");
+		double total = profiler->sampleCount == 0 ? 1.0 : (double)profiler->sampleCount;
+		for (size_t i = 0; i < shown; i++) {
+			FunctionProfile* entry = entries[i];
+			fprintf(stderr, "%-24s %6zu %10zu %6.1f%% %10zu %6.1f%% %14zu\n", functionName(entry->function), functionLine(entry->function),
+				entry->samples, 100.0 * (double)entry->samples / total, entry->inclusiveSamples,
+				100.0 * (double)entry->inclusiveSamples / total, entry->bytesAllocated);
+		}
+	}
+	else {
+		fprintf(stderr, "==== profile (instrumented, %.3f s) ====\n", elapsed);
+		fprintf(stderr, "%-24s %6s %10s %12s %7s %12s %14s\n", "function", "line", "calls", "self ms", "self %", "total ms", "allocated");
+		double total = elapsed <= 0 ? 1.0 : elapsed;
+		for (size_t i = 0; i < shown; i++) {
+			FunctionProfile* entry = entries[i];
+			fprintf(stderr, "%-24s %6zu %10zu %12.3f %6.1f%% %12.3f %14zu\n", functionName(entry->function), functionLine(entry->function),
+				entry->calls, entry->selfSeconds * 1000, 100.0 * entry->selfSeconds / total, entry->totalSeconds * 1000, entry->bytesAllocated);
+		}
+	}
+	if (count > shown) fprintf(stderr, "(%zu more functions)\n", count - shown);
+	free(entries);
+
+	size_t opcodes[UINT8_COUNT][2];
+	size_t executed = 0;
+	for (size_t i = 0; i < UINT8_COUNT; i++) {
+		opcodes[i][0] = i;
+		opcodes[i][1] = profiler->opcodeCounts[i];
+		executed += profiler->opcodeCounts[i];
+	}
+	qsort(opcodes, UINT8_COUNT, sizeof(opcodes[0]), compareOpcodes);
+
+	fprintf(stderr, "==== opcodes (%zu executed) ====\n", executed);
+	for (size_t i = 0; i < PROFILE_OPCODE_LIMIT && opcodes[i][1] > 0; i++) {
+		fprintf(stderr, "%-24s %14zu %6.1f%%\n", opcodeName((uint8_t)opcodes[i][0]), opcodes[i][1], 100.0 * (double)opcodes[i][1] / (double)executed);
+	}
+}
+
+static void writeNode(FILE* file, Profiler* profiler, ProfileNode* node, ProfileNode** path, size_t depth) {
+	if (node != &profiler->root) {
+		path[depth++] = node;
+		size_t weight = profiler->mode == PROFILE_SAMPLE ? node->samples : (size_t)(node->selfSeconds * 1e6 + 0.5);
+		if (weight > 0) {
+			for (size_t i = 0; i < depth; i++) {
+				fprintf(file, "%s%s:%zu", i == 0 ? "" : ";", functionName(path[i]->function), functionLine(path[i]->function));
+			}
+			fprintf(file, " %zu\n", weight);
+		}
+	}
+
+	for (ProfileNode* child = node->children; child != NULL; child = child->sibling) {
+		writeNode(file, profiler, child, path, depth);
+	}
+}
+
+static size_t nodeDepth(ProfileNode* node) {
+	size_t depth = 0;
+	for (ProfileNode* child = node->children; child != NULL; child = child->sibling) {
+		size_t childDepth = nodeDepth(child) + 1;
+		if (childDepth > depth) depth = childDepth;
+	}
+	return depth;
+}
+
+static void writeProfile(Profiler* profiler, double elapsed, const char* path) {
+	printSummary(profiler, elapsed);
+
+	FILE* file = fopen(path, "w");
+	if (file == NULL) {
+		fprintf(stderr, "Could not write profile \"%s\".\n", path);
+		return;
+	}
+
+	ProfileNode** stack = allocateOrExit(sizeof(ProfileNode*) * (nodeDepth(&profiler->root) + 1));
+	writeNode(file, profiler, &profiler->root, stack, 0);
+	free(stack);
+	fclose(file);
+	fprintf(stderr, "Collapsed stacks written to \"%s\".\n", path);
+}
+
+void stopProfiler(VM* vm, const char* path) {
+	Profiler* profiler = vm->profiler;
+	if (profiler == NULL) return;
+	vm->profiler = NULL;
+
+	if (profiler->mode == PROFILE_SAMPLE) {
+		atomicStore(&profiler->stopping, 1);
+		joinThread(profiler->timer);
+	}
+
+	double now = monotonicSeconds();
+	chargeSelf(profiler, now);
+	while (profiler->frameCount > 0) popFrame(profiler, now);
+
+	if (path != NULL) writeProfile(profiler, now - profiler->startTime, path);
+
+	for (size_t i = 0; i < profiler->functionCapacity; i++) free(profiler->functions[i]);
+	free(profiler->functions);
+	free(profiler->frames);
+	freeNodes(&profiler->root);
+	free(profiler);
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include "common.h"
+#include "vm.h"
+#include "thread.h"
+
+/*
+  A profiler attached to a VM ('--profile sample' or '--profile instrument'), NULL when there is none.
+  - While one is attached the interpreter loop dispatches every instruction through profileInstruction before its
+    handler (a second dispatch table which sends every opcode there), so without one the loop is exactly as fast.
+  - Sampling: a timer thread raises a flag every interval, and the next instruction records the VM's frames in a call tree.
+    Time spent in a native is counted when the VM runs its next instruction, after it returns.
+  - Instrumenting: a shadow of the VM's frames is kept in step at every instruction, the clock only being read when the
+    frames change, to count calls and self and inclusive time (only the outermost of recursive calls counts towards the
+    latter) per function and per call path.
+  - Both count every executed opcode, and the bytes allocated while each function was on top of the stack.
+  - Functions seen by the profiler are kept alive until it's stopped, so their names can be reported.
+*/
+
+typedef enum {
+	PROFILE_SAMPLE,
+	PROFILE_INSTRUMENT
+} ProfileMode;
+
+// A call path, its function called from the parent's (the root has no function).
+typedef struct ProfileNode {
+	ObjFunction* function;
+	struct ProfileNode* parent;
+	struct ProfileNode* children;
+	struct ProfileNode* sibling;
+	size_t samples;
+	double selfSeconds;
+} ProfileNode;
+
+typedef struct {
+	ObjFunction* function;
+	size_t calls;
+	// Activations on the shadow stack, inclusive time is only counted when the outermost returns.
+	size_t active;
+	double selfSeconds;
+	double totalSeconds;
+	size_t samples;
+	size_t inclusiveSamples;
+	// The sample which last counted towards inclusiveSamples, so recursion counts once per sample.
+	size_t lastSample;
+	size_t bytesAllocated;
+} FunctionProfile;
+
+typedef struct {
+	ObjClosure* closure;
+	ProfileNode* node;
+	FunctionProfile* function;
+	double start;
+} ProfileFrame;
+
+struct Profiler {
+	ProfileMode mode;
+	ProfileNode root;
+	// Open addressed by function, entries are allocated separately so frames can point at them.
+	FunctionProfile** functions;
+	size_t functionCount;
+	size_t functionCapacity;
+	ProfileFrame* frames;
+	size_t frameCount;
+	size_t frameCapacity;
+	// When self time was last charged to the top frame.
+	double lastTime;
+	double startTime;
+	uint8_t previousOpcode;
+	size_t opcodeCounts[UINT8_COUNT];
+	size_t sampleCount;
+	Thread timer;
+	uint32_t interval;
+	volatile int32_t samplePending;
+	volatile int32_t stopping;
+};
+
+// Attaches a profiler to vm, returning false if it couldn't be started. interval is in microseconds, used when sampling.
+bool startProfiler(VM* vm, ProfileMode mode, uint32_t interval);
+// Detaches vm's profiler, printing a summary to stderr and writing the collapsed stacks (one 'a;b;c weight' line per call
+// path, as read by flamegraph tools) to path. Weights are samples, or microseconds of self time when instrumenting.
+// A NULL path only frees the profiler, for reading its counts beforehand.
+void stopProfiler(VM* vm, const char* path);
+void profileInstruction(VM* vm, uint8_t opcode);
+void profileAllocation(VM* vm, size_t bytes);
+void markProfiler(VM* vm);
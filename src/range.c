@@ -0,0 +1,81 @@
+#include "range.h"
+#include "natives.h"
+#include "iterator.h"
+#include "memory.h"
+#include <math.h>
+
+size_t rangeLength(ObjRange* range) {
+	return (size_t)((range->end - range->start) * range->step) + 1;
+}
+
+Value rangeGet(ObjRange* range, size_t index) {
+	return NUMBER_VAL((double)(range->start + range->step * (intmax_t)index));
+}
+
+bool rangeContains(ObjRange* range, Value value) {
+	if (!IS_NUMBER(value)) return false;
+	double number = AS_NUMBER(value);
+	if (floor(number) != number) return false;
+
+	double low = (double)(range->step > 0 ? range->start : range->end);
+	double high = (double)(range->step > 0 ? range->end : range->start);
+	return number >= low && number <= high;
+}
+
+bool rangeEqualsList(ObjRange* range, ObjList* list) {
+	size_t length = rangeLength(range);
+	if (list->items.count != length) return false;
+
+	for (size_t i = 0; i < length; i++) {
+		if (!valuesEqual(rangeGet(range, i), list->items.values[i])) return false;
+	}
+	return true;
+}
+
+bool rangesEqual(ObjRange* a, ObjRange* b) {
+	// Ranges are never empty, so ones of a single number are equal whichever way they count.
+	if (a->start != b->start || a->end != b->end) return false;
+	return a->step == b->step || a->start == a->end;
+}
+
+ObjList* rangeToList(VM* vm, ObjRange* range) {
+	size_t length = rangeLength(range);
+
+	push(vm, OBJ_VAL(range)); // GC
+	ValueArray items;
+	initValueArray(&items);
+	items.values = ALLOCATE(vm, Value, length);
+	items.capacity = length;
+	items.count = length;
+	for (size_t i = 0; i < length; i++) {
+		items.values[i] = rangeGet(range, i);
+	}
+	pop(vm);
+
+	// The range was allocated with the size of a list, see newRange.
+	ObjList* list = (ObjList*)range;
+	list->obj.type = OBJ_LIST;
+	list->items = items;
+	return list;
+}
+
+static Value rangeIteratorNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	Value iterator = OBJ_VAL(newInstance(vm, vm->iteratorClass));
+
+	push(vm, iterator); // GC
+	iteratorConstructorNative(vm, &iterator, 1, bound, hasError, exception);
+	pop(vm);
+	if (*hasError) return NULL_VAL;
+
+	return iterator;
+}
+
+static Value rangeLengthNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	return NUMBER_VAL((double)rangeLength(AS_RANGE(*bound)));
+}
+
+// Only the methods which don't need a list, the others turn the range into one (see invoke).
+void defineRangeMethods(VM* vm) {
+	defineNative(vm, &vm->rangeMethods, "iterator", 0, false, rangeIteratorNative);
+	defineNative(vm, &vm->rangeMethods, "length", 0, false, rangeLengthNative);
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include "common.h"
+#include "vm.h"
+
+size_t rangeLength(ObjRange* range);
+Value rangeGet(ObjRange* range, size_t index);
+bool rangeContains(ObjRange* range, Value value);
+// Compares the numbers the range stands for with the items of the list, without turning the range into a list.
+bool rangeEqualsList(ObjRange* range, ObjList* list);
+bool rangesEqual(ObjRange* a, ObjRange* b);
+// Turns range into the list it stands for in place, every value referencing the range now references the list.
+ObjList* rangeToList(VM* vm, ObjRange* range);
+void defineRangeMethods(VM* vm);
@@ -0,0 +1,160 @@
+#include "rope.h"
+#include "natives.h"
+#include "memory.h"
+#include <string.h>
+
+static const char* stringChars(Value value) {
+	if (IS_STRING(value)) return AS_STRING(value)->chars;
+	ObjRope* rope = AS_ROPE(value);
+	if (rope->flat != NULL) return rope->flat->chars;
+	return rope->buffer != NULL ? rope->buffer->chars : rope->parent->chars + rope->start;
+}
+
+size_t stringOrRopeLength(Value value) {
+	return IS_STRING(value) ? AS_STRING(value)->length : AS_ROPE(value)->length;
+}
+
+static RopeBuffer* newRopeBuffer(VM* vm, size_t capacity) {
+	RopeBuffer* buffer = ALLOCATE(vm, RopeBuffer, 1);
+	buffer->chars = ALLOCATE(vm, char, capacity);
+	buffer->length = 0;
+	buffer->capacity = capacity;
+	buffer->ropeCount = 0;
+	return buffer;
+}
+
+void releaseRopeBuffer(VM* vm, RopeBuffer* buffer) {
+	if (--buffer->ropeCount > 0) return;
+	FREE_ARRAY(vm, char, buffer->chars, buffer->capacity);
+	FREE(vm, RopeBuffer, buffer);
+}
+
+Value concatenateStrings(VM* vm, Value a, Value b) {
+	size_t aLength = stringOrRopeLength(a);
+	size_t bLength = stringOrRopeLength(b);
+	size_t length = aLength + bLength;
+
+	// Nothing has been appended past the end of a yet, so b can be without copying a.
+	if (IS_ROPE(a) && AS_ROPE(a)->buffer != NULL && AS_ROPE(a)->length == AS_ROPE(a)->buffer->length) {
+		RopeBuffer* buffer = AS_ROPE(a)->buffer;
+		if (length > buffer->capacity) {
+			size_t capacity = max(GROW_CAPACITY(buffer->capacity), length);
+			buffer->chars = GROW_ARRAY(vm, char, buffer->chars, buffer->capacity, capacity);
+			buffer->capacity = capacity;
+		}
+		// If b is a rope of the same buffer its chars are before the end of a, so they aren't overwritten.
+		memcpy(buffer->chars + aLength, stringChars(b), bLength);
+		buffer->length = length;
+		return OBJ_VAL(newRope(vm, buffer, length));
+	}
+
+	if (length < ROPE_MIN_LENGTH) {
+		char* chars = ALLOCATE(vm, char, length + 1);
+		memcpy(chars, stringChars(a), aLength);
+		memcpy(chars + aLength, stringChars(b), bLength);
+		chars[length] = '\0';
+		return OBJ_VAL(takeTransientString(vm, chars, length));
+	}
+
+	// Leaves room for as much again, since a rope this long is likely being built up.
+	RopeBuffer* buffer = newRopeBuffer(vm, length * 2);
+	memcpy(buffer->chars, stringChars(a), aLength);
+	memcpy(buffer->chars + aLength, stringChars(b), bLength);
+	buffer->length = length;
+	return OBJ_VAL(newRope(vm, buffer, length));
+}
+
+ObjString* flattenRope(VM* vm, ObjRope* rope) {
+	if (rope->flat == NULL) {
+		ObjString* flat = copyTransientString(vm, stringChars(OBJ_VAL(rope)), rope->length);
+		rope->flat = flat;
+		WRITE_BARRIER_OBJ(vm, rope, flat);
+		// A slice no longer needs its parent, which may be much longer.
+		rope->parent = NULL;
+	}
+	return rope->flat;
+}
+
+void flattenRopes(VM* vm, Value* values, size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		if (IS_ROPE(values[i])) values[i] = OBJ_VAL(flattenRope(vm, AS_ROPE(values[i])));
+	}
+}
+
+bool stringsEqual(Value a, Value b) {
+	if (!isStringOrRope(a) || !isStringOrRope(b)) return false;
+	size_t length = stringOrRopeLength(a);
+	return length == stringOrRopeLength(b) && memcmp(stringChars(a), stringChars(b), length) == 0;
+}
+
+/*
+  StringBuilder, whose contents are a rope appended to in place (once they are long enough to be one), so building a
+  string with it takes time linear in the string's length.
+*/
+
+static Value stringBuilderConstructorNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjInstance* instance = AS_INSTANCE(*bound);
+
+	Value contents = argCount > 0 ? args[0] : OBJ_VAL(copyString(vm, "", 0));
+	if (!IS_STRING(contents)) {
+		*hasError = true;
+		*exception = makeException(vm, "TypeException", "StringBuilder's initial contents must be a string.");
+		return NULL_VAL;
+	}
+	push(vm, contents); // GC
+	instanceSet(vm, instance, vm->stringConstants[STR_CONTENTS], contents);
+	pop(vm);
+
+	return OBJ_VAL(instance);
+}
+
+static bool getContents(VM* vm, ObjInstance* instance, Value* contents, bool* hasError, ObjInstance** exception) {
+	if (!instanceGet(instance, vm->stringConstants[STR_CONTENTS], contents) || !isStringOrRope(*contents)) {
+		*hasError = true;
+		*exception = makeException(vm, "PropertyException", "StringBuilder object must have a string 'contents' field.");
+		return false;
+	}
+	return true;
+}
+
+static Value stringBuilderAppendNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjInstance* instance = AS_INSTANCE(*bound);
+
+	Value contents;
+	if (!getContents(vm, instance, &contents, hasError, exception)) return NULL_VAL;
+
+	ObjString* string = valueToString(vm, args[0], hasError, exception);
+	if (*hasError) return NULL_VAL;
+
+	push(vm, OBJ_VAL(string)); // GC
+	Value result = concatenateStrings(vm, contents, OBJ_VAL(string));
+	vm->stackTop[-1] = result;
+	instanceSet(vm, instance, vm->stringConstants[STR_CONTENTS], result);
+	pop(vm);
+
+	return *bound;
+}
+
+static Value stringBuilderToStringNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	Value contents;
+	if (!getContents(vm, AS_INSTANCE(*bound), &contents, hasError, exception)) return NULL_VAL;
+
+	return IS_ROPE(contents) ? OBJ_VAL(flattenRope(vm, AS_ROPE(contents))) : contents;
+}
+
+static Value stringBuilderLengthNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	Value contents;
+	if (!getContents(vm, AS_INSTANCE(*bound), &contents, hasError, exception)) return NULL_VAL;
+
+	return NUMBER_VAL((double)stringOrRopeLength(contents));
+}
+
+void defineStringBuilderMethods(VM* vm) {
+	tableAddAll(vm, &vm->objectClass->methods, &vm->stringBuilderClass->methods);
+	vm->stringBuilderClass->superclass = vm->objectClass;
+
+	defineNative(vm, &vm->stringBuilderClass->methods, "constructor", 0, true, stringBuilderConstructorNative);
+	defineNative(vm, &vm->stringBuilderClass->methods, "append", 1, false, stringBuilderAppendNative);
+	defineNative(vm, &vm->stringBuilderClass->methods, "toString", 0, false, stringBuilderToStringNative);
+	defineNative(vm, &vm->stringBuilderClass->methods, "length", 0, false, stringBuilderLengthNative);
+}
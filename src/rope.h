@@ -0,0 +1,32 @@
+#pragma once
+#include "common.h"
+#include "vm.h"
+
+/*
+  Ropes are made by '+' and concat() when the result is at least ROPE_MIN_LENGTH chars long (shorter results are made
+  into strings straight away), and by substring() as slices of the string.
+  - Anything which needs an ObjString (natives, methods, indexing, field names) flattens the rope first, into a
+    transient string. The VM replaces the rope on its stack with the flattened string, and the rope keeps it so it is only
+    made once. Natives which only store or compare their arguments can take ropes as they are (see keepRopeArguments).
+  - Ropes are equal to the strings with the same chars, and typeof gives "string" for them.
+*/
+
+#ifndef ROPE_MIN_LENGTH
+#define ROPE_MIN_LENGTH 64
+#endif
+
+static inline bool isStringOrRope(Value value) {
+	return IS_STRING(value) || IS_ROPE(value);
+}
+
+// Concatenates two strings or ropes (a then b), which must be reachable by the GC.
+Value concatenateStrings(VM* vm, Value a, Value b);
+// The (transient) string with the chars of rope, which must be reachable by the GC.
+ObjString* flattenRope(VM* vm, ObjRope* rope);
+// Replaces the ropes among values (which must be reachable by the GC) with their flattened strings.
+void flattenRopes(VM* vm, Value* values, size_t count);
+size_t stringOrRopeLength(Value value);
+// Whether a and b are strings or ropes with the same chars.
+bool stringsEqual(Value a, Value b);
+void releaseRopeBuffer(VM* vm, RopeBuffer* buffer);
+void defineStringBuilderMethods(VM* vm);
@@ -2,6 +2,7 @@
 #include "natives.h"
 #include "memory.h"
 #include "iterator.h"
+#include "rope.h"
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
@@ -53,11 +54,10 @@ static Value stringConcatNative(VM* vm, Value* bound, uint8_t argCount, Value* a
 	ObjString* stringForm = valueToString(vm, concatee, hasError, exception);
 	if (*hasError) return NULL_VAL;
 
-	char* dest = ALLOCATE(vm, char, string->length + stringForm->length + 1);
-	memcpy(dest, string->chars, string->length);
-	memcpy(dest + string->length, stringForm->chars, stringForm->length);
-	dest[string->length + stringForm->length] = '\0';
-	return OBJ_VAL(takeString(vm, dest, string->length + stringForm->length));
+	push(vm, OBJ_VAL(stringForm)); // GC
+	Value result = concatenateStrings(vm, OBJ_VAL(string), OBJ_VAL(stringForm));
+	pop(vm);
+	return result;
 }
 
 static Value stringEndsWithNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
@@ -168,7 +168,7 @@ static Value stringRepeatNative(VM* vm, Value* bound, uint8_t argCount, Value* a
 	}
 	dest[string->length * size] = '\0';
 
-	return OBJ_VAL(takeString(vm, dest, string->length * size));
+	return OBJ_VAL(takeTransientString(vm, dest, string->length * size));
 }
 
 static Value stringStartsWithNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
@@ -193,8 +193,9 @@ static Value stringSubstringNative(VM* vm, Value* bound, uint8_t argCount, Value
 	Value endV = args[1];
 
 	uintmax_t start;
-	if (!validateListIndex(vm, string->length, startV, &start)) {
-		return (*hasError) ? NULL_VAL : pop(vm);
+	if (!validateListIndex(vm, string->length, startV, &start, exception)) {
+		*hasError = true;
+		return NULL_VAL;
 	}
 	
 	if (!IS_NUMBER(endV)) {
@@ -227,12 +228,12 @@ static Value stringSubstringNative(VM* vm, Value* bound, uint8_t argCount, Value
 		return NULL_VAL;
 	}
 
-	char* dest = ALLOCATE(vm, char, end - start + 1);
-
-	memcpy(dest, string->chars + start, end - start);
-	dest[end - start] = '\0';
-
-	return OBJ_VAL(takeString(vm, dest, end - start));
+	// Longer substrings are slices of the string, only copied if they are needed as strings (see rope.h).
+	size_t length = end - start;
+	if (length == string->length) return *bound;
+	if (length == 0) return OBJ_VAL(copyString(vm, "", 0));
+	if (length == 1) return OBJ_VAL(CHAR_STRING(vm, string->chars[start]));
+	return OBJ_VAL(newSlice(vm, string, start, length));
 }
 
 void defineStringMethods(VM* vm) {
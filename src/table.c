@@ -1,101 +1,304 @@
 #include "table.h"
 #include "memory.h"
 #include "object.h"
+#include "vm.h"
 #include "value.h"
 #include <stdlib.h>
 #include <string.h>
 
-#define TABLE_MAX_LOAD 0.75
+/*
+  Slots are split into groups of GROUP_WIDTH, and each has a control byte: CONTROL_EMPTY, CONTROL_DELETED or (for a full
+  slot) the low 7 bits of its key's hash. A key's probe sequence visits whole groups, starting from the group picked by
+  the rest of its hash. A lookup compares the control bytes of a group all at once, and only checks the keys whose
+  7 bits matched. It stops at the first group with an empty slot.
+*/
+
+#if !defined(DRAGON_TABLE_SCALAR) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define TABLE_SSE2
+#include <emmintrin.h>
+#elif !defined(DRAGON_TABLE_SCALAR) && defined(__aarch64__) && defined(__ARM_NEON)
+#define TABLE_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define GROUP_WIDTH 16
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xFE
+
+// Full and deleted slots together, as a fraction of the capacity.
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash) & 0x7F))
+#define IS_FULL(control) (((control) & 0x80) == 0)
+
+// A bit for each slot of a group.
+typedef uint32_t GroupMask;
+
+#if defined(TABLE_SSE2)
+
+static inline GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+	__m128i control = _mm_loadu_si128((const __m128i*)group);
+	return (GroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+}
+
+// The slots which are empty or deleted, whose control bytes have the top bit set.
+static inline GroupMask matchFree(const uint8_t* group) {
+	return (GroupMask)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+
+#elif defined(TABLE_NEON)
+
+// Takes a vector of bytes which are all zeros or all ones to a mask.
+static inline GroupMask toMask(uint8x16_t bytes) {
+	static const uint8_t bits[GROUP_WIDTH] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t masked = vandq_u8(bytes, vld1q_u8(bits));
+	return (GroupMask)vaddv_u8(vget_low_u8(masked)) | ((GroupMask)vaddv_u8(vget_high_u8(masked)) << 8);
+}
+
+static inline GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+	return toMask(vceqq_u8(vld1q_u8(group), vdupq_n_u8(byte)));
+}
+
+static inline GroupMask matchFree(const uint8_t* group) {
+	return toMask(vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(vld1q_u8(group)), 7)));
+}
+
+#else
+
+static inline GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+	GroupMask mask = 0;
+	for (int i = 0; i < GROUP_WIDTH; i++) {
+		if (group[i] == byte) mask |= (GroupMask)1 << i;
+	}
+	return mask;
+}
+
+static inline GroupMask matchFree(const uint8_t* group) {
+	GroupMask mask = 0;
+	for (int i = 0; i < GROUP_WIDTH; i++) {
+		if (!IS_FULL(group[i])) mask |= (GroupMask)1 << i;
+	}
+	return mask;
+}
+
+#endif
+
+static inline size_t lowestSlot(GroupMask mask) {
+#if defined(__GNUC__) || defined(__clang__)
+	return (size_t)__builtin_ctz(mask);
+#elif defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (size_t)index;
+#else
+	size_t index = 0;
+	while ((mask & 1) == 0) {
+		mask >>= 1;
+		index++;
+	}
+	return index;
+#endif
+}
+
+static size_t allocationSize(size_t capacity) {
+	return capacity * sizeof(Entry) + capacity;
+}
 
 void initTable(Table* table) {
 	table->count = 0;
 	table->capacity = 0;
 	table->entries = NULL;
+	table->control = NULL;
+	table->rehashes = 0;
+	table->owner = NULL;
 }
 
 void freeTable(VM* vm, Table* table) {
-	FREE_ARRAY(vm, Entry, table->entries, table->capacity);
+	reallocate(vm, table->entries, allocationSize(table->capacity), 0);
 	initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, size_t capacity, ObjString* key) {
-	size_t index = key->hash & (capacity - 1);
-	Entry* tombstone = NULL;
-	for (;;) {
-		Entry* entry = &entries[index];
-		if (entry->key == NULL) {
-			if (IS_NULL(entry->value)) {
-				return tombstone != NULL ? tombstone : entry;
-			}
-			else {
-				if (tombstone == NULL) tombstone = entry;
-			}
-		}
-		else if (entry->key == key) {
-			return entry;
+// Keys are always interned, but a transient string can be looked up by its chars.
+static bool keysEqual(ObjString* key, ObjString* other) {
+	if (key == other) return true;
+	return !other->isInterned && key->length == other->length && key->hash == other->hash &&
+		memcmp(key->chars, other->chars, key->length) == 0;
+}
+
+static inline Entry* findEntry(Table* table, ObjString* key) {
+	if (table->count == 0) return NULL;
+
+	uint32_t hash = stringHash(key);
+	size_t groupMask = table->capacity / GROUP_WIDTH - 1;
+	size_t group = H1(hash) & groupMask;
+	// Visiting the groups in steps of 1, 2, 3... reaches all of them, as there is a power of two.
+	for (size_t step = 1;; step++) {
+		const uint8_t* control = table->control + group * GROUP_WIDTH;
+		for (GroupMask matches = matchByte(control, H2(hash)); matches != 0; matches &= matches - 1) {
+			Entry* entry = &table->entries[group * GROUP_WIDTH + lowestSlot(matches)];
+			if (keysEqual(entry->key, key)) return entry;
 		}
-		index = (index + 1) & (capacity - 1);
+		if (matchByte(control, CONTROL_EMPTY) != 0) return NULL;
+		group = (group + step) & groupMask;
+	}
+}
+
+// The first empty or deleted slot in the probe sequence of hash.
+static size_t findFreeSlot(Table* table, uint32_t hash) {
+	size_t groupMask = table->capacity / GROUP_WIDTH - 1;
+	size_t group = H1(hash) & groupMask;
+	for (size_t step = 1;; step++) {
+		GroupMask free = matchFree(table->control + group * GROUP_WIDTH);
+		if (free != 0) return group * GROUP_WIDTH + lowestSlot(free);
+		group = (group + step) & groupMask;
 	}
 }
 
-static void adjustCapacity(VM* vm, Table* table, size_t capacity) {
-	Entry* entries = ALLOCATE(vm, Entry, capacity);
+static void setSlot(Table* table, size_t slot, ObjString* key, Value value) {
+	table->control[slot] = H2(key->hash);
+	table->entries[slot].key = key;
+	table->entries[slot].value = value;
+}
+
+static void resize(VM* vm, Table* table, size_t capacity) {
+	Table old = *table;
+
+	table->entries = (Entry*)reallocate(vm, NULL, 0, allocationSize(capacity));
+	table->control = (uint8_t*)(table->entries + capacity);
+	table->capacity = capacity;
+	table->count = 0;
+	memset(table->control, CONTROL_EMPTY, capacity);
+	for (size_t i = 0; i < capacity; i++) table->entries[i].key = NULL;
+
+	for (size_t i = 0; i < old.capacity; i++) {
+		Entry* entry = &old.entries[i];
+		if (entry->key == NULL) continue;
 
-	for (size_t i = 0; i < capacity; i++) {
-		entries[i].key = NULL;
-		entries[i].value = NULL_VAL;
+		setSlot(table, findFreeSlot(table, entry->key->hash), entry->key, entry->value);
+		table->count++;
+	}
+
+	reallocate(vm, old.entries, allocationSize(old.capacity), 0);
+	table->rehashes++;
+}
+
+// Rehashes the table without growing it, turning its deleted slots back into empty ones.
+static void dropDeleted(Table* table) {
+	// Deleted slots become empty and full ones are marked deleted, until they are moved to where they belong.
+	for (size_t i = 0; i < table->capacity; i++) {
+		table->control[i] = IS_FULL(table->control[i]) ? CONTROL_DELETED : CONTROL_EMPTY;
 	}
 
 	table->count = 0;
 	for (size_t i = 0; i < table->capacity; i++) {
-		Entry* entry = &table->entries[i];
-		if (entry->key == NULL) continue;
+		if (table->control[i] != CONTROL_DELETED) continue;
 
-		Entry* dest = findEntry(entries, capacity, entry->key);
-		dest->key = entry->key;
-		dest->value = entry->value;
+		Entry* entry = &table->entries[i];
+		size_t slot = findFreeSlot(table, entry->key->hash);
 		table->count++;
+
+		// Its own group is the first on its probe sequence with room, so it can stay.
+		if (slot / GROUP_WIDTH == i / GROUP_WIDTH) {
+			table->control[i] = H2(entry->key->hash);
+			continue;
+		}
+
+		if (table->control[slot] == CONTROL_EMPTY) {
+			setSlot(table, slot, entry->key, entry->value);
+			table->control[i] = CONTROL_EMPTY;
+			entry->key = NULL;
+		}
+		else {
+			// Swapped with an entry which hasn't been placed yet, which is placed next.
+			Entry displaced = table->entries[slot];
+			setSlot(table, slot, entry->key, entry->value);
+			*entry = displaced;
+			i--;
+		}
 	}
 
-	FREE_ARRAY(vm, Entry, table->entries, table->capacity);
-	table->entries = entries;
-	table->capacity = capacity;
+	table->rehashes++;
 }
 
-bool tableGet(Table* table, ObjString* key, Value* value) {
-	if (table->count == 0) return false;
+// Makes room for another slot to be filled.
+static void makeRoom(VM* vm, Table* table) {
+	if (table->capacity == 0) {
+		resize(vm, table, GROUP_WIDTH);
+		return;
+	}
 
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL) return false;
+	size_t live = 0;
+	for (size_t i = 0; i < table->capacity; i++) {
+		if (table->entries[i].key != NULL) live++;
+	}
+
+	// Mostly deleted slots, which can be cleaned up without growing.
+	if (live <= TABLE_MAX_LOAD(table->capacity) / 2) dropDeleted(table);
+	else resize(vm, table, table->capacity * 2);
+}
+
+bool tableGet(Table* table, ObjString* key, Value* value) {
+	Entry* entry = findEntry(table, key);
+	if (entry == NULL) return false;
 
 	*value = entry->value;
 	return true;
 }
 
 bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
-	if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-		size_t capacity = GROW_CAPACITY(table->capacity);
-		adjustCapacity(vm, table, capacity);
-	}
+	key = internString(vm, key);
+
+	Entry* entry = findEntry(table, key);
+	bool isNewKey = entry == NULL;
+	if (isNewKey) {
+		size_t slot = table->capacity > 0 ? findFreeSlot(table, key->hash) : 0;
+		// A deleted slot can be reused as it is, an empty one may need the table to grow first.
+		if (table->capacity == 0 || (table->control[slot] == CONTROL_EMPTY && table->count + 1 > TABLE_MAX_LOAD(table->capacity))) {
+			push(vm, OBJ_VAL(key)); // GC, the interned string may only be reachable from here.
+			makeRoom(vm, table);
+			pop(vm);
+			slot = findFreeSlot(table, key->hash);
+		}
 
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	bool isNewKey = entry->key == NULL;
-	if (isNewKey && IS_NULL(entry->value)) table->count++;
-	if (isNewKey) table->count++;
+		if (table->control[slot] == CONTROL_EMPTY) table->count++;
+		setSlot(table, slot, key, value);
+	}
+	else {
+		entry->value = value;
+	}
 
-	entry->key = key;
-	entry->value = value;
+	if (table->owner != NULL) {
+		WRITE_BARRIER_OBJ(vm, table->owner, key);
+		WRITE_BARRIER(vm, table->owner, value);
+	}
 	return isNewKey;
 }
 
-bool tableDelete(Table* table, ObjString* key) {
-	if (table->count == 0) return false;
+static void deleteSlot(Table* table, size_t slot) {
+	// If the group has an empty slot no probe sequence goes past it, so this one can be empty too.
+	const uint8_t* group = table->control + slot / GROUP_WIDTH * GROUP_WIDTH;
+	if (matchByte(group, CONTROL_EMPTY) != 0) {
+		table->control[slot] = CONTROL_EMPTY;
+		table->count--;
+	}
+	else {
+		table->control[slot] = CONTROL_DELETED;
+	}
+
+	table->entries[slot].key = NULL;
+	table->entries[slot].value = NULL_VAL;
+}
 
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL) return false;
+bool tableDelete(Table* table, ObjString* key) {
+	Entry* entry = findEntry(table, key);
+	if (entry == NULL) return false;
 
-	entry->key = NULL;
-	entry->value = BOOL_VAL(true);
+	deleteSlot(table, (size_t)(entry - table->entries));
 	return true;
 }
 
@@ -111,34 +314,44 @@ void tableAddAll(VM* vm, Table* from, Table* to) {
 ObjString* tableFindString(Table* table, const char* chars, size_t length, uint32_t hash) {
 	if (table->count == 0) return NULL;
 
-	size_t index = hash & (table->capacity - 1);
-
-	for (;;) {
-		Entry* entry = &table->entries[index];
-		if (entry->key == NULL) {
-			if (IS_NULL(entry->value)) return NULL;
-		}
-		else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
-			return entry->key;
+	size_t groupMask = table->capacity / GROUP_WIDTH - 1;
+	size_t group = H1(hash) & groupMask;
+	for (size_t step = 1;; step++) {
+		const uint8_t* control = table->control + group * GROUP_WIDTH;
+		for (GroupMask matches = matchByte(control, H2(hash)); matches != 0; matches &= matches - 1) {
+			ObjString* key = table->entries[group * GROUP_WIDTH + lowestSlot(matches)].key;
+			if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) return key;
 		}
-
-		index = (index + 1) & (table->capacity - 1);
+		if (matchByte(control, CONTROL_EMPTY) != 0) return NULL;
+		group = (group + step) & groupMask;
 	}
 }
 
 void markTable(VM* vm, Table* table) {
 	for (size_t i = 0; i < table->capacity; i++) {
 		Entry* entry = &table->entries[i];
+		if (entry->key == NULL) continue;
 		markObject(vm, (Obj*)entry->key);
 		markValue(vm, entry->value);
 	}
 }
 
+size_t tableRemoveWhiteOld(Table* table, size_t start, size_t count) {
+	size_t end = count < table->capacity - start ? start + count : table->capacity;
+	for (size_t i = start; i < end; i++) {
+		Entry* entry = &table->entries[i];
+		if (entry->key != NULL && entry->key->obj.isOld && !entry->key->obj.isMarked) {
+			deleteSlot(table, i);
+		}
+	}
+	return end;
+}
+
 void tableRemoveWhite(Table* table) {
 	for (size_t i = 0; i < table->capacity; i++) {
 		Entry* entry = &table->entries[i];
 		if (entry->key != NULL && !entry->key->obj.isMarked) {
-			tableDelete(table, entry->key);
+			deleteSlot(table, i);
 		}
 	}
-}
\ No newline at end of file
+}
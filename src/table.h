@@ -8,10 +8,21 @@ typedef struct {
 	Value value;
 } Entry;
 
+/*
+  An open addressing table in the style of Abseil's Swiss tables (see table.c). Slots without a key have a NULL key, so
+  the entries can be walked directly.
+*/
 typedef struct {
+	// Slots which are full or deleted.
 	size_t count;
 	size_t capacity;
 	Entry* entries;
+	// A byte per slot after the entries, in the same allocation: empty, deleted or 7 bits of the key's hash.
+	uint8_t* control;
+	// Bumped whenever entries move, so a walk over them spread across GC slices knows to start again.
+	size_t rehashes;
+	// The object embedding the table, so that tableSet can apply the write barrier, NULL for tables which are roots.
+	Obj* owner;
 } Table;
 
 void initTable(Table* table);
@@ -22,4 +33,6 @@ bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(VM* vm, Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, size_t length, uint32_t hash);
 void markTable(VM* vm, Table* table);
-void tableRemoveWhite(Table* table);
\ No newline at end of file
+void tableRemoveWhite(Table* table);
+// Removes the unmarked old keys among count entries from start, returning the index it stopped at.
+size_t tableRemoveWhiteOld(Table* table, size_t start, size_t count);
\ No newline at end of file
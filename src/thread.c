@@ -0,0 +1,128 @@
+#include "thread.h"
+#include <stdlib.h>
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// What a new thread runs, freed by the thread once it has started.
+typedef struct {
+	ThreadFn function;
+	void* argument;
+} ThreadStart;
+
+#ifdef _WIN32
+static DWORD WINAPI threadMain(LPVOID parameter) {
+	ThreadStart start = *(ThreadStart*)parameter;
+	free(parameter);
+	start.function(start.argument);
+	return 0;
+}
+
+bool startThread(Thread* thread, ThreadFn function, void* argument) {
+	ThreadStart* start = malloc(sizeof(ThreadStart));
+	if (start == NULL) return false;
+	start->function = function;
+	start->argument = argument;
+
+	*thread = CreateThread(NULL, 0, threadMain, start, 0, NULL);
+	if (*thread == NULL) {
+		free(start);
+		return false;
+	}
+	return true;
+}
+
+void joinThread(Thread thread) {
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+uint64_t currentThreadId(void) {
+	return (uint64_t)GetCurrentThreadId();
+}
+
+void initMutex(Mutex* mutex) { InitializeCriticalSection(mutex); }
+void freeMutex(Mutex* mutex) { DeleteCriticalSection(mutex); }
+void lockMutex(Mutex* mutex) { EnterCriticalSection(mutex); }
+void unlockMutex(Mutex* mutex) { LeaveCriticalSection(mutex); }
+
+void initCondition(Condition* condition) { InitializeConditionVariable(condition); }
+void freeCondition(Condition* condition) { (void)condition; }
+void waitCondition(Condition* condition, Mutex* mutex) { SleepConditionVariableCS(condition, mutex, INFINITE); }
+void broadcastCondition(Condition* condition) { WakeAllConditionVariable(condition); }
+
+size_t processorCount(void) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors < 1 ? 1 : (size_t)info.dwNumberOfProcessors;
+}
+
+void sleepMicroseconds(uint32_t microseconds) {
+	Sleep(microseconds < 1000 ? 1 : microseconds / 1000);
+}
+
+double monotonicSeconds(void) {
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+#else
+static void* threadMain(void* parameter) {
+	ThreadStart start = *(ThreadStart*)parameter;
+	free(parameter);
+	start.function(start.argument);
+	return NULL;
+}
+
+bool startThread(Thread* thread, ThreadFn function, void* argument) {
+	ThreadStart* start = malloc(sizeof(ThreadStart));
+	if (start == NULL) return false;
+	start->function = function;
+	start->argument = argument;
+
+	if (pthread_create(thread, NULL, threadMain, start) != 0) {
+		free(start);
+		return false;
+	}
+	return true;
+}
+
+void joinThread(Thread thread) {
+	pthread_join(thread, NULL);
+}
+
+uint64_t currentThreadId(void) {
+	// pthread_t is opaque, but the address of a thread local variable is unique among running threads.
+	static _Thread_local char marker;
+	return (uint64_t)(uintptr_t)&marker;
+}
+
+void initMutex(Mutex* mutex) { pthread_mutex_init(mutex, NULL); }
+void freeMutex(Mutex* mutex) { pthread_mutex_destroy(mutex); }
+void lockMutex(Mutex* mutex) { pthread_mutex_lock(mutex); }
+void unlockMutex(Mutex* mutex) { pthread_mutex_unlock(mutex); }
+
+void initCondition(Condition* condition) { pthread_cond_init(condition, NULL); }
+void freeCondition(Condition* condition) { pthread_cond_destroy(condition); }
+void waitCondition(Condition* condition, Mutex* mutex) { pthread_cond_wait(condition, mutex); }
+void broadcastCondition(Condition* condition) { pthread_cond_broadcast(condition); }
+
+size_t processorCount(void) {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count < 1 ? 1 : (size_t)count;
+}
+
+void sleepMicroseconds(uint32_t microseconds) {
+	struct timespec duration = { (time_t)(microseconds / 1000000), (long)(microseconds % 1000000) * 1000 };
+	nanosleep(&duration, NULL);
+}
+
+double monotonicSeconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+#endif
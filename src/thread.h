@@ -0,0 +1,61 @@
+#pragma once
+#include "common.h"
+
+/*
+  A thin layer over the platform's threads (pthreads, or Win32 threads on Windows) and clocks, for running workers (see
+  worker.h), compiling imports ahead of time (see prescan.h) and the profiler's sample timer (see profiler.h).
+  - Everything a VM owns is only ever touched by the thread running it, only message queues, prescan jobs and the
+    profiler's flags are shared between threads.
+*/
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Condition;
+#else
+#include <pthread.h>
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Condition;
+#endif
+
+typedef void (*ThreadFn)(void* argument);
+
+// Returns false if the thread couldn't be started.
+bool startThread(Thread* thread, ThreadFn function, void* argument);
+void joinThread(Thread thread);
+// A number unique to the calling thread among those running.
+uint64_t currentThreadId(void);
+
+void initMutex(Mutex* mutex);
+void freeMutex(Mutex* mutex);
+void lockMutex(Mutex* mutex);
+void unlockMutex(Mutex* mutex);
+
+void initCondition(Condition* condition);
+void freeCondition(Condition* condition);
+// Releases mutex (which must be locked) while waiting, it is locked again on return. May wake spuriously.
+void waitCondition(Condition* condition, Mutex* mutex);
+void broadcastCondition(Condition* condition);
+
+// The number of processors online, at least 1.
+size_t processorCount(void);
+void sleepMicroseconds(uint32_t microseconds);
+// Seconds since an arbitrary point, from a clock which never goes backwards.
+double monotonicSeconds(void);
+
+// Flags set by one thread and polled by another.
+#ifdef _MSC_VER
+static inline int32_t atomicLoad(volatile int32_t* flag) { return (int32_t)InterlockedOr((volatile LONG*)flag, 0); }
+static inline void atomicStore(volatile int32_t* flag, int32_t value) { InterlockedExchange((volatile LONG*)flag, value); }
+#else
+static inline int32_t atomicLoad(volatile int32_t* flag) { return __atomic_load_n(flag, __ATOMIC_RELAXED); }
+static inline void atomicStore(volatile int32_t* flag, int32_t value) { __atomic_store_n(flag, value, __ATOMIC_RELAXED); }
+#endif
@@ -0,0 +1,708 @@
+#include "typedarray.h"
+#include "natives.h"
+#include "memory.h"
+#include "range.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(DRAGON_ARRAY_SCALAR) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define ARRAY_SSE2
+#include <emmintrin.h>
+// AVX2 kernels are built alongside the SSE2 ones and used when the processor has it, unless the build already targets it.
+#if defined(__AVX2__)
+#define ARRAY_AVX2
+#define HAS_AVX2() true
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__x86_64__)
+#define ARRAY_AVX2
+#define AVX2_TARGET __attribute__((target("avx2")))
+#define HAS_AVX2() __builtin_cpu_supports("avx2")
+#include <immintrin.h>
+#endif
+#elif !defined(DRAGON_ARRAY_SCALAR) && defined(__aarch64__) && defined(__ARM_NEON)
+#define ARRAY_NEON
+#include <arm_neon.h>
+#endif
+
+#ifndef AVX2_TARGET
+#define AVX2_TARGET
+#endif
+
+const size_t arrayElementSize[] = {
+	[ARRAY_FLOAT64] = sizeof(double),
+	[ARRAY_INT32] = sizeof(int32_t),
+	[ARRAY_BYTE] = sizeof(uint8_t)
+};
+
+static const char* arrayKindNames[] = {
+	[ARRAY_FLOAT64] = "Float64Array",
+	[ARRAY_INT32] = "Int32Array",
+	[ARRAY_BYTE] = "ByteArray"
+};
+
+/*
+  Float64Array kernels
+*/
+
+#ifdef ARRAY_AVX2
+AVX2_TARGET static double sumFloat64AVX2(const double* x, size_t n) {
+	__m256d a = _mm256_setzero_pd();
+	__m256d b = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		a = _mm256_add_pd(a, _mm256_loadu_pd(x + i));
+		b = _mm256_add_pd(b, _mm256_loadu_pd(x + i + 4));
+	}
+	a = _mm256_add_pd(a, b);
+	__m128d half = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+	double total = _mm_cvtsd_f64(half) + _mm_cvtsd_f64(_mm_unpackhi_pd(half, half));
+	for (; i < n; i++) total += x[i];
+	return total;
+}
+
+AVX2_TARGET static double dotFloat64AVX2(const double* x, const double* y, size_t n) {
+	__m256d a = _mm256_setzero_pd();
+	__m256d b = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		a = _mm256_add_pd(a, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+		b = _mm256_add_pd(b, _mm256_mul_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+	}
+	a = _mm256_add_pd(a, b);
+	__m128d half = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+	double total = _mm_cvtsd_f64(half) + _mm_cvtsd_f64(_mm_unpackhi_pd(half, half));
+	for (; i < n; i++) total += x[i] * y[i];
+	return total;
+}
+
+AVX2_TARGET static double extremeFloat64AVX2(const double* x, size_t n, bool max) {
+	__m256d best = _mm256_set1_pd(x[0]);
+	__m256d unordered = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256d v = _mm256_loadu_pd(x + i);
+		best = max ? _mm256_max_pd(best, v) : _mm256_min_pd(best, v);
+		unordered = _mm256_or_pd(unordered, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+	}
+	if (_mm256_movemask_pd(unordered) != 0) return NAN;
+
+	double lanes[4];
+	_mm256_storeu_pd(lanes, best);
+	double result = lanes[0];
+	for (size_t lane = 1; lane < 4; lane++) result = max ? fmax(result, lanes[lane]) : fmin(result, lanes[lane]);
+	for (; i < n; i++) {
+		if (isnan(x[i])) return NAN;
+		result = max ? fmax(result, x[i]) : fmin(result, x[i]);
+	}
+	return result;
+}
+
+AVX2_TARGET static void scaleFloat64AVX2(double* x, size_t n, double factor) {
+	__m256d k = _mm256_set1_pd(factor);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) _mm256_storeu_pd(x + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), k));
+	for (; i < n; i++) x[i] *= factor;
+}
+
+AVX2_TARGET static void addFloat64AVX2(double* x, const double* y, size_t n) {
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) _mm256_storeu_pd(x + i, _mm256_add_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+	for (; i < n; i++) x[i] += y[i];
+}
+
+AVX2_TARGET static void addScalarFloat64AVX2(double* x, size_t n, double addend) {
+	__m256d k = _mm256_set1_pd(addend);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) _mm256_storeu_pd(x + i, _mm256_add_pd(_mm256_loadu_pd(x + i), k));
+	for (; i < n; i++) x[i] += addend;
+}
+#endif
+
+static double sumFloat64(const double* x, size_t n) {
+#ifdef ARRAY_AVX2
+	if (HAS_AVX2()) return sumFloat64AVX2(x, n);
+#endif
+	double total = 0;
+	size_t i = 0;
+#if defined(ARRAY_SSE2)
+	__m128d a = _mm_setzero_pd();
+	__m128d b = _mm_setzero_pd();
+	for (; i + 4 <= n; i += 4) {
+		a = _mm_add_pd(a, _mm_loadu_pd(x + i));
+		b = _mm_add_pd(b, _mm_loadu_pd(x + i + 2));
+	}
+	a = _mm_add_pd(a, b);
+	total = _mm_cvtsd_f64(a) + _mm_cvtsd_f64(_mm_unpackhi_pd(a, a));
+#elif defined(ARRAY_NEON)
+	float64x2_t a = vdupq_n_f64(0);
+	float64x2_t b = vdupq_n_f64(0);
+	for (; i + 4 <= n; i += 4) {
+		a = vaddq_f64(a, vld1q_f64(x + i));
+		b = vaddq_f64(b, vld1q_f64(x + i + 2));
+	}
+	total = vaddvq_f64(vaddq_f64(a, b));
+#endif
+	for (; i < n; i++) total += x[i];
+	return total;
+}
+
+static double dotFloat64(const double* x, const double* y, size_t n) {
+#ifdef ARRAY_AVX2
+	if (HAS_AVX2()) return dotFloat64AVX2(x, y, n);
+#endif
+	double total = 0;
+	size_t i = 0;
+#if defined(ARRAY_SSE2)
+	__m128d a = _mm_setzero_pd();
+	__m128d b = _mm_setzero_pd();
+	for (; i + 4 <= n; i += 4) {
+		a = _mm_add_pd(a, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+		b = _mm_add_pd(b, _mm_mul_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2)));
+	}
+	a = _mm_add_pd(a, b);
+	total = _mm_cvtsd_f64(a) + _mm_cvtsd_f64(_mm_unpackhi_pd(a, a));
+#elif defined(ARRAY_NEON)
+	float64x2_t a = vdupq_n_f64(0);
+	float64x2_t b = vdupq_n_f64(0);
+	for (; i + 4 <= n; i += 4) {
+		a = vaddq_f64(a, vmulq_f64(vld1q_f64(x + i), vld1q_f64(y + i)));
+		b = vaddq_f64(b, vmulq_f64(vld1q_f64(x + i + 2), vld1q_f64(y + i + 2)));
+	}
+	total = vaddvq_f64(vaddq_f64(a, b));
+#endif
+	for (; i < n; i++) total += x[i] * y[i];
+	return total;
+}
+
+// The least or greatest of n (at least one) numbers, NaN if any of them is.
+static double extremeFloat64(const double* x, size_t n, bool max) {
+#ifdef ARRAY_AVX2
+	if (HAS_AVX2()) return extremeFloat64AVX2(x, n, max);
+#endif
+	double result = x[0];
+	size_t i = 0;
+#if defined(ARRAY_SSE2)
+	__m128d best = _mm_set1_pd(x[0]);
+	__m128d unordered = _mm_setzero_pd();
+	for (; i + 2 <= n; i += 2) {
+		__m128d v = _mm_loadu_pd(x + i);
+		best = max ? _mm_max_pd(best, v) : _mm_min_pd(best, v);
+		unordered = _mm_or_pd(unordered, _mm_cmpunord_pd(v, v));
+	}
+	if (_mm_movemask_pd(unordered) != 0) return NAN;
+	double low = _mm_cvtsd_f64(best);
+	double high = _mm_cvtsd_f64(_mm_unpackhi_pd(best, best));
+	result = max ? fmax(low, high) : fmin(low, high);
+#elif defined(ARRAY_NEON)
+	// The NEON min and max give NaN when either operand is.
+	float64x2_t best = vdupq_n_f64(x[0]);
+	for (; i + 2 <= n; i += 2) {
+		float64x2_t v = vld1q_f64(x + i);
+		best = max ? vmaxq_f64(best, v) : vminq_f64(best, v);
+	}
+	result = max ? vmaxvq_f64(best) : vminvq_f64(best);
+	if (isnan(result)) return NAN;
+#endif
+	for (; i < n; i++) {
+		if (isnan(x[i])) return NAN;
+		result = max ? fmax(result, x[i]) : fmin(result, x[i]);
+	}
+	return result;
+}
+
+static void scaleFloat64(double* x, size_t n, double factor) {
+#ifdef ARRAY_AVX2
+	if (HAS_AVX2()) {
+		scaleFloat64AVX2(x, n, factor);
+		return;
+	}
+#endif
+	size_t i = 0;
+#if defined(ARRAY_SSE2)
+	__m128d k = _mm_set1_pd(factor);
+	for (; i + 2 <= n; i += 2) _mm_storeu_pd(x + i, _mm_mul_pd(_mm_loadu_pd(x + i), k));
+#elif defined(ARRAY_NEON)
+	for (; i + 2 <= n; i += 2) vst1q_f64(x + i, vmulq_n_f64(vld1q_f64(x + i), factor));
+#endif
+	for (; i < n; i++) x[i] *= factor;
+}
+
+static void addFloat64(double* x, const double* y, size_t n) {
+#ifdef ARRAY_AVX2
+	if (HAS_AVX2()) {
+		addFloat64AVX2(x, y, n);
+		return;
+	}
+#endif
+	size_t i = 0;
+#if defined(ARRAY_SSE2)
+	for (; i + 2 <= n; i += 2) _mm_storeu_pd(x + i, _mm_add_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+#elif defined(ARRAY_NEON)
+	for (; i + 2 <= n; i += 2) vst1q_f64(x + i, vaddq_f64(vld1q_f64(x + i), vld1q_f64(y + i)));
+#endif
+	for (; i < n; i++) x[i] += y[i];
+}
+
+static void addScalarFloat64(double* x, size_t n, double addend) {
+#ifdef ARRAY_AVX2
+	if (HAS_AVX2()) {
+		addScalarFloat64AVX2(x, n, addend);
+		return;
+	}
+#endif
+	size_t i = 0;
+#if defined(ARRAY_SSE2)
+	__m128d k = _mm_set1_pd(addend);
+	for (; i + 2 <= n; i += 2) _mm_storeu_pd(x + i, _mm_add_pd(_mm_loadu_pd(x + i), k));
+#elif defined(ARRAY_NEON)
+	float64x2_t k = vdupq_n_f64(addend);
+	for (; i + 2 <= n; i += 2) vst1q_f64(x + i, vaddq_f64(vld1q_f64(x + i), k));
+#endif
+	for (; i < n; i++) x[i] += addend;
+}
+
+/*
+  Int32Array and ByteArray kernels, sums are kept exactly in 64 bits.
+*/
+
+static double sumInt32(const int32_t* x, size_t n) {
+	int64_t total = 0;
+	for (size_t i = 0; i < n; i++) total += x[i];
+	return (double)total;
+}
+
+static double sumBytes(const uint8_t* x, size_t n) {
+	uint64_t total = 0;
+	size_t i = 0;
+#if defined(ARRAY_SSE2)
+	// Each sum of absolute differences from zero adds up 8 bytes into a 64 bit lane.
+	__m128i sums = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16) {
+		sums = _mm_add_epi64(sums, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(x + i)), _mm_setzero_si128()));
+	}
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i*)lanes, sums);
+	total = lanes[0] + lanes[1];
+#elif defined(ARRAY_NEON)
+	for (; i + 16 <= n; i += 16) total += vaddlvq_u8(vld1q_u8(x + i));
+#endif
+	for (; i < n; i++) total += x[i];
+	return (double)total;
+}
+
+static int compareFloat64(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	// NaNs go last.
+	if (isnan(x) || isnan(y)) return isnan(x) - isnan(y);
+	return (x > y) - (x < y);
+}
+
+static int compareInt32(const void* a, const void* b) {
+	int32_t x = *(const int32_t*)a;
+	int32_t y = *(const int32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static void sortBytes(uint8_t* x, size_t n) {
+	size_t counts[256] = { 0 };
+	for (size_t i = 0; i < n; i++) counts[x[i]]++;
+	size_t i = 0;
+	for (size_t byte = 0; byte < 256; byte++) {
+		memset(x + i, (int)byte, counts[byte]);
+		i += counts[byte];
+	}
+}
+
+/*
+  Helper functions
+*/
+
+// Allocates and zeroes the buffer of a new array, throwing if length elements wouldn't fit in memory.
+static ObjTypedArray* allocateArray(VM* vm, ArrayKind kind, size_t length, bool* hasError, ObjInstance** exception) {
+	if (length > TYPED_ARRAY_MAX_BYTES / arrayElementSize[kind]) {
+		*hasError = true;
+		*exception = makeException(vm, "OutOfMemoryException", "%s of %zu elements is too large.", arrayKindNames[kind], length);
+		return NULL;
+	}
+	size_t size = length * arrayElementSize[kind];
+	void* data = NULL;
+	if (size > 0) {
+		data = TRY_ALLOCATE(vm, uint8_t, size);
+		if (data == NULL) {
+			*hasError = true;
+			*exception = makeException(vm, "OutOfMemoryException", "Not enough memory for %s of %zu elements.", arrayKindNames[kind], length);
+			return NULL;
+		}
+		memset(data, 0, size);
+	}
+	return newTypedArray(vm, kind, data, length, NULL);
+}
+
+static ObjTypedArray* constructArray(VM* vm, ArrayKind kind, Value source, bool* hasError, ObjInstance** exception) {
+	const char* name = arrayKindNames[kind];
+	if (IS_NUMBER(source)) {
+		double length = AS_NUMBER(source);
+		if (length < 0 || floor(length) != length) {
+			*hasError = true;
+			*exception = makeException(vm, "TypeException", "Expected a non-negative integer length in %s.", name);
+			return NULL;
+		}
+		// Checked before the conversion, which is undefined for lengths size_t can't hold.
+		if (length > (double)TYPED_ARRAY_MAX_BYTES) {
+			*hasError = true;
+			*exception = makeException(vm, "OutOfMemoryException", "%s of %.17g elements is too large.", name, length);
+			return NULL;
+		}
+		return allocateArray(vm, kind, (size_t)length, hasError, exception);
+	}
+
+	if (IS_LIST(source)) {
+		ObjList* list = AS_LIST(source);
+		for (size_t i = 0; i < list->items.count; i++) {
+			if (!IS_NUMBER(list->items.values[i])) {
+				*hasError = true;
+				*exception = makeException(vm, "TypeException", "Expected a list of numbers in %s.", name);
+				return NULL;
+			}
+		}
+		ObjTypedArray* array = allocateArray(vm, kind, list->items.count, hasError, exception);
+		if (array == NULL) return NULL;
+		for (size_t i = 0; i < array->length; i++) typedArraySet(array, i, AS_NUMBER(list->items.values[i]));
+		return array;
+	}
+
+	if (IS_RANGE(source)) {
+		ObjRange* range = AS_RANGE(source);
+		ObjTypedArray* array = allocateArray(vm, kind, rangeLength(range), hasError, exception);
+		if (array == NULL) return NULL;
+		for (size_t i = 0; i < array->length; i++) typedArraySet(array, i, AS_NUMBER(rangeGet(range, i)));
+		return array;
+	}
+
+	if (IS_TYPED_ARRAY(source)) {
+		ObjTypedArray* from = AS_TYPED_ARRAY(source);
+		ObjTypedArray* array = allocateArray(vm, kind, from->length, hasError, exception);
+		if (array == NULL) return NULL;
+		if (from->kind == kind) {
+			if (array->length > 0) memcpy(array->data, from->data, array->length * arrayElementSize[kind]);
+		}
+		else {
+			for (size_t i = 0; i < array->length; i++) typedArraySet(array, i, AS_NUMBER(typedArrayGet(from, i)));
+		}
+		return array;
+	}
+
+	*hasError = true;
+	*exception = makeException(vm, "TypeException", "Expected a length, list, range or typed array in %s.", name);
+	return NULL;
+}
+
+// The typed array argument of method, which must be as long as the receiver.
+static ObjTypedArray* otherArray(VM* vm, ObjTypedArray* array, Value value, const char* method, bool* hasError, ObjInstance** exception) {
+	if (!IS_TYPED_ARRAY(value)) {
+		*hasError = true;
+		*exception = makeException(vm, "TypeException", "Expected typed array as first argument in %s.", method);
+		return NULL;
+	}
+	ObjTypedArray* other = AS_TYPED_ARRAY(value);
+	if (other->length != array->length) {
+		*hasError = true;
+		*exception = makeException(vm, "IndexException", "Expected arrays of the same length in %s (%zu and %zu).", method,
+			array->length, other->length);
+		return NULL;
+	}
+	return other;
+}
+
+static bool numberArgument(VM* vm, Value value, const char* method, bool* hasError, ObjInstance** exception) {
+	if (IS_NUMBER(value)) return true;
+	*hasError = true;
+	*exception = makeException(vm, "TypeException", "Expected number as first argument in %s.", method);
+	return false;
+}
+
+static void formatNumber(char* buffer, size_t size, double number) {
+	if (isinf(number)) snprintf(buffer, size, "%sInfinity", signbit(number) ? "-" : "");
+	else if (isnan(number)) snprintf(buffer, size, "NaN");
+	else snprintf(buffer, size, "%g", number);
+}
+
+ObjString* typedArrayToString(VM* vm, ObjTypedArray* array) {
+	const char* name = arrayKindNames[array->kind];
+	size_t capacity = strlen(name) + 64;
+	size_t length = 0;
+	char* chars = ALLOCATE(vm, char, capacity);
+	length += (size_t)snprintf(chars, capacity, "%s[", name);
+
+	for (size_t i = 0; i < array->length; i++) {
+		char number[32];
+		formatNumber(number, sizeof(number), AS_NUMBER(typedArrayGet(array, i)));
+		size_t numberLength = strlen(number);
+		// The number, ", " or "]" and the terminator.
+		if (length + numberLength + 3 > capacity) {
+			size_t newCapacity = max(capacity * 2, length + numberLength + 3);
+			chars = GROW_ARRAY(vm, char, chars, capacity, newCapacity);
+			capacity = newCapacity;
+		}
+		memcpy(chars + length, number, numberLength);
+		length += numberLength;
+		if (i != array->length - 1) {
+			memcpy(chars + length, ", ", 2);
+			length += 2;
+		}
+	}
+	chars[length++] = ']';
+	chars[length] = '\0';
+
+	chars = GROW_ARRAY(vm, char, chars, capacity, length + 1);
+	return takeTransientString(vm, chars, length);
+}
+
+/*
+  Constructors
+*/
+
+static Value float64ArrayNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjTypedArray* array = constructArray(vm, ARRAY_FLOAT64, args[0], hasError, exception);
+	return array == NULL ? NULL_VAL : OBJ_VAL(array);
+}
+
+static Value int32ArrayNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjTypedArray* array = constructArray(vm, ARRAY_INT32, args[0], hasError, exception);
+	return array == NULL ? NULL_VAL : OBJ_VAL(array);
+}
+
+static Value byteArrayNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjTypedArray* array = constructArray(vm, ARRAY_BYTE, args[0], hasError, exception);
+	return array == NULL ? NULL_VAL : OBJ_VAL(array);
+}
+
+/*
+  Typed Array Methods
+*/
+
+static Value typedArrayAddNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjTypedArray* array = AS_TYPED_ARRAY(*bound);
+
+	if (IS_NUMBER(args[0])) {
+		double addend = AS_NUMBER(args[0]);
+		if (array->kind == ARRAY_FLOAT64) {
+			addScalarFloat64(array->data, array->length, addend);
+		}
+		else {
+			for (size_t i = 0; i < array->length; i++) typedArraySet(array, i, AS_NUMBER(typedArrayGet(array, i)) + addend);
+		}
+		return *bound;
+	}
+
+	ObjTypedArray* other = otherArray(vm, array, args[0], "add", hasError, exception);
+	if (other == NULL) return NULL_VAL;
+
+	// Overlapping slices of the same buffer are added as if the other one were read first.
+	size_t size = array->length * arrayElementSize[array->kind];
+	size_t otherSize = other->length * arrayElementSize[other->kind];
+	uint8_t* start = array->data;
+	uint8_t* otherStart = other->data;
+	void* copy = NULL;
+	if (other->data != array->data && size > 0 && otherStart < start + size && start < otherStart + otherSize) {
+		copy = ALLOCATE(vm, uint8_t, otherSize);
+		memcpy(copy, other->data, otherSize);
+	}
+	const void* addends = copy != NULL ? copy : other->data;
+
+	if (array->kind == ARRAY_FLOAT64 && other->kind == ARRAY_FLOAT64) {
+		addFloat64(array->data, addends, array->length);
+	}
+	else {
+		ObjTypedArray view = *other;
+		view.data = (void*)addends;
+		for (size_t i = 0; i < array->length; i++) {
+			typedArraySet(array, i, AS_NUMBER(typedArrayGet(array, i)) + AS_NUMBER(typedArrayGet(&view, i)));
+		}
+	}
+
+	if (copy != NULL) FREE_ARRAY(vm, uint8_t, copy, otherSize);
+	return *bound;
+}
+
+static Value typedArrayCopyNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjTypedArray* array = constructArray(vm, AS_TYPED_ARRAY(*bound)->kind, *bound, hasError, exception);
+	return array == NULL ? NULL_VAL : OBJ_VAL(array);
+}
+
+static Value typedArrayDotNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjTypedArray* array = AS_TYPED_ARRAY(*bound);
+	ObjTypedArray* other = otherArray(vm, array, args[0], "dot", hasError, exception);
+	if (other == NULL) return NULL_VAL;
+
+	if (array->kind == ARRAY_FLOAT64 && other->kind == ARRAY_FLOAT64) {
+		return NUMBER_VAL(dotFloat64(array->data, other->data, array->length));
+	}
+	double total = 0;
+	for (size_t i = 0; i < array->length; i++) {
+		total += AS_NUMBER(typedArrayGet(array, i)) * AS_NUMBER(typedArrayGet(other, i));
+	}
+	return NUMBER_VAL(total);
+}
+
+static Value typedArrayFillNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjTypedArray* array = AS_TYPED_ARRAY(*bound);
+	if (!numberArgument(vm, args[0], "fill", hasError, exception)) return NULL_VAL;
+
+	double number = AS_NUMBER(args[0]);
+	switch (array->kind) {
+		case ARRAY_FLOAT64:
+			for (size_t i = 0; i < array->length; i++) ((double*)array->data)[i] = number;
+			break;
+		case ARRAY_INT32: {
+			int32_t value = toInt32(number);
+			for (size_t i = 0; i < array->length; i++) ((int32_t*)array->data)[i] = value;
+			break;
+		}
+		case ARRAY_BYTE:
+			if (array->length > 0) memset(array->data, toByte(number), array->length);
+			break;
+	}
+	return *bound;
+}
+
+static Value typedArrayLengthNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	return NUMBER_VAL((double)AS_TYPED_ARRAY(*bound)->length);
+}
+
+static Value extremeNative(VM* vm, Value* bound, bool max, bool* hasError, ObjInstance** exception) {
+	ObjTypedArray* array = AS_TYPED_ARRAY(*bound);
+	if (array->length == 0) {
+		*hasError = true;
+		*exception = makeException(vm, "IndexException", "Cannot take the %s of an empty array.", max ? "max" : "min");
+		return NULL_VAL;
+	}
+
+	switch (array->kind) {
+		case ARRAY_FLOAT64:
+			return NUMBER_VAL(extremeFloat64(array->data, array->length, max));
+		case ARRAY_INT32: {
+			const int32_t* x = array->data;
+			int32_t result = x[0];
+			for (size_t i = 1; i < array->length; i++) result = max ? (x[i] > result ? x[i] : result) : (x[i] < result ? x[i] : result);
+			return NUMBER_VAL((double)result);
+		}
+		default: {
+			const uint8_t* x = array->data;
+			uint8_t result = x[0];
+			for (size_t i = 1; i < array->length; i++) result = max ? (x[i] > result ? x[i] : result) : (x[i] < result ? x[i] : result);
+			return NUMBER_VAL((double)result);
+		}
+	}
+}
+
+static Value typedArrayMaxNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	return extremeNative(vm, bound, true, hasError, exception);
+}
+
+static Value typedArrayMinNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	return extremeNative(vm, bound, false, hasError, exception);
+}
+
+static Value typedArrayScaleNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjTypedArray* array = AS_TYPED_ARRAY(*bound);
+	if (!numberArgument(vm, args[0], "scale", hasError, exception)) return NULL_VAL;
+
+	double factor = AS_NUMBER(args[0]);
+	if (array->kind == ARRAY_FLOAT64) {
+		scaleFloat64(array->data, array->length, factor);
+	}
+	else {
+		for (size_t i = 0; i < array->length; i++) typedArraySet(array, i, AS_NUMBER(typedArrayGet(array, i)) * factor);
+	}
+	return *bound;
+}
+
+// slice(start, end), end defaulting to the length. Negative indices count back from the end.
+static Value typedArraySliceNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjTypedArray* array = AS_TYPED_ARRAY(*bound);
+	if (argCount > 2) {
+		*hasError = true;
+		*exception = makeException(vm, "ArityException", "Expected at most 2 argument(s) but got %u.", argCount);
+		return NULL_VAL;
+	}
+
+	double bounds[2] = { 0, (double)array->length };
+	for (uint8_t i = 0; i < argCount; i++) {
+		if (!IS_NUMBER(args[i]) || floor(AS_NUMBER(args[i])) != AS_NUMBER(args[i])) {
+			*hasError = true;
+			*exception = makeException(vm, "TypeException", "Expected integer indices in slice.");
+			return NULL_VAL;
+		}
+		bounds[i] = AS_NUMBER(args[i]);
+		if (bounds[i] < 0) bounds[i] += (double)array->length;
+	}
+	if (bounds[0] < 0 || bounds[0] > bounds[1] || bounds[1] > (double)array->length) {
+		*hasError = true;
+		*exception = makeException(vm, "IndexException", "Slice out of bounds.");
+		return NULL_VAL;
+	}
+
+	size_t start = (size_t)bounds[0];
+	uint8_t* data = (uint8_t*)array->data + start * arrayElementSize[array->kind];
+	ObjTypedArray* owner = array->parent != NULL ? array->parent : array;
+	return OBJ_VAL(newTypedArray(vm, array->kind, array->length == 0 ? NULL : data, (size_t)bounds[1] - start, owner));
+}
+
+static Value typedArraySortNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjTypedArray* array = AS_TYPED_ARRAY(*bound);
+	if (array->length < 2) return *bound;
+
+	switch (array->kind) {
+		case ARRAY_FLOAT64: qsort(array->data, array->length, sizeof(double), compareFloat64); break;
+		case ARRAY_INT32: qsort(array->data, array->length, sizeof(int32_t), compareInt32); break;
+		case ARRAY_BYTE: sortBytes(array->data, array->length); break;
+	}
+	return *bound;
+}
+
+static Value typedArraySumNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjTypedArray* array = AS_TYPED_ARRAY(*bound);
+	switch (array->kind) {
+		case ARRAY_FLOAT64: return NUMBER_VAL(sumFloat64(array->data, array->length));
+		case ARRAY_INT32: return NUMBER_VAL(sumInt32(array->data, array->length));
+		default: return NUMBER_VAL(sumBytes(array->data, array->length));
+	}
+}
+
+static Value typedArrayToListNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjTypedArray* array = AS_TYPED_ARRAY(*bound);
+
+	ValueArray items;
+	initValueArray(&items);
+	if (array->length > 0) {
+		items.values = ALLOCATE(vm, Value, array->length);
+		items.capacity = array->length;
+		items.count = array->length;
+		for (size_t i = 0; i < array->length; i++) items.values[i] = typedArrayGet(array, i);
+	}
+	return OBJ_VAL(newList(vm, items));
+}
+
+void defineTypedArrayMethods(VM* vm) {
+	defineNative(vm, &vm->typedArrayMethods, "add", 1, false, typedArrayAddNative);
+	defineNative(vm, &vm->typedArrayMethods, "copy", 0, false, typedArrayCopyNative);
+	defineNative(vm, &vm->typedArrayMethods, "dot", 1, false, typedArrayDotNative);
+	defineNative(vm, &vm->typedArrayMethods, "fill", 1, false, typedArrayFillNative);
+	defineNative(vm, &vm->typedArrayMethods, "length", 0, false, typedArrayLengthNative);
+	defineNative(vm, &vm->typedArrayMethods, "max", 0, false, typedArrayMaxNative);
+	defineNative(vm, &vm->typedArrayMethods, "min", 0, false, typedArrayMinNative);
+	defineNative(vm, &vm->typedArrayMethods, "scale", 1, false, typedArrayScaleNative);
+	defineNative(vm, &vm->typedArrayMethods, "slice", 0, true, typedArraySliceNative);
+	defineNative(vm, &vm->typedArrayMethods, "sort", 0, false, typedArraySortNative);
+	defineNative(vm, &vm->typedArrayMethods, "sum", 0, false, typedArraySumNative);
+	defineNative(vm, &vm->typedArrayMethods, "toList", 0, false, typedArrayToListNative);
+}
+
+void defineTypedArrayNatives(VM* vm, Module* mod) {
+	defineModuleNative(vm, mod, "Float64Array", 1, false, float64ArrayNative);
+	defineModuleNative(vm, mod, "Int32Array", 1, false, int32ArrayNative);
+	defineModuleNative(vm, mod, "ByteArray", 1, false, byteArrayNative);
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include "common.h"
+#include "vm.h"
+#include <math.h>
+
+/*
+  Typed arrays (Float64Array, Int32Array, ByteArray) hold numbers packed into a buffer rather than as values, 8, 4 or 1
+  bytes per element instead of a Value each.
+  - The constructors take a length (elements start at 0) or a list, range or typed array to copy. Indexing, index
+    assignment and foreach work as for lists, storing converts the number to the element type: Int32Array wraps it
+    modulo 2^32 and ByteArray modulo 256 after dropping the fraction, NaN and the infinities store 0.
+  - The bulk methods (sum, min, max, dot, scale, add, fill, sort) loop natively, with SSE2, AVX2 (picked at run time on
+    x86-64 with GCC or Clang) or NEON kernels for Float64Array and scalar loops otherwise. Sums are kept in several lanes,
+    so they may round differently from adding the elements in order.
+  - slice(start, end) returns a view sharing the elements, writes through either are seen by both.
+*/
+
+// The largest buffer a typed array may have, what 64-bit processors can address (lengths beyond it throw OutOfMemoryException).
+#define TYPED_ARRAY_MAX_BYTES (sizeof(size_t) > 4 ? (size_t)((uint64_t)1 << 48) : SIZE_MAX)
+
+extern const size_t arrayElementSize[];
+
+static inline int32_t toInt32(double number) {
+	if (number > -2147483649.0 && number < 2147483648.0) return (int32_t)number;
+	if (!isfinite(number)) return 0;
+	double wrapped = fmod(trunc(number), 4294967296.0);
+	if (wrapped < 0) wrapped += 4294967296.0;
+	return (int32_t)(uint32_t)wrapped;
+}
+
+static inline uint8_t toByte(double number) {
+	if (number >= 0 && number < 256) return (uint8_t)number;
+	return (uint8_t)toInt32(number);
+}
+
+static inline Value typedArrayGet(ObjTypedArray* array, size_t index) {
+	switch (array->kind) {
+		case ARRAY_FLOAT64: return NUMBER_VAL(((double*)array->data)[index]);
+		case ARRAY_INT32: return NUMBER_VAL((double)((int32_t*)array->data)[index]);
+		default: return NUMBER_VAL((double)((uint8_t*)array->data)[index]);
+	}
+}
+
+static inline void typedArraySet(ObjTypedArray* array, size_t index, double number) {
+	switch (array->kind) {
+		case ARRAY_FLOAT64: ((double*)array->data)[index] = number; break;
+		case ARRAY_INT32: ((int32_t*)array->data)[index] = toInt32(number); break;
+		default: ((uint8_t*)array->data)[index] = toByte(number); break;
+	}
+}
+
+ObjString* typedArrayToString(VM* vm, ObjTypedArray* array);
+void defineTypedArrayMethods(VM* vm);
+void defineTypedArrayNatives(VM* vm, Module* mod);
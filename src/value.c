@@ -5,6 +5,8 @@
 #include "memory.h"
 #include "object.h"
 #include "vm.h"
+#include "range.h"
+#include "rope.h"
 
 void initValueArray(ValueArray* array) {
 	array->values = NULL;
@@ -50,28 +52,24 @@ ObjString* numberToString(VM* vm, double value) {
 }
 
 ObjString* valueToString(VM* vm, Value value, bool* hasError, ObjInstance** exception) {
-	switch (value.type) {
-		case VAL_BOOL:
-			return vm->stringConstants[AS_BOOL(value) ? STR_TRUE : STR_FALSE];
-		case VAL_NULL:
-			return vm->stringConstants[STR_NULL];
-		case VAL_NUMBER:
-			return numberToString(vm, AS_NUMBER(value));
-		case VAL_OBJ:
-			return objectToString(vm, value, hasError, exception);
+	if (IS_BOOL(value)) {
+		return vm->stringConstants[AS_BOOL(value) ? STR_TRUE : STR_FALSE];
 	}
+	else if (IS_NULL(value)) {
+		return vm->stringConstants[STR_NULL];
+	}
+	else if (IS_NUMBER(value)) {
+		return numberToString(vm, AS_NUMBER(value));
+	}
+	return objectToString(vm, value, hasError, exception);
 }
 
 ObjString* valueToRepr(VM* vm, Value value) {
-	switch (value.type) {
-		case VAL_BOOL: 
-		case VAL_NULL:
-		case VAL_NUMBER:
-			// The above types cannot fail.
-			return valueToString(vm, value, NULL, NULL);
-		case VAL_OBJ:
-			return objectToRepr(vm, value);
+	if (IS_OBJ(value)) {
+		return objectToRepr(vm, value);
 	}
+	// The other types cannot fail.
+	return valueToString(vm, value, NULL, NULL);
 }
 
 bool isFalsey(Value value) {
@@ -88,7 +86,30 @@ bool listsEqual(ObjList* a, ObjList* b) {
 	return true;
 }
 
+// Ranges are equal to the lists they stand for.
+static bool sequencesEqual(Value a, Value b) {
+	if (IS_RANGE(a) && IS_RANGE(b)) return rangesEqual(AS_RANGE(a), AS_RANGE(b));
+	if (IS_RANGE(a) && IS_LIST(b)) return rangeEqualsList(AS_RANGE(a), AS_LIST(b));
+	if (IS_LIST(a) && IS_RANGE(b)) return rangeEqualsList(AS_RANGE(b), AS_LIST(a));
+	return false;
+}
+
+// Interned strings are equal only if they are the same string, transient ones are compared by their chars.
+static inline bool stringValuesEqual(Value a, Value b) {
+	if (AS_STRING(a) == AS_STRING(b)) return true;
+	if (AS_STRING(a)->isInterned && AS_STRING(b)->isInterned) return false;
+	return stringsEqual(a, b);
+}
+
 bool valuesEqual(Value a, Value b) {
+#ifdef DRAGON_NAN_BOXING
+	if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+	if (IS_LIST(a) && IS_LIST(b)) return listsEqual(AS_LIST(a), AS_LIST(b));
+	if (IS_RANGE(a) || IS_RANGE(b)) return sequencesEqual(a, b);
+	if (IS_ROPE(a) || IS_ROPE(b)) return stringsEqual(a, b);
+	if (IS_STRING(a) && IS_STRING(b)) return stringValuesEqual(a, b);
+	return a == b;
+#else
 	if (a.type != b.type) return false;
 	switch (a.type) {
 		case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
@@ -96,7 +117,11 @@ bool valuesEqual(Value a, Value b) {
 		case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
 		case VAL_OBJ: 
 			if (IS_LIST(a) && IS_LIST(b)) return listsEqual(AS_LIST(a), AS_LIST(b));
+			if (IS_RANGE(a) || IS_RANGE(b)) return sequencesEqual(a, b);
+			if (IS_ROPE(a) || IS_ROPE(b)) return stringsEqual(a, b);
+			if (IS_STRING(a) && IS_STRING(b)) return stringValuesEqual(a, b);
 			return AS_OBJ(a) == AS_OBJ(b);
 		default: return false; // Unreachable
 	}
+#endif
 }
\ No newline at end of file
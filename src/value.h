@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.h"
+#include <string.h>
 
 typedef struct Obj Obj;
 typedef struct ObjClosure ObjClosure;
@@ -8,6 +9,8 @@ typedef struct ObjFunction ObjFunction;
 typedef struct ObjUpvalue ObjUpvalue;
 typedef struct ObjString ObjString;
 typedef struct ObjInstance ObjInstance;
+typedef struct ObjShape ObjShape;
+typedef struct JitCode JitCode;
 typedef struct VM VM;
 
 typedef enum {
@@ -17,6 +20,38 @@ typedef enum {
 	VAL_OBJ
 } ValueType;
 
+#ifdef DRAGON_NAN_BOXING
+
+/*
+  NaN-boxing packs every value into a single 64-bit word.
+  - Doubles are stored as themselves, anything which is not a quiet NaN (with the bits in QNAN set) is a number.
+  - null, false and true are quiet NaNs with a tag in the low bits.
+  - Objects are quiet NaNs with the sign bit set, and the pointer in the low 48 bits.
+*/
+
+typedef uint64_t Value;
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NULL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+
+static inline Value numToValue(double num) {
+	Value value;
+	memcpy(&value, &num, sizeof(double));
+	return value;
+}
+
+static inline double valueToNum(Value value) {
+	double num;
+	memcpy(&num, &value, sizeof(Value));
+	return num;
+}
+
+#else
+
 typedef struct {
 	ValueType type;
 	union {
@@ -26,6 +61,8 @@ typedef struct {
 	};
 } Value;
 
+#endif
+
 typedef struct {
 	size_t capacity;
 	size_t count;
@@ -42,6 +79,27 @@ bool valuesEqual(Value a, Value b);
 
 // Helper macros
 
+#ifdef DRAGON_NAN_BOXING
+
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define BOOL_VAL(value) ((value) ? TRUE_VAL : FALSE_VAL)
+#define NULL_VAL ((Value)(uint64_t)(QNAN | TAG_NULL))
+#define NUMBER_VAL(value) numToValue(value)
+#define OBJ_VAL(value) ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(value)))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNum(value)
+#define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NULL(value) ((value) == NULL_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#else
+
 #define BOOL_VAL(value) ((Value) { VAL_BOOL, .boolean = value })
 #define NULL_VAL ((Value) { VAL_NULL, .number = 0 })
 #define NUMBER_VAL(value) ((Value) { VAL_NUMBER, .number = value })
@@ -54,4 +112,22 @@ bool valuesEqual(Value a, Value b);
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NULL(value) ((value).type == VAL_NULL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
-#define IS_OBJ(value) ((value).type == VAL_OBJ)
\ No newline at end of file
+#define IS_OBJ(value) ((value).type == VAL_OBJ)
+
+#endif
+
+// Mixes 64 bits (a number's or a pointer's) into a hash for the tables keyed by values.
+static inline uint32_t hashBits(uint64_t bits) {
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdULL;
+	bits ^= bits >> 33;
+	return (uint32_t)bits;
+}
+
+// Numbers equal to each other hash the same, adding zero turns -0 into 0.
+static inline uint32_t hashNumber(double number) {
+	number += 0.0;
+	uint64_t bits;
+	memcpy(&bits, &number, sizeof(bits));
+	return hashBits(bits);
+}
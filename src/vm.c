@@ -8,9 +8,20 @@
 #include "natives.h"
 #include "exception.h"
 #include "list.h"
+#include "range.h"
+#include "typedarray.h"
+#include "map.h"
+#include "jit.h"
+#include "rope.h"
 #include "strings.h"
 #include "iterator.h"
 #include "file.h"
+#include "bytecode.h"
+#include "worker.h"
+#include "profiler.h"
+#include "gc.h"
+#include "io.h"
+#include "prescan.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -23,20 +34,87 @@ static void resetStack(VM* vm) {
 	vm->openUpvalues = NULL;
 }
 
-static void initializeStack(VM* vm) {
-	vm->shouldGC = false;
-	vm->frameSize = 64;
-	vm->frames = ALLOCATE(vm, CallFrame, vm->frameSize);
+/*
+  The stack
+  - The frames, the stack and the open upvalue of each stack slot are each a reservation of address space (see
+    reserveMemory) large enough for frameMax frames, so they never move. A page more than that is reserved and never
+    committed, a guard which faults rather than letting anything run past the end.
+  - Frames (and STACK_SLOTS_PER_FRAME values each) are committed FRAME_COMMIT_COUNT at first, then doubling as calls go
+    deeper, so a VM only ever uses the memory its deepest call needed.
+*/
+
+#define FRAME_COMMIT_COUNT 64
+
+// The bytes reserved for count items of size, rounded up to whole pages, with the guard page.
+static size_t reservedBytes(size_t count, size_t size) {
+	size_t page = pageSize();
+	return (count * size + page - 1) / page * page + page;
+}
+
+static void releaseStack(CallFrame* frames, Value* stack, ObjUpvalue** openSlots, size_t frameMax) {
+	size_t slots = frameMax * STACK_SLOTS_PER_FRAME;
+	if (frames != NULL) releaseMemory(frames, reservedBytes(frameMax, sizeof(CallFrame)));
+	if (stack != NULL) releaseMemory(stack, reservedBytes(slots, sizeof(Value)));
+	if (openSlots != NULL) releaseMemory(openSlots, reservedBytes(slots, sizeof(ObjUpvalue*)));
+}
+
+// Commits the first frameCount frames and their stack slots.
+static bool commitStack(VM* vm, size_t frameCount) {
+	size_t slots = frameCount * STACK_SLOTS_PER_FRAME;
+	if (!commitMemory(vm->frames, frameCount * sizeof(CallFrame)) || !commitMemory(vm->stack, slots * sizeof(Value))) return false;
+	if (vm->openSlots != NULL && !commitMemory(vm->openSlots, slots * sizeof(ObjUpvalue*))) return false;
+	vm->frameSize = frameCount;
+	vm->stackSize = slots;
+	return true;
+}
 
-	vm->stackSize = 256 * vm->frameSize;
-	vm->stack = ALLOCATE(vm, Value, vm->stackSize);
+// Replaces the VM's stack with an empty one for frameMax frames, unless it can't be reserved.
+static bool reserveStack(VM* vm, size_t frameMax) {
+	// Guards against the sizes overflowing.
+	if (frameMax == 0 || frameMax > SIZE_MAX / 4 / STACK_SLOTS_PER_FRAME / sizeof(Value)) return false;
+
+	CallFrame* frames = reserveMemory(reservedBytes(frameMax, sizeof(CallFrame)));
+	Value* stack = reserveMemory(reservedBytes(frameMax * STACK_SLOTS_PER_FRAME, sizeof(Value)));
+	size_t committed = frameMax < FRAME_COMMIT_COUNT ? frameMax : FRAME_COMMIT_COUNT;
+	if (frames == NULL || stack == NULL || !commitMemory(frames, committed * sizeof(CallFrame)) ||
+		!commitMemory(stack, committed * STACK_SLOTS_PER_FRAME * sizeof(Value))) {
+		releaseStack(frames, stack, NULL, frameMax);
+		return false;
+	}
+
+	vm->frames = frames;
+	vm->stack = stack;
+	vm->openSlots = NULL;
+	vm->frameMax = frameMax;
+	vm->frameSize = committed;
+	vm->stackSize = committed * STACK_SLOTS_PER_FRAME;
 	resetStack(vm);
-	vm->shouldGC = true;
+	return true;
+}
+
+static void initializeStack(VM* vm) {
+	if (!reserveStack(vm, DEFAULT_FRAME_MAX)) {
+		fprintf(stderr, "Could not reserve the stack.\n");
+		exit(1);
+	}
+}
+
+bool setFrameMax(VM* vm, size_t frameMax) {
+	if (vm->frameCount != 0 || vm->stackTop != vm->stack) return false;
+
+	CallFrame* frames = vm->frames;
+	Value* stack = vm->stack;
+	ObjUpvalue** openSlots = vm->openSlots;
+	size_t oldFrameMax = vm->frameMax;
+	if (!reserveStack(vm, frameMax)) return false;
+	releaseStack(frames, stack, openSlots, oldFrameMax);
+	return true;
 }
 
 static void buildStringConstantTable(VM* vm) {
 	ObjString** table = ALLOCATE(vm, ObjString*, STR_CONSTANT_COUNT);
 	for (size_t i = 0; i < STR_CONSTANT_COUNT; i++) table[i] = NULL; // Avoid GC Problems
+	vm->stringConstants = table;
 
 	table[STR_CONSTRUCTOR] = copyString(vm, "constructor", 11);
 	table[STR_MESSAGE] = copyString(vm, "message", 7);
@@ -49,32 +127,93 @@ static void buildStringConstantTable(VM* vm) {
 	table[STR_INSTANCE] = copyString(vm, "instance", 8);
 	table[STR_STRING] = copyString(vm, "string", 6);
 	table[STR_LIST] = copyString(vm, "list", 4);
+	table[STR_ARRAY] = copyString(vm, "array", 5);
+	table[STR_MAP] = copyString(vm, "map", 3);
+	table[STR_SET] = copyString(vm, "set", 3);
 	table[STR_TRUE] = copyString(vm, "true", 4);
 	table[STR_FALSE] = copyString(vm, "false", 5);
 	table[STR_NAN] = copyString(vm, "NaN", 3);
 	table[STR_NATIVE_FUNCTION] = copyString(vm, "<native function>", 17);
 	table[STR_INDEX] = copyString(vm, "index", 5);
 	table[STR_DATA] = copyString(vm, "data", 4);
+	table[STR_ITERATOR] = copyString(vm, "iterator", 8);
+	table[STR_MORE] = copyString(vm, "more", 4);
+	table[STR_CONTENTS] = copyString(vm, "contents", 8);
 	table[STR_THIS_MODULE] = copyString(vm, "THIS_MODULE", 11);
-
-	vm->stringConstants = table;
+	table[STR_ID] = copyString(vm, "id", 2);
 }
 
 void initVM(VM* vm) {
-	initializeStack(vm);
+	// Everything the collector reads is set up before the first allocation.
+	initAllocator(&vm->allocator);
 	vm->objects = NULL;
+	vm->youngObjects = NULL;
+	vm->nurseryBytes = 0;
+	vm->remembered = NULL;
+	vm->rememberedCount = 0;
+	vm->rememberedCapacity = 0;
+	vm->gcStats = (GCStats){ 0 };
+	vm->gcMinor = false;
+	vm->gcIncremental = false;
+	vm->gcSliceBudget = 4000;
+	vm->gcMaxPause = 0.001;
+	vm->gcGrowthFactor = GC_HEAP_GROW_FACTOR;
+	vm->gcMinHeap = GC_MIN_HEAP;
+	vm->gcSoftLimit = 0;
+	vm->gcHardLimit = 0;
+	vm->outOfMemory = false;
+	vm->gcReserve = malloc(GC_RESERVE_SIZE);
+	vm->gcPhase = GC_PHASE_IDLE;
+	vm->gcDebt = 0;
+	vm->gcStringIndex = 0;
+	vm->gcStringRehashes = 0;
+	vm->sweepObjects = NULL;
+	vm->modules = NULL;
+	vm->intrinsics = NULL;
+	vm->optimizationLevel = 1;
+	vm->bytecodeCache = true;
+	vm->importPrescan = true;
+	vm->prescan = NULL;
+	vm->reportCompileErrors = true;
+	vm->workers = NULL;
+	vm->workerCount = 0;
+	vm->workerCapacity = 0;
+	vm->worker = NULL;
+	vm->files = NULL;
+	vm->fileCount = 0;
+	vm->fileCapacity = 0;
+	vm->profiler = NULL;
+	vm->jit = false;
 	vm->bytesAllocated = 0;
-	vm->nextGC = 1024 * 1024;
+	vm->nextGC = GC_MIN_HEAP;
 	vm->shouldGC = true;
 	vm->grayCount = 0;
 	vm->grayCapacity = 0;
 	vm->grayStack = NULL;
 	vm->compiler = NULL;
+	vm->stringConstants = NULL;
+	for (size_t i = 0; i < UINT8_COUNT; i++) vm->charStrings[i] = NULL;
+	vm->objectClass = NULL;
+	vm->exceptionClass = NULL;
+	vm->iteratorClass = NULL;
+	vm->stringBuilderClass = NULL;
+	vm->importClass = NULL;
+	vm->workerClass = NULL;
+	vm->fileClass = NULL;
 	initTable(&vm->strings);
 	initTable(&vm->importTable);
 	initTable(&vm->listMethods);
 	initTable(&vm->stringMethods);
+	initTable(&vm->rangeMethods);
+	initTable(&vm->typedArrayMethods);
+	initTable(&vm->mapMethods);
+	initTable(&vm->setMethods);
+	initializeStack(vm);
 	buildStringConstantTable(vm);
+	for (size_t i = 0; i < UINT8_COUNT; i++) {
+		char c = (char)i;
+		vm->charStrings[i] = copyString(vm, &c, 1);
+	}
 
 	ObjString* objectClassName = copyString(vm, "Object", 6);
 	push(vm, OBJ_VAL(objectClassName)); // GC
@@ -88,16 +227,33 @@ void initVM(VM* vm) {
 	vm->iteratorClass = newClass(vm, iteratorClassName);
 	pop(vm);
 
+	ObjString* stringBuilderClassName = copyString(vm, "StringBuilder", 13);
+	push(vm, OBJ_VAL(stringBuilderClassName)); // GC
+	vm->stringBuilderClass = newClass(vm, stringBuilderClassName);
+	pop(vm);
+
 	ObjString* importClassName = copyString(vm, "Import", 6);
 	push(vm, OBJ_VAL(importClassName)); // GC
 	vm->importClass = NULL;
 	vm->importClass = newClass(vm, importClassName);
 	pop(vm);
 
+	ObjString* workerClassName = copyString(vm, "Worker", 6);
+	push(vm, OBJ_VAL(workerClassName)); // GC
+	vm->workerClass = newClass(vm, workerClassName);
+	pop(vm);
+
 	defineObjectNatives(vm);
 	defineListMethods(vm);
 	defineStringMethods(vm);
+	defineRangeMethods(vm);
+	defineTypedArrayMethods(vm);
+	defineMapMethods(vm);
 	defineIteratorMethods(vm);
+	defineStringBuilderMethods(vm);
+	defineWorkerMethods(vm);
+	defineGCModule(vm);
+	defineIOModule(vm);
 
 	// Make all classes subclasses of Object
 	tableAddAll(vm, &vm->objectClass->methods, &vm->iteratorClass->methods);
@@ -108,23 +264,36 @@ void initVM(VM* vm) {
 }
 
 void freeVM(VM* vm) {
+	freePrescan(vm);
+	freeFiles(vm);
+	freeWorkers(vm);
+
 	Module* mod = vm->modules;
 
 	while (mod != NULL) {
-		freeTable(vm, &mod->globals);
+		freeModule(vm, mod);
 		Module* next = mod->next;
 		FREE(vm, Module, mod);
 		mod = next;
 	}
 
 	freeTable(vm, &vm->strings);
+	freeTable(vm, &vm->importTable);
 	freeTable(vm, &vm->listMethods);
 	freeTable(vm, &vm->stringMethods);
+	freeTable(vm, &vm->rangeMethods);
+	freeTable(vm, &vm->typedArrayMethods);
+	freeTable(vm, &vm->mapMethods);
+	freeTable(vm, &vm->setMethods);
 	FREE_ARRAY(vm, ObjString*, vm->stringConstants, STR_CONSTANT_COUNT);
 	vm->stringConstants = NULL;
-	FREE_ARRAY(vm, CallFrame, vm->frames, vm->frameSize);
-	FREE_ARRAY(vm, Value, vm->stack, vm->stackSize);
+	releaseStack(vm->frames, vm->stack, vm->openSlots, vm->frameMax);
+	vm->frames = NULL;
+	vm->stack = NULL;
+	vm->openSlots = NULL;
 	freeObjects(vm);
+	free(vm->gcReserve);
+	vm->gcReserve = NULL;
 	vm->shouldGC = true;
 }
 
@@ -151,81 +320,71 @@ Value peek(VM* vm, size_t distance) {
 }
 
 static bool throwGeneral(VM* vm, ObjInstance* throwee) {
-	CallFrame* frame = &vm->frames[vm->frameCount - 1];
-	ValueArray stackTrace;
-	initValueArray(&stackTrace);
-
 	Value message;
-	if (!tableGet(&throwee->fields, vm->stringConstants[STR_MESSAGE], &message)) {
+	if (!instanceGet(throwee, vm->stringConstants[STR_MESSAGE], &message)) {
 		message = NULL_VAL;
 	}
 
 	bool hasError = false;
-	ObjString* fullMessage = makeStringf(vm, "%s: %s", throwee->klass->name->chars, valueToString(vm, message, &hasError, &throwee)->chars);
+	ObjString* messageString = valueToString(vm, message, &hasError, &throwee);
 	if (hasError) return false;
 
-	writeValueArray(vm, &stackTrace, OBJ_VAL(fullMessage));
-
-	size_t prevLine = 0;
-	ObjFunction* prevFunction = NULL;
-	size_t count = 0;
-	bool repeating = false;
-
-	while (!frame->isTry) {
-		Value result = pop(vm);
-
-		closeUpvalues(vm, frame->slots);
-
-		// Add to stack trace
-		ObjFunction* function = frame->closure->function;
-		size_t instruction = frame->ip - function->chunk.code - 1;
-		size_t line = getLine(&function->chunk.lines, instruction);
-		if (line != prevLine || function != prevFunction) {
-			ObjString* traceLine;
-			if (repeating) {
-				traceLine = makeStringf(vm, "[Previous * %zu]", count);
-				repeating = false;
-				count = 0;
-				writeValueArray(vm, &stackTrace, OBJ_VAL(traceLine));
-			}
-			traceLine = makeStringf(vm, "[%d] in %s", line, function->name == NULL ? "<script>" : function->name->chars);
-			writeValueArray(vm, &stackTrace, OBJ_VAL(traceLine));
-			prevFunction = function;
-			prevLine = line;
-		}
-		else {
-			repeating = true;
-			count++;
-		}
+	// The frames are only held by the array until it is given to a trace.
+	vm->shouldGC = false;
 
+	// The frames down to the one whose try block the exception was thrown in, which is frame 0 if it isn't caught.
+	size_t tryIndex = vm->frameCount;
+	ExceptionHandler* handler = NULL;
+	while (tryIndex > 0 && handler == NULL) {
+		CallFrame* frame = &vm->frames[--tryIndex];
+		Chunk* chunk = &frame->closure->function->chunk;
+		handler = findExceptionHandler(chunk, (size_t)(frame->ip - chunk->code - 1));
+	}
+	bool caught = handler != NULL;
 
-		vm->frameCount--;
-		if (vm->frameCount == 0) {
-			pop(vm);
+	// Recursion throws from the same call over and over, so runs of calls from the same place share a frame.
+	size_t frameCount = 0;
+	for (size_t i = vm->frameCount; i-- > tryIndex;) {
+		CallFrame* frame = &vm->frames[i];
+		if (i == vm->frameCount - 1 || i == tryIndex || frame->ip != frame[1].ip) frameCount++;
+	}
 
-			for (size_t i = 0; i < stackTrace.count; i++) {
-				printf("%s\n", AS_CSTRING(stackTrace.values[i]));
-			}
-			return false;
+	TraceFrame* frames = ALLOCATE(vm, TraceFrame, frameCount);
+	size_t traceCount = 0;
+	for (size_t i = vm->frameCount; i-- > tryIndex;) {
+		CallFrame* frame = &vm->frames[i];
+		if (i == vm->frameCount - 1 || i == tryIndex || frame->ip != frame[1].ip) {
+			ObjFunction* function = frame->closure->function;
+			frames[traceCount++] = (TraceFrame){ function, frame->ip - function->chunk.code - 1, 0 };
+		}
+		else {
+			frames[traceCount - 1].repeats++;
 		}
-		vm->stackTop = frame->slots;
-		push(vm, result);
-
-		frame = &vm->frames[vm->frameCount - 1];
 	}
-	// The last call
-	ObjFunction* function = frame->closure->function;
-	size_t instruction = frame->ip - function->chunk.code - 1;
-	size_t line = getLine(&function->chunk.lines, instruction);
 
-	ObjString* traceLine = makeStringf(vm, "[%d] in %s", line, function->name == NULL ? "<script>" : function->name->chars);
-	writeValueArray(vm, &stackTrace, OBJ_VAL(traceLine));
+	if (!caught) {
+		flushStandardOutput(vm);
+		printStackTrace(vm, throwee->klass->name, messageString, frames, traceCount);
+		FREE_ARRAY(vm, TraceFrame, frames, frameCount);
+		vm->shouldGC = true;
+
+		closeUpvalues(vm, vm->stack);
+		resetStack(vm);
+		return false;
+	}
 
-	ObjList* stackTraceList = newList(vm, stackTrace);
-	tableSet(vm, &throwee->fields, vm->stringConstants[STR_STACK_TRACE], OBJ_VAL(stackTraceList));
+	ObjTrace* trace = newTrace(vm, throwee->klass->name, messageString, frames, traceCount);
+	push(vm, OBJ_VAL(trace));
+	instanceSet(vm, throwee, vm->stringConstants[STR_STACK_TRACE], OBJ_VAL(trace));
+	pop(vm);
+	vm->shouldGC = true;
 
-	frame->isTry = false;
-	frame->ip = frame->catchJump;
+	CallFrame* frame = &vm->frames[tryIndex];
+	vm->frameCount = tryIndex + 1;
+	vm->stackTop = frame->slots + handler->depth;
+	closeUpvalues(vm, vm->stackTop);
+	push(vm, OBJ_VAL(throwee));
+	frame->ip = frame->closure->function->chunk.code + handler->handler;
 
 	return true;
 }
@@ -240,7 +399,7 @@ ObjInstance* makeException(VM* vm, const char* name, const char* format, ...) {
 	ObjString* nameStr = copyString(vm, name, strlen(name));
 
 	Value value;
-	if (!tableGet(&vm->frames[vm->frameCount - 1].closure->owner->globals, nameStr, &value)) {
+	if (!getModuleGlobal(vm->frames[vm->frameCount - 1].closure->owner, nameStr, &value)) {
 		fprintf(stderr, "Expected '%s' to be available at global scope.", name);
 		return false;
 	}
@@ -251,7 +410,7 @@ ObjInstance* makeException(VM* vm, const char* name, const char* format, ...) {
 
 	ObjInstance* instance = newInstance(vm, AS_CLASS(value));
 	push(vm, OBJ_VAL(instance));
-	tableSet(vm, &instance->fields, vm->stringConstants[STR_MESSAGE], OBJ_VAL(message));
+	instanceSet(vm, instance, vm->stringConstants[STR_MESSAGE], OBJ_VAL(message));
 
 	popN(vm, 2);
 	push(vm, OBJ_VAL(instance));
@@ -268,7 +427,7 @@ bool throwException(VM* vm, const char* name, const char* format, ...) {
 	ObjString* nameStr = copyString(vm, name, strlen(name));
 
 	Value value;
-	if (!tableGet(&vm->frames[vm->frameCount - 1].closure->owner->globals, nameStr, &value)) {
+	if (!getModuleGlobal(vm->frames[vm->frameCount - 1].closure->owner, nameStr, &value)) {
 		fprintf(stderr, "Expected '%s' to be available at global scope.", name);
 		return false;
 	}
@@ -279,7 +438,7 @@ bool throwException(VM* vm, const char* name, const char* format, ...) {
 
 	ObjInstance* instance = newInstance(vm, AS_CLASS(value));
 	push(vm, OBJ_VAL(instance));
-	tableSet(vm, &instance->fields, vm->stringConstants[STR_MESSAGE], OBJ_VAL(message));
+	instanceSet(vm, instance, vm->stringConstants[STR_MESSAGE], OBJ_VAL(message));
 
 	popN(vm, 2);
 	push(vm, OBJ_VAL(instance));
@@ -287,6 +446,19 @@ bool throwException(VM* vm, const char* name, const char* format, ...) {
 }
 
 static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
+	if (vm->openSlots == NULL) {
+		ObjUpvalue** openSlots = reserveMemory(reservedBytes(vm->frameMax * STACK_SLOTS_PER_FRAME, sizeof(ObjUpvalue*)));
+		if (openSlots == NULL || !commitMemory(openSlots, vm->stackSize * sizeof(ObjUpvalue*))) {
+			fprintf(stderr, "Could not reserve the open upvalues.\n");
+			exit(1);
+		}
+		vm->openSlots = openSlots;
+	}
+
+	size_t slot = (size_t)(local - vm->stack);
+	if (vm->openSlots[slot] != NULL) return vm->openSlots[slot];
+
+	// Locals are mostly captured in the order they were declared, which puts the new upvalue first.
 	ObjUpvalue* prevUpvalue = NULL;
 	ObjUpvalue* upvalue = vm->openUpvalues;
 	while (upvalue != NULL && upvalue->location > local) {
@@ -294,10 +466,6 @@ static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
 		upvalue = upvalue->next;
 	}
 
-	if (upvalue != NULL && upvalue->location == local) {
-		return upvalue;
-	}
-
 	ObjUpvalue* createUpvalue = newUpvalue(vm, local);
 	createUpvalue->next = upvalue;
 
@@ -307,6 +475,7 @@ static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
 	else {
 		prevUpvalue->next = createUpvalue;
 	}
+	vm->openSlots[slot] = createUpvalue;
 
 	return createUpvalue;
 }
@@ -314,13 +483,39 @@ static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
 static void closeUpvalues(VM* vm, Value* last) {
 	while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
 		ObjUpvalue* upvalue = vm->openUpvalues;
+		vm->openSlots[upvalue->location - vm->stack] = NULL;
 		upvalue->closed = *upvalue->location;
+		WRITE_BARRIER(vm, upvalue, upvalue->closed);
 		upvalue->location = &upvalue->closed;
 		vm->openUpvalues = upvalue->next;
 	}
 }
 
+// Whether the heap is still out of memory when the flag is next checked, as a limit exceeded inside a handler may no
+// longer be once it has dropped its references. A failed allocation always is, as the reserve must be given back.
+static bool stillOutOfMemory(VM* vm) {
+	if (vm->gcReserve != NULL) {
+		collectGarbage(vm);
+		if (vm->gcHardLimit == 0 || vm->bytesAllocated <= vm->gcHardLimit) {
+			vm->outOfMemory = false;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Raised at calls and loop iterations once vm->outOfMemory is set (see memory.c).
+static bool throwOutOfMemory(VM* vm) {
+	bool handled = throwException(vm, "OutOfMemoryException", "Out of memory (%zu bytes allocated, the limit is %zu).",
+		vm->bytesAllocated, vm->gcHardLimit);
+	vm->outOfMemory = false;
+	if (vm->gcReserve == NULL) vm->gcReserve = malloc(GC_RESERVE_SIZE);
+	return handled;
+}
+
 static bool call(VM* vm, ObjClosure* closure, uint8_t argCount, uint8_t* argsUsed) {
+	if (vm->outOfMemory && stillOutOfMemory(vm)) return throwOutOfMemory(vm);
+
 	size_t expected = closure->function->arity;
 
 	if (closure->function->varargs) {
@@ -372,28 +567,71 @@ static bool call(VM* vm, ObjClosure* closure, uint8_t argCount, uint8_t* argsUse
 		*argsUsed = expected;
 	}
 
-	if (vm->frameCount == FRAMES_MAX) {
-		return throwException(vm, "StackOverflowException", "Stack overflow (Max frame: %d).", FRAMES_MAX);
+	if (vm->frameCount == vm->frameMax) {
+		return throwException(vm, "StackOverflowException", "Stack overflow (Max frame: %zu).", vm->frameMax);
 	}
 
-	if (vm->frameCount + 1 >= vm->frameSize) {
-		size_t oldCapacity = vm->frameSize;
-		vm->frameSize = GROW_CAPACITY(vm->frameSize);
-		vm->frames = GROW_ARRAY(vm, CallFrame, vm->frames, oldCapacity, vm->frameSize);
-
-		size_t oldStackCapacity = vm->stackSize;
-		size_t stackTopDistance = vm->stackTop - vm->stack;
-
-		vm->stackSize = 256 * vm->frameSize;
-		vm->stack = GROW_ARRAY(vm, Value, vm->stack, oldStackCapacity, vm->stackSize);
-		vm->stackTop = vm->stack + stackTopDistance;
+	if (vm->frameCount == vm->frameSize) {
+		size_t frameCount = vm->frameSize * 2 < vm->frameMax ? vm->frameSize * 2 : vm->frameMax;
+		if (!commitStack(vm, frameCount)) {
+			return throwException(vm, "OutOfMemoryException", "Could not grow the stack to %zu frames.", frameCount);
+		}
 	}
 
+#ifdef JIT_SUPPORTED
+	if (vm->jit) countJit(vm, closure->function);
+#endif
+
 	CallFrame* frame = &vm->frames[vm->frameCount++];
 	frame->closure = closure;
 	frame->ip = closure->function->chunk.code;
 	frame->slots = vm->stackTop - expected - 1;
-	frame->isTry = false;
+	return true;
+}
+
+/*
+  Tail calls, a call whose result the caller returns straight away (OP_TAIL_CALL, OP_TAIL_INVOKE) is made as any other,
+  then when it pushed a frame the callee's slots are moved down over the caller's and its frame takes the caller's
+  place, so recursion through tail calls runs in constant stack space.
+  - The compiler only emits them outside of try blocks, as the caller's handlers must stay on the stack.
+  - The frame execute was entered with is kept, as the native which called it pops the slots it expects.
+  - The caller's frame is gone from stack traces of exceptions thrown by the callee.
+*/
+static void replaceCaller(VM* vm) {
+	CallFrame* callee = &vm->frames[vm->frameCount - 1];
+	CallFrame* caller = callee - 1;
+	closeUpvalues(vm, caller->slots);
+
+	size_t slotCount = (size_t)(vm->stackTop - callee->slots);
+	memmove(caller->slots, callee->slots, sizeof(Value) * slotCount);
+	vm->stackTop = caller->slots + slotCount;
+	caller->closure = callee->closure;
+	caller->ip = callee->ip;
+	vm->frameCount--;
+}
+
+// Calls native with the given receiver (NULL for none), which isn't stored anywhere so the native can be shared.
+static bool callNative(VM* vm, ObjNative* native, Value* bound, uint8_t argCount) {
+	if (argCount != native->arity) {
+		if (!(native->varargs && argCount > native->arity)) {
+			pop(vm);
+			return throwException(vm, "ArityException", "Expected %zu argument(s) but got %u.", native->arity, argCount);
+		}
+	}
+
+	if (!native->keepsRopes) flattenRopes(vm, vm->stackTop - argCount, argCount);
+
+	bool hasError = false;
+	ObjInstance* exception = NULL;
+
+	Value result = native->function(vm, bound, argCount, vm->stackTop - argCount, &hasError, &exception);
+	vm->stackTop -= ((size_t)argCount) + 1;
+	if (hasError) {
+		pop(vm);
+		push(vm, OBJ_VAL(exception));
+		return throwGeneral(vm, exception);
+	}
+	push(vm, result);
 	return true;
 }
 
@@ -412,10 +650,7 @@ bool callValue(VM* vm, Value callee, uint8_t argCount, uint8_t* argsUsed) {
 				Value initializer;
 				if (tableGet(&klass->methods, vm->stringConstants[STR_CONSTRUCTOR], &initializer)) {
 					if (IS_NATIVE(initializer)) {
-						ObjNative* native = AS_NATIVE(initializer);
-						native->isBound = true;
-						native->bound = instance;
-						return callValue(vm, OBJ_VAL(native), argCount, argsUsed);
+						return callNative(vm, AS_NATIVE(initializer), &instance, argCount);
 					}
 					return call(vm, AS_CLOSURE(initializer), argCount, argsUsed);
 				}
@@ -430,27 +665,7 @@ bool callValue(VM* vm, Value callee, uint8_t argCount, uint8_t* argsUsed) {
 				return call(vm, AS_CLOSURE(callee), argCount, argsUsed);
 			case OBJ_NATIVE: {
 				ObjNative* native = AS_NATIVE(callee);
-
-				if (argCount != native->arity) {
-					if (!(native->varargs && argCount > native->arity)) {
-						pop(vm);
-						return throwException(vm, "ArityException", "Expected %zu argument(s) but got %u.", native->arity, argCount);
-					}
-				}
-
-				NativeFn nativeFunction = native->function;
-				bool hasError = false;
-				ObjInstance* exception = NULL;
-
-				Value result = nativeFunction(vm, native->isBound ? &native->bound : NULL, argCount, vm->stackTop - argCount, &hasError, &exception);
-				vm->stackTop -= ((size_t)argCount) + 1;
-				if (hasError) {
-					pop(vm);
-					push(vm, OBJ_VAL(exception));
-					return throwGeneral(vm, exception);
-				}
-				push(vm, result);
-				return !hasError;
+				return callNative(vm, native, native->isBound ? &native->bound : NULL, argCount);
 			}
 			default:
 				break; // Non-callable object.
@@ -475,10 +690,7 @@ static bool bindMethod(VM* vm, ObjInstance* instance, ObjClass* klass, ObjString
 	
 	Obj* bound = NULL;
 	if (IS_NATIVE(method)) {
-		ObjNative* native = AS_NATIVE(method);
-		native->isBound = true;
-		native->bound = OBJ_VAL(instance);
-		bound = (Obj*)native;
+		bound = (Obj*)newBoundNative(vm, AS_NATIVE(method), OBJ_VAL(instance));
 	}
 	else {
 		bound = (Obj*)newBoundMethod(vm, peek(vm, 0), AS_CLOSURE(method));
@@ -497,38 +709,59 @@ static bool invokeFromClass(VM* vm, ObjInstance* instance, ObjClass* klass, ObjS
 		return throwException(vm, "PropertyException", "Undefined property '%s'.", name->chars);
 	}
 
-	uint8_t _;
 	if (IS_NATIVE(method)) {
-		ObjNative* native = AS_NATIVE(method);
-		native->isBound = true;
-		native->bound = OBJ_VAL(instance);
-		return callValue(vm, OBJ_VAL(native), argCount, &_);
+		Value receiver = OBJ_VAL(instance);
+		return callNative(vm, AS_NATIVE(method), &receiver, argCount);
 	}
 
+	uint8_t _;
 	return call(vm, AS_CLOSURE(method), argCount, &_);
 }
 
 static bool invoke(VM* vm, ObjString* name, uint8_t argCount) {
 	Value receiver = peek(vm, argCount);
+	if (IS_ROPE(receiver)) {
+		receiver = OBJ_VAL(flattenRope(vm, AS_ROPE(receiver)));
+		vm->stackTop[-argCount - 1] = receiver;
+	}
+
+	// Built in methods get the receiver passed straight to them, without binding a method object.
+	if (IS_RANGE(receiver)) {
+		Value method;
+		if (tableGet(&vm->rangeMethods, name, &method)) return callNative(vm, AS_NATIVE(method), &receiver, argCount);
+		rangeToList(vm, AS_RANGE(receiver));
+	}
+	if (IS_TYPED_ARRAY(receiver)) {
+		Value method;
+		if (!tableGet(&vm->typedArrayMethods, name, &method)) return throwException(vm, "PropertyException", "Undefined array method '%s'.", name->chars);
+		return callNative(vm, AS_NATIVE(method), &receiver, argCount);
+	}
+	if (IS_MAP(receiver) || IS_SET(receiver)) {
+		Value method;
+		bool isMap = IS_MAP(receiver);
+		if (!tableGet(isMap ? &vm->mapMethods : &vm->setMethods, name, &method)) {
+			return throwException(vm, "PropertyException", "Undefined %s method '%s'.", isMap ? "map" : "set", name->chars);
+		}
+		return callNative(vm, AS_NATIVE(method), &receiver, argCount);
+	}
 
-	uint8_t _;
 	if (IS_LIST(receiver)) {
 		Value method;
 		if (!tableGet(&vm->listMethods, name, &method)) return throwException(vm, "PropertyException", "Undefined list method '%s'.", name->chars);
-		ObjNative* native = AS_NATIVE(method);
-		native->isBound = true;
-		native->bound = receiver;
-		return callValue(vm, method, argCount, &_);
+		if (IS_CLOSURE(method)) {
+			uint8_t _;
+			return call(vm, AS_CLOSURE(method), argCount, &_);
+		}
+		return callNative(vm, AS_NATIVE(method), &receiver, argCount);
 	}
 	else if (IS_STRING(receiver)) {
 		Value method;
 		if (!tableGet(&vm->stringMethods, name, &method)) return throwException(vm, "PropertyException", "Undefined string method '%s'.", name->chars);
-		ObjNative* native = AS_NATIVE(method);
-		native->isBound = true;
-		native->bound = receiver;
-		return callValue(vm, method, argCount, &_);
+		return callNative(vm, AS_NATIVE(method), &receiver, argCount);
 	}
 
+	uint8_t _;
+
 	if (!IS_INSTANCE(receiver)) {
 		return throwException(vm, "TypeException", "Only instances contain methods.");
 	}
@@ -536,7 +769,8 @@ static bool invoke(VM* vm, ObjString* name, uint8_t argCount) {
 	ObjInstance* instance = AS_INSTANCE(receiver);
 
 	Value value;
-	if (tableGet(&instance->fields, name, &value)) {
+	if (instanceGet(instance, name, &value)) {
+		if (IS_TRACE(value)) value = resolveStackTrace(vm, instance);
 		vm->stackTop[-argCount - 1] = value;
 		return callValue(vm, value, argCount, &_);
 	}
@@ -544,9 +778,95 @@ static bool invoke(VM* vm, ObjString* name, uint8_t argCount) {
 	return invokeFromClass(vm, instance, instance->klass, name, argCount);
 }
 
+static inline CacheEntry* findCacheEntry(InlineCache* cache, ObjShape* shape) {
+	for (uint8_t i = 0; i < cache->count; i++) {
+		if (cache->entries[i].shape == shape) return &cache->entries[i];
+	}
+	return NULL;
+}
+
+// The cache belongs to function's chunk, which takes the write barrier for the objects the entry references.
+static void updateCache(VM* vm, ObjFunction* function, InlineCache* cache, ObjShape* shape, ObjShape* next, ObjClosure* method, size_t slot) {
+	if (cache->megamorphic || shape == NULL) return;
+	if (cache->count == INLINE_CACHE_SIZE) {
+		cache->megamorphic = true;
+		return;
+	}
+
+	CacheEntry* entry = &cache->entries[cache->count++];
+	entry->shape = shape;
+	entry->next = next;
+	entry->method = method;
+	entry->slot = slot;
+	WRITE_BARRIER_OBJ(vm, function, shape);
+	WRITE_BARRIER_OBJ(vm, function, next);
+	WRITE_BARRIER_OBJ(vm, function, method);
+}
+
+// Caches how name resolves on instances of the given shape, for property reads and invokes.
+static void cacheLookup(VM* vm, ObjFunction* function, InlineCache* cache, ObjInstance* instance, ObjString* name) {
+	// The field may hold an unformatted trace, which reads must see (see resolveStackTrace).
+	if (instance->shape == NULL || name == vm->stringConstants[STR_STACK_TRACE]) return;
+
+	size_t slot;
+	if (shapeGetSlot(instance->shape, name, &slot)) {
+		updateCache(vm, function, cache, instance->shape, NULL, NULL, slot);
+		return;
+	}
+
+	Value method;
+	if (tableGet(&instance->klass->methods, name, &method) && IS_CLOSURE(method)) {
+		updateCache(vm, function, cache, instance->shape, NULL, AS_CLOSURE(method), 0);
+	}
+}
+
+static void setProperty(VM* vm, ObjFunction* function, InlineCache* cache, ObjInstance* instance, ObjString* name, Value value) {
+	CacheEntry* entry = findCacheEntry(cache, instance->shape);
+	if (entry != NULL) {
+		if (entry->next == NULL) {
+			cache->hits++;
+			instance->slots[entry->slot] = value;
+			WRITE_BARRIER(vm, instance, value);
+			return;
+		}
+		if (entry->slot < instance->slotCapacity) {
+			cache->hits++;
+			instance->slots[entry->slot] = value;
+			instance->shape = entry->next;
+			WRITE_BARRIER(vm, instance, value);
+			WRITE_BARRIER_OBJ(vm, instance, entry->next);
+			if (entry->next->count > instance->klass->fieldCountHint) {
+				instance->klass->fieldCountHint = entry->next->count;
+			}
+			return;
+		}
+	}
+
+	cache->misses++;
+	ObjShape* shape = instance->shape;
+	if (instanceSet(vm, instance, name, value)) {
+		if (instance->shape != NULL && instance->shape->parent == shape) {
+			updateCache(vm, function, cache, shape, instance->shape, NULL, shape->count);
+		}
+	}
+	else if (shape != NULL) {
+		size_t slot;
+		shapeGetSlot(shape, name, &slot);
+		updateCache(vm, function, cache, shape, NULL, NULL, slot);
+	}
+}
+
+// Converts the operand distance from the top of the stack to a string in place, so it stays reachable. Ropes are left as they are.
+static void stringOperand(VM* vm, size_t distance, bool* hasError, ObjInstance** exception) {
+	if (*hasError || isStringOrRope(peek(vm, distance))) return;
+	ObjString* string = valueToString(vm, peek(vm, distance), hasError, exception);
+	if (!*hasError) vm->stackTop[-1 - (ptrdiff_t)distance] = OBJ_VAL(string);
+}
+
 static bool concatenate(VM* vm, ObjInstance** exception) {
-	ObjString* b;
-	ObjString* a;
+	// Where the operands are on the stack.
+	size_t a = 1;
+	size_t b = 0;
 	bool hasError = false;
 	// Swaps stack so that .toString() implicit call functions (calling convention)
 	if (IS_INSTANCE(peek(vm, 1))) {
@@ -554,14 +874,11 @@ static bool concatenate(VM* vm, ObjInstance** exception) {
 		Value valA = pop(vm);
 		push(vm, valB);
 		push(vm, valA);
-
-		b = valueToString(vm, peek(vm, 1), &hasError, exception);
-		a = valueToString(vm, peek(vm, 0), &hasError, exception);
-	}
-	else {
-		b = valueToString(vm, peek(vm, 0), &hasError, exception);
-		a = valueToString(vm, peek(vm, 1), &hasError, exception);
+		a = 0;
+		b = 1;
 	}
+	stringOperand(vm, b, &hasError, exception);
+	stringOperand(vm, a, &hasError, exception);
 	
 	if (hasError) { 
 		pop(vm);
@@ -569,36 +886,34 @@ static bool concatenate(VM* vm, ObjInstance** exception) {
 		return false; 
 	}
 
-	size_t length = a->length + b->length;
-	char* chars = ALLOCATE(vm, char, length + 1);
-	memcpy(chars, a->chars, a->length);
-	memcpy(chars + a->length, b->chars, b->length);
-	chars[length] = '\0';
-
-	ObjString* result = takeString(vm, chars, length);
+	Value result = concatenateStrings(vm, peek(vm, a), peek(vm, b));
 	pop(vm);
 	pop(vm);
-	push(vm, OBJ_VAL(result));
+	push(vm, result);
 	return true;
 }
 
-static inline Value getConstant(CallFrame* frame) {
+static inline size_t readIndex(uint8_t** ip) {
+	// Almost all indices fit in a single byte, so avoid the call for those.
+	if (**ip < 0x80) return *(*ip)++;
 	size_t index;
-	frame->ip += readUleb128(frame->ip, &index);
-	return frame->closure->function->chunk.constants.values[index];
+	*ip += readUleb128(*ip, &index);
+	return index;
 }
 
 static inline bool isInteger(double value) {
 	return floor(value) == value;
 }
 
-bool validateListIndex(VM* vm, size_t listLength, Value indexVal, uintmax_t* dest) {
+bool validateListIndex(VM* vm, size_t listLength, Value indexVal, uintmax_t* dest, ObjInstance** exception) {
 	if (!IS_NUMBER(indexVal)) {
-		return throwException(vm, "TypeException", "Index must be a number.");
+		*exception = makeException(vm, "TypeException", "Index must be a number.");
+		return false;
 	}
 	double indexNum = AS_NUMBER(indexVal);
 	if (!isInteger(indexNum)) {
-		return throwException(vm, "TypeException", "Index must be an integer.");
+		*exception = makeException(vm, "TypeException", "Index must be an integer.");
+		return false;
 	}
 	intmax_t indexSigned = (intmax_t)indexNum;
 	uintmax_t index = indexSigned;
@@ -608,7 +923,8 @@ bool validateListIndex(VM* vm, size_t listLength, Value indexVal, uintmax_t* des
 	}
 
 	if (index >= listLength) {
-		return throwException(vm, "IndexException", "Index %d is out of bounds for length %d.", indexSigned, listLength);
+		*exception = makeException(vm, "IndexException", "Index %d is out of bounds for length %d.", indexSigned, listLength);
+		return false;
 	}
 	*dest = index;
 	return true;
@@ -626,562 +942,1103 @@ static bool instanceof(ObjInstance* instance, ObjClass* klass) {
 	return false;
 }
 
-static InterpreterResult fetchExecute(VM* vm, bool isFunctionCall) {
-	CallFrame* frame = &vm->frames[vm->frameCount - 1];
-	size_t baseFrameCount = vm->frameCount - 1;
-#define CURRENT_MODULE() (frame->closure->owner)
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() (getConstant(frame))
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op) \
+/*
+  Creates a module, linked into the VM's list of modules so that it is reachable, and defines its builtins and name.
+*/
+static Module* newModule(VM* vm, Value name) {
+	push(vm, name); // GC
+	Module* module = reallocate(vm, NULL, 0, sizeof(Module));
+	module->next = vm->modules;
+	vm->modules = module;
+
+	// Initialised once reachable, as defining the builtins can trigger a collection.
+	initModule(vm, module);
+	defineModuleGlobal(vm, module, vm->stringConstants[STR_THIS_MODULE], name);
+	pop(vm);
+	return module;
+}
+
+/*
+  The interpreter loop.
+  - ip and frame are kept in locals for the duration of the loop, they must be written back (STORE_FRAME) before
+    anything that may inspect the frame stack (exceptions, natives, nested calls) and reloaded (LOAD_FRAME) after
+    anything that may push, pop or reallocate frames.
+  - On GCC and Clang each handler jumps directly to the next one through a table of label addresses (threaded dispatch),
+    elsewhere (or when tracing execution) the switch is used.
+  - baseFrameCount is the number of frames below the one the loop was entered on; returning to it ends the loop.
+*/
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(DEBUG_TRACE_EXECUTION)
+#define COMPUTED_GOTO
+#endif
+
+// The JIT is entered from the interpreter loop through a dispatch table (see op_jit), so it needs threaded dispatch.
+#if defined(JIT_SUPPORTED) && defined(COMPUTED_GOTO)
+#define JIT_DISPATCH
+#endif
+
+static InterpreterResult execute(VM* vm, size_t baseFrameCount) {
+	CallFrame* frame;
+	uint8_t* ip;
+	Value* constants;
+	InlineCache* caches;
+
+#define STORE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME() \
 	do { \
-		if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
-			pop(vm); \
-			pop(vm); \
-			if(!throwException(vm, "TypeException", "Operands must be numbers.")) return INTERPRETER_RUNTIME_ERR; \
-			break; \
-		} \
-		double b = AS_NUMBER(pop(vm)); \
-		double a = AS_NUMBER(pop(vm)); \
-		push(vm, valueType(a op b)); \
+		frame = &vm->frames[vm->frameCount - 1]; \
+		ip = frame->ip; \
+		constants = frame->closure->function->chunk.constants.values; \
+		caches = frame->closure->function->chunk.caches; \
+		LOAD_JIT(); \
 	} while (false)
 
-#define BITWISE_BINARY_OP(op) \
+#ifdef JIT_DISPATCH
+// A frame whose function has JIT code continues in it.
+#define LOAD_JIT() \
 	do { \
-		if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
-			pop(vm); \
-			pop(vm); \
-			if(!throwException(vm, "TypeException", "Operands must be numbers.")) return INTERPRETER_RUNTIME_ERR; \
-			break; \
-		} \
-		double b = AS_NUMBER(pop(vm)); \
-		double a = AS_NUMBER(pop(vm)); \
-		if (!isInteger(a) || !isInteger(b)) { \
-			if(!throwException(vm, "TypeException", "Operands must be integers.")) return INTERPRETER_RUNTIME_ERR; \
-			break; \
-		} \
-		intmax_t aInt = (intmax_t)a; \
-		intmax_t bInt = (intmax_t)b; \
-		push(vm, NUMBER_VAL((double)(aInt op bInt))); \
+		if (frame->closure->function->jit != NULL) dispatch = jitTable; \
 	} while (false)
+// Counts a loop iteration towards compiling the function, continuing in its code once it has some.
+#define COUNT_BACKEDGE() \
+	do { \
+		if (vm->jit && countJit(vm, frame->closure->function)) dispatch = jitTable; \
+	} while (false)
+#else
+#define LOAD_JIT() ((void)0)
+#define COUNT_BACKEDGE() ((void)0)
+#endif
 
-	uint8_t instruction;
-	switch (instruction = READ_BYTE()) {
+#define CURRENT_MODULE() (frame->closure->owner)
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[readIndex(&ip)])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&caches[readIndex(&ip)])
 
-		case OP_CONSTANT: {
-			Value constant = READ_CONSTANT();
-			push(vm, constant);
-			break;
-		}
+#define PUSH(value) (*vm->stackTop++ = (value))
+#define POP() (*--vm->stackTop)
+#define PEEK(distance) (vm->stackTop[-1 - (distance)])
 
-		case OP_NULL: push(vm, NULL_VAL); break;
-		case OP_TRUE: push(vm, BOOL_VAL(true)); break;
-		case OP_FALSE: push(vm, BOOL_VAL(false)); break;
-		case OP_OBJECT: push(vm, OBJ_VAL(vm->objectClass)); break;
+#ifdef DRAGON_OPCODE_STATS
+#define RECORD_OPCODE() recordOpcode(*ip)
+#else
+#define RECORD_OPCODE() ((void)0)
+#endif
 
-		case OP_LIST: {
-			uint8_t itemCount = READ_BYTE();
+#ifdef COMPUTED_GOTO
+#define DISPATCH() do { RECORD_OPCODE(); goto *dispatch[READ_BYTE()]; } while (false)
+#define CASE(opcode) case opcode: op_##opcode
+#else
+#define DISPATCH() goto dispatch
+#define CASE(opcode) case opcode: op_##opcode
+#endif
 
-			ValueArray items;
-			initValueArray(&items);
+// Replaces a rope on the stack with its flattened string, for instructions which need an ObjString.
+#define FLATTEN(distance) \
+	do { \
+		if (IS_ROPE(PEEK(distance))) PEEK(distance) = OBJ_VAL(flattenRope(vm, AS_ROPE(PEEK(distance)))); \
+	} while (false)
 
-			for (size_t i = 0; i < itemCount; i++) {
-				writeValueArray(vm, &items, peek(vm, itemCount - i - 1));
-			}
-			ObjList* list = newList(vm, items);
-			popN(vm, itemCount);
-			push(vm, OBJ_VAL(list));
-			break;
-		}
+// Continues with the handler of the given opcode, with ip at that instruction's operands.
+#define CONTINUE_AS(opcode) goto op_##opcode
 
-		case OP_RANGE: {
-			Value endV = pop(vm);
-			Value startV = pop(vm);
+/*
+  Quickening, operand-less instructions rewrite themselves in place to a variant specialized for the operand types they
+  see (e.g. OP_ADD to OP_ADD_NUM). The variant rewrites itself back to the generic instruction when its guard fails, it
+  must still be right after the opcode, so this can't be used by handlers entered with CONTINUE_AS or goto.
+*/
+#define QUICKEN(opcode) (ip[-1] = (opcode))
 
-			if (!IS_NUMBER(startV) || !IS_NUMBER(endV)) {
-				pop(vm);
-				pop(vm);
-				if (!throwException(vm, "TypeException", "Operands must be numbers.")) return INTERPRETER_RUNTIME_ERR;
-				break;
-			}
-			double b = AS_NUMBER(endV);
-			double a = AS_NUMBER(startV);
-			if (!isInteger(a) || !isInteger(b)) {
-				if (!throwException(vm, "TypeException", "Operands must be integers.")) return INTERPRETER_RUNTIME_ERR;
-				break;
-			}
-			intmax_t aInt = (intmax_t)a;
-			intmax_t bInt = (intmax_t)b;
+// Raises an exception of the given class, resuming at the handler if it is caught.
+#define THROW(name, ...) \
+	do { \
+		STORE_FRAME(); \
+		if (!throwException(vm, name, __VA_ARGS__)) return INTERPRETER_RUNTIME_ERR; \
+		LOAD_FRAME(); \
+		DISPATCH(); \
+	} while (false)
 
-			ValueArray array;
-			initValueArray(&array);
+// Where OutOfMemoryException is raised, at backward jumps (calls check in call). Jumps check before jumping, as the ip
+// then still is inside any try block the loop is in.
+#define SAFEPOINT() \
+	do { \
+		if (vm->outOfMemory && stillOutOfMemory(vm)) { \
+			STORE_FRAME(); \
+			if (!throwOutOfMemory(vm)) return INTERPRETER_RUNTIME_ERR; \
+			LOAD_FRAME(); \
+			DISPATCH(); \
+		} \
+	} while (false)
 
-			if (bInt > aInt) {
-				for (intmax_t i = aInt; i <= bInt; i++) {
-					writeValueArray(vm, &array, NUMBER_VAL((double)i));
-				}
-			}
-			else {
-				for (intmax_t i = aInt; i >= bInt; i--) {
-					writeValueArray(vm, &array, NUMBER_VAL((double)i));
-				}
-			}
+// Runs an expression which may call into Dragon code or throw, the expression evaluating to false is an uncaught exception.
+#define PROTECT(expression) \
+	do { \
+		STORE_FRAME(); \
+		if (!(expression)) return INTERPRETER_RUNTIME_ERR; \
+		LOAD_FRAME(); \
+	} while (false)
 
-			push(vm, OBJ_VAL(newList(vm, array)));
-			break;
-		}
+// PROTECT for the call of a tail call, whose frame (if it pushed one) then replaces the caller's (see replaceCaller).
+#define TAIL_CALL(expression) \
+	do { \
+		size_t callerCount = vm->frameCount; \
+		PROTECT(expression); \
+		if (vm->frameCount == callerCount + 1 && callerCount - 1 > baseFrameCount) { \
+			replaceCaller(vm); \
+			LOAD_FRAME(); \
+		} \
+	} while (false)
 
-		case OP_GET_GLOBAL: {
-			ObjString* name = READ_STRING();
-			Value value;
-			if (!tableGet(&CURRENT_MODULE()->globals, name, &value)) {
-				if (!throwException(vm, "UndefinedVariableException", "Undefined variable '%s'.", name->chars)) return INTERPRETER_RUNTIME_ERR;
-				break;
-			}
-			push(vm, value);
-			break;
-		}
+// The body of OP_INVOKE and OP_TAIL_INVOKE, making the call with CALL (PROTECT or TAIL_CALL).
+#define INVOKE(CALL) \
+	do { \
+		ObjString* method = READ_STRING(); \
+		uint8_t argCount = READ_BYTE(); \
+		InlineCache* cache = READ_CACHE(); \
+		\
+		Value receiver = PEEK(argCount); \
+		if (IS_INSTANCE(receiver)) { \
+			ObjInstance* instance = AS_INSTANCE(receiver); \
+			CacheEntry* entry = findCacheEntry(cache, instance->shape); \
+			if (entry != NULL) { \
+				cache->hits++; \
+				uint8_t _; \
+				if (entry->method != NULL) { \
+					CALL(call(vm, entry->method, argCount, &_)); \
+				} \
+				else { \
+					Value value = instance->slots[entry->slot]; \
+					vm->stackTop[-argCount - 1] = value; \
+					CALL(callValue(vm, value, argCount, &_)); \
+				} \
+				DISPATCH(); \
+			} \
+			cache->misses++; \
+			cacheLookup(vm, frame->closure->function, cache, instance, method); \
+		} \
+		\
+		CALL(invoke(vm, method, argCount)); \
+		DISPATCH(); \
+	} while (false)
 
-		case OP_DEFINE_GLOBAL: {
-			ObjString* name = READ_STRING();
-			tableSet(vm, &CURRENT_MODULE()->globals, name, peek(vm, 0));
-			pop(vm);
-			break;
-		}
+// Throws the exception validateListIndex gives for an invalid index, and carries on in the catch block if it is caught.
+#define VALIDATE_INDEX(length, indexValue, index) \
+	do { \
+		ObjInstance* exception; \
+		if (!validateListIndex(vm, length, indexValue, &index, &exception)) { \
+			PROTECT(throwGeneral(vm, exception)); \
+			DISPATCH(); \
+		} \
+	} while (false)
 
-		case OP_SET_GLOBAL: {
-			ObjString* name = READ_STRING();
-			if (tableSet(vm, &CURRENT_MODULE()->globals, name, peek(vm, 0))) {
-				tableDelete(&CURRENT_MODULE()->globals, name);
-				if (!throwException(vm, "UndefinedVariableException", "Undefined variable '%s'.", name->chars)) return INTERPRETER_RUNTIME_ERR;
-				break;
-			}
-			break;
-		}
+#define BINARY_OP(valueType, op) \
+	do { \
+		if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+			POP(); \
+			POP(); \
+			THROW("TypeException", "Operands must be numbers."); \
+		} \
+		double b = AS_NUMBER(POP()); \
+		double a = AS_NUMBER(PEEK(0)); \
+		PEEK(0) = valueType(a op b); \
+	} while (false)
 
-		case OP_GET_LOCAL: {
-			uint8_t slot = READ_BYTE();
-			push(vm, frame->slots[slot]);
-			break;
-		}
+#define BITWISE_BINARY_OP(op) \
+	do { \
+		if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+			POP(); \
+			POP(); \
+			THROW("TypeException", "Operands must be numbers."); \
+		} \
+		double b = AS_NUMBER(POP()); \
+		double a = AS_NUMBER(POP()); \
+		if (!isInteger(a) || !isInteger(b)) { \
+			THROW("TypeException", "Operands must be integers."); \
+		} \
+		intmax_t aInt = (intmax_t)a; \
+		intmax_t bInt = (intmax_t)b; \
+		PUSH(NUMBER_VAL((double)(aInt op bInt))); \
+	} while (false)
 
-		case OP_SET_LOCAL: {
-			uint8_t slot = READ_BYTE();
-			frame->slots[slot] = peek(vm, 0);
-			break;
-		}
+#ifdef COMPUTED_GOTO
+	static void* dispatchTable[UINT8_COUNT] = {
+		[0 ... UINT8_MAX] = &&op_unknown,
+		[OP_CONSTANT] = &&op_OP_CONSTANT,
+		[OP_NULL] = &&op_OP_NULL,
+		[OP_TRUE] = &&op_OP_TRUE,
+		[OP_FALSE] = &&op_OP_FALSE,
+		[OP_OBJECT] = &&op_OP_OBJECT,
+		[OP_LIST] = &&op_OP_LIST,
+		[OP_RANGE] = &&op_OP_RANGE,
+		[OP_FOR_RANGE_INIT] = &&op_OP_FOR_RANGE_INIT,
+		[OP_FOR_RANGE] = &&op_OP_FOR_RANGE,
+		[OP_ITER_INIT] = &&op_OP_ITER_INIT,
+		[OP_ITER_NEXT] = &&op_OP_ITER_NEXT,
+		[OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+		[OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+		[OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+		[OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+		[OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+		[OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+		[OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+		[OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+		[OP_GET_PROPERTY] = &&op_OP_GET_PROPERTY,
+		[OP_SET_PROPERTY] = &&op_OP_SET_PROPERTY,
+		[OP_SET_PROPERTY_KV] = &&op_OP_SET_PROPERTY_KV,
+		[OP_GET_INDEX] = &&op_OP_GET_INDEX,
+		[OP_SET_INDEX] = &&op_OP_SET_INDEX,
+		[OP_GET_SUPER] = &&op_OP_GET_SUPER,
+		[OP_DUP] = &&op_OP_DUP,
+		[OP_DUP_X2] = &&op_OP_DUP_X2,
+		[OP_SWAP] = &&op_OP_SWAP,
+		[OP_POP] = &&op_OP_POP,
+		[OP_NOT] = &&op_OP_NOT,
+		[OP_NEGATE] = &&op_OP_NEGATE,
+		[OP_ADD] = &&op_OP_ADD,
+		[OP_SUB] = &&op_OP_SUB,
+		[OP_MUL] = &&op_OP_MUL,
+		[OP_DIV] = &&op_OP_DIV,
+		[OP_MOD] = &&op_OP_MOD,
+		[OP_BIT_NOT] = &&op_OP_BIT_NOT,
+		[OP_AND] = &&op_OP_AND,
+		[OP_OR] = &&op_OP_OR,
+		[OP_XOR] = &&op_OP_XOR,
+		[OP_LSH] = &&op_OP_LSH,
+		[OP_ASH] = &&op_OP_ASH,
+		[OP_RSH] = &&op_OP_RSH,
+		[OP_EQUAL] = &&op_OP_EQUAL,
+		[OP_NOT_EQUAL] = &&op_OP_NOT_EQUAL,
+		[OP_IS] = &&op_OP_IS,
+		[OP_GREATER] = &&op_OP_GREATER,
+		[OP_GREATER_EQ] = &&op_OP_GREATER_EQ,
+		[OP_LESS] = &&op_OP_LESS,
+		[OP_LESS_EQ] = &&op_OP_LESS_EQ,
+		[OP_IN] = &&op_OP_IN,
+		[OP_INSTANCEOF] = &&op_OP_INSTANCEOF,
+		[OP_TYPEOF] = &&op_OP_TYPEOF,
+		[OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+		[OP_JUMP_IF_FALSE_SC] = &&op_OP_JUMP_IF_FALSE_SC,
+		[OP_JUMP] = &&op_OP_JUMP,
+		[OP_LOOP] = &&op_OP_LOOP,
+		[OP_SWITCH] = &&op_OP_SWITCH,
+		[OP_CALL] = &&op_OP_CALL,
+		[OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+		[OP_CLOSURE] = &&op_OP_CLOSURE,
+		[OP_CLASS] = &&op_OP_CLASS,
+		[OP_INHERIT] = &&op_OP_INHERIT,
+		[OP_METHOD] = &&op_OP_METHOD,
+		[OP_INVOKE] = &&op_OP_INVOKE,
+		[OP_TAIL_INVOKE] = &&op_OP_TAIL_INVOKE,
+		[OP_SUPER_INVOKE] = &&op_OP_SUPER_INVOKE,
+		[OP_THROW] = &&op_OP_THROW,
+		[OP_IMPORT] = &&op_OP_IMPORT,
+		[OP_EXPORT] = &&op_OP_EXPORT,
+		[OP_RETURN] = &&op_OP_RETURN,
+		[OP_LIST_STEP] = &&op_OP_LIST_STEP,
+		[OP_GET_LOCAL_GET_LOCAL] = &&op_OP_GET_LOCAL_GET_LOCAL,
+		[OP_GET_LOCAL_GET_PROPERTY] = &&op_OP_GET_LOCAL_GET_PROPERTY,
+		[OP_ADD_CONSTANT] = &&op_OP_ADD_CONSTANT,
+		[OP_SET_LOCAL_POP] = &&op_OP_SET_LOCAL_POP,
+		[OP_SET_GLOBAL_POP] = &&op_OP_SET_GLOBAL_POP,
+		[OP_LESS_JUMP_IF_FALSE] = &&op_OP_LESS_JUMP_IF_FALSE,
+		[OP_POP_LOOP] = &&op_OP_POP_LOOP,
+		[OP_ADD_NUM] = &&op_OP_ADD_NUM,
+		[OP_ADD_STR] = &&op_OP_ADD_STR,
+		[OP_GET_INDEX_LIST] = &&op_OP_GET_INDEX_LIST,
+		[OP_SET_INDEX_LIST] = &&op_OP_SET_INDEX_LIST
+	};
+	// Used instead while a profiler is attached, which then continues with dispatchTable.
+	static void* profileTable[UINT8_COUNT] = {
+		[0 ... UINT8_MAX] = &&op_profile
+	};
+	void** dispatch = vm->profiler == NULL ? dispatchTable : profileTable;
+#endif
+#ifdef JIT_DISPATCH
+	// Used instead while the frame's function has JIT code, which is entered before each instruction where it can be.
+	static void* jitTable[UINT8_COUNT] = {
+		[0 ... UINT8_MAX] = &&op_jit
+	};
+#endif
 
-		case OP_GET_UPVALUE: {
-			uint8_t slot = READ_BYTE();
-			push(vm, *frame->closure->upvalues[slot]->location);
-			break;
-		}
+	LOAD_FRAME();
 
-		case OP_SET_UPVALUE: {
-			uint8_t slot = READ_BYTE();
-			*frame->closure->upvalues[slot]->location = peek(vm, 0);
-			break;
+	for (;;) {
+#ifndef COMPUTED_GOTO
+	dispatch:
+#endif
+#ifdef DEBUG_TRACE_EXECUTION
+		printf("     ");
+		for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+			printf("[ ");
+			printf("%s", valueToRepr(vm, *slot)->chars);
+			printf(" ]");
 		}
+		printf("\n");
 
-		case OP_CLOSE_UPVALUE: {
-			closeUpvalues(vm, vm->stackTop - 1);
-			pop(vm);
-			break;
-		}
+		disassembleInstruction(vm, &frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));
+#endif
 
-		case OP_GET_PROPERTY: {
-			ObjString* name = READ_STRING();
-
-			if (IS_LIST(peek(vm, 0))) {
-				Value method;
-				if (!tableGet(&vm->listMethods, name, &method)) return throwException(vm, "PropertyException", "Undefined list method '%s'.", name->chars);
-				ObjNative* native = AS_NATIVE(method);
-				native->isBound = true;
-				native->bound = pop(vm);
-				push(vm, method);
-				break;
-			}
-			else if (IS_STRING(peek(vm, 0))) {
-				Value method;
-				if (!tableGet(&vm->stringMethods, name, &method)) return throwException(vm, "PropertyException", "Undefined string method '%s'.", name->chars);
-				ObjNative* native = AS_NATIVE(method);
-				native->isBound = true;
-				native->bound = pop(vm);
-				push(vm, method);
-				break;
-			}
-
-			if (!IS_INSTANCE(peek(vm, 0))) {
-				if (!throwException(vm, "TypeException", "Only instances contain properties.")) return INTERPRETER_RUNTIME_ERR;
-				break;
-			}
-			ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
-			Value value;
-			if (tableGet(&instance->fields, name, &value)) {
-				pop(vm);
-				push(vm, value);
-				break;
-			}
-			if (!bindMethod(vm, instance, instance->klass, name)) {
-				return INTERPRETER_RUNTIME_ERR;
-			}
-			break;
-		}
+		if (vm->profiler != NULL) profileInstruction(vm, *ip);
+		RECORD_OPCODE();
+		switch (READ_BYTE()) {
 
-		case OP_SET_PROPERTY: {
-			if (!IS_INSTANCE(peek(vm, 1))) {
-				if (!throwException(vm, "TypeException", "Only instances contain fields.")) return INTERPRETER_RUNTIME_ERR;
-				break;
+			CASE(OP_CONSTANT): {
+				PUSH(READ_CONSTANT());
+				DISPATCH();
 			}
-			ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
-			tableSet(vm, &instance->fields, READ_STRING(), peek(vm, 0));
-			Value value = pop(vm);
-			pop(vm);
-			push(vm, value);
-			break;
-		}
 
-		case OP_SET_PROPERTY_KV: {
-			if (!IS_INSTANCE(peek(vm, 1))) {
-				if (!throwException(vm, "TypeException", "Only instances contain fields.")) return INTERPRETER_RUNTIME_ERR;
-				break;
+			CASE(OP_NULL): PUSH(NULL_VAL); DISPATCH();
+			CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+			CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+			CASE(OP_OBJECT): PUSH(OBJ_VAL(vm->objectClass)); DISPATCH();
+
+			CASE(OP_LIST): {
+				uint8_t itemCount = READ_BYTE();
+
+				ValueArray items;
+				initValueArray(&items);
+
+				for (size_t i = 0; i < itemCount; i++) {
+					writeValueArray(vm, &items, PEEK(itemCount - i - 1));
+				}
+				ObjList* list = newList(vm, items);
+				vm->stackTop -= itemCount;
+				PUSH(OBJ_VAL(list));
+				DISPATCH();
 			}
-			ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
-			tableSet(vm, &instance->fields, READ_STRING(), peek(vm, 0));
-			pop(vm);
-			break;
-		}
 
-		case OP_GET_INDEX: {
-			if (IS_LIST(peek(vm, 1))) {
-				Value indexVal = pop(vm);
-				ObjList* list = AS_LIST(pop(vm));
+			CASE(OP_RANGE): {
+				Value endV = POP();
+				Value startV = POP();
 
-				uintmax_t index;
-				if (!validateListIndex(vm, list->items.count, indexVal, &index)) {
-					return INTERPRETER_RUNTIME_ERR;
+				if (!IS_NUMBER(startV) || !IS_NUMBER(endV)) {
+					THROW("TypeException", "Operands must be numbers.");
+				}
+				double b = AS_NUMBER(endV);
+				double a = AS_NUMBER(startV);
+				if (!isInteger(a) || !isInteger(b)) {
+					THROW("TypeException", "Operands must be integers.");
 				}
 
-				push(vm, list->items.values[index]);
-				break;
+				PUSH(OBJ_VAL(newRange(vm, (intmax_t)a, (intmax_t)b)));
+				DISPATCH();
 			}
-			else if (IS_STRING(peek(vm, 1))) {
-				Value indexVal = pop(vm);
-				ObjString* string = AS_STRING(pop(vm));
 
-				uintmax_t index;
-				if (!validateListIndex(vm, string->length, indexVal, &index)) {
-					return INTERPRETER_RUNTIME_ERR;
+			// The start and end of a range looped over by foreach, which are followed by the step (see countedForeach).
+			CASE(OP_FOR_RANGE_INIT): {
+				if (!IS_NUMBER(PEEK(1)) || !IS_NUMBER(PEEK(0))) {
+					THROW("TypeException", "Operands must be numbers.");
+				}
+				double start = AS_NUMBER(PEEK(1));
+				double end = AS_NUMBER(PEEK(0));
+				if (!isInteger(start) || !isInteger(end)) {
+					THROW("TypeException", "Operands must be integers.");
 				}
+				PUSH(NUMBER_VAL(end >= start ? 1 : -1));
+				DISPATCH();
+			}
 
-				push(vm, OBJ_VAL(copyString(vm, &string->chars[index], 1)));
-				break;
+			CASE(OP_FOR_RANGE): {
+				uint16_t offset = READ_SHORT();
+				double counter = AS_NUMBER(PEEK(2));
+				double end = AS_NUMBER(PEEK(1));
+				double step = AS_NUMBER(PEEK(0));
+				if (step > 0 ? counter > end : counter < end) {
+					ip += offset;
+					DISPATCH();
+				}
+				PEEK(2) = NUMBER_VAL(counter + step);
+				PUSH(NUMBER_VAL(counter));
+				DISPATCH();
 			}
-			else if (IS_INSTANCE(peek(vm, 1))) {
-				Value indexVal = pop(vm);
-				ObjInstance* instance = AS_INSTANCE(pop(vm));
 
-				if (!IS_STRING(indexVal)) {
-					if (!throwException(vm, "TypeException", "Field name must be a string.")) return INTERPRETER_RUNTIME_ERR;
-					break;
+			/*
+			  The value looped over by foreach becomes a cursor of two hidden locals (see iteratorForeach), the position
+			  for lists, strings and ranges, which are walked natively, followed by the value itself. Anything else gets a
+			  null position followed by what its 'iterator' method returns.
+			*/
+			CASE(OP_ITER_INIT): {
+				FLATTEN(0);
+				Value value = PEEK(0);
+				if (IS_LIST(value) || IS_STRING(value) || IS_RANGE(value) || IS_TYPED_ARRAY(value) || IS_MAP(value) || IS_SET(value)) {
+					PEEK(0) = NUMBER_VAL(0);
+					PUSH(value);
+					DISPATCH();
 				}
+				PEEK(0) = NULL_VAL;
+				PUSH(value);
+				PROTECT(invoke(vm, vm->stringConstants[STR_ITERATOR], 0));
+				DISPATCH();
+			}
 
-				ObjString* key = AS_STRING(indexVal);
+			/*
+			  Pushes the next item of a native cursor and jumps to the loop body, or pushes false when there are none left
+			  and continues to the loop's exit jump. Iterator objects instead have their 'more' method called, the exit jump
+			  is followed by the call to 'next'.
+			*/
+			CASE(OP_ITER_NEXT): {
+				uint16_t offset = READ_SHORT();
+				Value data = PEEK(0);
+				if (IS_NULL(PEEK(1))) {
+					PUSH(data);
+					PROTECT(invoke(vm, vm->stringConstants[STR_MORE], 0));
+					DISPATCH();
+				}
 
-				Value value;
-				if (!tableGet(&instance->fields, key, &value)) {
-					push(vm, NULL_VAL);
-					break;
+				size_t index = (size_t)AS_NUMBER(PEEK(1));
+				Value item;
+				if (IS_LIST(data)) {
+					ObjList* list = AS_LIST(data);
+					if (index >= list->items.count) {
+						PUSH(BOOL_VAL(false));
+						DISPATCH();
+					}
+					item = list->items.values[index];
+				}
+				else if (IS_RANGE(data)) {
+					ObjRange* range = AS_RANGE(data);
+					if (index >= rangeLength(range)) {
+						PUSH(BOOL_VAL(false));
+						DISPATCH();
+					}
+					item = rangeGet(range, index);
+				}
+				else if (IS_TYPED_ARRAY(data)) {
+					ObjTypedArray* array = AS_TYPED_ARRAY(data);
+					if (index >= array->length) {
+						PUSH(BOOL_VAL(false));
+						DISPATCH();
+					}
+					item = typedArrayGet(array, index);
+				}
+				else if (IS_MAP(data) || IS_SET(data)) {
+					// The position is that of the next entry, deleted entries are skipped.
+					ObjMap* map = AS_MAP(data);
+					index = mapNextEntry(map, index);
+					if (index >= map->entryCount) {
+						PUSH(BOOL_VAL(false));
+						DISPATCH();
+					}
+					item = map->entries[index].key;
+				}
+				else {
+					ObjString* string = AS_STRING(data);
+					if (index >= string->length) {
+						PUSH(BOOL_VAL(false));
+						DISPATCH();
+					}
+					item = OBJ_VAL(CHAR_STRING(vm, string->chars[index]));
 				}
-				push(vm, value);
-				break;
-			}
-			if (!throwException(vm, "TypeException", "Can only index into lists.")) return INTERPRETER_RUNTIME_ERR;
-			break;
-		}
 
-		case OP_SET_INDEX: {
-			if (IS_LIST(peek(vm, 2))) {
-				Value value = pop(vm);
-				Value indexVal = pop(vm);
-				ObjList* list = AS_LIST(pop(vm));
+				PEEK(1) = NUMBER_VAL(index + 1);
+				PUSH(item);
+				ip += offset;
+				DISPATCH();
+			}
 
-				uintmax_t index;
-				if (!validateListIndex(vm, list->items.count, indexVal, &index)) {
-					return INTERPRETER_RUNTIME_ERR;
+			CASE(OP_GET_GLOBAL): {
+				size_t slot = readIndex(&ip);
+				Value value = CURRENT_MODULE()->slots.values[slot];
+				if (IS_UNDEFINED_GLOBAL(value)) {
+					THROW("UndefinedVariableException", "Undefined variable '%s'.", moduleGlobalName(CURRENT_MODULE(), slot)->chars);
 				}
+				PUSH(value);
+				DISPATCH();
+			}
 
-				list->items.values[index] = value;
-				push(vm, value);
-				break;
+			CASE(OP_DEFINE_GLOBAL): {
+				size_t slot = readIndex(&ip);
+				CURRENT_MODULE()->slots.values[slot] = POP();
+				DISPATCH();
 			}
-			else if (IS_INSTANCE(peek(vm, 2))) {
-				Value value = peek(vm, 0);
-				Value indexVal = peek(vm, 1);
-				ObjInstance* instance = AS_INSTANCE(peek(vm, 2));
 
-				if (!IS_STRING(indexVal)) {
-					if (!throwException(vm, "TypeException", "Field name must be a string.")) return INTERPRETER_RUNTIME_ERR;
-					break;
+			CASE(OP_SET_GLOBAL): {
+				size_t slot = readIndex(&ip);
+				Value* global = &CURRENT_MODULE()->slots.values[slot];
+				if (IS_UNDEFINED_GLOBAL(*global)) {
+					THROW("UndefinedVariableException", "Undefined variable '%s'.", moduleGlobalName(CURRENT_MODULE(), slot)->chars);
 				}
+				*global = PEEK(0);
+				DISPATCH();
+			}
 
-				ObjString* key = AS_STRING(indexVal);
+			CASE(OP_GET_LOCAL): {
+				uint8_t slot = READ_BYTE();
+				PUSH(frame->slots[slot]);
+				DISPATCH();
+			}
 
-				tableSet(vm, &instance->fields, key, value);
+			CASE(OP_SET_LOCAL): {
+				uint8_t slot = READ_BYTE();
+				frame->slots[slot] = PEEK(0);
+				DISPATCH();
+			}
 
-				popN(vm, 3);
-				push(vm, value);
-				break;
+			CASE(OP_GET_UPVALUE): {
+				uint8_t slot = READ_BYTE();
+				PUSH(*frame->closure->upvalues[slot]->location);
+				DISPATCH();
 			}
-			if (!throwException(vm, "TypeException", "Can only index into lists.")) return INTERPRETER_RUNTIME_ERR;
-			break;
-		}
 
-		case OP_GET_SUPER: {
-			ObjString* name = READ_STRING();
-			ObjClass* superclass = AS_CLASS(pop(vm));
+			CASE(OP_SET_UPVALUE): {
+				uint8_t slot = READ_BYTE();
+				ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+				*upvalue->location = PEEK(0);
+				WRITE_BARRIER(vm, upvalue, PEEK(0));
+				DISPATCH();
+			}
 
-			if (!bindMethod(vm, AS_INSTANCE(frame->slots[0]), superclass, name)) {
-				return INTERPRETER_RUNTIME_ERR;
+			CASE(OP_CLOSE_UPVALUE): {
+				closeUpvalues(vm, vm->stackTop - 1);
+				POP();
+				DISPATCH();
 			}
-			break;
-		}
 
-		case OP_POP: pop(vm); break;
-		case OP_DUP: push(vm, peek(vm, 0)); break;
-		
-		case OP_DUP_X2: {
-			// x, y -> x, y, x, y
-			push(vm, peek(vm, 1));
-			push(vm, peek(vm, 1));
-			break;
-		}
+			CASE(OP_GET_PROPERTY): {
+				ObjString* name = READ_STRING();
+				InlineCache* cache = READ_CACHE();
+
+				if (IS_INSTANCE(PEEK(0))) {
+					CacheEntry* entry = findCacheEntry(cache, AS_INSTANCE(PEEK(0))->shape);
+					if (entry != NULL) {
+						cache->hits++;
+						if (entry->method == NULL) {
+							PEEK(0) = AS_INSTANCE(PEEK(0))->slots[entry->slot];
+						}
+						else {
+							PEEK(0) = OBJ_VAL(newBoundMethod(vm, PEEK(0), entry->method));
+						}
+						DISPATCH();
+					}
+				}
 
-		case OP_SWAP: {
-			Value a = pop(vm);
-			Value b = pop(vm);
-			push(vm, a);
-			push(vm, b);
-			break;
-		}
+				FLATTEN(0);
+				if (IS_RANGE(PEEK(0))) {
+					Value method;
+					if (tableGet(&vm->rangeMethods, name, &method)) {
+						PEEK(0) = OBJ_VAL(newBoundNative(vm, AS_NATIVE(method), PEEK(0)));
+						DISPATCH();
+					}
+					rangeToList(vm, AS_RANGE(PEEK(0)));
+				}
 
-		case OP_NOT:
-			push(vm, BOOL_VAL(isFalsey(pop(vm))));
-			break;
+				if (IS_TYPED_ARRAY(PEEK(0))) {
+					Value method;
+					if (!tableGet(&vm->typedArrayMethods, name, &method)) {
+						THROW("PropertyException", "Undefined array method '%s'.", name->chars);
+					}
+					PEEK(0) = OBJ_VAL(newBoundNative(vm, AS_NATIVE(method), PEEK(0)));
+					DISPATCH();
+				}
 
-		case OP_NEGATE:
-			if (!IS_NUMBER(peek(vm, 0))) {
-				if (!throwException(vm, "TypeException", "Operand must be a number.")) return INTERPRETER_RUNTIME_ERR;
-				break;
-			}
-			push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
-			break;
+				if (IS_MAP(PEEK(0)) || IS_SET(PEEK(0))) {
+					Value method;
+					bool isMap = IS_MAP(PEEK(0));
+					if (!tableGet(isMap ? &vm->mapMethods : &vm->setMethods, name, &method)) {
+						THROW("PropertyException", "Undefined %s method '%s'.", isMap ? "map" : "set", name->chars);
+					}
+					PEEK(0) = OBJ_VAL(newBoundNative(vm, AS_NATIVE(method), PEEK(0)));
+					DISPATCH();
+				}
 
-		case OP_ADD: {
-			if (IS_LIST(peek(vm, 1))) {
-				Value appendee = peek(vm, 0);
-				ObjList* list = AS_LIST(peek(vm, 1));
-				
-				ValueArray array;
-				initValueArray(&array);
-				for (size_t i = 0; i < list->items.count; i++) {
-					writeValueArray(vm, &array, list->items.values[i]);
+				if (IS_LIST(PEEK(0))) {
+					Value method;
+					if (!tableGet(&vm->listMethods, name, &method)) {
+						THROW("PropertyException", "Undefined list method '%s'.", name->chars);
+					}
+					if (IS_CLOSURE(method)) PEEK(0) = OBJ_VAL(newBoundMethod(vm, PEEK(0), AS_CLOSURE(method)));
+					else PEEK(0) = OBJ_VAL(newBoundNative(vm, AS_NATIVE(method), PEEK(0)));
+					DISPATCH();
+				}
+				else if (IS_STRING(PEEK(0))) {
+					Value method;
+					if (!tableGet(&vm->stringMethods, name, &method)) {
+						THROW("PropertyException", "Undefined string method '%s'.", name->chars);
+					}
+					PEEK(0) = OBJ_VAL(newBoundNative(vm, AS_NATIVE(method), PEEK(0)));
+					DISPATCH();
 				}
-				writeValueArray(vm, &array, appendee);
 
-				ObjList* nList = newList(vm, array);
-				popN(vm, 2);
-				push(vm, OBJ_VAL(nList));
-			}
-			else if (IS_STRING(peek(vm, 0)) || IS_STRING(peek(vm, 1))) {
-				ObjInstance* exception = NULL;
-				if (!concatenate(vm, &exception)) {
-					if (!throwGeneral(vm, exception)) return INTERPRETER_RUNTIME_ERR;
-					break;
+				if (!IS_INSTANCE(PEEK(0))) {
+					THROW("TypeException", "Only instances contain properties.");
 				}
+				ObjInstance* instance = AS_INSTANCE(PEEK(0));
+				cache->misses++;
+				cacheLookup(vm, frame->closure->function, cache, instance, name);
+				Value value;
+				if (instanceGet(instance, name, &value)) {
+					if (IS_TRACE(value)) value = resolveStackTrace(vm, instance);
+					PEEK(0) = value;
+					DISPATCH();
+				}
+				PROTECT(bindMethod(vm, instance, instance->klass, name));
+				DISPATCH();
 			}
-			else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
-				double b = AS_NUMBER(pop(vm));
-				double a = AS_NUMBER(pop(vm));
-				push(vm, NUMBER_VAL(a + b));
+
+			CASE(OP_SET_PROPERTY): {
+				ObjString* name = READ_STRING();
+				InlineCache* cache = READ_CACHE();
+				if (!IS_INSTANCE(PEEK(1))) {
+					THROW("TypeException", "Only instances contain fields.");
+				}
+				setProperty(vm, frame->closure->function, cache, AS_INSTANCE(PEEK(1)), name, PEEK(0));
+				Value value = POP();
+				PEEK(0) = value;
+				DISPATCH();
 			}
-			else {
-				pop(vm);
-				pop(vm);
-				if (!throwException(vm, "TypeException", "Operands are invalid for '+' operation.")) return INTERPRETER_RUNTIME_ERR;
-				break;
+
+			CASE(OP_SET_PROPERTY_KV): {
+				ObjString* name = READ_STRING();
+				InlineCache* cache = READ_CACHE();
+				if (!IS_INSTANCE(PEEK(1))) {
+					THROW("TypeException", "Only instances contain fields.");
+				}
+				setProperty(vm, frame->closure->function, cache, AS_INSTANCE(PEEK(1)), name, PEEK(0));
+				POP();
+				DISPATCH();
 			}
-			break;
-		}
-		case OP_SUB: BINARY_OP(NUMBER_VAL, -); break;
-		case OP_MUL: BINARY_OP(NUMBER_VAL, *); break;
-		case OP_DIV: BINARY_OP(NUMBER_VAL, / ); break;
 
-		case OP_MOD: {
-			if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
-				pop(vm);
-				pop(vm);
-				if (!throwException(vm, "TypeException", "Operands must be numbers.")) return INTERPRETER_RUNTIME_ERR;
-				break;
+			CASE(OP_GET_INDEX_LIST): {
+				if (IS_LIST(PEEK(1)) && IS_NUMBER(PEEK(0))) {
+					ObjList* list = AS_LIST(PEEK(1));
+					double index = AS_NUMBER(PEEK(0));
+					if (index >= 0 && index < (double)list->items.count && index == (double)(size_t)index) {
+						vm->stackTop--;
+						PEEK(0) = list->items.values[(size_t)index];
+						DISPATCH();
+					}
+					goto generic_get_index;
+				}
+				QUICKEN(OP_GET_INDEX);
+				goto generic_get_index;
 			}
-			double b = AS_NUMBER(pop(vm));
-			double a = AS_NUMBER(pop(vm));
-			push(vm, NUMBER_VAL(fmod(a, b)));
-			break;
-		}
 
-		case OP_BIT_NOT: {
-			if (!IS_NUMBER(peek(vm, 0))) {
-				if (!throwException(vm, "TypeException", "Operand must be a number.")) return INTERPRETER_RUNTIME_ERR;
-				break;
+			CASE(OP_GET_INDEX):
+				if (IS_LIST(PEEK(1)) && IS_NUMBER(PEEK(0))) QUICKEN(OP_GET_INDEX_LIST);
+			generic_get_index: {
+				FLATTEN(0);
+				FLATTEN(1);
+				if (IS_LIST(PEEK(1))) {
+					Value indexVal = POP();
+					ObjList* list = AS_LIST(POP());
+
+					uintmax_t index;
+					VALIDATE_INDEX(list->items.count, indexVal, index);
+
+					PUSH(list->items.values[index]);
+					DISPATCH();
+				}
+				else if (IS_STRING(PEEK(1))) {
+					Value indexVal = POP();
+					ObjString* string = AS_STRING(POP());
+
+					uintmax_t index;
+					VALIDATE_INDEX(string->length, indexVal, index);
+
+					PUSH(OBJ_VAL(CHAR_STRING(vm, string->chars[index])));
+					DISPATCH();
+				}
+				else if (IS_RANGE(PEEK(1))) {
+					Value indexVal = POP();
+					ObjRange* range = AS_RANGE(POP());
+
+					uintmax_t index;
+					VALIDATE_INDEX(rangeLength(range), indexVal, index);
+
+					PUSH(rangeGet(range, index));
+					DISPATCH();
+				}
+				else if (IS_TYPED_ARRAY(PEEK(1))) {
+					Value indexVal = POP();
+					ObjTypedArray* array = AS_TYPED_ARRAY(POP());
+
+					uintmax_t index;
+					VALIDATE_INDEX(array->length, indexVal, index);
+
+					PUSH(typedArrayGet(array, index));
+					DISPATCH();
+				}
+				else if (IS_MAP(PEEK(1))) {
+					Value value;
+					if (!mapGet(AS_MAP(PEEK(1)), PEEK(0), &value)) value = NULL_VAL;
+					vm->stackTop--;
+					PEEK(0) = value;
+					DISPATCH();
+				}
+				else if (IS_INSTANCE(PEEK(1))) {
+					Value indexVal = POP();
+					ObjInstance* instance = AS_INSTANCE(POP());
+
+					if (!IS_STRING(indexVal)) {
+						THROW("TypeException", "Field name must be a string.");
+					}
+
+					ObjString* key = AS_STRING(indexVal);
+
+					Value value;
+					if (!instanceGet(instance, key, &value)) {
+						PUSH(NULL_VAL);
+						DISPATCH();
+					}
+					if (IS_TRACE(value)) value = resolveStackTrace(vm, instance);
+					PUSH(value);
+					DISPATCH();
+				}
+				THROW("TypeException", "Can only index into lists.");
 			}
-			double value = AS_NUMBER(pop(vm));
-			if (!isInteger(value)) {
-				if (!throwException(vm, "TypeException", "Operand must be an integer.")) return INTERPRETER_RUNTIME_ERR;
-				break;
+
+			CASE(OP_SET_INDEX_LIST): {
+				if (IS_LIST(PEEK(2)) && IS_NUMBER(PEEK(1))) {
+					ObjList* list = AS_LIST(PEEK(2));
+					double index = AS_NUMBER(PEEK(1));
+					if (index >= 0 && index < (double)list->items.count && index == (double)(size_t)index) {
+						Value value = PEEK(0);
+						list->items.values[(size_t)index] = value;
+						WRITE_BARRIER(vm, list, value);
+						vm->stackTop -= 2;
+						PEEK(0) = value;
+						DISPATCH();
+					}
+					goto generic_set_index;
+				}
+				QUICKEN(OP_SET_INDEX);
+				goto generic_set_index;
 			}
-			intmax_t valInt = (intmax_t)value;
-			push(vm, NUMBER_VAL((double)~valInt));
-			break;
-		}
 
-		case OP_AND: BITWISE_BINARY_OP(&); break;
-		case OP_OR: BITWISE_BINARY_OP(|); break;
-		case OP_XOR: BITWISE_BINARY_OP(^); break;
-		case OP_LSH: BITWISE_BINARY_OP(<<); break;
-		case OP_ASH: BITWISE_BINARY_OP(>>); break;
-		case OP_RSH: {
-			if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {
-				if (!throwException(vm, "TypeException", "Operands must be numbers.")) return INTERPRETER_RUNTIME_ERR;
-				break;
-			}
-			double b = AS_NUMBER(pop(vm));
-			double a = AS_NUMBER(pop(vm));
-			if (!isInteger(a) || !isInteger(b)) {
-				if (!throwException(vm, "TypeException", "Operands must be integers.")) return INTERPRETER_RUNTIME_ERR;
-				break;
-			}
-			uintmax_t aInt = (uintmax_t)a;
-			uintmax_t bInt = (uintmax_t)b;
-			push(vm, NUMBER_VAL((double)(aInt >> bInt)));
-			break;
-		}
+			CASE(OP_SET_INDEX):
+				if (IS_LIST(PEEK(2)) && IS_NUMBER(PEEK(1))) QUICKEN(OP_SET_INDEX_LIST);
+			generic_set_index: {
+				FLATTEN(1);
+				if (IS_RANGE(PEEK(2))) rangeToList(vm, AS_RANGE(PEEK(2)));
+				if (IS_LIST(PEEK(2))) {
+					Value value = POP();
+					Value indexVal = POP();
+					ObjList* list = AS_LIST(POP());
+
+					uintmax_t index;
+					VALIDATE_INDEX(list->items.count, indexVal, index);
+
+					list->items.values[index] = value;
+					WRITE_BARRIER(vm, list, value);
+					PUSH(value);
+					DISPATCH();
+				}
+				else if (IS_TYPED_ARRAY(PEEK(2))) {
+					Value value = POP();
+					Value indexVal = POP();
+					ObjTypedArray* array = AS_TYPED_ARRAY(POP());
+
+					uintmax_t index;
+					VALIDATE_INDEX(array->length, indexVal, index);
+					if (!IS_NUMBER(value)) {
+						THROW("TypeException", "Can only store numbers in typed arrays.");
+					}
 
-		case OP_EQUAL: {
-			Value b = pop(vm);
-			Value a = pop(vm);
-			push(vm, BOOL_VAL(valuesEqual(a, b)));
-			break;
-		}
+					typedArraySet(array, index, AS_NUMBER(value));
+					PUSH(value);
+					DISPATCH();
+				}
+				else if (IS_MAP(PEEK(2))) {
+					// Left on the stack while the map grows.
+					mapSet(vm, AS_MAP(PEEK(2)), PEEK(1), PEEK(0));
+					Value value = POP();
+					vm->stackTop -= 2;
+					PUSH(value);
+					DISPATCH();
+				}
+				else if (IS_INSTANCE(PEEK(2))) {
+					Value value = PEEK(0);
+					Value indexVal = PEEK(1);
+					ObjInstance* instance = AS_INSTANCE(PEEK(2));
 
-		case OP_NOT_EQUAL: {
-			Value b = pop(vm);
-			Value a = pop(vm);
-			push(vm, BOOL_VAL(!valuesEqual(a, b)));
-			break;
-		}
+					if (!IS_STRING(indexVal)) {
+						THROW("TypeException", "Field name must be a string.");
+					}
 
-		case OP_IS: {
-			Value b = pop(vm);
-			Value a = pop(vm);
+					ObjString* key = AS_STRING(indexVal);
+
+					// Computed keys are usually dynamic, so leave the instance's shaped layout rather than growing the transition tree.
+					Value _;
+					if (instance->shape != NULL && !instanceGet(instance, key, &_)) {
+						instanceMakeDictionary(vm, instance);
+					}
+					instanceSet(vm, instance, key, value);
 
-			bool result;
-			if (IS_OBJ(a) && IS_OBJ(b)) {
-				result = AS_OBJ(a) == AS_OBJ(b);
+					vm->stackTop -= 3;
+					PUSH(value);
+					DISPATCH();
+				}
+				THROW("TypeException", "Can only index into lists.");
 			}
-			else {
-				result = valuesEqual(a, b);
+
+			CASE(OP_GET_SUPER): {
+				ObjString* name = READ_STRING();
+				ObjClass* superclass = AS_CLASS(POP());
+
+				PROTECT(bindMethod(vm, AS_INSTANCE(frame->slots[0]), superclass, name));
+				DISPATCH();
 			}
-			
-			push(vm, BOOL_VAL(result));
-			break;
-		}
 
-		case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-		case OP_GREATER_EQ: BINARY_OP(BOOL_VAL, >=); break;
-		case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-		case OP_LESS_EQ: BINARY_OP(BOOL_VAL, <=); break;
+			CASE(OP_POP): POP(); DISPATCH();
+			CASE(OP_DUP): PUSH(PEEK(0)); DISPATCH();
 
-		case OP_IN: {
-			Value b = pop(vm);
-			Value a = pop(vm);
+			CASE(OP_DUP_X2): {
+				// x, y -> x, y, x, y
+				PUSH(PEEK(1));
+				PUSH(PEEK(1));
+				DISPATCH();
+			}
 
-			if (IS_LIST(b)) {
-				ObjList* list = AS_LIST(b);
+			CASE(OP_SWAP): {
+				Value a = PEEK(0);
+				PEEK(0) = PEEK(1);
+				PEEK(1) = a;
+				DISPATCH();
+			}
 
-				for (size_t i = 0; i < list->items.count; i++) {
-					if (valuesEqual(list->items.values[i], a)) {
-						push(vm, BOOL_VAL(true));
-						goto exit;
-					}
+			CASE(OP_NOT):
+				PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+				DISPATCH();
+
+			CASE(OP_NEGATE):
+				if (!IS_NUMBER(PEEK(0))) {
+					THROW("TypeException", "Operand must be a number.");
+				}
+				PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+				DISPATCH();
+
+			CASE(OP_ADD_NUM): {
+				if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+					double b = AS_NUMBER(POP());
+					double a = AS_NUMBER(PEEK(0));
+					PEEK(0) = NUMBER_VAL(a + b);
+					DISPATCH();
+				}
+				QUICKEN(OP_ADD);
+				goto generic_add;
+			}
+
+			CASE(OP_ADD_STR): {
+				if (isStringOrRope(PEEK(0)) && isStringOrRope(PEEK(1))) {
+					Value result = concatenateStrings(vm, PEEK(1), PEEK(0));
+					vm->stackTop--;
+					PEEK(0) = result;
+					DISPATCH();
 				}
-				push(vm, BOOL_VAL(false));
-				exit:
-				break;
+				QUICKEN(OP_ADD);
+				goto generic_add;
 			}
-			else if (IS_INSTANCE(b)) {
-				ObjInstance* instance = AS_INSTANCE(b);
 
-				if (!IS_STRING(a)) {
-					if (!throwException(vm, "TypeException", "Field name must be a string.")) return INTERPRETER_RUNTIME_ERR;
-					break;
+			CASE(OP_ADD):
+				if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) QUICKEN(OP_ADD_NUM);
+				else if (isStringOrRope(PEEK(0)) && isStringOrRope(PEEK(1))) QUICKEN(OP_ADD_STR);
+			generic_add: {
+				if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+					double b = AS_NUMBER(POP());
+					double a = AS_NUMBER(PEEK(0));
+					PEEK(0) = NUMBER_VAL(a + b);
 				}
+				else if (IS_LIST(PEEK(1)) || IS_RANGE(PEEK(1))) {
+					if (IS_RANGE(PEEK(1))) rangeToList(vm, AS_RANGE(PEEK(1)));
+					Value appendee = PEEK(0);
+					ObjList* list = AS_LIST(PEEK(1));
+
+					ValueArray array;
+					initValueArray(&array);
+					for (size_t i = 0; i < list->items.count; i++) {
+						writeValueArray(vm, &array, list->items.values[i]);
+					}
+					writeValueArray(vm, &array, appendee);
 
-				ObjString* key = AS_STRING(a);
+					ObjList* nList = newList(vm, array);
+					vm->stackTop -= 2;
+					PUSH(OBJ_VAL(nList));
+				}
+				else if (isStringOrRope(PEEK(0)) || isStringOrRope(PEEK(1))) {
+					ObjInstance* exception = NULL;
+					STORE_FRAME();
+					if (!concatenate(vm, &exception)) {
+						if (!throwGeneral(vm, exception)) return INTERPRETER_RUNTIME_ERR;
+					}
+					LOAD_FRAME();
+				}
+				else {
+					POP();
+					POP();
+					THROW("TypeException", "Operands are invalid for '+' operation.");
+				}
+				DISPATCH();
+			}
+			CASE(OP_SUB): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+			CASE(OP_MUL): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+			CASE(OP_DIV): BINARY_OP(NUMBER_VAL, /); DISPATCH();
+
+			CASE(OP_MOD): {
+				if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+					POP();
+					POP();
+					THROW("TypeException", "Operands must be numbers.");
+				}
+				double b = AS_NUMBER(POP());
+				double a = AS_NUMBER(PEEK(0));
+				PEEK(0) = NUMBER_VAL(fmod(a, b));
+				DISPATCH();
+			}
 
-				Value v;
-				push(vm, BOOL_VAL(tableGet(&instance->fields, key, &v)));
-				break;
+			CASE(OP_BIT_NOT): {
+				if (!IS_NUMBER(PEEK(0))) {
+					THROW("TypeException", "Operand must be a number.");
+				}
+				double value = AS_NUMBER(POP());
+				if (!isInteger(value)) {
+					THROW("TypeException", "Operand must be an integer.");
+				}
+				intmax_t valInt = (intmax_t)value;
+				PUSH(NUMBER_VAL((double)~valInt));
+				DISPATCH();
 			}
-			else if(IS_STRING(b)) {
-				ObjString* string = AS_STRING(b);
 
-				if (!IS_STRING(a)) {
-					if (!throwException(vm, "TypeException", "Substring must be a string.")) return INTERPRETER_RUNTIME_ERR;
-					break;
+			CASE(OP_AND): BITWISE_BINARY_OP(&); DISPATCH();
+			CASE(OP_OR): BITWISE_BINARY_OP(|); DISPATCH();
+			CASE(OP_XOR): BITWISE_BINARY_OP(^); DISPATCH();
+			CASE(OP_LSH): BITWISE_BINARY_OP(<<); DISPATCH();
+			CASE(OP_ASH): BITWISE_BINARY_OP(>>); DISPATCH();
+			CASE(OP_RSH): {
+				if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+					THROW("TypeException", "Operands must be numbers.");
+				}
+				double b = AS_NUMBER(POP());
+				double a = AS_NUMBER(POP());
+				if (!isInteger(a) || !isInteger(b)) {
+					THROW("TypeException", "Operands must be integers.");
 				}
+				uintmax_t aInt = (uintmax_t)a;
+				uintmax_t bInt = (uintmax_t)b;
+				PUSH(NUMBER_VAL((double)(aInt >> bInt)));
+				DISPATCH();
+			}
 
-				ObjString* substring = AS_STRING(a);
+			CASE(OP_EQUAL): {
+				Value b = POP();
+				Value a = PEEK(0);
+				PEEK(0) = BOOL_VAL(valuesEqual(a, b));
+				DISPATCH();
+			}
 
-				push(vm, BOOL_VAL(strstr(string->chars, substring->chars) != NULL));
-				break;
+			CASE(OP_NOT_EQUAL): {
+				Value b = POP();
+				Value a = PEEK(0);
+				PEEK(0) = BOOL_VAL(!valuesEqual(a, b));
+				DISPATCH();
 			}
 
-			if (!throwException(vm, "TypeException", "Can only use 'in' on strings, lists, and instances.")) return INTERPRETER_RUNTIME_ERR;
-			break;
-		}
+			CASE(OP_IS): {
+				Value b = POP();
+				Value a = POP();
 
-		case OP_INSTANCEOF: {
-			Value superclass = pop(vm);
-			Value value = pop(vm);
+				bool result;
+				// Strings are the same if they have the same chars, as if they were all interned.
+				if (IS_OBJ(a) && IS_OBJ(b) && !(isStringOrRope(a) && isStringOrRope(b))) {
+					result = AS_OBJ(a) == AS_OBJ(b);
+				}
+				else {
+					result = valuesEqual(a, b);
+				}
 
-			if (!IS_INSTANCE(value)) {
-				push(vm, BOOL_VAL(false));
-				break;
+				PUSH(BOOL_VAL(result));
+				DISPATCH();
 			}
 
-			if (!IS_CLASS(superclass)) {
-				if (!throwException(vm, "TypeException", "Superclass must be a class.")) return INTERPRETER_RUNTIME_ERR;
-				break;
+			CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >); DISPATCH();
+			CASE(OP_GREATER_EQ): BINARY_OP(BOOL_VAL, >=); DISPATCH();
+			CASE(OP_LESS): BINARY_OP(BOOL_VAL, <); DISPATCH();
+			CASE(OP_LESS_EQ): BINARY_OP(BOOL_VAL, <=); DISPATCH();
+
+			CASE(OP_IN): {
+				FLATTEN(0);
+				FLATTEN(1);
+				Value b = POP();
+				Value a = POP();
+
+				if (IS_LIST(b)) {
+					ObjList* list = AS_LIST(b);
+
+					bool found = false;
+					for (size_t i = 0; i < list->items.count; i++) {
+						if (valuesEqual(list->items.values[i], a)) {
+							found = true;
+							break;
+						}
+					}
+					PUSH(BOOL_VAL(found));
+					DISPATCH();
+				}
+				else if (IS_RANGE(b)) {
+					PUSH(BOOL_VAL(rangeContains(AS_RANGE(b), a)));
+					DISPATCH();
+				}
+				else if (IS_MAP(b) || IS_SET(b)) {
+					Value _;
+					PUSH(BOOL_VAL(mapGet(AS_MAP(b), a, &_)));
+					DISPATCH();
+				}
+				else if (IS_INSTANCE(b)) {
+					ObjInstance* instance = AS_INSTANCE(b);
+
+					if (!IS_STRING(a)) {
+						THROW("TypeException", "Field name must be a string.");
+					}
+
+					ObjString* key = AS_STRING(a);
+
+					Value v;
+					PUSH(BOOL_VAL(instanceGet(instance, key, &v)));
+					DISPATCH();
+				}
+				else if (IS_STRING(b)) {
+					ObjString* string = AS_STRING(b);
+
+					if (!IS_STRING(a)) {
+						THROW("TypeException", "Substring must be a string.");
+					}
+
+					ObjString* substring = AS_STRING(a);
+
+					PUSH(BOOL_VAL(strstr(string->chars, substring->chars) != NULL));
+					DISPATCH();
+				}
+
+				THROW("TypeException", "Can only use 'in' on strings, lists, maps, sets and instances.");
 			}
 
-			ObjClass* superclassCheck = AS_CLASS(superclass);
-			
-			push(vm, BOOL_VAL(instanceof(AS_INSTANCE(value), superclassCheck)));
-			break;
-		}
+			CASE(OP_INSTANCEOF): {
+				Value superclass = POP();
+				Value value = POP();
+
+				if (!IS_INSTANCE(value)) {
+					PUSH(BOOL_VAL(false));
+					DISPATCH();
+				}
+
+				if (!IS_CLASS(superclass)) {
+					THROW("TypeException", "Superclass must be a class.");
+				}
+
+				ObjClass* superclassCheck = AS_CLASS(superclass);
+
+				PUSH(BOOL_VAL(instanceof(AS_INSTANCE(value), superclassCheck)));
+				DISPATCH();
+			}
 
-		case OP_TYPEOF: {
-			Value value = pop(vm);
+			CASE(OP_TYPEOF): {
+				Value value = POP();
 
-			ObjString* string = NULL;
+				ObjString* string = NULL;
 
-			switch (value.type) {
-				case VAL_BOOL: string = vm->stringConstants[STR_BOOLEAN]; break;
-				case VAL_NUMBER: string = vm->stringConstants[STR_NUMBER]; break;
-				case VAL_NULL: string = vm->stringConstants[STR_NULL]; break;
-				case VAL_OBJ: {
+				if (IS_BOOL(value)) string = vm->stringConstants[STR_BOOLEAN];
+				else if (IS_NUMBER(value)) string = vm->stringConstants[STR_NUMBER];
+				else if (IS_NULL(value)) string = vm->stringConstants[STR_NULL];
+				else {
 					switch (AS_OBJ(value)->type) {
 						case OBJ_CLOSURE:
 						case OBJ_BOUND_METHOD:
@@ -1191,260 +2048,414 @@ static InterpreterResult fetchExecute(VM* vm, bool isFunctionCall) {
 							break;
 						case OBJ_CLASS: string = vm->stringConstants[STR_CLASS]; break;
 						case OBJ_INSTANCE: string = vm->stringConstants[STR_INSTANCE]; break;
-						case OBJ_STRING: string = vm->stringConstants[STR_STRING]; break;
-						case OBJ_LIST: string = vm->stringConstants[STR_LIST]; break;
+						case OBJ_STRING:
+						case OBJ_ROPE:
+							string = vm->stringConstants[STR_STRING];
+							break;
+						case OBJ_LIST:
+						case OBJ_RANGE:
+							string = vm->stringConstants[STR_LIST];
+							break;
+						case OBJ_TYPED_ARRAY: string = vm->stringConstants[STR_ARRAY]; break;
+						case OBJ_MAP: string = vm->stringConstants[STR_MAP]; break;
+						case OBJ_SET: string = vm->stringConstants[STR_SET]; break;
 					}
-					break;
 				}
+
+				PUSH(OBJ_VAL(string));
+				DISPATCH();
 			}
 
-			push(vm, OBJ_VAL(string));
+			CASE(OP_JUMP_IF_FALSE): {
+				uint16_t offset = READ_SHORT();
+				if (isFalsey(POP())) ip += offset;
+				DISPATCH();
+			}
 
-			break;
-		}
+			CASE(OP_JUMP_IF_FALSE_SC): {
+				uint16_t offset = READ_SHORT();
+				if (isFalsey(PEEK(0))) ip += offset;
+				DISPATCH();
+			}
 
-		case OP_JUMP_IF_FALSE: {
-			uint16_t offset = READ_SHORT();
-			if (isFalsey(pop(vm))) frame->ip += offset;
-			break;
-		}
+			CASE(OP_JUMP): {
+				uint16_t offset = READ_SHORT();
+				ip += offset;
+				DISPATCH();
+			}
 
-		case OP_JUMP_IF_FALSE_SC: {
-			uint16_t offset = READ_SHORT();
-			if (isFalsey(peek(vm, 0))) frame->ip += offset;
-			break;
-		}
+			CASE(OP_LOOP): {
+				uint16_t offset = READ_SHORT();
+				SAFEPOINT();
+				ip -= offset;
+				COUNT_BACKEDGE();
+				DISPATCH();
+			}
 
-		case OP_JUMP: {
-			uint16_t offset = READ_SHORT();
-			frame->ip += offset;
-			break;
-		}
+			CASE(OP_SWITCH): {
+				SwitchTable* table = &frame->closure->function->chunk.switches[READ_SHORT()];
+				FLATTEN(0);
+				ip = frame->closure->function->chunk.code + switchTarget(table, PEEK(0));
+				DISPATCH();
+			}
 
-		case OP_LOOP: {
-			uint16_t offset = READ_SHORT();
-			frame->ip -= offset;
-			break;
-		}
+			CASE(OP_CALL): {
+				uint8_t argCount = READ_BYTE();
+				uint8_t _;
+				PROTECT(callValue(vm, PEEK(argCount), argCount, &_));
+				DISPATCH();
+			}
 
-		case OP_CALL: {
-			uint8_t argCount = READ_BYTE();
-			uint8_t _;
-			if (!callValue(vm, peek(vm, argCount), argCount, &_)) {
-				return INTERPRETER_RUNTIME_ERR;
+			CASE(OP_TAIL_CALL): {
+				uint8_t argCount = READ_BYTE();
+				uint8_t _;
+				TAIL_CALL(callValue(vm, PEEK(argCount), argCount, &_));
+				DISPATCH();
 			}
-			break;
-		}
 
-		case OP_CLOSURE: {
-			ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-			ObjClosure* closure = newClosure(vm, CURRENT_MODULE(), function);
-			push(vm, OBJ_VAL(closure));
-			for (size_t i = 0; i < closure->upvalueCount; i++) {
-				uint8_t isLocal = READ_BYTE();
-				uint8_t index = READ_BYTE();
-				if (isLocal) {
-					closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
+			CASE(OP_CLOSURE): {
+				ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+				// Closures of a function which captures nothing can't differ, so one is made and shared by all.
+				if (function->upvalueCount == 0) {
+					ObjClosure* shared = function->sharedClosure;
+					if (shared == NULL || shared->owner != CURRENT_MODULE()) {
+						shared = newClosure(vm, CURRENT_MODULE(), function);
+						function->sharedClosure = shared;
+						WRITE_BARRIER_OBJ(vm, function, shared);
+					}
+					PUSH(OBJ_VAL(shared));
+					DISPATCH();
 				}
-				else {
-					closure->upvalues[i] = frame->closure->upvalues[index];
+
+				ObjClosure* closure = newClosure(vm, CURRENT_MODULE(), function);
+				PUSH(OBJ_VAL(closure));
+				for (size_t i = 0; i < closure->upvalueCount; i++) {
+					uint8_t isLocal = READ_BYTE();
+					uint8_t index = READ_BYTE();
+					if (isLocal) {
+						closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
+						WRITE_BARRIER_OBJ(vm, closure, closure->upvalues[i]);
+					}
+					else {
+						closure->upvalues[i] = frame->closure->upvalues[index];
+					}
 				}
+				DISPATCH();
 			}
-			break;
-		}
 
-		case OP_CLASS:
-			push(vm, OBJ_VAL(newClass(vm, READ_STRING())));
-			break;
+			CASE(OP_CLASS):
+				PUSH(OBJ_VAL(newClass(vm, READ_STRING())));
+				DISPATCH();
 
-		case OP_INHERIT: {
-			Value superclass = peek(vm, 1);
-			if (!IS_CLASS(superclass)) {
-				if (!throwException(vm, "TypeException", "Superclass must be a class.")) return INTERPRETER_RUNTIME_ERR;
-				break;
+			CASE(OP_INHERIT): {
+				Value superclass = PEEK(1);
+				if (!IS_CLASS(superclass)) {
+					THROW("TypeException", "Superclass must be a class.");
+				}
+				ObjClass* subclass = AS_CLASS(PEEK(0));
+				tableAddAll(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
+				subclass->superclass = AS_CLASS(superclass);
+				WRITE_BARRIER(vm, subclass, superclass);
+				POP();
+				DISPATCH();
 			}
-			ObjClass* subclass = AS_CLASS(peek(vm, 0));
-			tableAddAll(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
-			subclass->superclass = AS_CLASS(superclass);
-			pop(vm);
-			break;
-		}
 
-		case OP_METHOD:
-			defineMethod(vm, READ_STRING());
-			break;
+			CASE(OP_METHOD):
+				defineMethod(vm, READ_STRING());
+				DISPATCH();
 
-		case OP_INVOKE: {
-			ObjString* method = READ_STRING();
-			uint8_t argCount = READ_BYTE();
-			if (!invoke(vm, method, argCount)) {
-				return INTERPRETER_RUNTIME_ERR;
-			}
-			break;
-		}
+			CASE(OP_INVOKE):
+				INVOKE(PROTECT);
 
-		case OP_SUPER_INVOKE: {
-			ObjString* method = READ_STRING();
-			uint8_t argCount = READ_BYTE();
-			ObjClass* superclass = AS_CLASS(pop(vm));
-			if (!invokeFromClass(vm, AS_INSTANCE(frame->slots[0]), superclass, method, argCount)) {
-				return INTERPRETER_RUNTIME_ERR;
+			CASE(OP_TAIL_INVOKE):
+				INVOKE(TAIL_CALL);
+
+			CASE(OP_SUPER_INVOKE): {
+				ObjString* method = READ_STRING();
+				uint8_t argCount = READ_BYTE();
+				ObjClass* superclass = AS_CLASS(POP());
+				PROTECT(invokeFromClass(vm, AS_INSTANCE(frame->slots[0]), superclass, method, argCount));
+				DISPATCH();
 			}
-			break;
-		}
 
-		case OP_THROW: {
-			Value throwee = peek(vm, 0);
+			CASE(OP_THROW): {
+				Value throwee = PEEK(0);
 
-			if (!IS_INSTANCE(throwee)) {
-				if (!throwException(vm, "TypeException", "Throwee must be an instance.")) return INTERPRETER_RUNTIME_ERR;
-				break;
-			}
+				if (!IS_INSTANCE(throwee)) {
+					THROW("TypeException", "Throwee must be an instance.");
+				}
 
-			ObjInstance* instance = AS_INSTANCE(throwee);
+				ObjInstance* instance = AS_INSTANCE(throwee);
 
-			if (!instanceof(instance, vm->exceptionClass)) {
-				if (!throwException(vm, "TypeException", "Throwee must inherit from 'Exception'.")) return INTERPRETER_RUNTIME_ERR;
-				break;
-			}
+				if (!instanceof(instance, vm->exceptionClass)) {
+					THROW("TypeException", "Throwee must inherit from 'Exception'.");
+				}
 
-			if (!throwGeneral(vm, instance)) return INTERPRETER_RUNTIME_ERR;
+				PROTECT(throwGeneral(vm, instance));
+				DISPATCH();
+			}
 
-			break;
-		}
+			CASE(OP_IMPORT): {
+				ObjString* path = READ_STRING();
 
-		case OP_TRY_BEGIN: {
-			uint16_t catchLocation = READ_SHORT();
+				Value importValue;
+				if (tableGet(&vm->importTable, path, &importValue)) {
+					PUSH(importValue);
+					DISPATCH();
+				}
 
-			frame->isTry = true;
-			frame->catchJump = frame->ip + catchLocation;
+				ObjString* lookupPath = makeStringf(vm, "%s/%s.dgn", vm->directory, path->chars);
+				PUSH(OBJ_VAL(lookupPath));
 
-			break;
-		}
+				// The module is created first so the compiler can resolve its globals to slots.
+				Module* importModule = newModule(vm, OBJ_VAL(path));
 
-		case OP_TRY_END: {
-			frame->isTry = false;
-			break;
-		}
+				ObjFunction* function = NULL;
+				char* cachePath = NULL;
+				if (vm->prescan != NULL) {
+					function = takePrescanned(vm, importModule, lookupPath->chars);
+				}
+				if (function == NULL && vm->bytecodeCache) {
+					cachePath = bytecodePath(lookupPath->chars);
+					function = loadBytecode(vm, importModule, cachePath, lookupPath->chars);
+				}
 
-		case OP_IMPORT: {
-			ObjString* path = READ_STRING();
-			
-			ObjString* lookupPath = makeStringf(vm, "%s/%s.dgn", vm->directory, path->chars);
+				if (function == NULL) {
+					//TODO Refactor to use custom file type and FREE_ARRAY
+					char* source = readFile(lookupPath->chars);
+					function = compile(vm, importModule, source);
+					vm->compiler = NULL;
+					if (function == NULL) {
+						free(source);
+						free(cachePath);
+						return INTERPRETER_COMPILER_ERR;
+					}
 
-			Value importValue;
-			if (tableGet(&vm->importTable, path, &importValue)) {
-				push(vm, importValue);
-				break;
-			}
+					// A cache which can't be written (e.g. a read only directory) is only a missed speed up.
+					if (cachePath != NULL) {
+						PUSH(OBJ_VAL(function));
+						saveBytecode(vm, importModule, function, cachePath, lookupPath->chars, source);
+						POP();
+					}
+					free(source);
+				}
+				free(cachePath);
+				POP();
 
-			//TODO Refactor to use custom file type and FREE_ARRAY
-			char* source = readFile(lookupPath->chars);
+				PUSH(OBJ_VAL(function));
+				ObjClosure* closure = newClosure(vm, importModule, function);
+				POP();
+				PUSH(OBJ_VAL(closure));
 
-			ObjFunction* function = compile(vm, source);
-			if (function == NULL) return INTERPRETER_COMPILER_ERR;
+				bool hasError = false;
+				ObjInstance* exception = NULL;
 
-			vm->compiler = NULL;
+				STORE_FRAME();
+				callDragonFromNative(vm, NULL, OBJ_VAL(closure), 0, &hasError, &exception);
+				LOAD_FRAME();
 
-			Module* importModule = reallocate(vm, NULL, 0, sizeof(Module));
-			initModule(vm, importModule);
+				POP();
 
-			Module* vmModule = vm->modules;
+				ObjInstance* importObj = newInstance(vm, vm->importClass);
 
-			while (vmModule != NULL) {
-				Module* next = vmModule->next;
-				if (vmModule->next == NULL) {
-					vmModule->next = importModule;
-				}
-				vmModule = next;
-			}
+				PUSH(OBJ_VAL(importObj));
 
-			tableSet(vm, &importModule->globals, vm->stringConstants[STR_THIS_MODULE], OBJ_VAL(path));
+				// Modules can export any number of names, so store them directly in the fields table.
+				instanceMakeDictionary(vm, importObj);
+				tableAddAll(vm, &importModule->exports, &importObj->fields);
 
-			uint8_t _;
-			push(vm, OBJ_VAL(function));
-			ObjClosure* closure = newClosure(vm, importModule, function);
-			pop(vm);
-			push(vm, OBJ_VAL(closure));
-			
-			bool hasError = false;
-			ObjInstance* exception = NULL;
+				tableSet(vm, &vm->importTable, path, OBJ_VAL(importObj));
+				DISPATCH();
+			}
 
-			callDragonFromNative(vm, NULL, OBJ_VAL(closure), 0, &hasError, &exception);
+			CASE(OP_EXPORT): {
+				ObjString* name = READ_STRING();
 
-			pop(vm);
-			
-			ObjInstance* importObj = newInstance(vm, vm->importClass);
+				tableSet(vm, &CURRENT_MODULE()->exports, name, PEEK(0));
 
-			push(vm, OBJ_VAL(importObj));
+				POP();
+				DISPATCH();
+			}
 
-			tableAddAll(vm, &importModule->exports, &importObj->fields);
+			CASE(OP_RETURN): {
+				Value value = POP();
+				closeUpvalues(vm, frame->slots);
+				vm->frameCount--;
+				if (vm->frameCount == baseFrameCount || vm->frameCount == 0) {
+					if (vm->frameCount == 0) {
+						POP();
+					}
+					else {
+						// The native caller owns the callee and argument slots, and pops them itself.
+						vm->stackTop = frame->slots + frame->closure->function->arity + 1;
+						PUSH(value);
+					}
+					return INTERPRETER_OK;
+				}
 
-			free(source);
+				vm->stackTop = frame->slots;
+				PUSH(value);
+				LOAD_FRAME();
+				DISPATCH();
+			}
 
-			tableSet(vm, &vm->importTable, path, OBJ_VAL(importObj));
-			break;
-		}
+			/*
+			  The loop of a list method such as map (see list.h). The instruction calls the function for the next item with
+			  ip left at itself, so it is run again with the function's result once it returns (straight away for natives).
+			*/
+			CASE(OP_LIST_STEP): {
+				ListStep step = (ListStep)READ_BYTE();
+				if (!stepListMethod(vm, step, frame->slots)) DISPATCH();
+
+				ip -= 2;
+				uint8_t argCount = LIST_STEP_ARG_COUNT(step);
+				uint8_t _;
+				PROTECT(callValue(vm, PEEK(argCount), argCount, &_));
+				DISPATCH();
+			}
 
-		case OP_EXPORT: {
-			ObjString* name = READ_STRING();
+			/*
+			  Superinstructions, each replaces a common sequence of two instructions and keeps the operands of both.
+			  Where the fast path doesn't apply the first instruction is done inline and the handler of the second
+			  continues from its operands.
+			*/
+
+			CASE(OP_GET_LOCAL_GET_LOCAL): {
+				uint8_t first = READ_BYTE();
+				uint8_t second = READ_BYTE();
+				PUSH(frame->slots[first]);
+				PUSH(frame->slots[second]);
+				DISPATCH();
+			}
 
-			Value value = peek(vm, 0);
+			CASE(OP_GET_LOCAL_GET_PROPERTY): {
+				uint8_t slot = READ_BYTE();
+				Value receiver = frame->slots[slot];
+
+				if (IS_INSTANCE(receiver)) {
+					uint8_t* operands = ip;
+					readIndex(&ip);
+					InlineCache* cache = READ_CACHE();
+					CacheEntry* entry = findCacheEntry(cache, AS_INSTANCE(receiver)->shape);
+					if (entry != NULL && entry->method == NULL) {
+						cache->hits++;
+						PUSH(AS_INSTANCE(receiver)->slots[entry->slot]);
+						DISPATCH();
+					}
+					ip = operands;
+				}
 
-			tableSet(vm, &CURRENT_MODULE()->exports, name, value);
+				PUSH(receiver);
+				CONTINUE_AS(OP_GET_PROPERTY);
+			}
 
-			pop(vm);
+			CASE(OP_ADD_CONSTANT): {
+				Value constant = READ_CONSTANT();
+				if (IS_NUMBER(PEEK(0)) && IS_NUMBER(constant)) {
+					PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + AS_NUMBER(constant));
+					DISPATCH();
+				}
+				PUSH(constant);
+				goto generic_add;
+			}
 
-			break;
-		}
+			CASE(OP_SET_LOCAL_POP): {
+				uint8_t slot = READ_BYTE();
+				frame->slots[slot] = POP();
+				DISPATCH();
+			}
 
-		case OP_RETURN: {
-			Value value = pop(vm);
-			closeUpvalues(vm, frame->slots);
-			vm->frameCount--;
-			if ((isFunctionCall && vm->frameCount == baseFrameCount) || vm->frameCount == 0) {
-				if (isFunctionCall) {
-					push(vm, value);
+			CASE(OP_SET_GLOBAL_POP): {
+				size_t slot = readIndex(&ip);
+				Value* global = &CURRENT_MODULE()->slots.values[slot];
+				if (IS_UNDEFINED_GLOBAL(*global)) {
+					THROW("UndefinedVariableException", "Undefined variable '%s'.", moduleGlobalName(CURRENT_MODULE(), slot)->chars);
 				}
-				else {
-					pop(vm);
+				*global = POP();
+				DISPATCH();
+			}
+
+			CASE(OP_LESS_JUMP_IF_FALSE): {
+				uint16_t offset = READ_SHORT();
+				if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+					POP();
+					POP();
+					THROW("TypeException", "Operands must be numbers.");
 				}
-				return INTERPRETER_OK;
+				double b = AS_NUMBER(POP());
+				double a = AS_NUMBER(POP());
+				if (!(a < b)) ip += offset;
+				DISPATCH();
+			}
+
+			CASE(OP_POP_LOOP): {
+				uint16_t offset = READ_SHORT();
+				POP();
+				SAFEPOINT();
+				ip -= offset;
+				COUNT_BACKEDGE();
+				DISPATCH();
 			}
 
-			vm->stackTop = frame->slots;
-			push(vm, value);
-			break;
+			default:
+#ifdef COMPUTED_GOTO
+			op_unknown:
+#endif
+				fprintf(stderr, "Unknown opcode %d.\n", ip[-1]);
+				return INTERPRETER_RUNTIME_ERR;
+
+#ifdef COMPUTED_GOTO
+			// Every instruction is dispatched through here while a profiler is attached.
+			op_profile:
+				profileInstruction(vm, ip[-1]);
+				goto *dispatchTable[ip[-1]];
+#endif
+
+#ifdef JIT_DISPATCH
+			/*
+			  Every instruction of a function with JIT code is dispatched through here. The code runs from this instruction
+			  (if it can be entered here) up to one it leaves to the interpreter, which is then run by its handler.
+			*/
+			op_jit: {
+				ip--;
+				ObjFunction* function = frame->closure->function;
+				if (function->jit == NULL) dispatch = dispatchTable;
+				else if (jitEnters(function, ip)) ip = runJit(vm, frame, ip);
+				goto *dispatchTable[*ip++];
+			}
+#endif
 		}
 	}
-	return INTERPRETER_CONTINUE;
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
 #undef CURRENT_MODULE
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef CONTINUE_AS
+#undef QUICKEN
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef DISPATCH
+#undef CASE
+#undef THROW
+#undef PROTECT
+#undef TAIL_CALL
+#undef INVOKE
+#undef SAFEPOINT
+#undef LOAD_JIT
+#undef COUNT_BACKEDGE
+#undef VALIDATE_INDEX
 #undef BINARY_OP
+#undef BITWISE_BINARY_OP
 }
 
 Value runFunction(VM* vm, bool* hasError) {
-	InterpreterResult result;
-	for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-		CallFrame* frame = &vm->frames[vm->frameCount - 1];
-		printf("     ");
-		for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
-			printf("[ ");
-			printf("%s", valueToRepr(vm, *slot)->chars);
-			printf(" ]");
-		}
-		printf("\n");
-
-		disassembleInstruction(vm, &frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
-#endif
-
-		result = fetchExecute(vm, true);
-		if (result != INTERPRETER_CONTINUE) break;
-	}
+	InterpreterResult result = execute(vm, vm->frameCount - 1);
 	if (result != INTERPRETER_OK) {
 		*hasError = true;
 		return NULL_VAL;
@@ -1453,45 +2464,97 @@ Value runFunction(VM* vm, bool* hasError) {
 }
 
 static InterpreterResult run(VM* vm) {
-	for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-		CallFrame* frame = &vm->frames[vm->frameCount - 1];
-		printf("     ");
-		for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
-			printf("[ ");
-			printf("%s", valueToRepr(vm, *slot)->chars);
-			printf(" ]");
-		}
-		printf("\n");
+	return execute(vm, 0);
+}
 
-		disassembleInstruction(vm, &frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
-#endif
+static InterpreterResult runScript(VM* vm, Module* module, ObjFunction* function) {
+	uint8_t _;
+	push(vm, OBJ_VAL(function));
+	ObjClosure* closure = newClosure(vm, module, function);
+	pop(vm);
+	push(vm, OBJ_VAL(closure));
+	call(vm, closure, 0, &_);
 
-		InterpreterResult result = fetchExecute(vm, false);
-		if (result != INTERPRETER_CONTINUE) return result;
-	}
+	return run(vm);
 }
 
 InterpreterResult interpret(VM* vm, const char* directory, const char* source) {
 	vm->directory = directory;
-	ObjFunction* function = compile(vm, source);
+
+	Module* mainModule = newModule(vm, OBJ_VAL(copyString(vm, "$main$", 6)));
+
+	ObjFunction* function = compile(vm, mainModule, source);
 	if (function == NULL) return INTERPRETER_COMPILER_ERR;
 
 	vm->compiler = NULL;
+	if (vm->importPrescan) prescanImports(vm, source);
+	return runScript(vm, mainModule, function);
+}
 
-	Module* mainModule = reallocate(vm, NULL, 0, sizeof(Module));
-	initModule(vm, mainModule);
+InterpreterResult interpretBytecode(VM* vm, const char* directory, const char* path) {
+	vm->directory = directory;
 
-	vm->modules = mainModule;
+	Module* mainModule = newModule(vm, OBJ_VAL(copyString(vm, "$main$", 6)));
 
-	tableSet(vm, &mainModule->globals, vm->stringConstants[STR_THIS_MODULE], OBJ_VAL(copyString(vm, "$main$", 6)));
+	ObjFunction* function = loadBytecode(vm, mainModule, path, NULL);
+	if (function == NULL) {
+		fprintf(stderr, "Could not load bytecode file \"%s\".\n", path);
+		return INTERPRETER_COMPILER_ERR;
+	}
+	return runScript(vm, mainModule, function);
+}
 
-	uint8_t _;
-	push(vm, OBJ_VAL(function));
-	ObjClosure* closure = newClosure(vm, mainModule, function);
+ObjClosure* newIntrinsic(VM* vm, const char* name, size_t arity, const uint8_t* code, size_t length) {
+	if (vm->intrinsics == NULL) vm->intrinsics = newModule(vm, OBJ_VAL(copyString(vm, "$intrinsics$", 12)));
+
+	ObjFunction* function = newFunction(vm);
+	push(vm, OBJ_VAL(function)); // GC
+	function->arity = arity;
+	function->name = copyString(vm, name, strlen(name));
+	WRITE_BARRIER_OBJ(vm, function, function->name);
+	for (size_t i = 0; i < length; i++) writeChunk(vm, &function->chunk, code[i], 0);
+
+	ObjClosure* closure = newClosure(vm, vm->intrinsics, function);
 	pop(vm);
-	push(vm, OBJ_VAL(closure));
-	call(vm, closure, 0, &_);
+	return closure;
+}
 
-	return run(vm);
+uint8_t* compileImport(VM* vm, const char* path, const char* source, size_t* length) {
+	Module* module = newModule(vm, OBJ_VAL(copyString(vm, path, strlen(path))));
+	ObjFunction* function = compile(vm, module, source);
+	vm->compiler = NULL;
+
+	uint8_t* data = NULL;
+	if (function != NULL) {
+		push(vm, OBJ_VAL(function));
+		data = encodeBytecode(vm, module, function, path, source, length);
+		pop(vm);
+	}
+
+	// Nothing refers to the module once it has been encoded, the newest module is always the first.
+	vm->modules = module->next;
+	freeModule(vm, module);
+	FREE(vm, Module, module);
+	return data;
+}
+
+bool precompileFile(VM* vm, const char* path) {
+	char* source = readFile(path);
+	char* cachePath = bytecodePath(path);
+
+	// Compiled into a module set up the same way as an import's, which is where the file will be loaded.
+	Module* module = newModule(vm, OBJ_VAL(copyString(vm, path, strlen(path))));
+	ObjFunction* function = compile(vm, module, source);
+	vm->compiler = NULL;
+
+	bool saved = false;
+	if (function != NULL) {
+		push(vm, OBJ_VAL(function));
+		saved = saveBytecode(vm, module, function, cachePath, path, source);
+		pop(vm);
+	}
+
+	free(cachePath);
+	free(source);
+	return saved;
 }
\ No newline at end of file
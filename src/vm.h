@@ -4,23 +4,53 @@
 #include "table.h"
 #include "compiler.h"
 #include "module.h"
+#include "memory.h"
+#include "pool.h"
 
-#define FRAMES_MAX 1024
+// The most frames a VM's stack holds unless set otherwise (see setFrameMax).
+#define DEFAULT_FRAME_MAX 1024
+// The stack has room for this many values per frame.
+#define STACK_SLOTS_PER_FRAME 256
+
+typedef struct Worker Worker;
+typedef struct IOFile IOFile;
+typedef struct Profiler Profiler;
+typedef struct Prescan Prescan;
 
 typedef struct {
 	ObjClosure* closure;
 	uint8_t* ip;
 	Value* slots;
-	bool isTry;
-	uint8_t* catchJump;
 } CallFrame;
 
+typedef struct {
+	size_t minorCount;
+	size_t majorCount;
+	double minorSeconds;
+	double majorSeconds;
+	double maxMinorPause;
+	double maxMajorPause;
+	size_t incrementalCount;
+	size_t sliceCount;
+	double sliceSeconds;
+	double maxSlicePause;
+	// The most bytesAllocated has been, and the totals allocated and freed.
+	size_t peakBytes;
+	size_t allocatedBytes;
+	size_t freedBytes;
+} GCStats;
+
 struct VM {
 	Module* modules;
-	char* directory;
+	// The module of the functions made by newIntrinsic, made along with the first of them.
+	Module* intrinsics;
+	const char* directory;
+	// The frames and stack are reserved for frameMax frames up front and never move, so pointers into them stay valid.
+	// The first frameSize frames and stackSize values are committed, more are committed as calls get deeper.
 	CallFrame* frames;
 	size_t frameCount;
 	size_t frameSize;
+	size_t frameMax;
 	Value* stack;
 	size_t stackSize;
 	Value* stackTop;
@@ -28,17 +58,77 @@ struct VM {
 	Table importTable;
 	Table listMethods;
 	Table stringMethods;
+	Table rangeMethods;
+	Table typedArrayMethods;
+	Table mapMethods;
+	Table setMethods;
 	ObjString** stringConstants;
+	// The strings of every single char, so indexing and iterating over strings doesn't allocate or intern any.
+	ObjString* charStrings[UINT8_COUNT];
 	ObjClass* objectClass;
 	ObjClass* exceptionClass;
 	ObjClass* iteratorClass;
+	ObjClass* stringBuilderClass;
 	ObjClass* importClass;
+	ObjClass* workerClass;
+	ObjClass* fileClass;
 	Compiler* compiler;
+	int optimizationLevel;
+	bool bytecodeCache;
+	// Imports compiled ahead of time on other threads (see prescan.h), unless '--no-import-prescan' is given.
+	bool importPrescan;
+	Prescan* prescan;
+	// Cleared by the VMs which compile ahead of time, so errors are only reported by the import itself.
+	bool reportCompileErrors;
+	// The workers this VM started (see worker.h), and the worker it is run by, which is NULL for the main VM.
+	Worker** workers;
+	size_t workerCount;
+	size_t workerCapacity;
+	Worker* worker;
+	// The files opened through the io module (see io.h), the standard streams first.
+	IOFile** files;
+	size_t fileCount;
+	size_t fileCapacity;
+	// Attached by '--profile' (see profiler.h), NULL otherwise.
+	Profiler* profiler;
+	// Compiles hot functions to machine code ('--jit', see jit.h).
+	bool jit;
+	// Sorted by location, the highest first. openSlots holds the one of each stack slot (or NULL), it's reserved like the
+	// stack with the first capture.
 	ObjUpvalue* openUpvalues;
+	ObjUpvalue** openSlots;
 	size_t bytesAllocated;
 	size_t nextGC;
 	bool shouldGC;
+	bool gcMinor;
+	// Incremental major collections ('--gc-incremental'), run in slices of at most gcSliceBudget objects or gcMaxPause seconds.
+	bool gcIncremental;
+	size_t gcSliceBudget;
+	double gcMaxPause;
+	// When collections run ('--gc-growth', '--gc-min-heap' and the heap limits, or the gc module), 0 being no limit.
+	double gcGrowthFactor;
+	size_t gcMinHeap;
+	size_t gcSoftLimit;
+	size_t gcHardLimit;
+	// Set when the heap is over the hard limit or the system ran out of memory, until OutOfMemoryException is raised.
+	bool outOfMemory;
+	void* gcReserve;
+	GCPhase gcPhase;
+	size_t gcDebt;
+	// Where the incremental sweep of the intern table is at, restarted when the table is rehashed.
+	size_t gcStringIndex;
+	size_t gcStringRehashes;
+	// Old objects still to be swept by an incremental collection.
+	Obj* sweepObjects;
+	Allocator allocator;
+	// Objects which have survived a collection, and those allocated since the last one.
 	Obj* objects;
+	Obj* youngObjects;
+	size_t nurseryBytes;
+	Obj** remembered;
+	size_t rememberedCount;
+	size_t rememberedCapacity;
+	GCStats gcStats;
 	size_t grayCount;
 	size_t grayCapacity;
 	Obj** grayStack;
@@ -63,23 +153,45 @@ typedef enum {
 	STR_INSTANCE,
 	STR_STRING,
 	STR_LIST,
+	STR_ARRAY,
+	STR_MAP,
+	STR_SET,
 	STR_TRUE,
 	STR_FALSE,
 	STR_NAN,
 	STR_NATIVE_FUNCTION,
 	STR_INDEX,
 	STR_DATA,
+	STR_ITERATOR,
+	STR_MORE,
+	STR_CONTENTS,
 	STR_THIS_MODULE,
+	STR_ID,
 	STR_CONSTANT_COUNT
 } StringConstant;
 
+#define CHAR_STRING(vm, c) ((vm)->charStrings[(uint8_t)(c)])
+
 void initVM(VM* vm);
 void freeVM(VM* vm);
+// Reserves the stack for frameMax frames ('--max-frames'), beyond which calls throw a StackOverflowException. Only
+// possible while nothing is running, returns false (leaving the stack as it was) if it can't be reserved.
+bool setFrameMax(VM* vm, size_t frameMax);
 InterpreterResult interpret(VM* vm, const char* directory, const char* source);
+InterpreterResult interpretBytecode(VM* vm, const char* directory, const char* path);
+// Compiles the module at path as importing it would, returning the contents of its bytecode file (allocated with malloc)
+// or NULL if it doesn't compile.
+uint8_t* compileImport(VM* vm, const char* path, const char* source, size_t* length);
+// Compiles the script at path into a bytecode file next to it, returning false if it doesn't compile or can't be written.
+bool precompileFile(VM* vm, const char* path);
 ObjInstance* makeException(VM* vm, const char* name, const char* format, ...);
 bool callValue(VM* vm, Value callee, uint8_t argCount, uint8_t* argsUsed);
-bool validateListIndex(VM* vm, size_t listLength, Value indexVal, uintmax_t* dest);
+// Whether indexVal is a valid index (negative ones counting from the end) into a list of listLength items, which is put in
+// dest. Otherwise the exception to throw is put in exception.
+bool validateListIndex(VM* vm, size_t listLength, Value indexVal, uintmax_t* dest, ObjInstance** exception);
 Value runFunction(VM* vm, bool* hasError);
+// A closure over a function with the given code, for built in methods written in bytecode (see list.h).
+ObjClosure* newIntrinsic(VM* vm, const char* name, size_t arity, const uint8_t* code, size_t length);
 void push(VM* vm, Value value);
 Value pop(VM* vm);
 Value popN(VM* vm, size_t count);
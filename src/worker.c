@@ -0,0 +1,552 @@
+#include "worker.h"
+#include "natives.h"
+#include "memory.h"
+#include "rope.h"
+#include "file.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  Message queues, which are the only memory shared between threads. Senders append and receivers take from the head
+  under the queue's lock, which is only held to link or unlink a message.
+*/
+
+static void initQueue(MessageQueue* queue) {
+	initMutex(&queue->lock);
+	initCondition(&queue->available);
+	queue->head = NULL;
+	queue->tail = NULL;
+	queue->closed = false;
+}
+
+static void freeQueue(MessageQueue* queue) {
+	Message* message = queue->head;
+	while (message != NULL) {
+		Message* next = message->next;
+		free(message);
+		message = next;
+	}
+	freeCondition(&queue->available);
+	freeMutex(&queue->lock);
+}
+
+// Wakes every receiver, which return NULL once the messages already queued have been taken.
+static void closeQueue(MessageQueue* queue) {
+	lockMutex(&queue->lock);
+	queue->closed = true;
+	broadcastCondition(&queue->available);
+	unlockMutex(&queue->lock);
+}
+
+// Returns false (leaving the message to the caller) if the queue is closed.
+static bool enqueueMessage(MessageQueue* queue, Message* message) {
+	message->next = NULL;
+
+	lockMutex(&queue->lock);
+	if (queue->closed) {
+		unlockMutex(&queue->lock);
+		return false;
+	}
+	if (queue->tail == NULL) queue->head = message;
+	else queue->tail->next = message;
+	queue->tail = message;
+	broadcastCondition(&queue->available);
+	unlockMutex(&queue->lock);
+	return true;
+}
+
+// Waits for the next message, or returns NULL if the queue is closed and empty.
+static Message* dequeueMessage(MessageQueue* queue) {
+	lockMutex(&queue->lock);
+	while (queue->head == NULL && !queue->closed) waitCondition(&queue->available, &queue->lock);
+
+	Message* message = queue->head;
+	if (message != NULL) {
+		queue->head = message->next;
+		if (queue->head == NULL) queue->tail = NULL;
+	}
+	unlockMutex(&queue->lock);
+	return message;
+}
+
+/*
+  Encoding
+  A message is a tag per value, followed by its contents: a double for numbers, a length and the chars for strings, the
+  start and end of ranges, and an item count then the items for lists (field count then names and values for objects).
+  It is built straight into the Message's buffer, so sending is a single allocation outside of either VM's heap.
+*/
+
+typedef enum {
+	MESSAGE_NULL,
+	MESSAGE_TRUE,
+	MESSAGE_FALSE,
+	MESSAGE_NUMBER,
+	MESSAGE_STRING,
+	MESSAGE_RANGE,
+	MESSAGE_LIST,
+	MESSAGE_OBJECT
+} MessageTag;
+
+typedef struct {
+	uint8_t* data;
+	size_t count;
+	size_t capacity;
+	bool failed;
+} MessageWriter;
+
+static void writeBytes(MessageWriter* writer, const void* bytes, size_t length) {
+	if (writer->failed) return;
+	if (writer->count + length > writer->capacity) {
+		size_t capacity = writer->capacity < 256 ? 256 : writer->capacity;
+		while (capacity < writer->count + length) capacity *= 2;
+		uint8_t* data = realloc(writer->data, capacity);
+		if (data == NULL) {
+			writer->failed = true;
+			return;
+		}
+		writer->data = data;
+		writer->capacity = capacity;
+	}
+	memcpy(writer->data + writer->count, bytes, length);
+	writer->count += length;
+}
+
+static void writeTag(MessageWriter* writer, MessageTag tag) {
+	uint8_t byte = (uint8_t)tag;
+	writeBytes(writer, &byte, 1);
+}
+
+static void writeSize(MessageWriter* writer, size_t size) {
+	writeBytes(writer, &size, sizeof(size_t));
+}
+
+static void writeChars(MessageWriter* writer, ObjString* string) {
+	writeSize(writer, string->length);
+	writeBytes(writer, string->chars, string->length);
+}
+
+static bool encodeValue(VM* vm, MessageWriter* writer, Value value, size_t depth, ObjInstance** exception);
+
+static bool encodeObject(VM* vm, MessageWriter* writer, ObjInstance* instance, size_t depth, ObjInstance** exception) {
+	writeTag(writer, MESSAGE_OBJECT);
+
+	size_t count = instanceFieldCount(instance);
+	if (instance->shape == NULL) {
+		writeSize(writer, count);
+		for (size_t i = 0; i < instance->fields.capacity; i++) {
+			Entry* entry = &instance->fields.entries[i];
+			if (entry->key == NULL) continue;
+			writeChars(writer, entry->key);
+			if (!encodeValue(vm, writer, entry->value, depth + 1, exception)) return false;
+		}
+		return true;
+	}
+
+	// The shape chain runs from the last field added to the first, they are sent in the order they were added.
+	ObjString** names = malloc(sizeof(ObjString*) * (count == 0 ? 1 : count));
+	if (names == NULL) {
+		writer->failed = true;
+		return true;
+	}
+	for (ObjShape* shape = instance->shape; shape->parent != NULL; shape = shape->parent) {
+		names[shape->count - 1] = shape->name;
+	}
+
+	writeSize(writer, count);
+	bool encoded = true;
+	for (size_t i = 0; i < count && encoded; i++) {
+		writeChars(writer, names[i]);
+		encoded = encodeValue(vm, writer, instance->slots[i], depth + 1, exception);
+	}
+	free(names);
+	return encoded;
+}
+
+static bool encodeValue(VM* vm, MessageWriter* writer, Value value, size_t depth, ObjInstance** exception) {
+	if (depth > MESSAGE_MAX_DEPTH) {
+		*exception = makeException(vm, "WorkerException", "Message nests deeper than %d lists or objects.", MESSAGE_MAX_DEPTH);
+		return false;
+	}
+
+	if (IS_NULL(value)) {
+		writeTag(writer, MESSAGE_NULL);
+	}
+	else if (IS_BOOL(value)) {
+		writeTag(writer, AS_BOOL(value) ? MESSAGE_TRUE : MESSAGE_FALSE);
+	}
+	else if (IS_NUMBER(value)) {
+		double number = AS_NUMBER(value);
+		writeTag(writer, MESSAGE_NUMBER);
+		writeBytes(writer, &number, sizeof(double));
+	}
+	else if (IS_STRING(value)) {
+		writeTag(writer, MESSAGE_STRING);
+		writeChars(writer, AS_STRING(value));
+	}
+	else if (IS_ROPE(value)) {
+		// The rope is reachable through the value being sent, which is on the stack.
+		writeTag(writer, MESSAGE_STRING);
+		writeChars(writer, flattenRope(vm, AS_ROPE(value)));
+	}
+	else if (IS_RANGE(value)) {
+		ObjRange* range = AS_RANGE(value);
+		writeTag(writer, MESSAGE_RANGE);
+		writeBytes(writer, &range->start, sizeof(intmax_t));
+		writeBytes(writer, &range->end, sizeof(intmax_t));
+	}
+	else if (IS_LIST(value)) {
+		ObjList* list = AS_LIST(value);
+		writeTag(writer, MESSAGE_LIST);
+		writeSize(writer, list->items.count);
+		for (size_t i = 0; i < list->items.count; i++) {
+			if (!encodeValue(vm, writer, list->items.values[i], depth + 1, exception)) return false;
+		}
+	}
+	else if (IS_INSTANCE(value) && AS_INSTANCE(value)->klass == vm->objectClass) {
+		return encodeObject(vm, writer, AS_INSTANCE(value), depth, exception);
+	}
+	else {
+		*exception = makeException(vm, "WorkerException", "Only null, booleans, numbers, strings, ranges, lists and Objects can be sent between workers.");
+		return false;
+	}
+	return true;
+}
+
+// The message holding a copy of value, or NULL with the exception to throw.
+static Message* encodeMessage(VM* vm, Value value, ObjInstance** exception) {
+	MessageWriter writer = { NULL, 0, 0, false };
+	// Room for the header, the buffer becomes the message.
+	writeBytes(&writer, &(Message){ NULL, 0 }, offsetof(Message, data));
+
+	if (!encodeValue(vm, &writer, value, 0, exception)) {
+		free(writer.data);
+		return NULL;
+	}
+	if (writer.failed) {
+		free(writer.data);
+		*exception = makeException(vm, "WorkerException", "Not enough memory to send message.");
+		return NULL;
+	}
+
+	Message* message = (Message*)writer.data;
+	message->length = writer.count - offsetof(Message, data);
+	return message;
+}
+
+/*
+  Decoding
+  Every value made is kept on the stack until it has been stored in the value containing it.
+*/
+
+typedef struct {
+	const uint8_t* position;
+} MessageReader;
+
+static void readBytes(MessageReader* reader, void* bytes, size_t length) {
+	memcpy(bytes, reader->position, length);
+	reader->position += length;
+}
+
+static size_t readSize(MessageReader* reader) {
+	size_t size;
+	readBytes(reader, &size, sizeof(size_t));
+	return size;
+}
+
+static const char* readChars(MessageReader* reader, size_t* length) {
+	*length = readSize(reader);
+	const char* chars = (const char*)reader->position;
+	reader->position += *length;
+	return chars;
+}
+
+static Value decodeValue(VM* vm, MessageReader* reader) {
+	uint8_t tag = *reader->position++;
+
+	switch (tag) {
+		case MESSAGE_NULL: return NULL_VAL;
+		case MESSAGE_TRUE: return BOOL_VAL(true);
+		case MESSAGE_FALSE: return BOOL_VAL(false);
+		case MESSAGE_NUMBER: {
+			double number;
+			readBytes(reader, &number, sizeof(double));
+			return NUMBER_VAL(number);
+		}
+		case MESSAGE_STRING: {
+			size_t length;
+			const char* chars = readChars(reader, &length);
+			if (length == 1) return OBJ_VAL(CHAR_STRING(vm, chars[0]));
+			return OBJ_VAL(copyTransientString(vm, chars, length));
+		}
+		case MESSAGE_RANGE: {
+			intmax_t start;
+			intmax_t end;
+			readBytes(reader, &start, sizeof(intmax_t));
+			readBytes(reader, &end, sizeof(intmax_t));
+			return OBJ_VAL(newRange(vm, start, end));
+		}
+		case MESSAGE_LIST: {
+			size_t count = readSize(reader);
+
+			ValueArray items;
+			initValueArray(&items);
+			for (size_t i = 0; i < count; i++) {
+				Value item = decodeValue(vm, reader);
+				push(vm, item); // GC
+				writeValueArray(vm, &items, item);
+			}
+			ObjList* list = newList(vm, items);
+			popN(vm, count);
+			return OBJ_VAL(list);
+		}
+		case MESSAGE_OBJECT: {
+			size_t count = readSize(reader);
+
+			ObjInstance* instance = newInstance(vm, vm->objectClass);
+			push(vm, OBJ_VAL(instance)); // GC
+			for (size_t i = 0; i < count; i++) {
+				size_t length;
+				const char* chars = readChars(reader, &length);
+				push(vm, OBJ_VAL(copyString(vm, chars, length)));
+				push(vm, decodeValue(vm, reader));
+				instanceSet(vm, instance, AS_STRING(peek(vm, 1)), peek(vm, 0));
+				popN(vm, 2);
+			}
+			pop(vm);
+			return OBJ_VAL(instance);
+		}
+		default: return NULL_VAL; // Unreachable, messages are only made by encodeMessage.
+	}
+}
+
+// Takes ownership of the message.
+static Value decodeMessage(VM* vm, Message* message) {
+	MessageReader reader = { message->data };
+	Value value = decodeValue(vm, &reader);
+	free(message);
+	return value;
+}
+
+/*
+  Workers
+*/
+
+static void runWorker(void* argument) {
+	Worker* worker = argument;
+
+	VM vm;
+	initVM(&vm);
+	vm.worker = worker;
+	vm.optimizationLevel = worker->optimizationLevel;
+	vm.bytecodeCache = worker->bytecodeCache;
+	vm.importPrescan = worker->importPrescan;
+	vm.jit = worker->jit;
+	// Keeps the default stack if the worker's can't be reserved.
+	if (worker->frameMax != vm.frameMax) setFrameMax(&vm, worker->frameMax);
+	vm.gcIncremental = worker->gcIncremental;
+	vm.gcSliceBudget = worker->gcSliceBudget;
+	vm.gcMaxPause = worker->gcMaxPause;
+	vm.gcGrowthFactor = worker->gcGrowthFactor;
+	vm.gcMinHeap = worker->gcMinHeap;
+	vm.gcSoftLimit = worker->gcSoftLimit;
+	vm.gcHardLimit = worker->gcHardLimit;
+	updateHeapTarget(&vm);
+
+	worker->result = interpret(&vm, worker->directory, worker->source);
+	freeVM(&vm);
+
+	closeQueue(&worker->inbox);
+	closeQueue(&worker->outbox);
+}
+
+static void freeWorker(Worker* worker) {
+	if (!worker->joined) {
+		closeQueue(&worker->inbox);
+		joinThread(worker->thread);
+	}
+	freeQueue(&worker->inbox);
+	freeQueue(&worker->outbox);
+	free(worker->source);
+	free(worker->directory);
+	free(worker);
+}
+
+void freeWorkers(VM* vm) {
+	for (size_t i = 0; i < vm->workerCount; i++) freeWorker(vm->workers[i]);
+	FREE_ARRAY(vm, Worker*, vm->workers, vm->workerCapacity);
+	vm->workers = NULL;
+	vm->workerCount = 0;
+	vm->workerCapacity = 0;
+}
+
+static Worker* getWorker(VM* vm, Value receiver, bool* hasError, ObjInstance** exception) {
+	Value id;
+	if (!instanceGet(AS_INSTANCE(receiver), vm->stringConstants[STR_ID], &id) || !IS_NUMBER(id) ||
+		AS_NUMBER(id) < 0 || AS_NUMBER(id) >= vm->workerCount || AS_NUMBER(id) != (size_t)AS_NUMBER(id)) {
+		*hasError = true;
+		*exception = makeException(vm, "PropertyException", "Worker object must have the 'id' field of a started worker.");
+		return NULL;
+	}
+	return vm->workers[(size_t)AS_NUMBER(id)];
+}
+
+static Value workerConstructorNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	ObjInstance* instance = AS_INSTANCE(*bound);
+
+	if (!IS_STRING(args[0])) {
+		*hasError = true;
+		*exception = makeException(vm, "TypeException", "Expected string as first argument to Worker.");
+		return NULL_VAL;
+	}
+
+	ObjString* lookupPath = makeStringf(vm, "%s/%s.dgn", vm->directory, AS_CSTRING(args[0]));
+	size_t length;
+	char* source = (char*)readFileBytes(lookupPath->chars, &length);
+	if (source == NULL) {
+		*hasError = true;
+		*exception = makeException(vm, "WorkerException", "Could not open worker module \"%s\".", lookupPath->chars);
+		return NULL_VAL;
+	}
+	source[length] = '\0';
+
+	Worker* worker = malloc(sizeof(Worker));
+	if (worker == NULL) {
+		free(source);
+		*hasError = true;
+		*exception = makeException(vm, "WorkerException", "Not enough memory to start worker.");
+		return NULL_VAL;
+	}
+	worker->source = source;
+	worker->directory = getDirectory(lookupPath->chars);
+	initQueue(&worker->inbox);
+	initQueue(&worker->outbox);
+	worker->optimizationLevel = vm->optimizationLevel;
+	worker->bytecodeCache = vm->bytecodeCache;
+	worker->importPrescan = vm->importPrescan;
+	worker->jit = vm->jit;
+	worker->frameMax = vm->frameMax;
+	worker->gcIncremental = vm->gcIncremental;
+	worker->gcSliceBudget = vm->gcSliceBudget;
+	worker->gcMaxPause = vm->gcMaxPause;
+	worker->gcGrowthFactor = vm->gcGrowthFactor;
+	worker->gcMinHeap = vm->gcMinHeap;
+	worker->gcSoftLimit = vm->gcSoftLimit;
+	worker->gcHardLimit = vm->gcHardLimit;
+	worker->result = INTERPRETER_OK;
+	worker->joined = false;
+
+	if (!startThread(&worker->thread, runWorker, worker)) {
+		// Never started, so there is nothing to join.
+		worker->joined = true;
+		freeWorker(worker);
+		*hasError = true;
+		*exception = makeException(vm, "WorkerException", "Could not start worker thread.");
+		return NULL_VAL;
+	}
+
+	if (vm->workerCount == vm->workerCapacity) {
+		size_t oldCapacity = vm->workerCapacity;
+		vm->workerCapacity = GROW_CAPACITY(oldCapacity);
+		vm->workers = GROW_ARRAY(vm, Worker*, vm->workers, oldCapacity, vm->workerCapacity);
+	}
+	size_t id = vm->workerCount;
+	vm->workers[vm->workerCount++] = worker;
+
+	instanceSet(vm, instance, vm->stringConstants[STR_ID], NUMBER_VAL((double)id));
+	return OBJ_VAL(instance);
+}
+
+static Value workerSendNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	Worker* worker = getWorker(vm, *bound, hasError, exception);
+	if (*hasError) return NULL_VAL;
+
+	Message* message = encodeMessage(vm, args[0], exception);
+	if (message == NULL) {
+		*hasError = true;
+		return NULL_VAL;
+	}
+	if (!enqueueMessage(&worker->inbox, message)) {
+		free(message);
+		*hasError = true;
+		*exception = makeException(vm, "WorkerException", "Cannot send to a worker which has finished or been closed.");
+		return NULL_VAL;
+	}
+	return NULL_VAL;
+}
+
+static Value workerReceiveNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	Worker* worker = getWorker(vm, *bound, hasError, exception);
+	if (*hasError) return NULL_VAL;
+
+	Message* message = dequeueMessage(&worker->outbox);
+	return message == NULL ? NULL_VAL : decodeMessage(vm, message);
+}
+
+static Value workerCloseNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	Worker* worker = getWorker(vm, *bound, hasError, exception);
+	if (*hasError) return NULL_VAL;
+
+	closeQueue(&worker->inbox);
+	return NULL_VAL;
+}
+
+static Value workerJoinNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	Worker* worker = getWorker(vm, *bound, hasError, exception);
+	if (*hasError) return NULL_VAL;
+
+	if (!worker->joined) {
+		joinThread(worker->thread);
+		worker->joined = true;
+	}
+	return BOOL_VAL(worker->result == INTERPRETER_OK);
+}
+
+void defineWorkerMethods(VM* vm) {
+	tableAddAll(vm, &vm->objectClass->methods, &vm->workerClass->methods);
+	vm->workerClass->superclass = vm->objectClass;
+
+	defineNative(vm, &vm->workerClass->methods, "constructor", 1, false, workerConstructorNative);
+	defineNative(vm, &vm->workerClass->methods, "send", 1, false, workerSendNative);
+	defineNative(vm, &vm->workerClass->methods, "receive", 0, false, workerReceiveNative);
+	defineNative(vm, &vm->workerClass->methods, "close", 0, false, workerCloseNative);
+	defineNative(vm, &vm->workerClass->methods, "join", 0, false, workerJoinNative);
+
+	keepRopeArguments(vm, &vm->workerClass->methods, "send");
+}
+
+/*
+  Natives for the worker side, which throw when not run by a worker.
+*/
+
+static Value postMessageNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	if (vm->worker == NULL) {
+		*hasError = true;
+		*exception = makeException(vm, "WorkerException", "postMessage can only be used by a worker.");
+		return NULL_VAL;
+	}
+
+	Message* message = encodeMessage(vm, args[0], exception);
+	if (message == NULL) {
+		*hasError = true;
+		return NULL_VAL;
+	}
+	// The outbox is only closed once the worker has finished.
+	enqueueMessage(&vm->worker->outbox, message);
+	return NULL_VAL;
+}
+
+static Value receiveMessageNative(VM* vm, Value* bound, uint8_t argCount, Value* args, bool* hasError, ObjInstance** exception) {
+	if (vm->worker == NULL) {
+		*hasError = true;
+		*exception = makeException(vm, "WorkerException", "receiveMessage can only be used by a worker.");
+		return NULL_VAL;
+	}
+
+	Message* message = dequeueMessage(&vm->worker->inbox);
+	return message == NULL ? NULL_VAL : decodeMessage(vm, message);
+}
+
+void defineWorkerNatives(VM* vm, Module* mod) {
+	defineModuleNative(vm, mod, "postMessage", 1, false, postMessageNative);
+	defineModuleNative(vm, mod, "receiveMessage", 0, false, receiveMessageNative);
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include "common.h"
+#include "vm.h"
+#include "thread.h"
+
+/*
+  Workers, each running a module in a VM of its own on its own thread ('Worker("path")', resolved like an import).
+  - VMs share nothing, so they only talk through messages: a sent value is deep copied into a Message outside of either
+    heap, which the receiver copies into its own. Null, booleans, numbers, strings, ranges, lists and instances of Object
+    can be sent, lists and fields nesting up to MESSAGE_MAX_DEPTH deep.
+  - Each worker has an inbox (parent to worker, 'worker.send'/'receiveMessage') and an outbox (worker to parent,
+    'postMessage'/'worker.receive'). Receiving blocks until a message arrives, or returns null once the queue is closed
+    and empty. A worker's queues are closed when it finishes, its inbox also by 'worker.close()'.
+  - A VM owns the workers it starts, freeing it waits for each of them to finish.
+*/
+
+#define MESSAGE_MAX_DEPTH 256
+
+typedef struct Message {
+	struct Message* next;
+	size_t length;
+	uint8_t data[];
+} Message;
+
+typedef struct {
+	Mutex lock;
+	Condition available;
+	Message* head;
+	Message* tail;
+	bool closed;
+} MessageQueue;
+
+struct Worker {
+	Thread thread;
+	char* source;
+	char* directory;
+	MessageQueue inbox;
+	MessageQueue outbox;
+	// The settings of the VM which started it, which its own VM runs with.
+	int optimizationLevel;
+	bool bytecodeCache;
+	bool importPrescan;
+	bool jit;
+	size_t frameMax;
+	bool gcIncremental;
+	size_t gcSliceBudget;
+	double gcMaxPause;
+	double gcGrowthFactor;
+	size_t gcMinHeap;
+	size_t gcSoftLimit;
+	size_t gcHardLimit;
+	// Only read once the thread has been joined.
+	InterpreterResult result;
+	bool joined;
+};
+
+void defineWorkerMethods(VM* vm);
+// The natives a worker's modules use to talk to the VM which started it.
+void defineWorkerNatives(VM* vm, Module* mod);
+// Closes the inboxes of the VM's workers and waits for them to finish.
+void freeWorkers(VM* vm);